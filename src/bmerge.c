@@ -26,32 +26,116 @@ Differences over standard binary search (e.g. bsearch in stdlib.h) :
 #define GE 4
 #define GT 5
 
-static SEXP i, x, nqgrp;
-static int ncol, *icols, *xcols, *o, *xo, *retFirst, *retLength, *retIndex, *allLen1, *allGrp1, *rollends, ilen, anslen;
-static int *op, nqmaxgrp, *tmpptr, scols;
-static int ctr, nomatch; // populating matches for non-equi joins
-enum {ALL, FIRST, LAST} mult = ALL;
-static double roll, rollabs;
-static Rboolean rollToNearest=FALSE;
+enum {ALL, FIRST, LAST};
+
+// Everything bmerge_r needs, rather than statics, so that blocks of i can be joined on different threads at once (see
+// below); bmerge_r reads its inputs from here and writes its results through it. bmerge itself allocates and errors through
+// the R API, and strcodes holds the savetl globals, so bmerge is still called from R's main thread one join at a time.
+typedef struct {
+    SEXP i, x, nqgrp;
+    int ncol, *icols, *xcols, *o, *xo, *op, *rollends;
+    int *retFirst, *retLength, *retIndex, *allLen1, *allGrp1;   // one per i row
+    int *extFirst, *extLength, *extIndex;                       // non-equi mult="all": further matches of an i row after its first
+    int ctr, extalloc;                                          // number of those and their allocated length
+    Rboolean extfail;                                           // failed to grow ext* (set rather than error() on a thread)
+    int nqmaxgrp, nomatch;
+    int mult;
+    double roll, rollabs;
+    Rboolean rollToNearest;
+} bmergeCtx;
+
 #define XIND(i) (xo ? xo[(i)]-1 : i)
 
-void bmerge_r(int xlow, int xupp, int ilow, int iupp, int col, int thisgrp, int lowmax, int uppmax);
+static void bmerge_r(bmergeCtx *ctx, int xlow, int xupp, int ilow, int iupp, int col, int thisgrp, int lowmax, int uppmax, int gallop);
 
-SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, SEXP xoArg, SEXP rollarg, SEXP rollendsArg, SEXP nomatchArg, SEXP multArg, SEXP opArg, SEXP nqgrpArg, SEXP nqmaxgrpArg) {
+static Rboolean growext(bmergeCtx *ctx)
+// malloc/realloc rather than Realloc as this may run on a thread; the caller checks extfail afterwards
+{
+    int newalloc = ctx->extalloc ? 1.1*ctx->extalloc+1 : 1000;
+    int *f = realloc(ctx->extFirst, newalloc*sizeof(int));  if (f) ctx->extFirst = f;
+    int *l = realloc(ctx->extLength, newalloc*sizeof(int)); if (l) ctx->extLength = l;
+    int *x = realloc(ctx->extIndex, newalloc*sizeof(int));  if (x) ctx->extIndex = x;
+    if (!f || !l || !x) { ctx->extfail = TRUE; return FALSE; }
+    ctx->extalloc = newalloc;
+    return TRUE;
+}
+
+static Rboolean needUTF8(SEXP col, int nth)
+// any string that ENC2UTF8 would translate (allocating a CHARSXP so not on a thread)?
+{
+    const SEXP *s = (const SEXP *)DATAPTR(col);
+    const int n = LENGTH(col);
+    Rboolean any = FALSE;
+    #pragma omp parallel for num_threads(nth) reduction(||:any)
+    for (int j=0; j<n; j++) any = any || (s[j] != NA_STRING && !IS_ASCII(s[j]) && !IS_UTF8(s[j]));
+    return any;
+}
+
+static Rboolean strcodes(SEXP xc, const int *xo, SEXP ic, int *xcodes, int *icodes)
+// Integer codes for the strings of x's first join column and of i's that compare as StrCmp does, so that bmerge_r can join
+// them in its integer branch: one int compare rather than a StrCmp per probe. x is sorted on this column, so walking it (in
+// xo order) gives its distinct strings in order; they get codes 2, 4, 6, ... A string of i not in x gets the odd code just
+// above the strings of x below it (found by bisection), so it sorts in the same place and matches nothing. NA_STRING is
+// NA_INTEGER, first as in StrCmp. The codes live in the CHARSXPs' TRUELENGTH (as forder's csort_pre) only while this runs.
+// Returns FALSE, leaving the strings to bmerge_r, if x turns out not to be grouped on the column.
+{
+    const int xN = LENGTH(xc), iN = LENGTH(ic);
+    SEXP *u = (SEXP *)malloc((xN+iN) * sizeof(SEXP));   // x's distinct strings in order, then i's strings not in x
+    if (!u) error("Failed to allocate %d bytes in bmerge for the character codes", (xN+iN) * sizeof(SEXP));
+    int un = 0, vn = 0;
+    Rboolean ok = TRUE;
+    savetl_init();
+    for (int p=0; p<xN && ok; p++) {
+        SEXP s = STRING_ELT(xc, XIND(p));
+        if (s == NA_STRING || (un && s == u[un-1])) continue;
+        if (TRUELENGTH(s) < 0) { ok = FALSE; break; }   // seen before but not adjacent
+        if (TRUELENGTH(s) > 0) savetl(s);
+        SET_TRUELENGTH(s, -2*(un+1));
+        u[un++] = s;
+    }
+    if (ok) {
+        for (int p=0; p<xN; p++) {
+            SEXP s = STRING_ELT(xc, p);
+            xcodes[p] = s == NA_STRING ? NA_INTEGER : -TRUELENGTH(s);
+        }
+        for (int p=0; p<iN; p++) {
+            SEXP s = STRING_ELT(ic, p);
+            if (s == NA_STRING) { icodes[p] = NA_INTEGER; continue; }
+            if (TRUELENGTH(s) >= 0) {
+                int lo = 0, hi = un;   // the number of x's strings below s
+                while (lo < hi) { int mid = lo + (hi-lo)/2; if (StrCmp(u[mid], s) < 0) lo = mid+1; else hi = mid; }
+                if (TRUELENGTH(s) > 0) savetl(s);
+                SET_TRUELENGTH(s, -(2*lo+1));
+                u[un + vn++] = s;
+            }
+            icodes[p] = -TRUELENGTH(s);
+        }
+    }
+    for (int k=0; k<un+vn; k++) SET_TRUELENGTH(u[k], 0);
+    savetl_end();
+    free(u);
+    return ok;
+}
+
+SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, SEXP xoArg, SEXP rollarg, SEXP rollendsArg, SEXP nomatchArg, SEXP multArg, SEXP opArg, SEXP nqgrpArg, SEXP nqmaxgrpArg, SEXP strcodesArg) {
     int xN, iN, protecti=0;
-    ctr=0; // needed for non-equi join case
+    SEXP i, x, nqgrp;
+    int ncol, *icols, *xcols, *o, *xo, *retFirst, *retLength, *retIndex, *allLen1, *allGrp1, *rollends;
+    int *op, nqmaxgrp, scols, nomatch, mult;
+    double roll, rollabs;
+    Rboolean rollToNearest;
     SEXP retFirstArg, retLengthArg, retIndexArg, allLen1Arg, allGrp1Arg;
     retFirstArg = retLengthArg = retIndexArg = R_NilValue; // suppress gcc msg
 
     // iArg, xArg, icolsArg and xcolsArg
-    i = iArg; x = xArg;  // set globals so bmerge_r can see them.
+    i = iArg; x = xArg;
     if (!isInteger(icolsArg)) error("Internal error: icols is not integer vector");
     if (!isInteger(xcolsArg)) error("Internal error: xcols is not integer vector");
     if (LENGTH(icolsArg) > LENGTH(xcolsArg)) error("Internal error: length(icols) [%d] > length(xcols) [%d]", LENGTH(icolsArg), LENGTH(xcolsArg)); 
     icols = INTEGER(icolsArg);
     xcols = INTEGER(xcolsArg);
     xN = LENGTH(VECTOR_ELT(x,0));
-    iN = ilen = anslen = LENGTH(VECTOR_ELT(i,0));
+    iN = LENGTH(VECTOR_ELT(i,0));
     ncol = LENGTH(icolsArg);    // there may be more sorted columns in x than involved in the join
     for(int col=0; col<ncol; col++) {
         if (icols[col]==NA_INTEGER) error("Internal error. icols[%d] is NA", col);
@@ -95,38 +179,30 @@ SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, SE
     op = INTEGER(opArg);
     if (!isInteger(nqgrpArg))
         error("Internal error: nqgrpArg must be an integer vector");
-    nqgrp = nqgrpArg; // set global for bmerge_r
+    nqgrp = nqgrpArg;
     scols = (!length(nqgrpArg)) ? 0 : -1; // starting col index, -1 is external group column for non-equi join case
 
     // nqmaxgrpArg
     if (!isInteger(nqmaxgrpArg) || length(nqmaxgrpArg) != 1 || INTEGER(nqmaxgrpArg)[0] <= 0)
         error("Intrnal error: nqmaxgrpArg is not a positive length-1 integer vector");
     nqmaxgrp = INTEGER(nqmaxgrpArg)[0];
-    if (nqmaxgrp>1 && mult == ALL) {
-        // non-equi case with mult=ALL, may need reallocation
-        anslen = 1.1 * ((iN > 1000) ? iN : 1000);
-        retFirst = Calloc(anslen, int); // anslen is set above
-        retLength = Calloc(anslen, int);
-        retIndex = Calloc(anslen, int);
-        if (retFirst==NULL || retLength==NULL || retIndex==NULL)
-            error("Internal error in allocating memory for non-equi join");
-        // initialise retIndex here directly, as next loop is meant for both equi and non-equi joins
-        for (int j=0; j<anslen; j++) retIndex[j] = j+1;
-    } else { // equi joins (or) non-equi join but no multiple matches
-        retFirstArg = PROTECT(allocVector(INTSXP, anslen));
-        retFirst = INTEGER(retFirstArg);
-        retLengthArg = PROTECT(allocVector(INTSXP, anslen)); // TODO: no need to allocate length at all when
-        retLength = INTEGER(retLengthArg);                   // mult = "first" / "last"
-        retIndexArg = PROTECT(allocVector(INTSXP, 0));
-        retIndex = INTEGER(retIndexArg);
-        protecti += 3;
-    }
-    for (int j=0; j<anslen; j++) {
+    // retFirst, retLength (and retIndex for non-equi mult="all") hold the first match of each i row. The further matches of
+    // a non-equi join with mult="all" are collected in ext* by bmerge_r and appended to these at the end.
+    const Rboolean nqall = nqmaxgrp>1 && mult==ALL;
+    retFirstArg = PROTECT(allocVector(INTSXP, iN));
+    retFirst = INTEGER(retFirstArg);
+    retLengthArg = PROTECT(allocVector(INTSXP, iN)); // TODO: no need to allocate length at all when
+    retLength = INTEGER(retLengthArg);               // mult = "first" / "last"
+    retIndexArg = PROTECT(allocVector(INTSXP, nqall ? iN : 0));
+    retIndex = INTEGER(retIndexArg);
+    protecti += 3;
+    for (int j=0; j<iN; j++) {
         // defaults need to populated here as bmerge_r may well not touch many locations, say if the last row of i is before the first row of x.
         retFirst[j] = nomatch;   // default to no match for NA goto below
         // retLength[j] = 0;   // TO DO: do this to save the branch below and later branches at R level to set .N to 0
         retLength[j] = nomatch==0 ? 0 : 1;
     }
+    if (nqall) for (int j=0; j<iN; j++) retIndex[j] = j+1;
 
     // allLen1Arg
     allLen1Arg = PROTECT(allocVector(LGLSXP, 1));
@@ -157,24 +233,97 @@ SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, SE
         xo = INTEGER(xoArg);
     }
 
+    // strcodesArg: when there are enough rows of i to pay for walking x once, a character first join column is joined on
+    // integer codes (see strcodes) in place of the strings. i and x are then shallow copies with those columns swapped.
+    const int nth = getDTthreads();
+    if (!isLogical(strcodesArg) || LENGTH(strcodesArg)!=1) error("Internal error: strcodesArg is not TRUE or FALSE");
+    if (LOGICAL(strcodesArg)[0]==TRUE && scols==0 && iN && xN < INT_MAX/2 && op[0]==EQ && (roll==0.0 || ncol>1) &&
+        TYPEOF(VECTOR_ELT(x, xcols[0]-1))==STRSXP && (double)iN * log2(xN+1.0) * 16 >= xN) {
+        SEXP ic = VECTOR_ELT(i, icols[0]-1), xc = VECTOR_ELT(x, xcols[0]-1);
+        if (!needUTF8(ic, nth) && !needUTF8(xc, nth)) {
+            SEXP icodes = PROTECT(allocVector(INTSXP, iN)), xcodes = PROTECT(allocVector(INTSXP, xN));
+            protecti += 2;
+            if (strcodes(xc, xo, ic, INTEGER(xcodes), INTEGER(icodes))) {
+                i = PROTECT(shallow_duplicate(i)); x = PROTECT(shallow_duplicate(x));
+                protecti += 2;
+                SET_VECTOR_ELT(i, icols[0]-1, icodes);
+                SET_VECTOR_ELT(x, xcols[0]-1, xcodes);
+            }
+        }
+    }
+
     // start bmerge
+    bmergeCtx ctx = {
+        .i=i, .x=x, .nqgrp=nqgrp, .ncol=ncol, .icols=icols, .xcols=xcols, .o=o, .xo=xo, .op=op, .rollends=rollends,
+        .retFirst=retFirst, .retLength=retLength, .retIndex=retIndex, .allLen1=allLen1, .allGrp1=allGrp1,
+        .extFirst=NULL, .extLength=NULL, .extIndex=NULL, .ctr=0, .extalloc=0, .extfail=FALSE,
+        .nqmaxgrp=nqmaxgrp, .nomatch=nomatch, .mult=mult,
+        .roll=roll, .rollabs=rollabs, .rollToNearest=rollToNearest
+    };
+    // i (in its sorted order) is split into contiguous blocks that are joined independently on different threads. Each
+    // block starts from all of x, so every i row gets exactly the result it gets from one bmerge_r over all of i. Each block
+    // has its own allLen1, allGrp1 and ext*, combined afterwards in block order. (ext* entries are then in a different order
+    // than from one bmerge_r over all of i, but each i row's entries are still in group order and the R level orders by
+    // indices.) Strings that ENC2UTF8 would translate and columns that bmerge_r errors on are left to one block.
+    int nBlock = (nth>1 && iN>=4096) ? 4*nth : 1;
+    if (nBlock > iN/1024) nBlock = iN/1024;
+    if (nBlock < 1) nBlock = 1;
+    for (int col=0; col<ncol && nBlock>1; col++) {
+        SEXP ic = VECTOR_ELT(i, icols[col]-1), xc = VECTOR_ELT(x, xcols[col]-1);
+        if (TYPEOF(xc)==STRSXP) {
+            if (op[col]!=EQ || needUTF8(ic, nth) || needUTF8(xc, nth)) nBlock = 1;
+        } else if (TYPEOF(xc)!=LGLSXP && TYPEOF(xc)!=INTSXP && TYPEOF(xc)!=REALSXP) nBlock = 1;
+    }
+    bmergeCtx *bctx = (bmergeCtx *)R_alloc(nBlock, sizeof(bmergeCtx));
+    int *bflags = (int *)R_alloc(2*nBlock, sizeof(int));
+    for (int b=0; b<nBlock; b++) {
+        bctx[b] = ctx;
+        bctx[b].allLen1 = bflags+2*b;
+        bctx[b].allGrp1 = bflags+2*b+1;
+        bflags[2*b] = bflags[2*b+1] = TRUE;
+    }
     if (iN) {
-        // embarassingly parallel if we've storage space for nqmaxgrp*iN
-        for (int kk=0; kk<nqmaxgrp; kk++) {
-            bmerge_r(-1,xN,-1,iN,scols,kk+1,1,1);
+        if (nBlock==1) {
+            for (int kk=0; kk<nqmaxgrp && !bctx[0].extfail; kk++) {
+                bmerge_r(bctx, -1,xN,-1,iN,scols,kk+1,1,1,0);
+            }
+        } else {
+            #pragma omp parallel for schedule(dynamic) num_threads(nth)
+            for (int b=0; b<nBlock; b++) {
+                const int from = (int)((long long)iN*b/nBlock), to = (int)((long long)iN*(b+1)/nBlock);
+                for (int kk=0; kk<nqmaxgrp && !bctx[b].extfail; kk++) {
+                    bmerge_r(bctx+b, -1,xN,from-1,to,scols,kk+1,1,1,0);
+                }
+            }
         }
     }
-    ctr += iN;
-    if (nqmaxgrp > 1 && mult == ALL) {
-        // memcpy ret* to SEXP
+    int ctr = iN;
+    Rboolean extfail = FALSE;
+    for (int b=0; b<nBlock; b++) {
+        if (!bflags[2*b]) allLen1[0] = FALSE;
+        if (!bflags[2*b+1]) allGrp1[0] = FALSE;
+        ctr += bctx[b].ctr;
+        extfail |= bctx[b].extfail;
+    }
+    if (!extfail && ctr > iN) {
         retFirstArg = PROTECT(allocVector(INTSXP, ctr));
         retLengthArg = PROTECT(allocVector(INTSXP, ctr));
-        retIndexArg = PROTECT(allocVector(INTSXP, ctr));
+        SEXP tt = PROTECT(allocVector(INTSXP, ctr));
         protecti += 3;
-        memcpy(INTEGER(retFirstArg), retFirst, sizeof(int)*ctr);
-        memcpy(INTEGER(retLengthArg), retLength, sizeof(int)*ctr);
-        memcpy(INTEGER(retIndexArg), retIndex, sizeof(int)*ctr);
+        memcpy(INTEGER(retFirstArg), retFirst, sizeof(int)*iN);
+        memcpy(INTEGER(retLengthArg), retLength, sizeof(int)*iN);
+        memcpy(INTEGER(tt), retIndex, sizeof(int)*iN);
+        retIndexArg = tt;
+        for (int b=0, k=iN; b<nBlock; k+=bctx[b].ctr, b++) {
+            memcpy(INTEGER(retFirstArg)+k, bctx[b].extFirst, sizeof(int)*bctx[b].ctr);
+            memcpy(INTEGER(retLengthArg)+k, bctx[b].extLength, sizeof(int)*bctx[b].ctr);
+            memcpy(INTEGER(retIndexArg)+k, bctx[b].extIndex, sizeof(int)*bctx[b].ctr);
+        }
+    }
+    for (int b=0; b<nBlock; b++) {
+        free(bctx[b].extFirst); free(bctx[b].extLength); free(bctx[b].extIndex);
     }
+    if (extfail) error("Error in reallocating memory in non-equi joins.\n");
     SEXP ans = PROTECT(allocVector(VECSXP, 5)); protecti++;
     SEXP ansnames = PROTECT(allocVector(STRSXP, 5)); protecti++;
     SET_VECTOR_ELT(ans, 0, retFirstArg);
@@ -188,25 +337,17 @@ SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, SE
     SET_STRING_ELT(ansnames, 3, mkChar("allLen1"));
     SET_STRING_ELT(ansnames, 4, mkChar("allGrp1"));
     setAttrib(ans, R_NamesSymbol, ansnames);
-    if (nqmaxgrp > 1 && mult == ALL) {
-        Free(retFirst);
-        Free(retLength);
-        Free(retIndex);
-    }
     UNPROTECT(protecti);
     return (ans);
 }
 
-static union {
+typedef union {
   int i;
   double d;
   unsigned long long ull;
   long long ll;
   SEXP s;
-} ival, xval;
-
-static int mid, tmplow, tmpupp;  // global to save them being added to recursive stack. Maybe optimizer would do this anyway.
-static SEXP ic, xc;
+} bval;
 
 // If we find a non-ASCII, non-NA, non-UTF8 encoding, we try to convert it to UTF8. That is, marked non-ascii/non-UTF8 encodings will always be checked in UTF8 locale. This seems to be the best fix I could think of to put the encoding issues to rest..
 // Since the if-statement will fail with the first condition check in "normal" ASCII cases, there shouldn't be huge penalty issues for default setup.
@@ -218,21 +359,78 @@ SEXP ENC2UTF8(SEXP s) {
     return (s);
 }
 
-void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisgrp, int lowmax, int uppmax)
+static int xcmp(SEXP xc, const int *xo, int pos, bval ival, unsigned long long (*twiddle)(void *, int, int, int))
+// compares x[pos] to ival exactly as the bisection in bmerge_r does: <0, 0 or >0
+{
+    bval xval;
+    switch (TYPEOF(xc)) {
+    case STRSXP :
+        return StrCmp(ENC2UTF8(STRING_ELT(xc, XIND(pos))), ival.s);
+    case REALSXP :
+        xval.ull = twiddle(DATAPTR(xc), XIND(pos), 1, -1);
+        return (xval.ull > ival.ull) - (xval.ull < ival.ull);
+    default :
+        xval.i = INTEGER(xc)[XIND(pos)];
+        return (xval.i > ival.i) - (xval.i < ival.i);
+    }
+}
+
+static void gallop_r(SEXP xc, const int *xo, SEXP ic, int ifarRow, unsigned long long (*twiddle)(void *, int, int, int), int dir, int m, int *xlowp, int *xuppp)
+// The m rows of i in this range all lie beyond the previous match at *xlowp (dir>0) or *xuppp (dir<0). When i closely tracks
+// x (e.g. time-ordered events joined to a keyed reference table) they also all match near it, so gallop out from it in steps
+// of 2m, 4m, 8m until x passes the farthest i value (row ifarRow) and bisect only that window. If x has still not passed it,
+// give up and bisect as before; that costs at most 3 extra probes. The narrowed bound is strictly beyond every i value in the
+// range, just as the bisection in bmerge_r expects, so the group bounds it then finds are exactly the same.
+{
+    bval ifar;
+    long long step = 2*(long long)m;
+    switch (TYPEOF(xc)) {
+    case STRSXP :  ifar.s = ENC2UTF8(STRING_ELT(ic, ifarRow)); break;
+    case REALSXP : ifar.ull = twiddle(DATAPTR(ic), ifarRow, 1, -1); break;
+    default :      ifar.i = INTEGER(ic)[ifarRow];
+    }
+    for (int k=0; k<3; k++, step<<=1) {
+        if (dir > 0) {
+            if (*xlowp + step >= *xuppp) return;   // window already spans the rest
+            if (xcmp(xc, xo, *xlowp + (int)step, ifar, twiddle) > 0) { *xuppp = *xlowp + (int)step; return; }
+        } else {
+            if (*xuppp - step <= *xlowp) return;
+            if (xcmp(xc, xo, *xuppp - (int)step, ifar, twiddle) < 0) { *xlowp = *xuppp - (int)step; return; }
+        }
+    }
+}
+
+static void bmerge_r(bmergeCtx *ctx, int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisgrp, int lowmax, int uppmax, int gallop)
 // col is >0 and <=ncol-1 if this range of [xlow,xupp] and [ilow,iupp] match up to but not including that column
 // lowmax=1 if xlowIn is the lower bound of this group (needed for roll)
 // uppmax=1 if xuppIn is the upper bound of this group (needed for roll)
 // new: col starts with -1 for non-equi joins, which gathers rows from nested id group counter 'thisgrp'
+// gallop=1|-1 when this i range is the upper|lower part left over at this column by the parent call, whose match was at
+//   xlowIn|xuppIn; see gallop_r. gallop=0 always bisects the whole of [xlowIn,xuppIn].
 {
     int xlow=xlowIn, xupp=xuppIn, ilow=ilowIn, iupp=iuppIn, j, k, ir, lir, tmp;
     Rboolean isInt64=FALSE;
+    const SEXP i = ctx->i, x = ctx->x;
+    const int ncol = ctx->ncol, *icols = ctx->icols, *xcols = ctx->xcols, *o = ctx->o, *xo = ctx->xo, *op = ctx->op, *rollends = ctx->rollends;
+    const int nqmaxgrp = ctx->nqmaxgrp, nomatch = ctx->nomatch, mult = ctx->mult;
+    const double roll = ctx->roll, rollabs = ctx->rollabs;
+    const Rboolean rollToNearest = ctx->rollToNearest;
+    unsigned long long (*twiddle)(void *, int, int, int);
+    bval ival, xval;
+    int mid, tmplow, tmpupp;
+    SEXP ic = R_NilValue, xc;
     ir = lir = ilow + (iupp-ilow)/2;           // lir = logical i row.
     if (o) ir = o[lir]-1;                      // ir = the actual i row if i were ordered
     if (col>-1) {
         ic = VECTOR_ELT(i,icols[col]-1);  // ic = i column
         xc = VECTOR_ELT(x,xcols[col]-1);  // xc = x column
     // it was checked in bmerge() that the types are equal
-    } else xc = nqgrp;
+    } else xc = ctx->nqgrp;
+    if (gallop && col>-1) {
+        tmp = gallop>0 ? iuppIn-1 : ilowIn+1;  // the i row farthest from the previous match
+        gallop_r(xc, xo, ic, o ? o[tmp]-1 : tmp, TYPEOF(xc)==REALSXP ? (INHERITS(xc, char_integer64) ? &i64twiddle : &dtwiddle) : NULL,
+                 gallop, iuppIn-ilowIn-1, &xlow, &xupp);
+    }
     switch (TYPEOF(xc)) {
     case LGLSXP : case INTSXP :   // including factors
         ival.i = (col>-1) ? INTEGER(ic)[ir] : thisgrp;
@@ -341,10 +539,10 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
     case REALSXP :
         isInt64 = INHERITS(xc, char_integer64);
         twiddle = isInt64 ? &i64twiddle : &dtwiddle;
-        ival.ull = twiddle(DATAPTR(ic), ir, 1);
+        ival.ull = twiddle(DATAPTR(ic), ir, 1, -1);
         while(xlow < xupp-1) {
             mid = xlow + (xupp-xlow)/2;
-            xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1);
+            xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1, -1);
             if (xval.ull<ival.ull) {
                 xlow=mid;
             } else if (xval.ull>ival.ull) {
@@ -354,12 +552,12 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
                 tmpupp = mid;
                 while(tmplow<xupp-1) {
                     mid = tmplow + (xupp-tmplow)/2;
-                    xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1);
+                    xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1, -1);
                     if (xval.ull == ival.ull) tmplow=mid; else xupp=mid;
                 }
                 while(xlow<tmpupp-1) {
                     mid = xlow + (tmpupp-xlow)/2;
-                    xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1);
+                    xval.ull = twiddle(DATAPTR(xc), XIND(mid), 1, -1);
                     if (xval.ull == ival.ull) tmpupp=mid; else xlow=mid;
                 }
                 break;
@@ -389,12 +587,12 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
         if (col>-1) {
             while(tmplow<iupp-1) {
                 mid = tmplow + (iupp-tmplow)/2;
-                xval.ull = twiddle(DATAPTR(ic), o ? o[mid]-1 : mid, 1 );
+                xval.ull = twiddle(DATAPTR(ic), o ? o[mid]-1 : mid, 1, -1);
                 if (xval.ull == ival.ull) tmplow=mid; else iupp=mid;
             }
             while(ilow<tmpupp-1) {
                 mid = ilow + (tmpupp-ilow)/2;
-                xval.ull = twiddle(DATAPTR(ic), o ? o[mid]-1 : mid, 1 );
+                xval.ull = twiddle(DATAPTR(ic), o ? o[mid]-1 : mid, 1, -1);
                 if (xval.ull == ival.ull) tmpupp=mid; else ilow=mid;
             }
         }
@@ -405,59 +603,48 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
     }
     if (xlow<xupp-1) { // if value found, low and upp surround it, unlike standard binary search where low falls on it
         if (col<ncol-1) {
-            bmerge_r(xlow, xupp, ilow, iupp, col+1, thisgrp, 1, 1);
+            bmerge_r(ctx, xlow, xupp, ilow, iupp, col+1, thisgrp, 1, 1, 0);
             // final two 1's are lowmax and uppmax
         } else {
             int len = xupp-xlow-1;
-            if (mult==ALL && len>1) allLen1[0] = FALSE;
+            if (mult==ALL && len>1) ctx->allLen1[0] = FALSE;
             if (nqmaxgrp == 1) {
                 for (j=ilow+1; j<iupp; j++) {   // usually iterates once only for j=ir
                     k = o ? o[j]-1 : j;
-                    retFirst[k] = (mult != LAST) ? xlow+2 : xupp; // extra +1 for 1-based indexing at R level
-                    retLength[k]= (mult == ALL) ? len : 1;
-                    // retIndex initialisation is taken care of in bmerge and doesn't change for thisgrp=1
+                    ctx->retFirst[k] = (mult != LAST) ? xlow+2 : xupp; // extra +1 for 1-based indexing at R level
+                    ctx->retLength[k]= (mult == ALL) ? len : 1;
+                    // ctx->retIndex initialisation is taken care of in bmerge and doesn't change for thisgrp=1
                 }
             } else {
                 // non-equi join
                 for (j=ilow+1; j<iupp; j++) {
                     k = o ? o[j]-1 : j;
-                    if (retFirst[k] != nomatch) {
+                    if (ctx->retFirst[k] != nomatch) {
                         if (mult == ALL) {
                             // for this irow, we've matches on more than one group
-                            allGrp1[0] = FALSE;
-                            retFirst[ctr+ilen] = xlow+2;
-                            retLength[ctr+ilen] = len;
-                            retIndex[ctr+ilen] = k+1;
-                            ++ctr;
-                            if (ctr+ilen >= anslen) {
-                                anslen = 1.1*anslen;
-                                tmpptr = Realloc(retFirst, anslen, int);
-                                if (tmpptr != NULL) retFirst = tmpptr; 
-                                else error("Error in reallocating memory in non-equi joins.\n");
-                                tmpptr = Realloc(retLength, anslen, int);
-                                if (tmpptr != NULL) retLength = tmpptr; 
-                                else error("Error in reallocating memory in non-equi joins.\n");
-                                tmpptr = Realloc(retIndex, anslen, int);
-                                if (tmpptr != NULL) retIndex = tmpptr; 
-                                else error("Error in reallocating memory in non-equi joins.\n");
-                            }
+                            ctx->allGrp1[0] = FALSE;
+                            if (ctx->ctr == ctx->extalloc && !growext(ctx)) return;
+                            ctx->extFirst[ctx->ctr] = xlow+2;
+                            ctx->extLength[ctx->ctr] = len;
+                            ctx->extIndex[ctx->ctr] = k+1;
+                            ++ctx->ctr;
                         } else if (mult == FIRST) {
-                            retFirst[k] = (XIND(retFirst[k]-1) > XIND(xlow+1)) ? xlow+2 : retFirst[k];
-                            retLength[k] = 1;
+                            ctx->retFirst[k] = (XIND(ctx->retFirst[k]-1) > XIND(xlow+1)) ? xlow+2 : ctx->retFirst[k];
+                            ctx->retLength[k] = 1;
                         } else {
-                            retFirst[k] = (XIND(retFirst[k]-1) < XIND(xupp-1)) ? xupp : retFirst[k];
-                            retLength[k] = 1;
+                            ctx->retFirst[k] = (XIND(ctx->retFirst[k]-1) < XIND(xupp-1)) ? xupp : ctx->retFirst[k];
+                            ctx->retLength[k] = 1;
                         }
                     } else {
                         // none of the groups so far have filled in for this index. So use it!
                         if (mult == ALL) {
-                            retFirst[k] = xlow+2;
-                            retLength[k] = len;
-                            retIndex[k] = k+1;
-                            // no need to increment ctr of course
+                            ctx->retFirst[k] = xlow+2;
+                            ctx->retLength[k] = len;
+                            ctx->retIndex[k] = k+1;
+                            // no need to increment ctx->ctr of course
                         } else {
-                            retFirst[k] = (mult == FIRST) ? xlow+2 : xupp;
-                            retLength[k] = 1;
+                            ctx->retFirst[k] = (mult == FIRST) ? xlow+2 : xupp;
+                            ctx->retLength[k] = 1;
                         }
                     }
                 }
@@ -470,18 +657,18 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
             if ( (!lowmax || xlow>xlowIn) && (!uppmax || xupp<xuppIn) ) {
                 if (  ( TYPEOF(ic)==REALSXP && REAL(ic)[ir]-REAL(xc)[XIND(xlow)] <= REAL(xc)[XIND(xupp)]-REAL(ic)[ir] )
                    || ( TYPEOF(ic)<=INTSXP && INTEGER(ic)[ir]-INTEGER(xc)[XIND(xlow)] <= INTEGER(xc)[XIND(xupp)]-INTEGER(ic)[ir] )) {
-                    retFirst[ir] = xlow+1;
-                    retLength[ir] = 1;
+                    ctx->retFirst[ir] = xlow+1;
+                    ctx->retLength[ir] = 1;
                 } else {
-                    retFirst[ir] = xupp+1;
-                    retLength[ir] = 1;
+                    ctx->retFirst[ir] = xupp+1;
+                    ctx->retLength[ir] = 1;
                 }
             } else if (uppmax && xupp==xuppIn && rollends[1]) {
-                retFirst[ir] = xlow+1;
-                retLength[ir] = 1;
+                ctx->retFirst[ir] = xlow+1;
+                ctx->retLength[ir] = 1;
             } else if (lowmax && xlow==xlowIn && rollends[0]) {
-                retFirst[ir] = xupp+1;
-                retLength[ir] = 1;
+                ctx->retFirst[ir] = xupp+1;
+                ctx->retLength[ir] = 1;
             }
         } else {
             // Regular roll=TRUE|+ve|-ve
@@ -498,8 +685,8 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
                         (double)(ival.ll-xval.ll)-rollabs < 1e-6 ) ))  // cast to double for when rollabs==Inf
                   || (TYPEOF(ic)<=INTSXP && (double)(INTEGER(ic)[ir]-INTEGER(xc)[XIND(xlow)])-rollabs < 1e-6 )
                   || (TYPEOF(ic)==STRSXP)   )) {
-                retFirst[ir] = xlow+1;
-                retLength[ir] = 1;
+                ctx->retFirst[ir] = xlow+1;
+                ctx->retLength[ir] = 1;
             } else if
                (  (  (roll<0.0 && (!uppmax || xupp<xuppIn) && (xlow>xlowIn || !lowmax || rollends[0]))
                   || (roll>0.0 && xlow==xlowIn && lowmax && rollends[0]) )
@@ -512,40 +699,40 @@ void bmerge_r(int xlowIn, int xuppIn, int ilowIn, int iuppIn, int col, int thisg
                         (double)(xval.ll-ival.ll)-rollabs < 1e-6 ) ))
                   || (TYPEOF(ic)<=INTSXP && (double)(INTEGER(xc)[XIND(xupp)]-INTEGER(ic)[ir])-rollabs < 1e-6 )
                   || (TYPEOF(ic)==STRSXP)   )) {
-                retFirst[ir] = xupp+1;   // == xlow+2
-                retLength[ir] = 1;
+                ctx->retFirst[ir] = xupp+1;   // == xlow+2
+                ctx->retLength[ir] = 1;
             }
         }
-        if (iupp-ilow > 2 && retFirst[ir]!=NA_INTEGER) {
+        if (iupp-ilow > 2 && ctx->retFirst[ir]!=NA_INTEGER) {
             // >=2 equal values in the last column being rolling to the same point.  
             for (j=ilow+1; j<iupp; j++) {
-                // will rewrite retFirst[ir] to itself, but that's ok
+                // will rewrite ctx->retFirst[ir] to itself, but that's ok
                 if (o) k=o[j]-1; else k=j;
-                retFirst[k] = retFirst[ir];
-                retLength[k]= retLength[ir]; 
+                ctx->retFirst[k] = ctx->retFirst[ir];
+                ctx->retLength[k]= ctx->retLength[ir]; 
             }
         }
     }
     switch (op[col]) {
     case EQ:
         if (ilow>ilowIn && (xlow>xlowIn || ((roll!=0.0 || op[col] != EQ) && col==ncol-1)))
-            bmerge_r(xlowIn, xlow+1, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn);
+            bmerge_r(ctx, xlowIn, xlow+1, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn, -1);
         if (iupp<iuppIn && (xupp<xuppIn || ((roll!=0.0 || op[col] != EQ) && col==ncol-1)))
-            bmerge_r(xupp-1, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax);
+            bmerge_r(ctx, xupp-1, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax, 1);
     break;
     case LE: case LT:
         // roll is not yet implemented
         if (ilow>ilowIn)
-            bmerge_r(xlowIn, xuppIn, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn);
+            bmerge_r(ctx, xlowIn, xuppIn, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn, 0);
         if (iupp<iuppIn)
-            bmerge_r(xlowIn, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax);
+            bmerge_r(ctx, xlowIn, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax, 0);
     break;
     case GE: case GT:
         // roll is not yet implemented
         if (ilow>ilowIn)
-            bmerge_r(xlowIn, xuppIn, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn);
+            bmerge_r(ctx, xlowIn, xuppIn, ilowIn, ilow+1, col, 1, lowmax, uppmax && xlow+1==xuppIn, 0);
         if (iupp<iuppIn)
-            bmerge_r(xlowIn, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax);
+            bmerge_r(ctx, xlowIn, xuppIn, iupp-1, iuppIn, col, 1, lowmax && xupp-1==xlowIn, uppmax, 0);
     break;
     }
 }
@@ -37,6 +37,44 @@
 #endif
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+// Compensated summation of doubles for gsum, gmean and fastmean, in place of long double (slow x87, not vectorized, and
+// platform dependent: 80 bits on x86, 64 on ARM and under valgrind). Each of DSUMLANES lanes keeps a running sum s and, in c,
+// the exact rounding errors of its additions (TwoSum, as Neumaier's variant of Kahan's, Ogita, Rump & Oishi's Sum2); the
+// j-th value goes to lane j%DSUMLANES so the lanes are independent chains that vectorize. The result is the same on every
+// platform, depends only on the order of the values, and is as accurate as summing in twice double precision and rounding
+// once: |result - exact| <= 2^-53*|exact| + n^2*2^-106*sum(|x|). Inf, -Inf, NA and NaN propagate through s; a partial sum
+// beyond DBL_MAX is Inf (as it already is for a sum beyond DBL_MAX) whereas long double could have come back into range.
+#define DSUMLANES 4
+typedef struct { double s[DSUMLANES], c[DSUMLANES]; } dsum_t;
+
+static inline void dsuminit(dsum_t *a) {
+  for (int l=0; l<DSUMLANES; l++) a->s[l] = a->c[l] = 0.0;
+}
+
+static inline void dsumadd(dsum_t *a, const int lane, const double v) {
+  const double t = a->s[lane] + v, z = t - a->s[lane];
+  a->c[lane] += (a->s[lane] - (t - z)) + (v - z);
+  a->s[lane] = t;
+}
+
+// Add x[0..n-1], skipping NA and NaN (as adding 0.0 leaves a lane as it is) when narm, continuing from the j-th value
+static inline int dsumblock(dsum_t *a, int j, const double *x, const int n, const Rboolean narm) {
+  int i = 0;
+  for (; i<n && (j+i)%DSUMLANES; i++) dsumadd(a, (j+i)%DSUMLANES, narm && ISNAN(x[i]) ? 0.0 : x[i]);
+  for (; i+DSUMLANES<=n; i+=DSUMLANES) {
+    for (int l=0; l<DSUMLANES; l++) dsumadd(a, l, narm && ISNAN(x[i+l]) ? 0.0 : x[i+l]);
+  }
+  for (; i<n; i++) dsumadd(a, (j+i)%DSUMLANES, narm && ISNAN(x[i]) ? 0.0 : x[i]);
+  return j+n;
+}
+
+static inline double dsumget(const dsum_t *a) {
+  dsum_t t;
+  dsuminit(&t);
+  for (int l=0; l<DSUMLANES; l++) { dsumadd(&t, 0, a->s[l]); t.c[0] += a->c[l]; }
+  return R_FINITE(t.s[0]) ? t.s[0] + t.c[0] : t.s[0];
+}
+
 // init.c
 void setSizes();
 SEXP char_integer64;
@@ -68,14 +106,16 @@ Rboolean isDatatable(SEXP x);
 
 // forder.c
 int StrCmp(SEXP x, SEXP y);
-unsigned long long dtwiddle(void *p, int i, int order);
-unsigned long long i64twiddle(void *p, int i, int order);
-unsigned long long (*twiddle)(void *, int, int);
+unsigned long long dtwiddle(void *p, int i, int order, int nalast);
+unsigned long long i64twiddle(void *p, int i, int order, int nalast);
 SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP naArg);
 
 // reorder.c
 SEXP reorder(SEXP x, SEXP order);
 
+// subset.c
+SEXP subsetVector(SEXP x, SEXP idx);
+
 // fcast.c
 SEXP int_vec_init(R_len_t n, int val);
 
@@ -113,7 +153,7 @@ SEXP dogroups(SEXP dt, SEXP dtcols, SEXP groups, SEXP grpcols, SEXP jiscols,
 // bmerge.c
 SEXP bmerge(SEXP iArg, SEXP xArg, SEXP icolsArg, SEXP xcolsArg, SEXP isorted, 
                 SEXP xoArg, SEXP rollarg, SEXP rollendsArg, SEXP nomatchArg, 
-                SEXP multArg, SEXP opArg, SEXP nqgrpArg, SEXP nqmaxgrpArg);
+                SEXP multArg, SEXP opArg, SEXP nqgrpArg, SEXP nqmaxgrpArg, SEXP strcodesArg);
 SEXP ENC2UTF8(SEXP s);
 
 // rbindlist.c
@@ -122,6 +162,7 @@ SEXP combineFactorLevels(SEXP factorLevels, int *factorType, Rboolean *isRowOrde
 // quickselect
 double dquickselect(double *x, int n, int k);
 double iquickselect(int *x, int n, int k);
+unsigned long long ullquickselect(unsigned long long *x, int n, int k);
 
 // fread.c
 double wallclock();
@@ -16,19 +16,30 @@ mean() is so slow, and so much slower than sum(), and so commonly used
 and benchmarked, that it warrants this fast mean.
 We can't call .Internal(mean(x)) because that's disallowed by QC.R, but
 anyway .Internal(mean(x)) doesn't respect na.rm=TRUE.
-We are careful to retain the double scan that summary.c does that
-adjusts for accumalated rounding errors in floating point.
+Unlike summary.c the sums aren't in long double: integers are summed
+exactly in int64_t (then divided in long double as summary.c does, so
+a sum beyond 2^53 isn't rounded first) and doubles by compensated
+summation (dsum_t in data.table.h), which is more accurate than long
+double, the same on every platform, and vectorizes. So the second scan
+summary.c does to adjust for accumulated rounding errors isn't needed:
+the sum is as if in twice double precision, and a second scan could
+only lose that accuracy when there's cancellation, since each x[i]-mean
+is rounded.
 
-We explicitly test that fastmean returns the same result as
-base::mean in test.data.table(). For that we use exact equality under
-floating point, not all.equal. A stronger test. These
-tests run under R CMD check and run on all CRAN platforms daily to catch
-if we become out of line to base R (say if base R changed its mean).
+So for integers fastmean returns exactly what base::mean does, and
+test.data.table() checks that with exact equality, not all.equal. For
+doubles it may differ from base::mean in the last bit: the sum's error
+is at most 2^-53*|S| + n^2*2^-106*sum(|x|) for the exact sum S of the
+n values (see ?datatable.optimize), at least as accurate as long
+double, and test.data.table() checks the means against sums it knows
+exactly. These tests run under R CMD check on all CRAN platforms daily.
 */
 
 SEXP fastmean(SEXP args)
 {
-  	long double s = 0., t = 0.;
+	dsum_t s;
+	int64_t is = 0;
+	double m;
 	R_len_t i, l = 0, n = 0;
 	SEXP x, ans, tmp;
 	Rboolean narm=FALSE;
@@ -52,33 +63,23 @@ SEXP fastmean(SEXP args)
 	    case INTSXP:
 	        for (i = 0; i<l; i++) {
 		        if(INTEGER(x)[i] == NA_INTEGER) continue;
-		        s += INTEGER(x)[i];   // no under/overflow here, s is long double not integer
+		        is += INTEGER(x)[i];   // no under/overflow here, is is int64_t not integer
 		        n++;
 		    }
 		    if (n>0)
-		        REAL(ans)[0] = (double) (s/n);
+		        REAL(ans)[0] = (double)((long double)is/n);
 		    else
 		        REAL(ans)[0] = R_NaN;  // consistent with base: mean(NA,na.rm=TRUE)==NaN==mean(numeric(),na.rm=TRUE)
 	        break;
 	    case REALSXP:
-	        for (i = 0; i<l; i++) {
-	            if(ISNAN(REAL(x)[i])) continue;  // TO DO: could drop this line and let NA propogate?
-	            s += REAL(x)[i];
-	            n++;
-	        }
+	        for (i = 0; i<l; i++) n += !ISNAN(REAL(x)[i]);
 	        if (n==0) {
 	            REAL(ans)[0] = R_NaN;
 	            break;
 	        }
-	        s /= n;
-	        if(R_FINITE((double)s)) {
-		        for (i = 0; i<l; i++) {
-		            if(ISNAN(REAL(x)[i])) continue;
-		            t += (REAL(x)[i] - s);
-		        }
-		        s += t/n;
-	        }
-	        REAL(ans)[0] = (double) s;
+	        dsuminit(&s);
+	        dsumblock(&s, 0, REAL(x), l, TRUE);
+	        REAL(ans)[0] = dsumget(&s)/n;
 	        break;
 	    default:
 	        error("Type '%s' not supported in fastmean", type2char(TYPEOF(x)));
@@ -89,24 +90,19 @@ SEXP fastmean(SEXP args)
 	    case INTSXP:
 	        for (i = 0; i<l; i++) {
 		        if(INTEGER(x)[i] == NA_INTEGER) {UNPROTECT(1); return(ans);}
-		        s += INTEGER(x)[i];
+		        is += INTEGER(x)[i];
 		    }
-		    REAL(ans)[0] = (double) (s/l);
+		    REAL(ans)[0] = (double)((long double)is/l);
 	        break;
 	    case REALSXP:
-	        for (i = 0; i<l; i++) {
-	            if(ISNAN(REAL(x)[i])) {UNPROTECT(1); return(ans);}
-	            s += REAL(x)[i];
-	        }
-	        s /= l;
-	        if(R_FINITE((double)s)) {
-		        for (i = 0; i<l; i++) {
-		            // no NA if got this far
-		            t += (REAL(x)[i] - s);
-		        }
-		        s += t/LENGTH(x);
+	        dsuminit(&s);
+	        dsumblock(&s, 0, REAL(x), l, FALSE);
+	        m = dsumget(&s)/l;
+	        if (ISNAN(m)) {
+	            // NA for an NA or NaN, as before; else NaN, from Inf and -Inf or an empty x
+	            for (i = 0; i<l; i++) if(ISNAN(REAL(x)[i])) {UNPROTECT(1); return(ans);}
 	        }
-	        REAL(ans)[0] = (double) s;
+	        REAL(ans)[0] = m;
 	        break;
 	    default:
 	        error("Type '%s' not supported in fastmean", type2char(TYPEOF(x)));
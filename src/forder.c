@@ -1,78 +1,192 @@
 #include "data.table.h"
 // #define TIMING_ON
 
-/* 
+/*
     - Only forder() and *twiddle() functions are meant for use by other C code in data.table, hence all other functions here except forder and *twiddle are static.
-    - The static functions here make use of global variables, whose scope is limited to the same translation unit; therefore access from outside this file must be via forder and/or *twiddle only. 
+    - All state of one call to forder lives in a forderCtx on forder's stack rather than in statics, so a call made while another is part way through
+      (a nested forder from C, or one of a key's columns ordered inside another's) doesn't clobber it. It is not thread-safe: forder allocates its
+      result and errors through the R API, so it must be called from R's main thread. Character columns also use CHARSXP truelengths (R's global
+      string cache) in csort_pre and cgroup and the savetl globals, so only one call at a time may order them; savetl_init is called only then.
+      The rounding set by setNumericRounding is a global option.
     - The coding techniques deployed here are for efficiency; e.g. i) the static functions are recursive or called repetitively and we wish to minimise stack overhead, or ii) reach outside themselves to place results in the end result directly rather than returning small bits of memory.
+    - Working memory used while sorting (group size stack, radix counts, xsub, otmp, newo etc) lives in a sortWorker so that several sorts can run at once.
+      The master worker sorts the first column (and each large group of later columns) and fans out to a pool of workers, one per thread, to sort the
+      buckets below the most significant byte. Runs of smaller groups in later columns are sorted by the pool in parallel batches. Each worker pushes
+      group sizes onto its own stack and the stacks are stitched back together in order, so the ordering and groups are identical to a single thread.
 */
 
-static int *gs[2] = {NULL};                                         // gs = groupsizes e.g. 23,12,87,2,1,34,...
-static int flip = 0;                                                // two vectors flip flopped: flip and 1-flip
-static int gsalloc[2] = {0};                                        // allocated stack size
-static int gsngrp[2] = {0};                                         // used
-static int gsmax[2] = {0};                                          // max grpn so far
-static int gsmaxalloc = 0;                                          // max size of stack, set by forder to nrows
-static Rboolean stackgrps = TRUE;                                   // switched off for last column when not needed by setkey
-static Rboolean sortStr = TRUE;                                     // TRUE for setkey, FALSE for by=
-static int *newo = NULL;                                            // used by forder and [i|d|c]sort to reorder order. not needed if length(by)==1
-
-static int nalast = -1;                                             // =1, 0, -1 for TRUE, NA, FALSE respectively. Value rewritten inside forder().
+typedef struct {
+    int *gs;                                                        // gs = groupsizes e.g. 23,12,87,2,1,34,...
+    int alloc;                                                      // allocated stack size
+    int ngrp;                                                       // used
+    int max;                                                        // max grpn so far
+} grpstack;
+
+typedef struct forderCtx forderCtx;
+
+typedef struct {
+    forderCtx *ctx;                                                 // the call this worker belongs to
+    grpstack st;                                                    // group sizes pushed by this worker
+    unsigned int radixcounts[8][257];                               // 4 are used for iradix, 8 for dradix and i64radix
+    int skip[8];
+    void *radix_xsub;     int radix_xsuballoc;
+    int *otmp;            int otmp_alloc;
+    void *xtmp;           int xtmp_alloc;
+    int *csort_otmp;      int csort_otmp_alloc;
+    void *xsub; int *newo; int xsub_alloc;                          // per-group working memory for columns 2+. newo is used by [i|d|c]sort to reorder order
+    unsigned int *counts;                                           // icount's counts, N_RANGE+1 long, calloc'd on first use
+    int range, xmin;                                                // set by setRange
+    int nth;                                                        // >1 allows this worker to fan out to the pool; master only, never inside a parallel region
+    Rboolean isSorted;
+    char msg[256];                                                  // first error. error() can't be called from a thread so it's raised by checkWorkers() afterwards
+} sortWorker;
+
+typedef struct {
+    int g0, g1;                                                     // groups [g0,g1) of prev
+    int row;                                                        // first row of o covered
+    int wk;                                                         // the worker that sorted it, index into workers
+    int start, ngrp;                                                // the group sizes it pushed onto that worker's stack
+} task;
+
+struct forderCtx {
+    int nalast;                                                     // =1, 0, -1 for TRUE, NA, FALSE respectively.
                                                                     // note that na.last=NA (0) removes NAs, not retains them.
-static int order = 1;                                               // =1, -1 for ascending and descending order respectively
+    int order;                                                      // =1, -1 for ascending and descending order of the current column
+    Rboolean stackgrps;                                             // switched off for last column when not needed by setkey
+    Rboolean sortStr;                                               // TRUE for setkey, FALSE for by=
+    unsigned long long (*twiddle)(void *, int, int, int);           // dtwiddle or i64twiddle for the current column
+    Rboolean (*is_nan)(void *, int);                                // see dnan and i64nan
+    sortWorker *workers;                                            // workers[0] is the master, workers+1 the pool
+    int nworkers;
+    grpstack prev;                                                  // groups from the columns sorted so far; read by the next column
+    task *tasks;                                                    // the current column's groups split into tasks
+    int gsmaxalloc;                                                 // max size of stack, set by forder to nrows
+    SEXP *ustr; int ustr_alloc, ustr_n;                             // unique strings found by csort_pre and cgroup
+    int *cradix_counts; int cradix_counts_alloc;
+    int maxlen;
+    SEXP *cradix_xtmp; int cradix_xtmp_alloc;
+    void *keys;                                                     // all the 'by' columns packed into one key by packKeys, or NULL
+    Rboolean savingtl;                                              // savetl_init was called: there's a character column
+};
 
 #define N_SMALL 200                                                 // replaced n < 200 with n < N_SMALL. Easier to change later
 #define N_RANGE 100000                                              // range limit for counting sort. UPDATE: should be less than INT_MAX (see setRange for details)
+#define N_PARALLEL 100000                                           // vectors and groups shorter than this aren't worth waking threads for
 
-#define Error(...) do {savetl_end(); error(__VA_ARGS__);} while(0)  // http://gcc.gnu.org/onlinedocs/cpp/Swallowing-the-Semicolon.html#Swallowing-the-Semicolon
+static void freeCtx(forderCtx *ctx);
+#define Error(...) do {freeCtx(ctx); if (ctx->savingtl) savetl_end(); error(__VA_ARGS__);} while(0)  // needs ctx in scope. http://gcc.gnu.org/onlinedocs/cpp/Swallowing-the-Semicolon.html#Swallowing-the-Semicolon
+#define WError(w, ...) do {if (!(w)->msg[0]) snprintf((w)->msg, sizeof((w)->msg), __VA_ARGS__);} while(0)  // thread-safe; see checkWorkers
 #undef warning
 #define warning(...) Do not use warning in this file                // since it can be turned to error via warn=2
-/* use malloc/realloc (not Calloc/Realloc) so we can trap errors 
+/* use malloc/realloc (not Calloc/Realloc) so we can trap errors
 and call savetl_end() before the error(). */
 
-static void growstack(int newlen) {
+static void checkWorkers(forderCtx *ctx) {
+    for (int i=0; i<ctx->nworkers; i++) if (ctx->workers[i].msg[0]) {
+        char msg[256];
+        memcpy(msg, ctx->workers[i].msg, sizeof(msg));              // freed by Error
+        Error("%s", msg);
+    }
+}
+
+static void growstack(sortWorker *w, int newlen) {
     if (newlen==0) newlen=100000;                                   // no link to icount range restriction, just 100,000 seems a good minimum at 0.4MB.
-    if (newlen>gsmaxalloc) newlen=gsmaxalloc;
-    gs[flip] = realloc(gs[flip], newlen*sizeof(int));
-    if (gs[flip] == NULL) Error("Failed to realloc working memory stack to %d*4bytes (flip=%d)", newlen, flip);
-    gsalloc[flip] = newlen;
+    if (newlen>w->ctx->gsmaxalloc) newlen=w->ctx->gsmaxalloc;
+    int *tmp = realloc(w->st.gs, newlen*sizeof(int));
+    if (tmp == NULL) { WError(w, "Failed to realloc working memory stack to %d*4bytes", newlen); return; }
+    w->st.gs = tmp;
+    w->st.alloc = newlen;
 }
 
-static void push(int x) {
-    if (!stackgrps || x==0) return;
-    if (gsalloc[flip] == gsngrp[flip]) growstack(gsngrp[flip]*2);
-    gs[flip][gsngrp[flip]++] = x;
-    if (x > gsmax[flip]) gsmax[flip] = x;
+static void push(sortWorker *w, int x) {
+    if (!w->ctx->stackgrps || x==0) return;
+    if (w->st.alloc == w->st.ngrp) { growstack(w, w->st.ngrp*2); if (w->st.alloc == w->st.ngrp) return; }
+    w->st.gs[w->st.ngrp++] = x;
+    if (x > w->st.max) w->st.max = x;
 }
 
-static void mpush(int x, int n) {
-    if (!stackgrps || x==0) return;
-    if (gsalloc[flip] < gsngrp[flip]+n) growstack((gsngrp[flip]+n)*2);
-    for (int i=0; i<n; i++) gs[flip][gsngrp[flip]++] = x;
-    if (x > gsmax[flip]) gsmax[flip] = x;
+static void mpush(sortWorker *w, int x, int n) {
+    if (!w->ctx->stackgrps || x==0) return;
+    if (w->st.alloc < w->st.ngrp+n) { growstack(w, (w->st.ngrp+n)*2); if (w->st.alloc < w->st.ngrp+n) return; }
+    for (int i=0; i<n; i++) w->st.gs[w->st.ngrp++] = x;
+    if (x > w->st.max) w->st.max = x;
 }
 
-static void flipflop() {
-    flip = 1-flip;
-    gsngrp[flip] = 0;
-    gsmax[flip] = 0;
-    if (gsalloc[flip] < gsalloc[1-flip]) growstack(gsalloc[1-flip]*2);
+static void stitch(forderCtx *ctx, grpstack *dst, task *t, int ntask)
+// Appends the group sizes each task pushed onto its worker's stack to dst, in task order. Then empties the source stacks.
+{
+    sortWorker *workers = ctx->workers;
+    int total = dst->ngrp;
+    for (int i=0; i<ntask; i++) total += t[i].ngrp;
+    if (dst->alloc < total) {
+        int *tmp = realloc(dst->gs, total*sizeof(int));
+        if (tmp == NULL) Error("Failed to realloc working memory stack to %d*4bytes", total);
+        dst->gs = tmp;
+        dst->alloc = total;
+    }
+    for (int i=0; i<ntask; i++) {
+        memcpy(dst->gs + dst->ngrp, workers[t[i].wk].st.gs + t[i].start, t[i].ngrp*sizeof(int));
+        dst->ngrp += t[i].ngrp;
+    }
+    for (int i=0; i<ctx->nworkers; i++) {
+        if (&workers[i].st == dst) continue;
+        if (workers[i].st.max > dst->max) dst->max = workers[i].st.max;
+        workers[i].st.ngrp = workers[i].st.max = 0;
+    }
 }
 
-static void gsfree() {
-    free(gs[0]); free(gs[1]);
-    gs[0] = NULL; gs[1]= NULL;
-    flip = 0;
-    gsalloc[0] = gsalloc[1] = 0;
-    gsngrp[0] = gsngrp[1] = 0;
-    gsmax[0] = gsmax[1] = 0;
-    gsmaxalloc = 0;
+static void freeCtx(forderCtx *ctx) {
+    for (int i=0; i<ctx->nworkers; i++) {
+        sortWorker *w = ctx->workers+i;
+        free(w->st.gs); free(w->radix_xsub); free(w->otmp); free(w->xtmp);
+        free(w->csort_otmp); free(w->xsub); free(w->newo); free(w->counts);
+    }
+    free(ctx->workers);         ctx->workers=NULL;          ctx->nworkers=0;
+    free(ctx->prev.gs);         ctx->prev.gs=NULL;          ctx->prev.alloc = ctx->prev.ngrp = ctx->prev.max = 0;
+    free(ctx->tasks);           ctx->tasks=NULL;
+    free(ctx->ustr);            ctx->ustr=NULL;             ctx->ustr_alloc=0;
+    free(ctx->cradix_counts);   ctx->cradix_counts=NULL;    ctx->cradix_counts_alloc=0;
+    free(ctx->cradix_xtmp);     ctx->cradix_xtmp=NULL;      ctx->cradix_xtmp_alloc=0;   // TO DO: use xtmp already got
+    free(ctx->keys);            ctx->keys=NULL;
+}
+
+static void newWorkers(forderCtx *ctx, int nth) {
+    ctx->workers = (sortWorker *)calloc(nth+1, sizeof(sortWorker));  // calloc: radixcounts must start 0, as they're left after each use
+    if (ctx->workers == NULL) Error("Failed to allocate %d sort workers", nth+1);
+    ctx->nworkers = nth+1;
+    for (int i=0; i<ctx->nworkers; i++) { ctx->workers[i].ctx = ctx; ctx->workers[i].nth = 1; ctx->workers[i].isSorted = TRUE; }
+}
+
+#define ALLOC_WORK(fun, ptr, alloc, type, size)                                                              \
+static Rboolean fun(sortWorker *w, int n) {                                                                  \
+    if (w->alloc >= n) return TRUE;                                                                          \
+    void *tmp = realloc(w->ptr, (size_t)n * size);                                                           \
+    if (tmp == NULL) { WError(w, "Failed to allocate working memory for " #ptr ". Requested %d * %d bytes", n, (int)size); return FALSE; } \
+    w->ptr = (type)tmp;                                                                                      \
+    w->alloc = n;                                                                                            \
+    return TRUE;                                                                                             \
+}
+ALLOC_WORK(alloc_otmp,       otmp,       otmp_alloc,       int *,  sizeof(int))
+ALLOC_WORK(alloc_xtmp,       xtmp,       xtmp_alloc,       void *, sizeof(double))     // TO DO: currently always the largest type (double) but could be int if that's all that's needed
+ALLOC_WORK(alloc_radix_xsub, radix_xsub, radix_xsuballoc,  void *, sizeof(double))
+ALLOC_WORK(alloc_csort_otmp, csort_otmp, csort_otmp_alloc, int *,  sizeof(int))
+
+static Rboolean alloc_xsub(sortWorker *w, int n) {
+    if (w->xsub_alloc >= n) return TRUE;
+    void *tmp = realloc(w->xsub, (size_t)n * sizeof(double));                                               // double is the largest type, 8
+    if (tmp == NULL) { WError(w, "Couldn't allocate xsub in forder, requested %d * %d bytes.", n, (int)sizeof(double)); return FALSE; }
+    w->xsub = tmp;
+    tmp = realloc(w->newo, (size_t)n * sizeof(int));
+    if (tmp == NULL) { WError(w, "Couldn't allocate newo in forder, requested %d * %d bytes.", n, (int)sizeof(int)); return FALSE; }
+    w->newo = (int *)tmp;
+    w->xsub_alloc = n;
+    return TRUE;
 }
 
 #ifdef TIMING_ON
   // many calls to clock() can be expensive, hence compiled out rather than switch(verbose)
   #include <time.h>
-  #define NBLOCK 20  
+  #define NBLOCK 20
   static clock_t tblock[NBLOCK], tstart;
   static int nblock[NBLOCK];
   #define TBEG() tstart = clock();
@@ -83,7 +197,7 @@ static void gsfree() {
 #endif
 
 
-/* 
+/*
    icount originally copied from do_radixsort in src/main/sort.c @ rev 51389. Then reworked here again in forder.c in v1.8.11
    base::sort.list(method="radix") turns out not to be a radix sort, but a counting sort, and we like it.
    See http://r.789695.n4.nabble.com/method-radix-in-sort-list-isn-t-actually-a-radix-sort-tp3309470p3309470.html
@@ -93,14 +207,44 @@ static void gsfree() {
      3. Separated setRange so forder can redirect to iradix
 */
 
-static int range, xmin;                                                  // used by both icount and forder
-static void setRange(int *x, int n)
+static void setRangeFromMinMax(sortWorker *w, int xmin, int xmax)
+{
+    w->xmin = xmin;                                                         // used by forder
+    if(xmin == NA_INTEGER) {w->range = NA_INTEGER; return;}                 // all NAs, nothing to do
+    double overflow = (double)xmax - (double)xmin + 1;                      // ex: x=c(-2147483647L, NA_integer_, 1L) results in overflowing int range.
+    if (overflow > INT_MAX) {w->range = INT_MAX; return;}                   // detect and force iradix here, since icount is out of the picture
+    w->range = xmax-xmin+1;
+}
+
+static void setRange(sortWorker *w, int *x, int n)
 {
+    forderCtx *ctx = w->ctx;
     int i, tmp;
-    xmin = NA_INTEGER;     // used by forder
-    int xmax = NA_INTEGER; // declared locally as we only need xmin outside
-    double overflow;
-    
+    int xmin = NA_INTEGER, xmax = NA_INTEGER;
+    if (w->nth>1 && n>=N_PARALLEL) {
+        // min and max of each batch, then combine
+        int nth = MIN(w->nth, ctx->nworkers-1), bsize = (n-1)/nth+1, nb = (n-1)/bsize+1;
+        int bmin[nb], bmax[nb];
+        #pragma omp parallel for num_threads(nth)
+        for (int b=0; b<nb; b++) {
+            int lo = NA_INTEGER, hi = NA_INTEGER, to = MIN(n, (b+1)*bsize);
+            for (int i=b*bsize; i<to; i++) {
+                int tmp = x[i];
+                if (tmp == NA_INTEGER) continue;
+                if (lo == NA_INTEGER) lo = hi = tmp;
+                else if (tmp > hi) hi = tmp;
+                else if (tmp < lo) lo = tmp;
+            }
+            bmin[b] = lo; bmax[b] = hi;
+        }
+        for (int b=0; b<nb; b++) {
+            if (bmin[b] == NA_INTEGER) continue;
+            if (xmin == NA_INTEGER || bmin[b] < xmin) xmin = bmin[b];
+            if (xmax == NA_INTEGER || bmax[b] > xmax) xmax = bmax[b];
+        }
+        setRangeFromMinMax(w, xmin, xmax);
+        return;
+    }
     i = 0;
     while(i<n && x[i]==NA_INTEGER) i++;
     if (i<n) xmax = xmin = x[i];
@@ -110,60 +254,102 @@ static void setRange(int *x, int n)
         if (tmp > xmax) xmax = tmp;
         else if (tmp < xmin) xmin = tmp;
     }
-    if(xmin == NA_INTEGER) {range = NA_INTEGER; return;}                    // all NAs, nothing to do    
-    
-    overflow = (double)xmax - (double)xmin + 1;                             // ex: x=c(-2147483647L, NA_integer_, 1L) results in overflowing int range.
-    if (overflow > INT_MAX) {range = INT_MAX; return;}                      // detect and force iradix here, since icount is out of the picture
-    range = xmax-xmin+1;
-    
-    return;
+    setRangeFromMinMax(w, xmin, xmax);
 }
 
 // x*order results in integer overflow when -1*NA, so careful to avoid that here :
-static inline int icheck(int x) {
+static inline int icheck(int x, int order, int nalast) {
     return ((nalast != 1) ? ((x != NA_INTEGER) ? x*order : x) : ((x != NA_INTEGER) ? (x*order)-1 : INT_MAX)); // if nalast==1, NAs must go last.
 }
 
+static void icount_par(sortWorker *w, int *x, int *o, int n)
+/* icount on the whole vector using the pool. Each batch of x counts into its own histogram. The histograms are then
+   cumulated bucket by bucket, batch by batch, so that each batch scatters forwards into its own slots and ties stay stable. */
+{
+    forderCtx *ctx = w->ctx;
+    const int nalast = ctx->nalast, order = ctx->order;
+    int range = w->range, xmin = w->xmin, napos = range;
+    int nth = MIN(w->nth, ctx->nworkers-1), bsize = (n-1)/nth+1, nb = (n-1)/bsize+1;
+    unsigned int *counts = (unsigned int *)calloc((size_t)nb*(range+1), sizeof(unsigned int));
+    if (counts == NULL) Error("Failed to allocate %d*%d counts in icount", nb, range+1);
+    #pragma omp parallel for num_threads(nth)
+    for (int b=0; b<nb; b++) {
+        unsigned int *thiscounts = counts + (size_t)b*(range+1);
+        int to = MIN(n, (b+1)*bsize);
+        for (int i=b*bsize; i<to; i++) thiscounts[x[i] == NA_INTEGER ? napos : x[i]-xmin]++;
+    }
+    unsigned int cumsum = 0;
+    for (int i=0; i<=range; i++) {
+        // same bucket order as icount: NA first unless nalast==1, then ascending or descending, then NA if nalast==1
+        int k = (nalast!=1) ? (i==0 ? napos : (order==1 ? i-1 : range-i))
+                            : (i==range ? napos : (order==1 ? i : range-1-i));
+        unsigned int thisgrpn = 0;
+        for (int b=0; b<nb; b++) {
+            unsigned int *c = counts + (size_t)b*(range+1) + k, tmp = *c;
+            *c = cumsum + thisgrpn;
+            thisgrpn += tmp;
+        }
+        if (thisgrpn) { push(w, thisgrpn); cumsum += thisgrpn; }
+    }
+    #pragma omp parallel for num_threads(nth)
+    for (int b=0; b<nb; b++) {
+        unsigned int *thiscounts = counts + (size_t)b*(range+1);
+        int to = MIN(n, (b+1)*bsize);
+        for (int i=b*bsize; i<to; i++) o[thiscounts[x[i] == NA_INTEGER ? napos : x[i]-xmin]++] = i+1;
+    }
+    free(counts);
+    if (nalast == 0) {
+        #pragma omp parallel for num_threads(nth)
+        for (int i=0; i<n; i++) o[i] = (x[o[i]-1] == NA_INTEGER) ? 0 : o[i];
+    }
+}
 
-static void icount(int *x, int *o, int n)
+static void icount(sortWorker *w, int *x, int *o, int n)
 /* Counting sort:
     1. Places the ordering into o directly, overwriting whatever was there
     2. Doesn't change x
     3. Pushes group sizes onto stack
 */
 {
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
     int i=0, tmp;
+    int range = w->range, xmin = w->xmin;
     int napos = range;  // always count NA in last bucket and we'll account for nalast option in due course
-    static unsigned int counts[N_RANGE+1] = {0};                            // static is IMPORTANT, counting sort is called repetitively.
-    /* counts are set back to 0 at the end efficiently. 1e5 = 0.4MB i.e 
-    tiny. We'll only use the front part of it, as large as range. So it's 
+    if (range > N_RANGE) { WError(w, "Internal error: range = %d; isorted can't handle range > %d", range, N_RANGE); return; }
+    if (w->nth>1 && n>=N_PARALLEL) { icount_par(w, x, o, n); return; }
+    if (w->counts == NULL && (w->counts = (unsigned int *)calloc(N_RANGE+1, sizeof(unsigned int))) == NULL) {
+        WError(w, "Failed to allocate working memory for icount");
+        return;
+    }
+    unsigned int *counts = w->counts;                                       // allocated once per worker, IMPORTANT, counting sort is called repetitively.
+    /* counts are set back to 0 at the end efficiently. 1e5 = 0.4MB i.e
+    tiny. We'll only use the front part of it, as large as range. So it's
     just reserving space, not using it. Have defined N_RANGE to be 100000.*/
-    if (range > N_RANGE) Error("Internal error: range = %d; isorted can't handle range > %d", range, N_RANGE);
     for(i=0; i<n; i++) {
         if (x[i] == NA_INTEGER) counts[napos]++;             // For nalast=NA case, we won't remove/skip NAs, rather set 'o' indices
-        else counts[x[i]-xmin]++;                            // to 0. subset will skip them. We can't know how many NAs to skip 
+        else counts[x[i]-xmin]++;                            // to 0. subset will skip them. We can't know how many NAs to skip
     }                                                        // beforehand - i.e. while allocating "ans" vector
     // TO DO: at this point if the last count==n then it's all the same number and we can stop now.
     // Idea from Terdiman, then improved on that by not needing to loop through counts.
-    
+
     tmp = 0;
     if (nalast!=1 && counts[napos]) {
-        push(counts[napos]);
+        push(w, counts[napos]);
         tmp += counts[napos];
     }
-    int w = (order==1) ? 0 : range-1;                                   // *** BLOCK 4 ***
-    for (i=0; i<range; i++) 
-    /* no point in adding tmp<n && i<=range, since range includes max, 
+    int k = (order==1) ? 0 : range-1;                                   // *** BLOCK 4 ***
+    for (i=0; i<range; i++)
+    /* no point in adding tmp<n && i<=range, since range includes max,
        need to go to max, unlike 256 loops elsewhere in forder.c */
     {
-        if (counts[w]) {                                                    // cumulate but not through 0's. Helps resetting zeros when n<range, below.
-            push(counts[w]);
-            counts[w] = (tmp += counts[w]);
+        if (counts[k]) {                                                    // cumulate but not through 0's. Helps resetting zeros when n<range, below.
+            push(w, counts[k]);
+            counts[k] = (tmp += counts[k]);
         }
-        w += order; // order is +1 or -1
+        k += order; // order is +1 or -1
     }
     if (nalast==1 && counts[napos]) {
-        push(counts[napos]);
+        push(w, counts[napos]);
         counts[napos] = (tmp += counts[napos]);
     }
     for(i=n-1; i>=0; i--) {
@@ -173,10 +359,10 @@ static void icount(int *x, int *o, int n)
         for (i=0; i<n; i++) o[i] = (x[o[i]-1] == NA_INTEGER) ? 0 : o[i];    // nalast = 0 is dealt with separately as it just sets o to 0
                                                                             // at those indices where x is NA. x[o[i]-1] because x is not modifed here.
 
-    /* counts were cumulated above so leaves non zero. 
+    /* counts were cumulated above so leaves non zero.
     Faster to clear up now ready for next time. */
     if (n < range) {
-        /* Many zeros in counts already. Loop through n instead, 
+        /* Many zeros in counts already. Loop through n instead,
         doesn't matter if we set to 0 several times on any repeats */
         counts[napos]=0;
         for (i=0; i<n; i++) {
@@ -188,11 +374,11 @@ static void icount(int *x, int *o, int n)
     return;
 }
 
-static void iinsert(int *x, int *o, int n)
+static void iinsert(sortWorker *w, int *x, int *o, int n)
 /*  orders both x and o by reference in-place. Fast for small vectors, low overhead.
-    don't be tempted to binsearch backwards here, have to shift anyway; 
+    don't be tempted to binsearch backwards here, have to shift anyway;
     many memmove would have overhead and do the same thing. */
-/*  when nalast == 0, iinsert will be called only from within iradix, where o[.] = 0 
+/*  when nalast == 0, iinsert will be called only from within iradix, where o[.] = 0
     for x[.]=NA is already taken care of */
 {
     int i, j, xtmp, otmp, tt;
@@ -201,7 +387,7 @@ static void iinsert(int *x, int *o, int n)
         if (xtmp < x[i-1]) {
             j = i-1;
             otmp = o[i];
-            while (j>=0 && xtmp < x[j]) { 
+            while (j>=0 && xtmp < x[j]) {
                 x[j+1] = x[j];
                 o[j+1] = o[j];
                 j--;
@@ -209,111 +395,96 @@ static void iinsert(int *x, int *o, int n)
             x[j+1] = xtmp;
             o[j+1] = otmp;
         }
-    }    
+    }
     tt = 0;
-    for (i=1; i<n; i++) if (x[i]==x[i-1]) tt++; else { push(tt+1); tt=0; }
-    push(tt+1);
+    for (i=1; i<n; i++) if (x[i]==x[i-1]) tt++; else { push(w, tt+1); tt=0; }
+    push(w, tt+1);
 }
 
 /*
-  iradix is a counting sort performed forwards from MSB to LSB, with some tricks 
+  iradix is a counting sort performed forwards from MSB to LSB, with some tricks
   and short circuits building on Terdiman and Herf.
-    http://codercorner.com/RadixSortRevisited.htm 
+    http://codercorner.com/RadixSortRevisited.htm
     http://stereopsis.com/radix.html
-  
+
     ~ Note they are LSD, but we do MSD here which is more complicated, for efficiency.
-    ~ NAs need no special treatment as NA is the most negative integer in R (checked in init.c once, 
+    ~ NAs need no special treatment as NA is the most negative integer in R (checked in init.c once,
       for efficiency) so NA naturally sort to the front.
     ~ Using 4-pass 1-byte radix for the following reasons :
-        *  11-bit (Herf) reduces to 3-passes (3*11=33) yes, and LSD need random access 
+        *  11-bit (Herf) reduces to 3-passes (3*11=33) yes, and LSD need random access
            to o vector in each pass 1:n so reduction in passes
         *  is good, but ...
-        *  ... Terdiman's idea to skip a radix if all values are equal occurs less the wider the 
+        *  ... Terdiman's idea to skip a radix if all values are equal occurs less the wider the
                radix. A narrower radix benefits more from that.
-        *      That's detected here using a single 'if', an improvement on Terdiman's exposition 
+        *      That's detected here using a single 'if', an improvement on Terdiman's exposition
                of a single loop to find if any count==n
-        *  The pass through counts bites when radix is wider, because we repetitively call this 
+        *  The pass through counts bites when radix is wider, because we repetitively call this
            iradix from fastorder forwards.
-        *  Herf's parallel histogramming is neat. In 4-pass 1-byte it needs 4*256 storage, that's 
+        *  Herf's parallel histogramming is neat. In 4-pass 1-byte it needs 4*256 storage, that's
            tiny, and can be static. 4*256 << 3*2048
-        *  4-pass 1-byte is simpler and tighter code than 3-pass 11-bit, giving modern optimizers 
+        *  4-pass 1-byte is simpler and tighter code than 3-pass 11-bit, giving modern optimizers
            and modern CPUs a better chance. We may get
         *  lucky anyway, if one or two of the 4-passes are skipped.
 
-     Recall: there are no comparisons at all in counting and radix, there is wide random access 
+     Recall: there are no comparisons at all in counting and radix, there is wide random access
      in each LSD radix pass, though.
 */
 
-static unsigned int radixcounts[8][257] = {{0}};                            // 4 are used for iradix, 8 for dradix and i64radix
-static int skip[8];
-/* global because iradix and iradix_r interact and are called repetitively. 
+/* radixcounts and skip are per worker because iradix and iradix_r interact and are called repetitively.
    counts are set back to 0 after each use, to benefit from skipped radix. */
-static void *radix_xsub=NULL;
-static size_t radix_xsuballoc=0;
-
-static int *otmp=NULL, otmp_alloc=0;
-static void alloc_otmp(int n) {
-    if (otmp_alloc >= n) return;
-    otmp = (int *)realloc(otmp, n * sizeof(int));
-    if (otmp == NULL) Error("Failed to allocate working memory for otmp. Requested %d * %d bytes", n, sizeof(int));
-    otmp_alloc = n;
-}
-
-static void *xtmp=NULL; int xtmp_alloc=0;                                   // TO DO: save xtmp if possible, see allocs in forder
-static void alloc_xtmp(int n) {                                             // TO DO: currently always the largest type (double) but 
-                                                                            // could be int if that's all that's needed
-    if (xtmp_alloc >= n) return;
-    xtmp = (double *)realloc(xtmp, n * sizeof(double));
-    if (xtmp == NULL) Error("Failed to allocate working memory for xtmp. Requested %d * %d bytes", n, sizeof(double));
-    xtmp_alloc = n;
-}
 
-static void iradix_r(int *xsub, int *osub, int n, int radix);
+static void iradix_r(sortWorker *w, int *xsub, int *osub, int n, int radix);
+static void dradix_r(sortWorker *w, unsigned char *xsub, int *osub, int n, int radix);
+static void radix_par(sortWorker *w, void *x, int *o, int n, int nbyte);
 
-static void iradix(int *x, int *o, int n)
+static void iradix(sortWorker *w, int *x, int *o, int n)
    /* As icount :
        Places the ordering into o directly, overwriting whatever was there
        Doesn't change x
        Pushes group sizes onto stack */
 {
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
     int i, j, radix, nextradix, itmp, thisgrpn, maxgrpn;
     unsigned int thisx=0, shift, *thiscounts;
+    unsigned int (*radixcounts)[257] = w->radixcounts;
+    int *skip = w->skip;
 
+    if (w->nth>1 && n>=N_PARALLEL) { radix_par(w, x, o, n, 4); return; }
     for (i=0;i<n;i++) {
-        /* parallel histogramming pass; i.e. count occurrences of 
+        /* parallel histogramming pass; i.e. count occurrences of
         0:255 in each byte.  Sequential so almost negligible. */
-        thisx = (unsigned int)(icheck(x[i])) - INT_MIN;                     // relies on overflow behaviour. And shouldn't -INT_MIN be up in iradix?
+        thisx = (unsigned int)(icheck(x[i], order, nalast)) - INT_MIN;                     // relies on overflow behaviour. And shouldn't -INT_MIN be up in iradix?
         radixcounts[0][thisx & 0xFF]++;                                     // unrolled since inside n-loop
         radixcounts[1][thisx >> 8 & 0xFF]++;
         radixcounts[2][thisx >> 16 & 0xFF]++;
         radixcounts[3][thisx >> 24 & 0xFF]++;
     }
     for (radix=0; radix<4; radix++) {
-        /* any(count == n) => all radix must have been that value => 
+        /* any(count == n) => all radix must have been that value =>
         last x (still thisx) was that value */
         i = thisx >> (radix*8) & 0xFF;
         skip[radix] = radixcounts[radix][i] == n;
         if (skip[radix]) radixcounts[radix][i] = 0;                         // clear it now, the other counts must be 0 already
     }
-    
+
     radix = 3;  // MSD
     while (radix>=0 && skip[radix]) radix--;
     if (radix==-1) {                                                        // All radix are skipped; i.e. one number repeated n times.
         if (nalast == 0 && x[0] == NA_INTEGER)                              // all values are identical. return 0 if nalast=0 & all NA
             for (i=0; i<n; i++) o[i] = 0;                                   // because of 'return', have to take care of it here.
         else for (i=0; i<n; i++) o[i] = (i+1);
-        push(n); 
-        return; 
+        push(w, n);
+        return;
     }
     for (i=radix-1; i>=0; i--) {
         if (!skip[i]) memset(radixcounts[i], 0, 257*sizeof(unsigned int));
-        /* clear the counts as we only needed the parallel pass for skip[] 
-           and we're going to use radixcounts again below. Can't use parallel 
+        /* clear the counts as we only needed the parallel pass for skip[]
+           and we're going to use radixcounts again below. Can't use parallel
            lower counts in MSD radix, unlike LSD. */
     }
     thiscounts = radixcounts[radix];
     shift = radix * 8;
-    
+
     itmp = thiscounts[0];
     maxgrpn = itmp;
     for (i=1; itmp<n && i<256; i++) {
@@ -324,63 +495,56 @@ static void iradix(int *x, int *o, int n)
         }
     }
     for (i=n-1; i>=0; i--) {
-        thisx = ((unsigned int)(icheck(x[i])) - INT_MIN) >> shift & 0xFF;
+        thisx = ((unsigned int)(icheck(x[i], order, nalast)) - INT_MIN) >> shift & 0xFF;
         o[--thiscounts[thisx]] = i+1;
     }
-    
-    if (radix_xsuballoc < maxgrpn) {
-        // The largest group according to the first non-skipped radix, so could be big (if radix is needed on first column)
-        // TO DO: could include extra bits to divide the first radix up more. Often the MSD has groups in just 0-4 out of 256.
-        // free'd at the end of forder once we're done calling iradix repetitively
-        radix_xsub = (int *)realloc(radix_xsub, maxgrpn*sizeof(double));    // realloc(NULL) == malloc
-        if (!radix_xsub) Error("Failed to realloc working memory %d*8bytes (xsub in iradix), radix=%d", maxgrpn, radix);
-        radix_xsuballoc = maxgrpn;
-    }
-    
-    alloc_otmp(maxgrpn);   // TO DO: can we leave this to forder and remove these calls??
-    alloc_xtmp(maxgrpn);   // TO DO: doesn't need to be sizeof(double) always, see inside
-    
+
+    // The largest group according to the first non-skipped radix, so could be big (if radix is needed on first column)
+    // TO DO: could include extra bits to divide the first radix up more. Often the MSD has groups in just 0-4 out of 256.
+    // free'd at the end of forder once we're done calling iradix repetitively
+    if (!alloc_radix_xsub(w, maxgrpn) || !alloc_otmp(w, maxgrpn) || !alloc_xtmp(w, maxgrpn)) return;  // TO DO: xtmp doesn't need to be sizeof(double) always, see inside
+
     nextradix = radix-1;
     while (nextradix>=0 && skip[nextradix]) nextradix--;
-    if (thiscounts[0] != 0) Error("Internal error. thiscounts[0]=%d but should have been decremented to 0. dradix=%d", thiscounts[0], radix);
+    if (thiscounts[0] != 0) { WError(w, "Internal error. thiscounts[0]=%d but should have been decremented to 0. dradix=%d", thiscounts[0], radix); return; }
     thiscounts[256] = n;
     itmp = 0;
     for (i=1; itmp<n && i<=256; i++) {
         if (thiscounts[i] == 0) continue;
         thisgrpn = thiscounts[i] - itmp;                                    // undo cumulate; i.e. diff
         if (thisgrpn == 1 || nextradix==-1) {
-            push(thisgrpn);
+            push(w, thisgrpn);
         } else {
             for (j=0; j<thisgrpn; j++)
-                ((int *)radix_xsub)[j] = icheck(x[o[itmp+j]-1]);            // this is why this xsub here can't be the same memory as xsub in forder.
-            iradix_r(radix_xsub, o+itmp, thisgrpn, nextradix);              // changes xsub and o by reference recursively.
+                ((int *)w->radix_xsub)[j] = icheck(x[o[itmp+j]-1], order, nalast);         // this is why this xsub here can't be the same memory as xsub in forder.
+            iradix_r(w, w->radix_xsub, o+itmp, thisgrpn, nextradix);        // changes xsub and o by reference recursively.
         }
         itmp = thiscounts[i];
         thiscounts[i] = 0;
     }
     if (nalast == 0)                                                        // nalast = 1, -1 are both taken care already.
         for (i=0; i<n; i++) o[i] = (x[o[i]-1] == NA_INTEGER) ? 0 : o[i];    // nalast = 0 is dealt with separately as it just sets o to 0
-                                                                            // at those indices where x is NA. x[o[i]-1] because x is not 
+                                                                            // at those indices where x is NA. x[o[i]-1] because x is not
                                                                             // modified by reference unlike iinsert or iradix_r
 }
 
-static void iradix_r(int *xsub, int *osub, int n, int radix)
+static void iradix_r(sortWorker *w, int *xsub, int *osub, int n, int radix)
     // xsub is a recursive offset into xsub working memory above in iradix, reordered by reference.
     // osub is a an offset into the main answer o, reordered by reference.
     // radix iterates 3,2,1,0
 {
     int i, j, itmp, thisx, thisgrpn, nextradix, shift;
     unsigned int *thiscounts;
-    
+
     if (n < N_SMALL) {              // N_SMALL=200 is guess based on limited testing. Needs calibrate().
                                     // Was 50 based on sum(1:50)=1275 worst -vs- 256 cummulate + 256 memset + allowance since reverse order is unlikely.
-        iinsert(xsub, osub, n);     // when nalast==0, iinsert will be called only from within iradix.
+        iinsert(w, xsub, osub, n);  // when nalast==0, iinsert will be called only from within iradix.
         return;
     }
-    
+
     shift = radix*8;
-    thiscounts = radixcounts[radix];
-    
+    thiscounts = w->radixcounts[radix];
+
     for (i=0; i<n; i++) {
         thisx = (unsigned int)xsub[i] - INT_MIN;                                // sequential in xsub
         thiscounts[thisx >> shift & 0xFF]++;
@@ -391,27 +555,27 @@ static void iradix_r(int *xsub, int *osub, int n, int radix)
     for (i=n-1; i>=0; i--) {
         thisx = ((unsigned int)xsub[i] - INT_MIN) >> shift & 0xFF;
         j = --thiscounts[thisx];
-        otmp[j] = osub[i];
-        ((int *)xtmp)[j] = xsub[i];
+        w->otmp[j] = osub[i];
+        ((int *)w->xtmp)[j] = xsub[i];
     }
-    memcpy(osub, otmp, n*sizeof(int));
-    memcpy(xsub, xtmp, n*sizeof(int));
-    
+    memcpy(osub, w->otmp, n*sizeof(int));
+    memcpy(xsub, w->xtmp, n*sizeof(int));
+
     nextradix = radix-1;
-    while (nextradix>=0 && skip[nextradix]) nextradix--;
-    /* TO DO:  If nextradix==-1 AND no further columns from forder AND !retGrp, we're 
+    while (nextradix>=0 && w->skip[nextradix]) nextradix--;
+    /* TO DO:  If nextradix==-1 AND no further columns from forder AND !retGrp, we're
                done. We have o. Remember to memset thiscounts before returning. */
-    
-    if (thiscounts[0] != 0) Error("Logical error. thiscounts[0]=%d but should have been decremented to 0. radix=%d", thiscounts[0], radix);
+
+    if (thiscounts[0] != 0) { WError(w, "Logical error. thiscounts[0]=%d but should have been decremented to 0. radix=%d", thiscounts[0], radix); return; }
     thiscounts[256] = n;
     itmp = 0;
     for (i=1; itmp<n && i<=256; i++) {
         if (thiscounts[i] == 0) continue;
         thisgrpn = thiscounts[i] - itmp;  // undo cummulate; i.e. diff
         if (thisgrpn == 1 || nextradix==-1) {
-            push(thisgrpn);
+            push(w, thisgrpn);
         } else {
-            iradix_r(xsub+itmp, osub+itmp, thisgrpn, nextradix);
+            iradix_r(w, xsub+itmp, osub+itmp, thisgrpn, nextradix);
         }
         itmp = thiscounts[i];
         thiscounts[i] = 0;
@@ -443,39 +607,40 @@ SEXP getNumericRounding()
     return ScalarInteger(dround);
 }
 
-static union {double d;
-              unsigned long long ull;} u;
-            //  int i;
-            //  unsigned int ui;} u;
+typedef union {double d;
+               unsigned long long ull;} dpun;   // local to each call (not static) so the twiddles are thread-safe
 
-unsigned long long dtwiddle(void *p, int i, int order)
+unsigned long long dtwiddle(void *p, int i, int order, int nalast)
+// nalast as forder's; i.e. other C code joining to or grouping on a key passes -1 (NA first)
 {
+    dpun u;
     u.d = order*((double *)p)[i];                               // take care of 'order' right at the beginning
     if (R_FINITE(u.d)) {
         u.ull = (u.d) ? u.ull + ((u.ull & dmask1) << 1) : 0;    // handle 0, -0 case. Fix for issues/743.
                                                                 // tested on vector length 100e6. was the fastest fix (see results at the bottom of page)
     } else if (ISNAN(u.d)) {
      /* 1. NA twiddled to all bits 0, sorts first.  R's value 1954 cleared.
-        2. NaN twiddled to set just bit 13, sorts immediately after NA. 13th bit to be 
+        2. NaN twiddled to set just bit 13, sorts immediately after NA. 13th bit to be
            consistent with "quiet" na bit but any bit outside last 2 bytes would do.
-           (ref: http://r.789695.n4.nabble.com/Question-re-NA-NaNs-in-R-td4685014.html) 
-        3. This also normalises a difference between NA on 32bit R (bit 13 set) and 64bit R (bit 13 not set) 
+           (ref: http://r.789695.n4.nabble.com/Question-re-NA-NaNs-in-R-td4685014.html)
+        3. This also normalises a difference between NA on 32bit R (bit 13 set) and 64bit R (bit 13 not set)
         4. -Inf twiddled to : 0 sign, exponent all 0, mantissa all 1, sorts after NaN
-        5. +Inf twiddled to : 1 sign, exponent all 1, mantissa all 0, sorts last since finite 
+        5. +Inf twiddled to : 1 sign, exponent all 1, mantissa all 0, sorts last since finite
            numbers are defined by not-all-1 in exponent */
         u.ull = (ISNA(u.d) ? 0 : (1ULL << 51));
-        return (nalast == 1 ? ~u.ull : u.ull);        
+        return (nalast == 1 ? ~u.ull : u.ull);
     }
-    unsigned long long mask = (u.ull & 0x8000000000000000) ? 
+    unsigned long long mask = (u.ull & 0x8000000000000000) ?
                      0xffffffffffffffff : 0x8000000000000000;       // always flip sign bit and if negative (sign bit was set) flip other bits too
     return( (u.ull ^ mask) & dmask2 );
 }
 
-unsigned long long i64twiddle(void *p, int i, int order)
-// 'order' is in effect now - ascending and descending order implemented. Default 
-// case (setkey) will not be affected much because nalast != 1 and order == 1 are 
-// defaults. 
+unsigned long long i64twiddle(void *p, int i, int order, int nalast)
+// 'order' is in effect now - ascending and descending order implemented. Default
+// case (setkey) will not be affected much because nalast != 1 and order == 1 are
+// defaults.
 {
+    dpun u;
     u.d = ((double *)p)[i];
     u.ull ^= 0x8000000000000000;
     if (nalast != 1) {
@@ -494,11 +659,11 @@ unsigned long long i64twiddle(void *p, int i, int order)
 }
 
 Rboolean dnan(void *p, int i) {
-    u.d = ((double *)p)[i];
-    return (ISNAN(u.d));
+    return (ISNAN(((double *)p)[i]));
 }
 
 Rboolean i64nan(void *p, int i) {
+    dpun u;
     u.d = ((double *)p)[i];
     return ((u.ull ^ 0x8000000000000000) == 0);
 }
@@ -513,34 +678,36 @@ unsigned long long i32twiddle(void *p, int i)
 }
 */
 
-unsigned long long (*twiddle)(void *, int, int);
 // integer64 has NA = 0x8000000000000000. And it gives TRUE for all ISNAN(.) when '.' is -ve number.
 // So, ISNAN(.) would just provide wrong results. This was particularly an issue while implementing
-// DT[order(., na.last=NA)] where '.' is an integer64 column. Therefore, 'is_nan'. This is basically 
-// ISNAN(.) for double and (u.ull ^ 0x8000000000000000 == 0) for integer64.
-Rboolean (*is_nan)(void *, int);
+// DT[order(., na.last=NA)] where '.' is an integer64 column. Therefore, 'is_nan'. This is basically
+// ISNAN(.) for double and (u.ull ^ 0x8000000000000000 == 0) for integer64. Hence forderCtx.is_nan.
 size_t colSize=8;  // the size of the column type (4 or 8). Just 8 currently until iradix is merged in.
 
-static void dradix_r(unsigned char *xsub, int *osub, int n, int radix);
-
 #ifdef WORDS_BIGENDIAN
 #define RADIX_BYTE colSize-radix-1
 #else
 #define RADIX_BYTE radix
 #endif
 
-static void dradix(unsigned char *x, int *o, int n)
+static void dradix(sortWorker *w, unsigned char *x, int *o, int n)
 {
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
+    unsigned long long (*twiddle)(void *, int, int, int) = w->ctx->twiddle;
+    Rboolean (*is_nan)(void *, int) = w->ctx->is_nan;
     int i, j, radix, nextradix, itmp, thisgrpn, maxgrpn;
     unsigned int *thiscounts;
+    unsigned int (*radixcounts)[257] = w->radixcounts;
+    int *skip = w->skip;
     unsigned long long thisx=0;
+    if (w->nth>1 && n>=N_PARALLEL) { radix_par(w, x, o, n, 8); return; }
     // see comments in iradix for structure.  This follows the same. TO DO: merge iradix in here (almost ready)
     for (i=0;i<n;i++) {
-        thisx = twiddle(x,i,order);
+        thisx = twiddle(x,i,order, nalast);
         for (radix=0; radix<colSize; radix++)
             radixcounts[radix][((unsigned char *)&thisx)[RADIX_BYTE]]++;
         // if dround==2 then radix 0 and 1 will be all 0 here and skipped.
-        /* on little endian, 0 is the least significant bits (the right) 
+        /* on little endian, 0 is the least significant bits (the right)
         / and 7 is the most including sign (the left); i.e. reversed. */
     }
     for (radix=0; radix<colSize; radix++) {
@@ -554,7 +721,7 @@ static void dradix(unsigned char *x, int *o, int n)
         if (nalast == 0 && is_nan(x, 0))                               // all values are identical. return 0 if nalast=0 & all NA
             for (i=0; i<n; i++) o[i] = 0;                               // because of 'return', have to take care of it here.
         else for (i=0; i<n; i++) o[i] = (i+1);
-        push(n);
+        push(w, n);
         return;
     }
     for (i=radix-1; i>=0; i--) {  // clear the lower radix counts, we only did them to know skip. will be reused within each group
@@ -571,50 +738,43 @@ static void dradix(unsigned char *x, int *o, int n)
         }
     }
     for (i=n-1; i>=0; i--) {
-        thisx = twiddle(x,i,order);
+        thisx = twiddle(x,i,order, nalast);
         o[ --thiscounts[((unsigned char *)&thisx)[RADIX_BYTE]] ] = i+1;
     }
 
-    if (radix_xsuballoc < maxgrpn) {                                            // TO DO: centralize this alloc
-        // The largest group according to the first non-skipped radix, so could be big (if radix is needed on first column)
-        // TO DO: could include extra bits to divide the first radix up more. Often the MSD has groups in just 0-4 out of 256.
-        // free'd at the end of forder once we're done calling iradix repetitively
-        radix_xsub = (double *)realloc(radix_xsub, maxgrpn*sizeof(double));  // realloc(NULL) == malloc
-        if (!radix_xsub) Error("Failed to realloc working memory %d*8bytes (xsub in dradix), radix=%d", maxgrpn, radix);
-        radix_xsuballoc = maxgrpn;
-    }
-    
-    alloc_otmp(maxgrpn);   // TO DO: leave to forder and remove these calls?
-    alloc_xtmp(maxgrpn);
-    
+    // The largest group according to the first non-skipped radix, so could be big (if radix is needed on first column)
+    // TO DO: could include extra bits to divide the first radix up more. Often the MSD has groups in just 0-4 out of 256.
+    // free'd at the end of forder once we're done calling iradix repetitively
+    if (!alloc_radix_xsub(w, maxgrpn) || !alloc_otmp(w, maxgrpn) || !alloc_xtmp(w, maxgrpn)) return;
+
     nextradix = radix-1;
     while (nextradix>=0 && skip[nextradix]) nextradix--;
-    if (thiscounts[0] != 0) Error("Logical error. thiscounts[0]=%d but should have been decremented to 0. dradix=%d", thiscounts[0], radix);
+    if (thiscounts[0] != 0) { WError(w, "Logical error. thiscounts[0]=%d but should have been decremented to 0. dradix=%d", thiscounts[0], radix); return; }
     thiscounts[256] = n;
     itmp = 0;
     for (i=1; itmp<n && i<=256; i++) {
         if (thiscounts[i] == 0) continue;
         thisgrpn = thiscounts[i] - itmp;  // undo cummulate; i.e. diff
         if (thisgrpn == 1 || nextradix==-1) {
-            push(thisgrpn);
+            push(w, thisgrpn);
         } else {
             if (colSize==4) { // ready for merging in iradix ...
-                error("Not yet used, still using iradix instead");
-                for (j=0; j<thisgrpn; j++) ((int *)radix_xsub)[j] = twiddle(x, o[itmp+j]-1, order);  
-            } else for (j=0; j<thisgrpn; j++) ((unsigned long long *)radix_xsub)[j] = twiddle(x, o[itmp+j]-1, order); // this is why this xsub here can't be the same memory as xsub in forder
-            dradix_r(radix_xsub, o+itmp, thisgrpn, nextradix); // changes xsub and o by reference recursively.
+                WError(w, "Not yet used, still using iradix instead");
+                return;
+            } else for (j=0; j<thisgrpn; j++) ((unsigned long long *)w->radix_xsub)[j] = twiddle(x, o[itmp+j]-1, order, nalast); // this is why this xsub here can't be the same memory as xsub in forder
+            dradix_r(w, w->radix_xsub, o+itmp, thisgrpn, nextradix); // changes xsub and o by reference recursively.
         }
         itmp = thiscounts[i];
         thiscounts[i] = 0;
     }
     if (nalast == 0)                                                 // nalast = 1, -1 are both taken care already.
-        for (i=0; i<n; i++) o[i] = is_nan(x, o[i]-1) ? 0 : o[i];     // nalast = 0 is dealt with separately as it just sets o to 0 
-                                                                     // at those indices where x is NA. x[o[i]-1] because x is not 
+        for (i=0; i<n; i++) o[i] = is_nan(x, o[i]-1) ? 0 : o[i];     // nalast = 0 is dealt with separately as it just sets o to 0
+                                                                     // at those indices where x is NA. x[o[i]-1] because x is not
                                                                      // modified by reference unlike iinsert or iradix_r
 
 }
 
-static void dinsert(unsigned long long *x, int *o, int n)
+static void dinsert(sortWorker *w, unsigned long long *x, int *o, int n)
 // orders both x and o by reference in-place. Fast for small vectors, low overhead.
 // don't be tempted to binsearch backwards here, have to shift anyway; many memmove would have overhead and do the same thing
 // 'dinsert' will not be called when nalast = 0 and o[0] = -1.
@@ -632,11 +792,11 @@ static void dinsert(unsigned long long *x, int *o, int n)
         }
     }
     tt = 0;
-    for (i=1; i<n; i++) if (x[i]==x[i-1]) tt++; else { push(tt+1); tt=0; }
-    push(tt+1);
+    for (i=1; i<n; i++) if (x[i]==x[i-1]) tt++; else { push(w, tt+1); tt=0; }
+    push(w, tt+1);
 }
 
-static void dradix_r(unsigned char *xsub, int *osub, int n, int radix)
+static void dradix_r(sortWorker *w, unsigned char *xsub, int *osub, int n, int radix)
     /* xsub is a recursive offset into xsub working memory above in dradix, reordered by reference.
        osub is a an offset into the main answer o, reordered by reference.
        dradix iterates 7,6,5,4,3,2,1,0 */
@@ -645,13 +805,13 @@ static void dradix_r(unsigned char *xsub, int *osub, int n, int radix)
     unsigned int *thiscounts;
     unsigned char *p;
     if (n < 200) {
-        /* 200 is guess based on limited testing. Needs calibrate(). Was 50 
-        based on sum(1:50)=1275 worst -vs- 256 cummulate + 256 memset + 
+        /* 200 is guess based on limited testing. Needs calibrate(). Was 50
+        based on sum(1:50)=1275 worst -vs- 256 cummulate + 256 memset +
         allowance since reverse order is unlikely */
-        dinsert((void *)xsub, osub, n);                                         // order=1 here because it's already taken care of in iradix
+        dinsert(w, (void *)xsub, osub, n);                                      // order=1 here because it's already taken care of in iradix
         return;
     }
-    thiscounts = radixcounts[radix];
+    thiscounts = w->radixcounts[radix];
     p = xsub + RADIX_BYTE;
     for (i=0; i<n; i++) {
         thiscounts[*p]++;
@@ -662,54 +822,142 @@ static void dradix_r(unsigned char *xsub, int *osub, int n, int radix)
         if (thiscounts[i]) thiscounts[i] = (itmp += thiscounts[i]);             // don't cummulate through 0s, important below
     p = xsub + (n-1)*colSize;
     if (colSize == 4) {
-        error("Not yet used, still using iradix instead");
-        for (i=n-1; i>=0; i--) {
-            j = --thiscounts[*(p+RADIX_BYTE)];
-            otmp[j] = osub[i];
-            ((int *)xtmp)[j] = *(int *)p;
-            p -= colSize;
-        }
-    } else { 
+        WError(w, "Not yet used, still using iradix instead");
+        return;
+    } else {
         for (i=n-1; i>=0; i--) {
             j = --thiscounts[*(p+RADIX_BYTE)];
-            otmp[j] = osub[i];
-            ((unsigned long long *)xtmp)[j] = *(unsigned long long *)p;
+            w->otmp[j] = osub[i];
+            ((unsigned long long *)w->xtmp)[j] = *(unsigned long long *)p;
             p -= colSize;
         }
     }
-    memcpy(osub, otmp, n*sizeof(int));
-    memcpy(xsub, xtmp, n*colSize);
-    
+    memcpy(osub, w->otmp, n*sizeof(int));
+    memcpy(xsub, w->xtmp, n*colSize);
+
     nextradix = radix-1;
-    while (nextradix>=0 && skip[nextradix]) nextradix--;
+    while (nextradix>=0 && w->skip[nextradix]) nextradix--;
     // TO DO:  If nextradix==-1 and no further columns from forder,  we're done. We have o. Remember to memset thiscounts before returning.
-    
-    if (thiscounts[0] != 0) Error("Logical error. thiscounts[0]=%d but should have been decremented to 0. radix=%d", thiscounts[0], radix);    
+
+    if (thiscounts[0] != 0) { WError(w, "Logical error. thiscounts[0]=%d but should have been decremented to 0. radix=%d", thiscounts[0], radix); return; }
     thiscounts[256] = n;
     itmp = 0;
     for (i=1; itmp<n && i<=256; i++) {
         if (thiscounts[i] == 0) continue;
         thisgrpn = thiscounts[i] - itmp;  // undo cummulate; i.e. diff
         if (thisgrpn == 1 || nextradix==-1) {
-            push(thisgrpn);
+            push(w, thisgrpn);
         } else {
-            dradix_r(xsub + itmp*colSize, osub+itmp, thisgrpn, nextradix);
+            dradix_r(w, xsub + itmp*colSize, osub+itmp, thisgrpn, nextradix);
         }
         itmp = thiscounts[i];
         thiscounts[i] = 0;
     }
 }
 
+static inline unsigned long long radixkey(forderCtx *ctx, void *x, int i, int nbyte) {
+    return nbyte==4 ? (unsigned int)(icheck(((int *)x)[i], ctx->order, ctx->nalast)) - INT_MIN : ctx->twiddle(x, i, ctx->order, ctx->nalast);
+}
+
+static void radix_par(sortWorker *w, void *x, int *o, int n, int nbyte)
+/* The top level of iradix (nbyte=4) and dradix (nbyte=8) when sorting a long vector from the master.
+   Each batch of x builds its own histograms of every byte (for skip) and then scatters forwards on the most significant
+   non-skipped byte into the slots reserved for it, so the result is stable exactly as the single threaded version.
+   Each of the 256 buckets is then sorted by a pool worker with iradix_r/dradix_r, pushing its groups onto that
+   worker's stack. The stacks are stitched back onto the master's in bucket order. */
+{
+    forderCtx *ctx = w->ctx;
+    const int nalast = ctx->nalast, order = ctx->order;
+    unsigned long long (*twiddle)(void *, int, int, int) = ctx->twiddle;
+    Rboolean (*is_nan)(void *, int) = ctx->is_nan;
+    int nth = MIN(w->nth, ctx->nworkers-1), bsize = (n-1)/nth+1, nb = (n-1)/bsize+1;
+    unsigned int *counts = (unsigned int *)calloc((size_t)nb*8*256, sizeof(unsigned int));
+    if (counts == NULL) Error("Failed to allocate %d*8*256 radix counts", nb);
+    #pragma omp parallel for num_threads(nth)
+    for (int b=0; b<nb; b++) {
+        unsigned int *thiscounts = counts + b*8*256;
+        int to = MIN(n, (b+1)*bsize);
+        for (int i=b*bsize; i<to; i++) {
+            unsigned long long thisx = radixkey(ctx, x, i, nbyte);
+            for (int radix=0; radix<nbyte; radix++) thiscounts[radix*256 + (thisx >> (radix*8) & 0xFF)]++;
+        }
+    }
+    unsigned long long lastx = radixkey(ctx, x, n-1, nbyte);
+    int radix;
+    for (radix=0; radix<nbyte; radix++) {
+        // any(count == n) => all radix must have been that value => last x was that value
+        int k = lastx >> (radix*8) & 0xFF;
+        unsigned int tot = 0;
+        for (int b=0; b<nb; b++) tot += counts[b*8*256 + radix*256 + k];
+        w->skip[radix] = tot == n;
+    }
+    radix = nbyte-1;  // MSD
+    while (radix>=0 && w->skip[radix]) radix--;
+    if (radix==-1) {                                                        // one number repeated n times
+        free(counts);
+        Rboolean allna = nalast == 0 && (nbyte==4 ? ((int *)x)[0]==NA_INTEGER : is_nan(x, 0));
+        #pragma omp parallel for num_threads(nth)
+        for (int i=0; i<n; i++) o[i] = allna ? 0 : i+1;
+        push(w, n);
+        return;
+    }
+    int shift = radix*8, start[257];
+    unsigned int cumsum = 0;
+    for (int k=0; k<256; k++) {
+        start[k] = cumsum;
+        for (int b=0; b<nb; b++) {
+            unsigned int *c = counts + b*8*256 + radix*256 + k, tmp = *c;
+            *c = cumsum;
+            cumsum += tmp;
+        }
+    }
+    start[256] = n;
+    #pragma omp parallel for num_threads(nth)
+    for (int b=0; b<nb; b++) {
+        unsigned int *thiscounts = counts + b*8*256 + radix*256;
+        int to = MIN(n, (b+1)*bsize);
+        for (int i=b*bsize; i<to; i++) o[thiscounts[radixkey(ctx, x, i, nbyte) >> shift & 0xFF]++] = i+1;
+    }
+    free(counts);
+
+    int nextradix = radix-1;
+    while (nextradix>=0 && w->skip[nextradix]) nextradix--;
+    task buckets[256];
+    for (int i=1; i<ctx->nworkers; i++) memcpy(ctx->workers[i].skip, w->skip, sizeof(w->skip));
+    #pragma omp parallel for schedule(dynamic) num_threads(nth)
+    for (int k=0; k<256; k++) {
+        int me = 1+omp_get_thread_num();
+        sortWorker *pw = ctx->workers+me;
+        int thisgrpn = start[k+1]-start[k], *osub = o+start[k];
+        buckets[k].wk = me;
+        buckets[k].start = pw->st.ngrp;
+        if (thisgrpn == 1 || (thisgrpn && nextradix==-1)) {
+            push(pw, thisgrpn);
+        } else if (thisgrpn && alloc_radix_xsub(pw, thisgrpn) && alloc_otmp(pw, thisgrpn) && alloc_xtmp(pw, thisgrpn)) {
+            if (nbyte==4) {
+                for (int j=0; j<thisgrpn; j++) ((int *)pw->radix_xsub)[j] = icheck(((int *)x)[osub[j]-1], order, nalast);
+                iradix_r(pw, pw->radix_xsub, osub, thisgrpn, nextradix);
+            } else {
+                for (int j=0; j<thisgrpn; j++) ((unsigned long long *)pw->radix_xsub)[j] = twiddle(x, osub[j]-1, order, nalast);
+                dradix_r(pw, pw->radix_xsub, osub, thisgrpn, nextradix);
+            }
+        }
+        buckets[k].ngrp = pw->st.ngrp - buckets[k].start;
+    }
+    checkWorkers(ctx);
+    stitch(ctx, &w->st, buckets, 256);
+    if (nalast == 0) {
+        #pragma omp parallel for num_threads(nth)
+        for (int i=0; i<n; i++) {
+            if (nbyte==4 ? ((int *)x)[o[i]-1] == NA_INTEGER : is_nan(x, o[i]-1)) o[i] = 0;
+        }
+    }
+}
+
 // TO DO?: dcount. Find step size, then range = (max-min)/step and proceed as icount. Many fixed precision floats (such as prices)
 // may be suitable. Fixed precision such as 1.10, 1.15, 1.20, 1.25, 1.30 ... do use all bits so dradix skipping may not help.
 
-static int *cradix_counts = NULL;
-static int cradix_counts_alloc = 0;
-static int maxlen = 1;
-static SEXP *cradix_xtmp = NULL;
-static int cradix_xtmp_alloc = 0;
-
-int StrCmp2(SEXP x, SEXP y) {    // same as StrCmp but also takes into account 'na.last' argument.
+static int StrCmp2(SEXP x, SEXP y, int order, int nalast) {    // same as StrCmp but also takes into account 'na.last' argument.
     if (x == y) return 0;                   // same cached pointer (including NA_STRING==NA_STRING)
     if (x == NA_STRING) return nalast;      // if x=NA, nalast=1 ? then x > y else x < y (Note: nalast == 0 is already taken care of in 'csorted', won't be 0 here)
     if (y == NA_STRING) return -nalast;     // if y=NA, nalast=1 ? then y > x
@@ -723,7 +971,7 @@ int StrCmp(SEXP x, SEXP y)            // also used by bmerge and chmatch
     if (y == NA_STRING) return 1;     // x>y
     return strcmp(CHAR(ENC2UTF8(x)), CHAR(ENC2UTF8(y))); // ENC2UTF8 handles encoding issues by converting all marked non-utf8 encodings alone to utf8 first. The function could be wrapped in the first if-statement already instead of at the last stage, but this is to ensure that all-ascii cases are handled with maximum efficiency.
     // This seems to fix the issues as far as I've checked. Will revisit if necessary.
-    
+
     // OLD COMMENT: can return 0 here for the same string in known and unknown encodings, good if the unknown string is in that encoding but not if not ordering is ascii only (C locale). TO DO: revisit and allow user to change to strcoll, and take account of Encoding. see comments in bmerge().  10k calls of strcmp = 0.37s, 10k calls of strcoll = 4.7s. See ?Comparison, ?Encoding, Scollate in R internals.
 
 }
@@ -732,10 +980,10 @@ int StrCmp(SEXP x, SEXP y)            // also used by bmerge and chmatch
 //        or UTF-8 is used by user, not both. Then error if not. If ok, then can proceed with byte level. ascii is never marked known by R, but non-ascii (i.e. knowable encoding) could be marked unknown.
 //        does R internals have is_ascii function exported?  If not, simple enough.
 
-static void cradix_r(SEXP *xsub, int n, int radix)
+static void cradix_r(forderCtx *ctx, SEXP *xsub, int n, int radix)
 // xsub is a unique set of CHARSXP, to be ordered by reference
 // First time, radix==0, and xsub==x. Then recursively moves SEXP together for L1 cache efficiency.
-// Quite different to iradix because 
+// Quite different to iradix because
 //   1) x is known to be unique so fits in cache (wide random access not an issue)
 //   2) they're variable length character strings
 //   3) no need to maintain o.  Just simply reorder x. No grps or push.
@@ -747,7 +995,7 @@ static void cradix_r(SEXP *xsub, int n, int radix)
 {
     int i, j, itmp, *thiscounts, thisgrpn=0, thisx=0;
     SEXP stmp;
-    
+
     // TO DO?: chmatch to existing sorted vector, then grow it.
     // TO DO?: if (n<N_SMALL=200) insert sort, then loop through groups via ==
     if (n<=1) return;
@@ -756,14 +1004,14 @@ static void cradix_r(SEXP *xsub, int n, int radix)
         return;
     }
     // TO DO: if (n<50) cinsert (continuing from radix offset into CHAR) or using StrCmp. But 256 is narrow, so quick and not too much an issue.
-    
-    thiscounts = cradix_counts + radix*256;
+
+    thiscounts = ctx->cradix_counts + radix*256;
     for (i=0; i<n; i++) {
         thisx = xsub[i]==NA_STRING ? 0 : (radix<LENGTH(xsub[i]) ? (unsigned char)(CHAR(xsub[i])[radix]) : 1);
         thiscounts[ thisx ]++;   // 0 for NA,  1 for ""
     }
-    if (thiscounts[thisx] == n && radix < maxlen-1) {   // this also catches when subx has shorter strings than the rest, thiscounts[0]==n and we'll recurse very quickly through to the overall maxlen with no 256 overhead each time
-        cradix_r(xsub, n, radix+1);
+    if (thiscounts[thisx] == n && radix < ctx->maxlen-1) {   // this also catches when subx has shorter strings than the rest, thiscounts[0]==n and we'll recurse very quickly through to the overall maxlen with no 256 overhead each time
+        cradix_r(ctx, xsub, n, radix+1);
         thiscounts[thisx] = 0;  // the rest must be 0 already, save the memset
         return;
     }
@@ -773,11 +1021,11 @@ static void cradix_r(SEXP *xsub, int n, int radix)
     for (i=n-1; i>=0; i--) {
         thisx = xsub[i]==NA_STRING ? 0 : (radix<LENGTH(xsub[i]) ? (unsigned char)(CHAR(xsub[i])[radix]) : 1);
         j = --thiscounts[thisx];
-        cradix_xtmp[j] = xsub[i];
+        ctx->cradix_xtmp[j] = xsub[i];
     }
-    memcpy(xsub, cradix_xtmp, n*sizeof(SEXP));
-    if (radix == maxlen-1) {
-        memset(thiscounts, 0, 256*sizeof(int)); 
+    memcpy(xsub, ctx->cradix_xtmp, n*sizeof(SEXP));
+    if (radix == ctx->maxlen-1) {
+        memset(thiscounts, 0, 256*sizeof(int));
         return;
     }
     if (thiscounts[0] != 0) Error("Logical error. counts[0]=%d in cradix but should have been decremented to 0. radix=%d", thiscounts[0], radix);
@@ -785,17 +1033,14 @@ static void cradix_r(SEXP *xsub, int n, int radix)
     for (i=1;i<256;i++) {
         if (thiscounts[i] == 0) continue;
         thisgrpn = thiscounts[i] - itmp;  // undo cummulate; i.e. diff
-        cradix_r(xsub+itmp, thisgrpn, radix+1);
+        cradix_r(ctx, xsub+itmp, thisgrpn, radix+1);
         itmp = thiscounts[i];
         thiscounts[i] = 0;  // set to 0 now since we're here, saves memset afterwards. Important to clear! Also more portable for machines where 0 isn't all bits 0 (?!)
     }
-    if (itmp<n-1) cradix_r(xsub+itmp, n-itmp, radix+1);  // final group
+    if (itmp<n-1) cradix_r(ctx, xsub+itmp, n-itmp, radix+1);  // final group
 }
 
-static SEXP *ustr = NULL;
-static int ustr_alloc = 0, ustr_n = 0;
-
-static void cgroup(SEXP *x, int *o, int n)
+static void cgroup(sortWorker *w, SEXP *x, int *o, int n)
 // As icount :
 //   Places the ordering into o directly, overwriting whatever was there
 //   Doesn't change x
@@ -803,11 +1048,13 @@ static void cgroup(SEXP *x, int *o, int n)
 // Only run when sortStr==FALSE. Basically a counting sort, in first appearance order, directly.
 // Since it doesn't sort the strings, the name is cgroup.
 // there is no _pre for this.  ustr created and cleared each time.
+// Writes TRUELENGTH so is only ever run by the master, single threaded.
 {
+    forderCtx *ctx = w->ctx;
     SEXP s;
     int i, k, cumsum;
-    // savetl_init() is called once at the start of forder
-    if (ustr_n != 0) Error("Internal error. ustr isn't empty when starting cgroup: ustr_n=%d, ustr_alloc=%d", ustr_n, ustr_alloc);
+    // savetl_init() is called once at the start of forder, when a column is character
+    if (ctx->ustr_n != 0) Error("Internal error. ustr isn't empty when starting cgroup: ustr_n=%d, ustr_alloc=%d", ctx->ustr_n, ctx->ustr_alloc);
     for(i=0; i<n; i++) {
         s = x[i];
         if (TRUELENGTH(s)<0) {                   // this case first as it's the most frequent
@@ -818,84 +1065,86 @@ static void cgroup(SEXP *x, int *o, int n)
             savetl(s);          // afterwards. From R 2.14.0, tl is initialized to 0, prior to that it was random so this step saved too much.
             SET_TRUELENGTH(s,0);
         }
-        if (ustr_alloc<=ustr_n) {
-            ustr_alloc = (ustr_alloc == 0) ? 10000 : ustr_alloc*2;  // 10000 = 78k of 8byte pointers. Small initial guess, negligible time to alloc. 
-            if (ustr_alloc>n) ustr_alloc = n;
-            ustr = realloc(ustr, ustr_alloc * sizeof(SEXP));
-            if (ustr == NULL) Error("Unable to realloc %d * %d bytes in cgroup", ustr_alloc, sizeof(SEXP));
+        if (ctx->ustr_alloc<=ctx->ustr_n) {
+            ctx->ustr_alloc = (ctx->ustr_alloc == 0) ? 10000 : ctx->ustr_alloc*2;  // 10000 = 78k of 8byte pointers. Small initial guess, negligible time to alloc.
+            if (ctx->ustr_alloc>n) ctx->ustr_alloc = n;
+            ctx->ustr = realloc(ctx->ustr, ctx->ustr_alloc * sizeof(SEXP));
+            if (ctx->ustr == NULL) Error("Unable to realloc %d * %d bytes in cgroup", ctx->ustr_alloc, sizeof(SEXP));
         }
-        SET_TRUELENGTH(s, -1); 
-        ustr[ustr_n++] = s;
+        SET_TRUELENGTH(s, -1);
+        ctx->ustr[ctx->ustr_n++] = s;
     }
     // TO DO: the same string in different encodings will be considered different here. Sweep through ustr and merge counts where equal (sort needed therefore, unfortunately?, only if there are any marked encodings present)
     cumsum = 0;
-    for(i=0; i<ustr_n; i++) {                                    // 0.000
-        push(-TRUELENGTH(ustr[i]));                            
-        SET_TRUELENGTH(ustr[i], cumsum += -TRUELENGTH(ustr[i]));
+    for(i=0; i<ctx->ustr_n; i++) {                                    // 0.000
+        push(w, -TRUELENGTH(ctx->ustr[i]));
+        SET_TRUELENGTH(ctx->ustr[i], cumsum += -TRUELENGTH(ctx->ustr[i]));
     }
-    int *target = (o[0] != -1) ? newo : o;
-    for(i=n-1; i>=0; i--) {                     
+    int *target = (o[0] != -1) ? w->newo : o;
+    for(i=n-1; i>=0; i--) {
         s = x[i];                                            // 0.400 (page fetches on string cache)
         SET_TRUELENGTH(s, k = TRUELENGTH(s)-1);
         target[k] = i+1;                                     // 0.800 (random access to o)
     }
-    for(i=0; i<ustr_n; i++) SET_TRUELENGTH(ustr[i],0);     // The cummulate meant counts are left non zero, so reset for next time (0.00s).
-    ustr_n = 0;
+    for(i=0; i<ctx->ustr_n; i++) SET_TRUELENGTH(ctx->ustr[i],0);     // The cummulate meant counts are left non zero, so reset for next time (0.00s).
+    ctx->ustr_n = 0;
 }
 
-static int *csort_otmp=NULL, csort_otmp_alloc=0;
-static void alloc_csort_otmp(int n) {
-    if (csort_otmp_alloc >= n) return;
-    csort_otmp = (int *)realloc(csort_otmp, n * sizeof(int));
-    if (csort_otmp == NULL) Error("Failed to allocate working memory for csort_otmp. Requested %d * %d bytes", n, sizeof(int));
-    csort_otmp_alloc = n;
-}
+static void isort(sortWorker *w, int *x, int *o, int n);
 
-static void csort(SEXP *x, int *o, int n)
-/* 
+static void csort(sortWorker *w, SEXP *x, int *o, int n)
+/*
    As icount :
     Places the ordering into o directly, overwriting whatever was there
     Doesn't change x
     Pushes group sizes onto stack
-   Requires csort_pre() to have created and sorted ustr already 
+   Requires csort_pre() to have created and sorted ustr already
 */
 {
+    forderCtx *ctx = w->ctx;
+    const int nalast = ctx->nalast, order = ctx->order;
     int i;
-    /* can't use otmp, since iradix might be called here and that uses otmp (and xtmp).
-       alloc_csort_otmp(n) is called from forder for either n=nrow if 1st column, 
-       or n=maxgrpn if onwards columns */
-    for(i=0; i<n; i++) csort_otmp[i] = (x[i] == NA_STRING) ? NA_INTEGER : -TRUELENGTH(x[i]);
+    /* can't use otmp, since iradix might be called here and that uses otmp (and xtmp). */
+    if (!alloc_csort_otmp(w, n)) return;
+    int *csort_otmp = w->csort_otmp;
+    if (w->nth>1 && n>=N_PARALLEL) {
+        // reading the ranks csort_pre left in TRUELENGTH is safe in parallel; it's writing them that isn't
+        #pragma omp parallel for num_threads(MIN(w->nth, ctx->nworkers-1))
+        for(int i=0; i<n; i++) csort_otmp[i] = (x[i] == NA_STRING) ? NA_INTEGER : -TRUELENGTH(x[i]);
+    } else {
+        for(i=0; i<n; i++) csort_otmp[i] = (x[i] == NA_STRING) ? NA_INTEGER : -TRUELENGTH(x[i]);
+    }
     if (nalast == 0 && n == 2) {                        // special case for nalast==0. n==1 is handled inside forder. at least 1 will be NA here
         if (o[0] == -1) for (i=0; i<n; i++) o[i] = i+1;    // else use o from caller directly (not 1st column)
         for (int i=0; i<n; i++) if (csort_otmp[i] == NA_INTEGER) o[i] = 0;
-        push(1); push(1);
-        return; 
+        push(w, 1); push(w, 1);
+        return;
     }
     if (n < N_SMALL && nalast != 0) {                                    // TO DO: calibrate() N_SMALL=200
         if (o[0] == -1) for (i=0; i<n; i++) o[i] = i+1;    // else use o from caller directly (not 1st column)
-        for (int i=0; i<n; i++) csort_otmp[i] = icheck(csort_otmp[i]);
-        iinsert(csort_otmp, o, n);
+        for (int i=0; i<n; i++) csort_otmp[i] = icheck(csort_otmp[i], order, nalast);
+        iinsert(w, csort_otmp, o, n);
     } else {
-        setRange(csort_otmp, n);
-        if (range == NA_INTEGER) Error("Internal error. csort's otmp contains all-NA");
-        int *target = (o[0] != -1) ? newo : o; 
-        if (range <= N_RANGE) // && range<n)            // TO DO: calibrate(). radix was faster (9.2s "range<=10000" instead of 11.6s 
-            icount(csort_otmp, target, n);       // "range<=N_RANGE && range<n") for run(7) where range=N_RANGE n=10000000
-        else iradix(csort_otmp, target, n);
+        setRange(w, csort_otmp, n);
+        if (w->range == NA_INTEGER) { WError(w, "Internal error. csort's otmp contains all-NA"); return; }
+        int *target = (o[0] != -1) ? w->newo : o;
+        if (w->range <= N_RANGE) // && range<n)         // TO DO: calibrate(). radix was faster (9.2s "range<=10000" instead of 11.6s
+            icount(w, csort_otmp, target, n);           // "range<=N_RANGE && range<n") for run(7) where range=N_RANGE n=10000000
+        else iradix(w, csort_otmp, target, n);
     }
     // all i* push onto stack. Using their counts may be faster here than thrashing SEXP fetches over several passes as cgroup does
     // (but cgroup needs that to keep orginal order, and cgroup saves the sort in csort_pre).
 }
 
-static void csort_pre(SEXP *x, int n)
+static void csort_pre(forderCtx *ctx, SEXP *x, int n)
 // Finds ustr and sorts it.
 // Runs once for each column (if sortStr==TRUE), then ustr is used by csort within each group
 // ustr is grown on each character column, to save sorting the same strings again if several columns contain the same strings
 {
     SEXP s;
     int i, old_un, new_un;
-    // savetl_init() is called once at the start of forder
-    old_un = ustr_n;
+    // savetl_init() is called once at the start of forder, when a column is character
+    old_un = ctx->ustr_n;
     for(i=0; i<n; i++) {
         s = x[i];
         if (TRUELENGTH(s)<0) continue;   // this case first as it's the most frequent. Already in ustr, this negative is its ordering.
@@ -903,35 +1152,35 @@ static void csort_pre(SEXP *x, int n)
             savetl(s);          // afterwards. From R 2.14.0, tl is initialized to 0, prior to that it was random so this step saved too much.
             SET_TRUELENGTH(s,0);
         }
-        if (ustr_alloc<=ustr_n) {
-            ustr_alloc = (ustr_alloc == 0) ? 10000 : ustr_alloc*2;  // 10000 = 78k of 8byte pointers. Small initial guess, negligible time to alloc. 
-            if (ustr_alloc > old_un+n) ustr_alloc = old_un + n;
-            ustr = realloc(ustr, ustr_alloc * sizeof(SEXP));
-            if (ustr==NULL) Error("Failed to realloc ustr. Requested %d * %d bytes", ustr_alloc, sizeof(SEXP));
+        if (ctx->ustr_alloc<=ctx->ustr_n) {
+            ctx->ustr_alloc = (ctx->ustr_alloc == 0) ? 10000 : ctx->ustr_alloc*2;  // 10000 = 78k of 8byte pointers. Small initial guess, negligible time to alloc.
+            if (ctx->ustr_alloc > old_un+n) ctx->ustr_alloc = old_un + n;
+            ctx->ustr = realloc(ctx->ustr, ctx->ustr_alloc * sizeof(SEXP));
+            if (ctx->ustr==NULL) Error("Failed to realloc ustr. Requested %d * %d bytes", ctx->ustr_alloc, sizeof(SEXP));
         }
         SET_TRUELENGTH(s, -1);  // this -1 will become its ordering later below
-        ustr[ustr_n++] = s;
-        if (s!=NA_STRING && LENGTH(s)>maxlen) maxlen=LENGTH(s);  // length on CHARSXP is the nchar of char * (excluding \0), and treats marked encodings as if ascii.
+        ctx->ustr[ctx->ustr_n++] = s;
+        if (s!=NA_STRING && LENGTH(s)>ctx->maxlen) ctx->maxlen=LENGTH(s);  // length on CHARSXP is the nchar of char * (excluding \0), and treats marked encodings as if ascii.
     }
-    new_un = ustr_n;
+    new_un = ctx->ustr_n;
     if (new_un == old_un) return;  // No new strings observed, seen them all before in previous column. ustr already sufficient.
     // If we ever make ustr permanently held by data.table, we'll just need to make the final loop to set -i-1 before returning here.
     // sort ustr.  TO DO: just sort new ones and merge them in.
     // These allocs are here, to save them being in the recursive cradix_r()
-    if (cradix_counts_alloc < maxlen) {
-        cradix_counts_alloc = maxlen + 10;   // +10 to save too many reallocs
-        cradix_counts = (int *)realloc(cradix_counts, cradix_counts_alloc * 256 * sizeof(int) );  // stack of counts
-        if (!cradix_counts) Error("Failed to alloc cradix_counts");
-        memset(cradix_counts, 0, cradix_counts_alloc * 256 * sizeof(int));
-    }
-    if (cradix_xtmp_alloc < ustr_n) {
-        cradix_xtmp = (SEXP *)realloc( cradix_xtmp,  ustr_n * sizeof(SEXP) );  // TO DO: Reuse the one we have in forder. Does it need to be n length?
-        if (!cradix_xtmp) Error("Failed to alloc cradix_tmp");
-        cradix_xtmp_alloc = ustr_n;
-    }
-    cradix_r(ustr, ustr_n, 0);  // sorts ustr in-place by reference
-    for(i=0; i<ustr_n; i++)     // save ordering in the CHARSXP. negative so as to distinguish with R's own usage.
-        SET_TRUELENGTH(ustr[i], -i-1);
+    if (ctx->cradix_counts_alloc < ctx->maxlen) {
+        ctx->cradix_counts_alloc = ctx->maxlen + 10;   // +10 to save too many reallocs
+        ctx->cradix_counts = (int *)realloc(ctx->cradix_counts, ctx->cradix_counts_alloc * 256 * sizeof(int) );  // stack of counts
+        if (!ctx->cradix_counts) Error("Failed to alloc cradix_counts");
+        memset(ctx->cradix_counts, 0, ctx->cradix_counts_alloc * 256 * sizeof(int));
+    }
+    if (ctx->cradix_xtmp_alloc < ctx->ustr_n) {
+        ctx->cradix_xtmp = (SEXP *)realloc( ctx->cradix_xtmp,  ctx->ustr_n * sizeof(SEXP) );  // TO DO: Reuse the one we have in forder. Does it need to be n length?
+        if (!ctx->cradix_xtmp) Error("Failed to alloc cradix_tmp");
+        ctx->cradix_xtmp_alloc = ctx->ustr_n;
+    }
+    cradix_r(ctx, ctx->ustr, ctx->ustr_n, 0);  // sorts ustr in-place by reference
+    for(i=0; i<ctx->ustr_n; i++)     // save ordering in the CHARSXP. negative so as to distinguish with R's own usage.
+        SET_TRUELENGTH(ctx->ustr[i], -i-1);
 }
 
 // functions to test vectors for sortedness: isorted, dsorted and csorted
@@ -943,147 +1192,365 @@ static void csort_pre(SEXP *x, int n)
 // TO DO: test in big steps first to return faster if unsortedness is at the end (a common case of rbind'ing data to end)
 // These are all sequential access to x, so very quick and cache efficient.
 
-static int isorted(int *x, int n)                           // order = 1 is ascending and order=-1 is descending
+static int isorted(sortWorker *w, int *x, int n)            // order = 1 is ascending and order=-1 is descending
 {                                                           // also takes care of na.last argument with check through 'icheck'
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
                                                             // Relies on NA_INTEGER==INT_MIN, checked in init.c
     int i=1,j=0;
-    if (nalast == 0) {                                      // when nalast = NA, 
+    if (nalast == 0) {                                      // when nalast = NA,
         for (int k=0; k<n; k++) if (x[k] != NA_INTEGER) j++;
-        if (j == 0) { push(n); return(-2); }                // all NAs ? return special value to replace all o's values with '0'
+        if (j == 0) { push(w, n); return(-2); }             // all NAs ? return special value to replace all o's values with '0'
         if (j != n) return(0);                              // any NAs ? return 0 = unsorted and leave it to sort routines to replace o's with 0's
     }                                                       // no NAs  ? continue to check the rest of isorted - the same routine as usual
-    if (n<=1) { push(n); return(1); }
-    if (icheck(x[1]) < icheck(x[0])) {
+    if (n<=1) { push(w, n); return(1); }
+    if (icheck(x[1], order, nalast) < icheck(x[0], order, nalast)) {
         i = 2;
-        while (i<n && icheck(x[i]) < icheck(x[i-1])) i++;
-        if (i==n) { mpush(1,n); return(-1);}                // strictly opposite to expected 'order', no ties; 
+        while (i<n && icheck(x[i], order, nalast) < icheck(x[i-1], order, nalast)) i++;
+        if (i==n) { mpush(w, 1, n); return(-1);}            // strictly opposite to expected 'order', no ties;
                                                             // e.g. no more than one NA at the beginning/end (for order=-1/1)
         else return(0);
     }
-    int old = gsngrp[flip];
+    int old = w->st.ngrp;
     int tt = 1;
     for (i=1; i<n; i++) {
-        if (icheck(x[i]) < icheck(x[i-1])) { gsngrp[flip] = old; return(0); }
-        if (x[i]==x[i-1]) tt++; else { push(tt); tt=1; }
+        if (icheck(x[i], order, nalast) < icheck(x[i-1], order, nalast)) { w->st.ngrp = old; return(0); }
+        if (x[i]==x[i-1]) tt++; else { push(w, tt); tt=1; }
     }
-    push(tt);
+    push(w, tt);
     return(1);                                              // same as 'order', NAs at the beginning for order=1, at end for order=-1, possibly with ties
 }
 
-static int dsorted(double *x, int n)                        // order=1 is ascending and -1 is descending
+static int dsorted(sortWorker *w, double *x, int n)         // order=1 is ascending and -1 is descending
 {                                                           // also accounts for nalast=0 (=NA), =1 (TRUE), -1 (FALSE) (in twiddle)
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
+    unsigned long long (*twiddle)(void *, int, int, int) = w->ctx->twiddle;
+    Rboolean (*is_nan)(void *, int) = w->ctx->is_nan;
     int i=1,j=0;
     unsigned long long prev, this;
-    if (nalast == 0) {                                      // when nalast = NA, 
+    if (nalast == 0) {                                      // when nalast = NA,
         for (int k=0; k<n; k++) if (!is_nan(x, k)) j++;
-        if (j == 0) { push(n); return(-2); }                // all NAs ? return special value to replace all o's values with '0'
+        if (j == 0) { push(w, n); return(-2); }             // all NAs ? return special value to replace all o's values with '0'
         if (j != n) return(0);                              // any NAs ? return 0 = unsorted and leave it to sort routines to replace o's with 0's
     }                                                       // no NAs  ? continue to check the rest of isorted - the same routine as usual
-    if (n<=1) { push(n); return(1); }
-    prev = twiddle(x,0,order);
-    this = twiddle(x,1,order);
+    if (n<=1) { push(w, n); return(1); }
+    prev = twiddle(x,0,order, nalast);
+    this = twiddle(x,1,order, nalast);
     if (this < prev) {
         i = 2;
         prev=this;
-        while (i<n && (this=twiddle(x,i,order)) < prev) {i++; prev=this; }
-        if (i==n) { mpush(1,n); return(-1);}                // strictly opposite of expected 'order', no ties; 
+        while (i<n && (this=twiddle(x,i,order, nalast)) < prev) {i++; prev=this; }
+        if (i==n) { mpush(w, 1, n); return(-1);}            // strictly opposite of expected 'order', no ties;
                                                             // e.g. no more than one NA at the beginning/end (for order=-1/1)
         else return(0);                                     // TO DO: improve to be stable for ties in reverse
     }
-    int old = gsngrp[flip];
+    int old = w->st.ngrp;
     int tt = 1;
     for (i=1; i<n; i++) {
-        this = twiddle(x,i,order);                          // TO DO: once we get past -Inf, NA and NaN at the bottom,  and +Inf at the top, 
+        this = twiddle(x,i,order, nalast);                          // TO DO: once we get past -Inf, NA and NaN at the bottom,  and +Inf at the top,
                                                             //        the middle only need be twiddled for tolerance (worth it?)
-        if (this < prev) { gsngrp[flip] = old; return(0); }
-        if (this==prev) tt++; else { push(tt); tt=1; }
+        if (this < prev) { w->st.ngrp = old; return(0); }
+        if (this==prev) tt++; else { push(w, tt); tt=1; }
         prev = this;
     }
-    push(tt);
+    push(w, tt);
     return(1);                                              // exactly as expected in 'order' (1=increasing, -1=decreasing), possibly with ties
 }
 
-static int csorted(SEXP *x, int n)                          // order=1 is ascending and -1 is descending
+static int csorted(sortWorker *w, SEXP *x, int n)           // order=1 is ascending and -1 is descending
 {                                                           // also accounts for nalast=0 (=NA), =1 (TRUE), -1 (FALSE)
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
     int i=1, j=0, tmp;
-    if (nalast == 0) {                                      // when nalast = NA, 
+    if (nalast == 0) {                                      // when nalast = NA,
         for (int k=0; k<n; k++) if (x[k] != NA_STRING) j++;
-        if (j == 0) { push(n); return(-2); }                // all NAs ? return special value to replace all o's values with '0'
+        if (j == 0) { push(w, n); return(-2); }             // all NAs ? return special value to replace all o's values with '0'
         if (j != n) return(0);                              // any NAs ? return 0 = unsorted and leave it to sort routines to replace o's with 0's
     }                                                       // no NAs  ? continue to check the rest of isorted - the same routine as usual
-    if (n<=1) { push(n); return(1); }
-    if (StrCmp2(x[1],x[0])<0) {
+    if (n<=1) { push(w, n); return(1); }
+    if (StrCmp2(x[1],x[0], order, nalast)<0) {
         i = 2;
-        while (i<n && StrCmp2(x[i],x[i-1])<0) i++;
-        if (i==n) { mpush(1,n); return(-1);}                // strictly opposite of expected 'order', no ties; 
+        while (i<n && StrCmp2(x[i],x[i-1], order, nalast)<0) i++;
+        if (i==n) { mpush(w, 1, n); return(-1);}            // strictly opposite of expected 'order', no ties;
                                                             // e.g. no more than one NA at the beginning/end (for order=-1/1)
         else return(0);
     }
-    int old = gsngrp[flip];
+    int old = w->st.ngrp;
+    int tt = 1;
+    for (i=1; i<n; i++) {
+        tmp = StrCmp2(x[i],x[i-1], order, nalast);
+        if (tmp < 0) { w->st.ngrp = old; return(0); }
+        if (tmp == 0) tt++; else { push(w, tt); tt=1; }
+    }
+    push(w, tt);
+    return(1);                                              // exactly as expected in 'order', possibly with ties
+}
+
+static inline int crank(SEXP s) {
+    return (s == NA_STRING) ? NA_INTEGER : -TRUELENGTH(s);
+}
+
+static int csortedRank(sortWorker *w, SEXP *x, int n)
+// As csorted but compares the ranks csort_pre left in TRUELENGTH rather than calling StrCmp2 (whose ENC2UTF8 may
+// allocate), so it's safe in parallel. Only valid after csort_pre on this column; i.e. for columns 2+ when sortStr.
+{
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
+    int i=1, j=0;
+    if (nalast == 0) {
+        for (int k=0; k<n; k++) if (x[k] != NA_STRING) j++;
+        if (j == 0) { push(w, n); return(-2); }
+        if (j != n) return(0);
+    }
+    if (n<=1) { push(w, n); return(1); }
+    if (x[1]!=x[0] && icheck(crank(x[1]), order, nalast) < icheck(crank(x[0]), order, nalast)) {
+        i = 2;
+        while (i<n && x[i]!=x[i-1] && icheck(crank(x[i]), order, nalast) < icheck(crank(x[i-1]), order, nalast)) i++;
+        if (i==n) { mpush(w, 1, n); return(-1);}
+        else return(0);
+    }
+    int old = w->st.ngrp;
     int tt = 1;
     for (i=1; i<n; i++) {
-        tmp = StrCmp2(x[i],x[i-1]);
-        if (tmp < 0) { gsngrp[flip] = old; return(0); }
-        if (tmp == 0) tt++; else { push(tt); tt=1; }
+        if (x[i]==x[i-1]) { tt++; continue; }              // same cached pointer first, as StrCmp2
+        if (icheck(crank(x[i]), order, nalast) < icheck(crank(x[i-1]), order, nalast)) { w->st.ngrp = old; return(0); }
+        push(w, tt); tt=1;
     }
-    push(tt);
-    return(1);                                              // exactly as expected in 'order', possibly with ties 
+    push(w, tt);
+    return(1);
 }
 
-static void isort(int *x, int *o, int n)
+static void isort(sortWorker *w, int *x, int *o, int n)
 {
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
     if (n<=2) {
         if (nalast == 0 && n == 2) {                        // nalast = 0 and n == 2 (check bottom of this file for explanation)
             if (o[0]==-1) { o[0]=1; o[1]=2; }
-            for (int i=0; i<n; i++) if (x[i] == NA_INTEGER) o[i] = 0; 
-            push(1); push(1);
+            for (int i=0; i<n; i++) if (x[i] == NA_INTEGER) o[i] = 0;
+            push(w, 1); push(w, 1);
             return;
-        } else Error("Internal error: isort received n=%d. isorted should have dealt with this (e.g. as a reverse sorted vector) already",n);
+        } else { WError(w, "Internal error: isort received n=%d. isorted should have dealt with this (e.g. as a reverse sorted vector) already",n); return; }
     }
     if (n<N_SMALL && o[0] != -1 && nalast != 0) {                 // see comment above in iradix_r on N_SMALL=200.
         /* if not o[0] then can't just populate with 1:n here, since x is changed by ref too (so would need to be copied). */
-        /* pushes inside too. Changes x and o by reference, so not suitable  in first column when o hasn't been populated yet 
+        /* pushes inside too. Changes x and o by reference, so not suitable  in first column when o hasn't been populated yet
            and x is the actual column in DT (hence check on o[0]). */
         if (order != 1 || nalast != -1)                     // so that default case, i.e., order=1, nalast=FALSE will not be affected (ex: `setkey`)
-            for (int i=0; i<n; i++) x[i] = icheck(x[i]);
-        iinsert(x, o, n);
+            for (int i=0; i<n; i++) x[i] = icheck(x[i], order, nalast);
+        iinsert(w, x, o, n);
     } else {
-        /* Tighter range (e.g. copes better with a few abormally large values in some groups), but also, when setRange was once at 
+        /* Tighter range (e.g. copes better with a few abormally large values in some groups), but also, when setRange was once at
            colum level that caused an extra scan of (long) x first. 10,000 calls to setRange takes just 0.04s i.e. negligible. */
-        setRange(x, n);
-        if (range==NA_INTEGER) Error("Internal error: isort passed all-NA. isorted should have caught this before this point");
-        int *target = (o[0] != -1) ? newo : o;
-        if (range<=N_RANGE && range<=n) {                   // was range<10000 for subgroups, but 1e5 for the first column, 
-            icount(x, target, n);                           // tried to generalise here.  1e4 rather than 1e5 here because iterated
+        setRange(w, x, n);
+        if (w->range==NA_INTEGER) { WError(w, "Internal error: isort passed all-NA. isorted should have caught this before this point"); return; }
+        int *target = (o[0] != -1) ? w->newo : o;
+        if (w->range<=N_RANGE && w->range<=n) {             // was range<10000 for subgroups, but 1e5 for the first column,
+            icount(w, x, target, n);                        // tried to generalise here.  1e4 rather than 1e5 here because iterated
         } else {                                            // was (thisgrpn < 200 || range > 20000) then radix
-            iradix(x, target, n);                           // a short vector with large range can bite icount when iterated (BLOCK 4 and 6)
+            iradix(w, x, target, n);                        // a short vector with large range can bite icount when iterated (BLOCK 4 and 6)
         }
     }
     // TO DO: add calibrate() to init.c
 }
 
-static void dsort(double *x, int *o, int n)
+static void dsort(sortWorker *w, double *x, int *o, int n)
 {
+    const int nalast = w->ctx->nalast, order = w->ctx->order;
+    unsigned long long (*twiddle)(void *, int, int, int) = w->ctx->twiddle;
+    Rboolean (*is_nan)(void *, int) = w->ctx->is_nan;
     if (n <= 2) {                                           // nalast = 0 and n == 2 (check bottom of this file for explanation)
         if (nalast == 0 && n == 2) {                        // don't have to twiddle here.. at least one will be NA and 'n' WILL BE 2.
             if (o[0]==-1) { o[0]=1; o[1]=2; }
             for (int i=0; i<n; i++) if (is_nan(x, i)) o[i] = 0;
-            push(1); push(1);
+            push(w, 1); push(w, 1);
             return;
-        } Error("Internal error: dsort received n=%d. dsorted should have dealt with this (e.g. as a reverse sorted vector) already",n);
+        }
+        WError(w, "Internal error: dsort received n=%d. dsorted should have dealt with this (e.g. as a reverse sorted vector) already",n);
+        return;
     }
     if (n<N_SMALL && o[0] != -1 && nalast != 0) {                                    // see comment above in iradix_r re N_SMALL=200,  and isort for o[0]
-        for (int i=0; i<n; i++) ((unsigned long long *)x)[i] = twiddle(x,i,order);   // have to twiddle here anyways, can't speed up default case like in isort
-        dinsert((unsigned long long *)x, o, n);
+        for (int i=0; i<n; i++) ((unsigned long long *)x)[i] = twiddle(x,i,order, nalast);   // have to twiddle here anyways, can't speed up default case like in isort
+        dinsert(w, (unsigned long long *)x, o, n);
     } else {
-        dradix((unsigned char *)x, (o[0] != -1) ? newo : o, n);
+        dradix(w, (unsigned char *)x, (o[0] != -1) ? w->newo : o, n);
+    }
+}
+
+static void sortGroups(sortWorker *w, int g0, int g1, int i, int *o, void *xd, int type, size_t size, int (*f)(), void (*g)())
+// Sorts rows i onwards of o within groups g0 to g1-1 of prev by the next column xd, pushing the new groups onto w's stack.
+// Run for runs of small groups in parallel by the pool, and for each large group by the master which then fans out itself.
+{
+    forderCtx *ctx = w->ctx;
+    const int nalast = ctx->nalast;
+    int j, k, tmp, thisgrpn, *osub;
+    for (int grp=g0; grp<g1; grp++) {
+        if (w->msg[0]) return;
+        thisgrpn = ctx->prev.gs[grp];
+        if (thisgrpn == 1) {
+            if (nalast==0) {                    // this edge case had to be taken care of here.. (see the bottom of this file for more explanation)
+                Rboolean isna;
+                switch(type) {
+                case INTSXP : case LGLSXP :     // NA_LOGICAL == NA_INTEGER checked in init.c
+                    isna = ((int *)xd)[o[i]-1] == NA_INTEGER; break;
+                case REALSXP :
+                    isna = ISNAN(((double *)xd)[o[i]-1]); break;
+                default :
+                    isna = ((SEXP *)xd)[o[i]-1] == NA_STRING;
+                }
+                if (isna) { w->isSorted=FALSE; o[i] = 0; }
+            }
+            i++; push(w, 1); continue;
+        }
+        if (!alloc_xsub(w, thisgrpn)) return;
+        osub = o+i;
+        void *xsub = w->xsub;
+        // ** TO DO **: if isSorted,  we can just point xsub into x directly. If (*f)() returns 0, though, will have to copy x at that point
+        //        When doing this,  xsub could be allocated at that point for the first time.
+        if (size==4)
+            for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = ((int *)xd)[o[i++]-1];
+        else
+            for (j=0; j<thisgrpn; j++) ((double *)xsub)[j] = ((double *)xd)[o[i++]-1];
+
+        tmp = (*f)(w, xsub, thisgrpn);          // [i|d|c]sorted(); very low cost, sequential
+
+        if (tmp) {
+            // *sorted will have already push()'d the groups
+            if (tmp==-1) {
+                w->isSorted = FALSE;
+                for (k=0;k<thisgrpn/2;k++) {        // reverse the order in-place using no function call or working memory
+                    tmp = osub[k];                  // isorted only returns -1 for _strictly_ decreasing order, otherwise ties wouldn't be stable
+                    osub[k] = osub[thisgrpn-1-k];
+                    osub[thisgrpn-1-k] = tmp;
+                }
+            } else if (nalast == 0 && tmp==-2) {    // all NAs, replace osub[.] with 0s.
+                w->isSorted = FALSE;
+                for (k=0; k<thisgrpn; k++) osub[k] = 0;
+            }
+            continue;
+        }
+        w->isSorted = FALSE;
+        w->newo[0] = -1;                            // nalast=NA will result in newo[0] = 0. So had to change to -1.
+        (*g)(w, xsub, osub, thisgrpn);              // may update osub directly, or if not will put the result in w->newo
+
+        if (w->newo[0] != -1) {
+            if (nalast != 0) for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = osub[ w->newo[j]-1 ];           // reuse xsub to reorder osub
+            else for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = (w->newo[j] == 0) ? 0 : osub[ w->newo[j]-1 ];  // final nalast case to handle!
+            memcpy(osub, xsub, thisgrpn*sizeof(int));
+        }
+    }
+}
+
+static Rboolean keyRange(SEXP x, int n, int nth, int *xmin, int *xmax, Rboolean *anyna)
+// min and max of an integer or logical column, or of a double column holding only NA and whole numbers within int range (e.g. Date).
+// FALSE if the column can't be packed by packKeys.
+{
+    const Rboolean isd = TYPEOF(x)==REALSXP;
+    const void *xd = DATAPTR(x);
+    if (n<N_PARALLEL) nth = 1;
+    int bsize = (n-1)/nth+1, nb = (n-1)/bsize+1;
+    int bmin[nb], bmax[nb];
+    Rboolean bna[nb], bok[nb];
+    #pragma omp parallel for num_threads(nth)
+    for (int b=0; b<nb; b++) {
+        int lo = INT_MAX, hi = INT_MIN, to = MIN(n, (b+1)*bsize);
+        Rboolean na = FALSE, ok = TRUE;
+        for (int i=b*bsize; i<to; i++) {
+            int v;
+            if (isd) {
+                double d = ((const double *)xd)[i];
+                if (ISNA(d)) { na = TRUE; continue; }
+                if (ISNAN(d) || d<=INT_MIN || d>INT_MAX || d!=(int)d) { ok = FALSE; break; }   // NaN sorts apart from NA so isn't packed either
+                v = (int)d;
+            } else {
+                v = ((const int *)xd)[i];
+                if (v==NA_INTEGER) { na = TRUE; continue; }
+            }
+            if (v<lo) lo = v;
+            if (v>hi) hi = v;
+        }
+        bmin[b] = lo; bmax[b] = hi; bna[b] = na; bok[b] = ok;
+    }
+    int lo = INT_MAX, hi = INT_MIN;
+    *anyna = FALSE;
+    for (int b=0; b<nb; b++) {
+        if (!bok[b]) return FALSE;
+        if (bmin[b] < lo) lo = bmin[b];
+        if (bmax[b] > hi) hi = bmax[b];
+        *anyna |= bna[b];
+    }
+    if (lo > hi) lo = hi = 0;                                               // all NA; only the NA slot is used
+    else if ((double)hi - lo + 1 >= INT_MAX) return FALSE;
+    *xmin = lo; *xmax = hi;
+    return TRUE;
+}
+
+static unsigned long long ktwiddle(void *p, int i, int order, int nalast) {
+    return ((unsigned long long *)p)[i];                                    // packKeys has already applied order and nalast
+}
+
+static Rboolean knan(void *p, int i) {
+    return FALSE;
+}
+
+static int packKeys(forderCtx *ctx, SEXP DT, SEXP by, SEXP orderArg, int n, int nth)
+/* Sorting column by column re-stacks the groups of each column and sorts within every one of them by the next column, which is
+   slow when the leading columns have many small groups. When every 'by' column is integer-like with a narrow range (e.g. a Date,
+   an int id and a small factor) the columns are instead packed into one key: each column is mapped onto 0:(range-1) in the
+   requested order, plus a slot for NA at the start or end according to na.last, and the key is the mixed radix number with the
+   first column most significant. One sort of the keys then gives exactly the order and groups of the column by column sort.
+   Returns INTSXP if the keys fit in an int (so that icount can be used when the product of the ranges is small), REALSXP for
+   unsigned 64 bit keys sorted by dradix via ktwiddle, or 0 if the columns can't be packed (na.last=NA, character, integer64,
+   fractional doubles, or the ranges need more than 64 bits). The keys are left in ctx->keys. */
+{
+    const int ncol = LENGTH(by);
+    if (ncol<2 || n<2 || ctx->nalast==0) return 0;
+    SEXP cols[ncol];
+    int xmin[ncol], xmax[ncol];
+    Rboolean anyna[ncol];
+    unsigned long long mult[ncol], total = 1;
+    for (int j=0; j<ncol; j++) {
+        cols[j] = VECTOR_ELT(DT, INTEGER(by)[j]-1);
+        switch(TYPEOF(cols[j])) {
+        case INTSXP : case LGLSXP :
+            break;
+        case REALSXP :
+            if (INHERITS(cols[j], char_integer64)) return 0;
+            break;
+        default :
+            return 0;
+        }
     }
+    for (int j=ncol-1; j>=0; j--) {                                        // last column first, most likely to exceed 64 bits on the first
+        if (!keyRange(cols[j], n, nth, xmin+j, xmax+j, anyna+j)) return 0;
+        unsigned long long span = (unsigned long long)(xmax[j]-xmin[j]) + 1 + anyna[j];
+        mult[j] = total;
+        if (span > ULLONG_MAX/total) return 0;
+        total *= span;
+    }
+    const Rboolean isint = total-1 <= INT_MAX;
+    ctx->keys = calloc(n, isint ? sizeof(int) : sizeof(unsigned long long));
+    if (ctx->keys == NULL) return 0;                                       // just sort column by column
+    const int pnth = n<N_PARALLEL ? 1 : nth;
+    for (int j=0; j<ncol; j++) {
+        const Rboolean isd = TYPEOF(cols[j])==REALSXP;
+        const void *xd = DATAPTR(cols[j]);
+        const int lo = xmin[j], hi = xmax[j], order = INTEGER(orderArg)[j];
+        const unsigned long long naval = ctx->nalast==1 ? (unsigned long long)(hi-lo)+1 : 0, off = anyna[j] && ctx->nalast==-1, m = mult[j];
+        #pragma omp parallel for num_threads(pnth)
+        for (int i=0; i<n; i++) {
+            int v;
+            Rboolean na;
+            if (isd) { double d = ((const double *)xd)[i]; na = ISNAN(d); v = na ? 0 : (int)d; }
+            else { v = ((const int *)xd)[i]; na = v==NA_INTEGER; }
+            unsigned long long k = na ? naval : (unsigned long long)(order==1 ? v-lo : hi-v) + off;
+            if (isint) ((int *)ctx->keys)[i] += (int)(k*m);
+            else ((unsigned long long *)ctx->keys)[i] += k*m;
+        }
+    }
+    return isint ? INTSXP : REALSXP;
 }
 
 SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP naArg)
 // sortStr TRUE from setkey, FALSE from by=
 {
-    int i, j, k, grp, ngrp, tmp, *osub, thisgrpn, n, col;
+    int i, grp, ngrp, tmp, n, col;
     Rboolean isSorted = TRUE;
     SEXP x, class;
     void *xd;
@@ -1093,13 +1560,13 @@ SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP
     clock_t tstart;  // local variable to mask the global tstart for ease when timing sub funs
 #endif
     TBEG()
-    
+
     if (isNewList(DT)) {
         if (!length(DT)) error("DT is an empty list() of 0 columns");
         if (!isInteger(by) || !length(by)) error("DT has %d columns but 'by' is either not integer or length 0", length(DT));  // seq_along(x) at R level
         n = length(VECTOR_ELT(DT,0));
         for (i=0; i<LENGTH(by); i++) {
-            if (INTEGER(by)[i] < 1 || INTEGER(by)[i] > length(DT)) 
+            if (INTEGER(by)[i] < 1 || INTEGER(by)[i] > length(DT))
                 error("'by' value %d out of range [1,%d]", INTEGER(by)[i], length(DT));
             if ( n != length(VECTOR_ELT(DT, INTEGER(by)[i]-1)) )
                 error("Column %d is length %d which differs from length of column 1 (%d)\n", INTEGER(by)[i], length(VECTOR_ELT(DT, INTEGER(by)[i]-1)), n);
@@ -1113,37 +1580,62 @@ SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP
     if (!isLogical(retGrp) || LENGTH(retGrp)!=1 || INTEGER(retGrp)[0]==NA_LOGICAL) error("retGrp must be TRUE or FALSE");
     if (!isLogical(sortStrArg) || LENGTH(sortStrArg)!=1 || INTEGER(sortStrArg)[0]==NA_LOGICAL ) error("sortStr must be TRUE or FALSE");
     if (!isLogical(naArg) || LENGTH(naArg) != 1) error("na.last must be logical TRUE, FALSE or NA of length 1");
-    sortStr = LOGICAL(sortStrArg)[0];
-    // static global set on top...
-    nalast = (LOGICAL(naArg)[0] == NA_LOGICAL) ? 0 : (LOGICAL(naArg)[0] == TRUE) ? 1 : -1; // 1=TRUE, -1=FALSE, 0=NA
-    gsmaxalloc = n;  // upper limit for stack size (all size 1 groups). We'll detect and avoid that limit, but if just one non-1 group (say 2), that can't be avoided.
-    
+    forderCtx thisctx, *ctx = &thisctx;     // everything about this call; nothing static so a nested call doesn't interfere
+    memset(ctx, 0, sizeof(forderCtx));
+    ctx->sortStr = LOGICAL(sortStrArg)[0];
+    ctx->nalast = (LOGICAL(naArg)[0] == NA_LOGICAL) ? 0 : (LOGICAL(naArg)[0] == TRUE) ? 1 : -1; // 1=TRUE, -1=FALSE, 0=NA
+    ctx->maxlen = 1;  // Minimum needed to count "" and NA
+    const int nalast = ctx->nalast;
+    const Rboolean sortStr = ctx->sortStr;
+    int nth = getDTthreads();
+    newWorkers(ctx, nth);
+    sortWorker *master = ctx->workers, *workers = ctx->workers;
+    ctx->gsmaxalloc = n;  // upper limit for stack size (all size 1 groups). We'll detect and avoid that limit, but if just one non-1 group (say 2), that can't be avoided.
+
     // TODO: check for 'orderArg'
-    
+
     SEXP ans = PROTECT(allocVector(INTSXP, n)); // once for the result, needs to be length n.
     int *o = INTEGER(ans);                      // TO DO: save allocation if NULL is returned (isSorted==TRUE)
     o[0] = -1;                                  // so [i|c|d]sort know they can populate o directly with no working memory needed to reorder existing order
                                                 // had to repace this from '0' to '-1' because 'nalast = 0' replace 'o[.]' with 0 values.
     xd = DATAPTR(x);
-    stackgrps = length(by)>1 || LOGICAL(retGrp)[0];
-    savetl_init();   // from now on use Error not error.
-
-    order = INTEGER(orderArg)[0];
-    switch(TYPEOF(x)) {
+    ctx->stackgrps = length(by)>1 || LOGICAL(retGrp)[0];
+    // savetl's globals are needed only for character columns, so other orderings don't take them from a call that holds them
+    if (isNewList(DT)) {
+        for (i=0; i<LENGTH(by) && !ctx->savingtl; i++) ctx->savingtl = TYPEOF(VECTOR_ELT(DT, INTEGER(by)[i]-1)) == STRSXP;
+    } else ctx->savingtl = TYPEOF(x) == STRSXP;
+    if (ctx->savingtl) savetl_init();   // from now on use Error not error.
+
+    int type = isNewList(DT) ? packKeys(ctx, DT, by, orderArg, n, nth) : 0;
+    Rboolean packed = type != 0;
+    if (packed) {
+        // a single sort of the packed keys replaces the loop through columns 2+ below
+        xd = ctx->keys;
+        ctx->stackgrps = LOGICAL(retGrp)[0];
+        ctx->nalast = -1;                       // NA and order are already in the keys
+        ctx->order = 1;
+    } else {
+        type = TYPEOF(x);
+        ctx->order = INTEGER(orderArg)[0];
+    }
+    switch(type) {
     case INTSXP : case LGLSXP :
-        tmp = isorted(xd, n); break;
+        tmp = isorted(master, xd, n); break;
     case REALSXP :
         class = getAttrib(x, R_ClassSymbol);
-        if (isString(class) && STRING_ELT(class, 0) == char_integer64) {
-            twiddle = &i64twiddle;
-            is_nan  = &i64nan; // see explanation under `is_nan` as to why we need this
+        if (packed) {
+            ctx->twiddle = &ktwiddle;
+            ctx->is_nan  = &knan;
+        } else if (isString(class) && STRING_ELT(class, 0) == char_integer64) {
+            ctx->twiddle = &i64twiddle;
+            ctx->is_nan  = &i64nan; // see explanation under `is_nan` as to why we need this
         } else {
-            twiddle = &dtwiddle;
-            is_nan  = &dnan;
+            ctx->twiddle = &dtwiddle;
+            ctx->is_nan  = &dnan;
         }
-        tmp = dsorted(xd, n); break;
+        tmp = dsorted(master, xd, n); break;
     case STRSXP :
-        tmp = csorted(xd, n); break;
+        tmp = csorted(master, xd, n); break;
     default :
         Error("First column being ordered is type '%s', not yet supported", type2char(TYPEOF(x)));
     }
@@ -1160,58 +1652,51 @@ SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP
         }
     } else {
         isSorted = FALSE;
-        switch(TYPEOF(x)) {
+        master->nth = nth;                      // the whole column: fan out to the pool
+        switch(type) {
         case INTSXP : case LGLSXP :
-            isort(xd, o, n); break;
+            isort(master, xd, o, n); break;
         case REALSXP :
-            dsort(xd, o, n); break;
+            dsort(master, xd, o, n); break;
         case STRSXP :
-            if (sortStr) { csort_pre(xd, n); alloc_csort_otmp(n); csort(xd, o, n); }
-            else cgroup(xd, o, n);
+            if (sortStr) { csort_pre(ctx, xd, n); csort(master, xd, o, n); }
+            else cgroup(master, xd, o, n);
             break;
         default :
             Error("Internal error: previous default should have caught unsupported type");
         }
+        master->nth = 1;
+        checkWorkers(ctx);
     }
+    // the master's stack is now the groups of the first column
+    grpstack tmpst = ctx->prev; ctx->prev = master->st; master->st = tmpst;
     TEND(0)
-    
-    int maxgrpn = gsmax[flip];   // biggest group in the first column
-    void *xsub = NULL;           // local to forder
+
     int (*f)(); void (*g)();
-    
-    if (length(by)>1 && gsngrp[flip]<n) {
-        xsub = (void *)malloc(maxgrpn * sizeof(double));    // double is the largest type, 8
-        if (xsub==NULL) Error("Couldn't allocate xsub in forder, requested %d * %d bytes.", maxgrpn, sizeof(double));
-        newo = (int *)malloc(maxgrpn * sizeof(int));        // global variable, used by isort, dsort, sort and cgroup
-        if (newo==NULL) Error("Couldn't allocate newo in forder, requested %d * %d bytes.", maxgrpn, sizeof(int));
-    }
-    TEND(1)  // should be negligible time to malloc even large blocks, but time it anyway to be sure
-    
-    for (col=2; col<=length(by); col++) {
+
+    for (col=2; col<=length(by) && !packed; col++) {
         x = VECTOR_ELT(DT,INTEGER(by)[col-1]-1);
         xd = DATAPTR(x);
-        ngrp = gsngrp[flip];
+        ngrp = ctx->prev.ngrp;
         if (ngrp == n && nalast != 0) break;
-        flipflop();
-        stackgrps = col!=LENGTH(by) || LOGICAL(retGrp)[0];
-        order = INTEGER(orderArg)[col-1];
+        ctx->stackgrps = col!=LENGTH(by) || LOGICAL(retGrp)[0];
+        ctx->order = INTEGER(orderArg)[col-1];
         switch(TYPEOF(x)) {
         case INTSXP : case LGLSXP :
             f = &isorted; g = &isort; break;
         case REALSXP :
             class = getAttrib(x, R_ClassSymbol);
             if (isString(class) && STRING_ELT(class, 0) == char_integer64) {
-                twiddle = &i64twiddle;
-                is_nan  = &i64nan;
+                ctx->twiddle = &i64twiddle;
+                ctx->is_nan  = &i64nan;
             } else {
-                twiddle = &dtwiddle;
-                is_nan  = &dnan;
+                ctx->twiddle = &dtwiddle;
+                ctx->is_nan  = &dnan;
             }
             f = &dsorted; g = &dsort; break;
         case STRSXP :
-            f = &csorted;
-            if (sortStr) { csort_pre(xd, n); alloc_csort_otmp(gsmax[1-flip]); g = &csort; }
-            else g = &cgroup; // no increasing/decreasing order required if sortStr = FALSE, just a dummy argument
+            if (sortStr) { csort_pre(ctx, xd, n); f = &csortedRank; g = &csort; }
+            else { f = &csorted; g = &cgroup; } // no increasing/decreasing order required if sortStr = FALSE, just a dummy argument
             break;
         default:
            Error("Column %d of 'by' (%d) is type '%s', not yet supported", col, INTEGER(by)[col-1], type2char(TYPEOF(x)));
@@ -1219,118 +1704,212 @@ SEXP forder(SEXP DT, SEXP by, SEXP retGrp, SEXP sortStrArg, SEXP orderArg, SEXP
         size_t size = SIZEOF(x);
         if (size!=4 && size!=8) Error("Column %d of 'by' is supported type '%s' but size (%d) isn't 4 or 8\n", col, type2char(TYPEOF(x)), size);
         // sizes of int and double are checked to be 4 and 8 respectively in init.c
-        i = 0;
-        for (grp=0; grp<ngrp; grp++) {
-            thisgrpn = gs[1-flip][grp];
-            if (thisgrpn == 1) {
-                if (nalast==0) {                    // this edge case had to be taken care of here.. (see the bottom of this file for more explanation)
-                    switch(TYPEOF(x)) {
-                    case INTSXP :
-                        if (INTEGER(x)[o[i]-1] == NA_INTEGER) { isSorted=FALSE; o[i] = 0; } break;
-                    case LGLSXP :
-                        if (LOGICAL(x)[o[i]-1] == NA_LOGICAL) { isSorted=FALSE; o[i] = 0; } break;
-                    case REALSXP :
-                        if (ISNAN(REAL(x)[o[i]-1])) { isSorted=FALSE; o[i] = 0; } break;
-                    case STRSXP :
-                        if (STRING_ELT(x, o[i]-1) == NA_STRING) { isSorted=FALSE; o[i] = 0; } break;
-                    default :
-                        Error("Internal error: previous default should have caught unsupported type");
-                    }
+
+        // Split the groups into ctx->tasks. Each large group is its own task, sorted by the master using all threads. Runs of
+        // smaller groups are batched and the batches sorted in parallel by the pool. cgroup writes TRUELENGTH so is one task.
+        Rboolean par = nth>1 && n>=N_PARALLEL && (TYPEOF(x)!=STRSXP || sortStr);
+        int bigN = MAX(N_PARALLEL, n/(2*nth)), batchN = MAX(N_SMALL, n/(4*nth));
+        int ntask = 0, g0 = 0, rows = 0;
+        for (int pass=0; pass<2; pass++) {      // count ctx->tasks then fill them
+            int row = 0;
+            ntask = 0;
+            #define ADDTASK(G1, BIG) { if (pass) { ctx->tasks[ntask].g0 = g0; ctx->tasks[ntask].g1 = G1; ctx->tasks[ntask].row = row-rows; ctx->tasks[ntask].wk = BIG ? 0 : -1; } ntask++; g0 = G1; rows = 0; }
+            g0 = 0; rows = 0;
+            for (grp=0; grp<ngrp && par; grp++) {
+                int thisgrpn = ctx->prev.gs[grp];
+                if (thisgrpn >= bigN) {
+                    if (grp>g0) ADDTASK(grp, FALSE)
+                    row += thisgrpn; rows = thisgrpn;
+                    ADDTASK(grp+1, TRUE)
+                    continue;
                 }
-                i++; push(1); continue;
+                row += thisgrpn; rows += thisgrpn;
+                if (rows >= batchN) ADDTASK(grp+1, FALSE)
             }
-            TBEG()
-            osub = o+i;
-            // ** TO DO **: if isSorted,  we can just point xsub into x directly. If (*f)() returns 0, though, will have to copy x at that point
-            //        When doing this,  xsub could be allocated at that point for the first time.
-            if (size==4)
-                for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = ((int *)xd)[o[i++]-1];
-            else
-                for (j=0; j<thisgrpn; j++) ((double *)xsub)[j] = ((double *)xd)[o[i++]-1];
-            TEND(2)
-            
-            // continue;  // BASELINE short circuit timing point. Up to here is the cost of creating xsub.
-            tmp = (*f)(xsub, thisgrpn);     // [i|d|c]sorted(); very low cost, sequential
-            TEND(3)
-            
-            if (tmp) {
-                // *sorted will have already push()'d the groups
-                if (tmp==-1) {
-                    isSorted = FALSE;
-                    for (k=0;k<thisgrpn/2;k++) {        // reverse the order in-place using no function call or working memory 
-                        tmp = osub[k];                  // isorted only returns -1 for _strictly_ decreasing order, otherwise ties wouldn't be stable
-                        osub[k] = osub[thisgrpn-1-k];
-                        osub[thisgrpn-1-k] = tmp;
-                    }
-                    TEND(4)
-                } else if (nalast == 0 && tmp==-2) {    // all NAs, replace osub[.] with 0s.
-                    isSorted = FALSE;
-                    for (k=0; k<thisgrpn; k++) osub[k] = 0;
-                }
-                continue;
+            if (!par) { if (pass) { ctx->tasks[0].g0 = 0; ctx->tasks[0].g1 = ngrp; ctx->tasks[0].row = 0; ctx->tasks[0].wk = 0; } ntask = 1; }
+            else if (g0 < ngrp) ADDTASK(ngrp, FALSE)
+            #undef ADDTASK
+            if (!pass) {
+                task *tmptasks = realloc(ctx->tasks, MAX(ntask,1)*sizeof(task));
+                if (tmptasks == NULL) Error("Failed to allocate %d ctx->tasks in forder", ntask);
+                ctx->tasks = tmptasks;
             }
-            isSorted = FALSE;
-            newo[0] = -1;                               // nalast=NA will result in newo[0] = 0. So had to change to -1.
-            (*g)(xsub, osub, thisgrpn);                 // may update osub directly, or if not will put the result in global newo
-                                                        
-            TEND(5)
-            
-            if (newo[0] != -1) {
-                if (nalast != 0) for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = osub[ newo[j]-1 ];           // reuse xsub to reorder osub
-                else for (j=0; j<thisgrpn; j++) ((int *)xsub)[j] = (newo[j] == 0) ? 0 : osub[ newo[j]-1 ];  // final nalast case to handle!
-                memcpy(osub, xsub, thisgrpn*sizeof(int));            
+        }
+        for (i=0; i<ctx->nworkers; i++) workers[i].isSorted = TRUE;
+        for (int t=0; t<ntask; t++) {           // large groups first, one at a time, by the master
+            if (ctx->tasks[t].wk != 0) continue;
+            master->nth = par ? nth : 1;
+            ctx->tasks[t].start = master->st.ngrp;
+            sortGroups(master, ctx->tasks[t].g0, ctx->tasks[t].g1, ctx->tasks[t].row, o, xd, TYPEOF(x), size, f, g);
+            ctx->tasks[t].ngrp = master->st.ngrp - ctx->tasks[t].start;
+            master->nth = 1;
+            if (master->msg[0]) break;
+        }
+        if (par && !master->msg[0]) {
+            #pragma omp parallel for schedule(dynamic) num_threads(nth)
+            for (int t=0; t<ntask; t++) {
+                if (ctx->tasks[t].wk == 0) continue;
+                int me = 1+omp_get_thread_num();
+                sortWorker *pw = workers+me;
+                ctx->tasks[t].wk = me;
+                ctx->tasks[t].start = pw->st.ngrp;
+                sortGroups(pw, ctx->tasks[t].g0, ctx->tasks[t].g1, ctx->tasks[t].row, o, xd, TYPEOF(x), size, f, g);
+                ctx->tasks[t].ngrp = pw->st.ngrp - ctx->tasks[t].start;
             }
-            TEND(6)
         }
+        checkWorkers(ctx);
+        for (i=0; i<ctx->nworkers; i++) if (!workers[i].isSorted) isSorted = FALSE;
+        ctx->prev.ngrp = ctx->prev.max = 0;
+        stitch(ctx, &ctx->prev, ctx->tasks, ntask);
+        TEND(2)
     }
 #ifdef TIMING_ON
     for (i=0; i<NBLOCK; i++) {
         Rprintf("Timing block %d = %8.3f   %8d\n", i, 1.0*tblock[i]/CLOCKS_PER_SEC, nblock[i]);
         if (i==12) Rprintf("\n");
     }
-    Rprintf("Found %d groups and maxgrpn=%d\n", gsngrp[flip], gsmax[flip]);
+    Rprintf("Found %d groups and maxgrpn=%d\n", ctx->prev.ngrp, ctx->prev.max);
 #endif
-    
-    if (!sortStr && ustr_n!=0) Error("Internal error: at the end of forder sortStr==FALSE but ustr_n!=0 [%d]", ustr_n);
-    for(int i=0; i<ustr_n; i++)
-        SET_TRUELENGTH(ustr[i],0);
-    maxlen = 1;  // reset global. Minimum needed to count "" and NA
-    ustr_n = 0;
-    savetl_end();
-    free(ustr);                ustr=NULL;          ustr_alloc=0;
-    
+
+    if (!sortStr && ctx->ustr_n!=0) Error("Internal error: at the end of forder sortStr==FALSE but ustr_n!=0 [%d]", ctx->ustr_n);
+    for(int i=0; i<ctx->ustr_n; i++)
+        SET_TRUELENGTH(ctx->ustr[i],0);
+    ctx->ustr_n = 0;
+    if (ctx->savingtl) savetl_end();
+
     if (isSorted) {
         UNPROTECT(1);  // The existing o vector, which we may save in future, if in future we only create when isSorted becomes FALSE
         ans = PROTECT(allocVector(INTSXP, 0));  // Can't attach attributes to NULL
     }
     if (LOGICAL(retGrp)[0]) {
-        ngrp = gsngrp[flip];
+        ngrp = ctx->prev.ngrp;
         setAttrib(ans, sym_starts, x = allocVector(INTSXP, ngrp));
-        //if (isSorted || LOGICAL(sort)[0])
-            for (INTEGER(x)[0]=1, i=1; i<ngrp; i++) INTEGER(x)[i] = INTEGER(x)[i-1] + gs[flip][i-1];
-        //else {
-            // it's not sorted already and we want to keep original group order
-        //    cumsum = 0;
-        //    for (i=0; i<ngrp; i++) { INTEGER(x)[i] = o[i+cumsum]; cumsum+=gs[flip][i]; }
-        //    isort(INTEGER(x), ngrp);
-        //}
-        setAttrib(ans, sym_maxgrpn, ScalarInteger(gsmax[flip]));
+        for (INTEGER(x)[0]=1, i=1; i<ngrp; i++) INTEGER(x)[i] = INTEGER(x)[i-1] + ctx->prev.gs[i-1];
+        setAttrib(ans, sym_maxgrpn, ScalarInteger(ctx->prev.max));
     }
-    
-    gsfree();
-    free(radix_xsub);          radix_xsub=NULL;    radix_xsuballoc=0;
-    free(xsub); free(newo);    xsub=newo=NULL;
-    free(xtmp);                xtmp=NULL;          xtmp_alloc=0;
-    free(otmp);                otmp=NULL;          otmp_alloc=0;
-    free(csort_otmp);          csort_otmp=NULL;    csort_otmp_alloc=0;
-
-    free(cradix_counts);       cradix_counts=NULL; cradix_counts_alloc=0;
-    free(cradix_xtmp);         cradix_xtmp=NULL;   cradix_xtmp_alloc=0;   // TO DO: use xtmp already got
-    
+
+    freeCtx(ctx);
+
     UNPROTECT(1);
     return( ans );
 }
 
+SEXP topk(SEXP DT, SEXP by, SEXP grpArg, SEXP kArg, SEXP orderArg, SEXP naArg)
+/* The first k rows of forder(DT, by), or when grpArg is given the first k rows within each group of the grpArg columns (groups
+   in sorted order), without sorting all n rows; e.g. DT[order(-x)[1:k]] and head-by-group. Within each group the k-th smallest
+   key of the first 'by' column is found by quickselect on its twiddled keys, and only the rows at or below it are kept. Those
+   candidates, still in row order so that ties stay stable, are then sorted by every column with forder and the first k taken
+   from each group. The result is identical to the head of the full ordering; when the first column has many ties at the k-th
+   value more candidates survive and the cost tends to that of the full sort. */
+{
+    if (!isNewList(DT) || !length(DT)) error("DT must be a non-empty list");
+    if (!isInteger(by) || !length(by)) error("'by' must be a non-empty integer vector");
+    if (!isInteger(grpArg)) error("'group' must be an integer vector");
+    if (!isInteger(kArg) || LENGTH(kArg)!=1 || INTEGER(kArg)[0]==NA_INTEGER || INTEGER(kArg)[0]<0) error("k must be a single non-negative integer");
+    if (!isInteger(orderArg) || LENGTH(orderArg)!=LENGTH(by)) error("'order' must be an integer vector the same length as 'by'");
+    if (!isLogical(naArg) || LENGTH(naArg)!=1) error("na.last must be logical TRUE, FALSE or NA of length 1");
+    const int n = length(VECTOR_ELT(DT,0)), k = INTEGER(kArg)[0], nby = LENGTH(by), ngby = LENGTH(grpArg);
+    const int nalast = (LOGICAL(naArg)[0] == NA_LOGICAL) ? 0 : (LOGICAL(naArg)[0] == TRUE) ? 1 : -1;
+    for (int j=0; j<nby; j++) if (INTEGER(by)[j]<1 || INTEGER(by)[j]>length(DT)) error("'by' value %d out of range [1,%d]", INTEGER(by)[j], length(DT));
+    if (k==0 || n==0) return allocVector(INTSXP, 0);
+    int protecti=0;
+
+    // groups. Rows dropped by na.last=NA in the group columns have no group (-1)
+    int ngrp = 1, *go = NULL, *gstarts = NULL, *grpid = NULL;
+    if (ngby) {
+        SEXP gorder = PROTECT(int_vec_init(ngby, 1)); protecti++;
+        SEXP gans = PROTECT(forder(DT, grpArg, PROTECT(ScalarLogical(TRUE)), PROTECT(ScalarLogical(TRUE)), gorder, naArg));
+        UNPROTECT(2); protecti++;   // the 2 logicals
+        SEXP starts = getAttrib(gans, sym_starts);
+        go = LENGTH(gans) ? INTEGER(gans) : NULL;
+        ngrp = LENGTH(starts);
+        gstarts = INTEGER(starts);
+        grpid = (int *)R_alloc(n, sizeof(int));
+        for (int i=0; i<n; i++) grpid[i] = -1;
+        for (int g=0; g<ngrp; g++) {
+            int end = g<ngrp-1 ? gstarts[g+1]-1 : n;
+            for (int p=gstarts[g]-1; p<end; p++) if (!go || go[p]) grpid[go ? go[p]-1 : p] = g;
+        }
+    }
+
+    // candidates: the rows whose key in the first column is no more than the k-th smallest in their group
+    SEXP x = VECTOR_ELT(DT, INTEGER(by)[0]-1);
+    const int type = TYPEOF(x), order = INTEGER(orderArg)[0];
+    const int nl = nalast==0 ? 1 : nalast;  // na.last=NA: NA keys last so they are only candidates when there aren't k others
+    Rboolean select = (type==INTSXP || type==LGLSXP || type==REALSXP) && (nalast!=0 || nby==1) && (ngby || k<n);
+    // with na.last=NA and more columns a row with NA in a later column would use up a place, so keep them all
+    char *keep = (char *)R_alloc(n, sizeof(char));
+    for (int i=0; i<n; i++) keep[i] = !grpid || grpid[i]>=0;
+    if (select) {
+        const int nth = n<N_PARALLEL ? 1 : getDTthreads();
+        unsigned long long *key = (unsigned long long *)R_alloc(n, sizeof(unsigned long long));
+        unsigned long long *tmp = (unsigned long long *)R_alloc(n, sizeof(unsigned long long));
+        unsigned long long (*twiddle)(void *, int, int, int) = INHERITS(x, char_integer64) ? &i64twiddle : &dtwiddle;
+        void *xd = DATAPTR(x);
+        #pragma omp parallel for num_threads(nth)
+        for (int i=0; i<n; i++) {
+            key[i] = type==REALSXP ? twiddle(xd, i, order, nl) : (unsigned int)(icheck(((int *)xd)[i], order, nl)) - INT_MIN;
+        }
+        #pragma omp parallel for schedule(dynamic) num_threads(nth)
+        for (int g=0; g<ngrp; g++) {
+            int start = ngby ? gstarts[g]-1 : 0, end = (ngby && g<ngrp-1) ? gstarts[g+1]-1 : n, m = 0;
+            for (int p=start; p<end; p++) if (!go || go[p]) tmp[start + m++] = key[go ? go[p]-1 : p];
+            if (m<=k) continue;
+            unsigned long long kth = ullquickselect(tmp+start, m, k-1);
+            for (int p=start; p<end; p++) {
+                if (go && !go[p]) continue;
+                int row = go ? go[p]-1 : p;
+                keep[row] = key[row] <= kth;
+            }
+        }
+    }
+    int ncand = 0;
+    for (int i=0; i<n; i++) ncand += keep[i];
+
+    // sort the candidates by the group number and then every 'by' column
+    SEXP sub, subby, suborder, cand = R_NilValue;
+    if (ncand==n && !ngby) {
+        sub = DT; subby = by; suborder = orderArg;
+    } else {
+        cand = PROTECT(allocVector(INTSXP, ncand)); protecti++;
+        int *c = INTEGER(cand);
+        for (int i=0, j=0; i<n; i++) if (keep[i]) c[j++] = i+1;
+        const int off = ngby ? 1 : 0;
+        sub = PROTECT(allocVector(VECSXP, nby+off)); protecti++;
+        subby = PROTECT(allocVector(INTSXP, nby+off)); protecti++;
+        suborder = PROTECT(allocVector(INTSXP, nby+off)); protecti++;
+        if (ngby) {
+            SEXP g = allocVector(INTSXP, ncand);
+            SET_VECTOR_ELT(sub, 0, g);
+            for (int j=0; j<ncand; j++) INTEGER(g)[j] = grpid[c[j]-1];
+            INTEGER(subby)[0] = 1;
+            INTEGER(suborder)[0] = 1;
+        }
+        for (int j=0; j<nby; j++) {
+            SET_VECTOR_ELT(sub, j+off, subsetVector(VECTOR_ELT(DT, INTEGER(by)[j]-1), cand));
+            INTEGER(subby)[j+off] = j+off+1;
+            INTEGER(suborder)[j+off] = INTEGER(orderArg)[j];
+        }
+    }
+    SEXP so = PROTECT(forder(sub, subby, PROTECT(ScalarLogical(FALSE)), PROTECT(ScalarLogical(TRUE)), suborder, naArg));
+    UNPROTECT(2); protecti++;   // the 2 logicals
+
+    // the first k of each group
+    int *ans = (int *)R_alloc(MAX(ncand,1), sizeof(int)), nans = 0, lastg = -1, cnt = 0;
+    for (int p=0; p<ncand; p++) {
+        int r = LENGTH(so) ? INTEGER(so)[p] : p+1;
+        if (r==0) continue;                 // removed by na.last=NA
+        int row = isNull(cand) ? r-1 : INTEGER(cand)[r-1]-1;
+        int g = ngby ? grpid[row] : 0;
+        if (g != lastg) { lastg = g; cnt = 0; }
+        if (cnt++ < k) ans[nans++] = row+1;
+    }
+    SEXP ansv = PROTECT(allocVector(INTSXP, nans)); protecti++;
+    if (nans) memcpy(INTEGER(ansv), ans, nans*sizeof(int));
+    UNPROTECT(protecti);
+    return ansv;
+}
+
 // TODO: implement 'order' argument to 'fsorted'
 // Not touching 'fsorted' for now for "decreasing order". Passing '1' as the value of 'order' argument (checks only ascending order as before).
 SEXP fsorted(SEXP x)
@@ -1338,19 +1917,26 @@ SEXP fsorted(SEXP x)
     // Just checks if ordered and returns FALSE early if not (and don't return ordering if so, unlike forder).
     int tmp,n;
     void *xd;
+    forderCtx thisctx, *ctx = &thisctx;
+    memset(ctx, 0, sizeof(forderCtx));
+    ctx->nalast = -1;
+    ctx->order = 1;                            // stackgrps FALSE so nothing is pushed
+    ctx->twiddle = INHERITS(x, char_integer64) ? &i64twiddle : &dtwiddle;
+    ctx->is_nan = INHERITS(x, char_integer64) ? &i64nan : &dnan;
     n = length(x);
     if (n <= 1) return(ScalarLogical(TRUE));
     if (!isVectorAtomic(x)) Error("is.sorted (R level) and fsorted (C level) only to be used on vectors. If needed on a list/data.table, you'll need the order anyway if not sorted, so use if (length(o<-forder(...))) for efficiency in one step, or equivalent at C level");
     xd = DATAPTR(x);
-    stackgrps = FALSE;
-    order = 1;
+    sortWorker w;
+    memset(&w, 0, sizeof(sortWorker));
+    w.ctx = ctx;
     switch(TYPEOF(x)) {
     case INTSXP : case LGLSXP :
-        tmp = isorted(xd, n); break;
+        tmp = isorted(&w, xd, n); break;
     case REALSXP :
-        tmp = dsorted(xd, n); break;
+        tmp = dsorted(&w, xd, n); break;
     case STRSXP :
-        tmp = csorted(xd, n); break;
+        tmp = csorted(&w, xd, n); break;
     default :
         Error("type '%s' is not yet supported", type2char(TYPEOF(x)));
     }
@@ -1448,6 +2034,7 @@ SEXP binary(SEXP x)
 {
     char buffer[69];
     int j;
+    dpun u;
     if (!isReal(x)) error("x must be type 'double'");
     SEXP ans = PROTECT(allocVector(STRSXP, LENGTH(x)));
     for (int i=0; i<LENGTH(x); i++) {
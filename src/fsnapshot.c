@@ -0,0 +1,337 @@
+#include "data.table.h"
+#include <errno.h>
+#include <fcntl.h>
+#ifdef WIN32
+  #include <windows.h>
+  #include <sys/types.h>
+  #include <sys/stat.h>  // _S_IWRITE
+  #include <io.h>
+  #define WRITE _write
+  #define CLOSE _close
+#else
+  #include <sys/mman.h>  // mmap
+  #include <sys/stat.h>  // fstat for filesize
+  #include <unistd.h>    // close
+  #define WRITE write
+  #define CLOSE close
+#endif
+
+/*
+  Binary columnar snapshot of a data.table, for fast round trips between pipeline stages.
+  All sections are 8 byte aligned so the reader can copy straight out of the mapped file.
+
+    char     magic[8]       "DTSNAP01"
+    uint32   version        SNAP_VERSION; also detects a file written on the other endianness
+    uint32   ncol
+    int64    nrow
+    int64    metaBytes      length of the R-serialized attributes blob (names, class, key, indices and
+                            per-column attributes such as factor levels). Built and applied at R level.
+    char     meta[metaBytes], padded to 8
+    ncol column blocks, each:
+      int32  type           SEXPTYPE: LGLSXP, INTSXP, REALSXP, CPLXSXP or STRSXP
+      int32  codec          0 = stored raw. Reserved for per-block compression.
+      int64  nbytes         length of payload following, before padding
+      char   payload[nbytes], padded to 8
+        numeric : the column's data as in memory
+        STRSXP  : int32 len[nrow] (-1 for NA) padded to 8, then the UTF-8 bytes of all strings end to end
+*/
+
+#define SNAP_MAGIC   "DTSNAP01"
+#define SNAP_VERSION 1
+#define PAD8(n)      (((n)+7) & ~(int64_t)7)
+#define COPY_CHUNK   (1<<20)  // bytes per parallel memcpy task on load
+
+static const char zeros[8] = {0};
+
+static int typeBytes(int type)
+{
+  switch(type) {
+  case LGLSXP: case INTSXP: return sizeof(int);
+  case REALSXP: return sizeof(double);
+  case CPLXSXP: return sizeof(Rcomplex);
+  }
+  return 0;
+}
+
+static void closeFile(SEXP fp)
+{
+  // fsave's file is held by an external pointer, as fload's mapping is, so that it's closed by the finalizer if R
+  // errors part way through (e.g. translateCharUTF8 on a "bytes" string, or out of memory) as well as on our own errors
+  int *f = (int *)R_ExternalPtrAddr(fp);
+  if (!f) return;
+  CLOSE(*f);
+  R_ClearExternalPtr(fp);
+}
+
+static void writeAll(SEXP fp, const void *buf, int64_t n, const char *filename)
+{
+  // write() can return short and on some platforms takes unsigned int size, so loop in chunks
+  const int f = *(int *)R_ExternalPtrAddr(fp);
+  const char *ch = (const char *)buf;
+  while (n>0) {
+    int thisn = n > (1<<30) ? (1<<30) : (int)n;
+    int ret = WRITE(f, ch, thisn);
+    if (ret<=0) {
+      int errwrite = errno;
+      closeFile(fp);
+      error("%s: '%s'. Failed to write to file. Is there space on the disk?", strerror(errwrite), filename);
+    }
+    ch += ret;
+    n -= ret;
+  }
+}
+
+static void writePad(SEXP fp, int64_t n, const char *filename)
+{
+  if (PAD8(n)>n) writeAll(fp, zeros, PAD8(n)-n, filename);
+}
+
+SEXP fsave(SEXP DT, SEXP metaArg, SEXP filenameArg, SEXP verboseArg)
+{
+  if (!isNewList(DT)) error("x must be a list");
+  if (TYPEOF(metaArg) != RAWSXP) error("Internal error: meta is not type raw");
+  if (!isString(filenameArg) || LENGTH(filenameArg)!=1) error("file must be a single character string");
+  if (!isLogical(verboseArg) || LENGTH(verboseArg)!=1 || LOGICAL(verboseArg)[0]==NA_LOGICAL) error("verbose must be TRUE or FALSE");
+  Rboolean verbose = LOGICAL(verboseArg)[0];
+  const char *filename = CHAR(STRING_ELT(filenameArg, 0));
+  int ncol = length(DT);
+  int64_t nrow = ncol ? length(VECTOR_ELT(DT, 0)) : 0;
+  for (int j=0; j<ncol; j++) {
+    SEXP thisCol = VECTOR_ELT(DT, j);
+    switch(TYPEOF(thisCol)) {
+    case LGLSXP: case INTSXP: case REALSXP: case CPLXSXP: case STRSXP: break;
+    default:
+      error("Column %d is type '%s' which fsave does not support. Supported types are logical, integer, double, complex and character. Use saveRDS for list columns.", j+1, type2char(TYPEOF(thisCol)));
+    }
+    if (length(thisCol) != nrow) error("Column %d is length %d but column 1 is length %lld", j+1, length(thisCol), (long long)nrow);
+  }
+  double tt = wallclock();
+
+  SEXP fd = PROTECT(ScalarInteger(-1));
+  SEXP fp = PROTECT(R_MakeExternalPtr(NULL, fd, R_NilValue));  // before the file is opened, so nothing leaks if this fails
+  R_RegisterCFinalizerEx(fp, closeFile, TRUE);
+#ifdef WIN32
+  INTEGER(fd)[0] = _open(filename, _O_WRONLY | _O_BINARY | _O_CREAT | _O_TRUNC, _S_IWRITE);
+#else
+  INTEGER(fd)[0] = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+  if (INTEGER(fd)[0] == -1) error("%s: '%s'. Unable to open file for writing.", strerror(errno), filename);
+  R_SetExternalPtrAddr(fp, INTEGER(fd));
+
+  writeAll(fp, SNAP_MAGIC, 8, filename);
+  uint32_t hdr[2] = { SNAP_VERSION, (uint32_t)ncol };
+  writeAll(fp, hdr, sizeof(hdr), filename);
+  int64_t metaBytes = LENGTH(metaArg);
+  int64_t hdr2[2] = { nrow, metaBytes };
+  writeAll(fp, hdr2, sizeof(hdr2), filename);
+  writeAll(fp, RAW(metaArg), metaBytes, filename);
+  writePad(fp, metaBytes, filename);
+
+  for (int j=0; j<ncol; j++) {
+    SEXP thisCol = VECTOR_ELT(DT, j);
+    int32_t blk[2] = { TYPEOF(thisCol), 0 };
+    if (TYPEOF(thisCol) != STRSXP) {
+      int64_t nbytes = nrow * typeBytes(TYPEOF(thisCol));
+      writeAll(fp, blk, sizeof(blk), filename);
+      writeAll(fp, &nbytes, sizeof(nbytes), filename);
+      writeAll(fp, DATAPTR(thisCol), nbytes, filename);
+      writePad(fp, nbytes, filename);
+      continue;
+    }
+    // Character column. translateCharUTF8 allocates via R_alloc so this loop stays single-threaded.
+    // Working memory is R_alloc'd too so an error from writeAll(), which closes the file, leaks nothing.
+    const void *vmax = vmaxget();
+    int32_t *lens = (int32_t *)R_alloc(nrow+1, sizeof(int32_t));
+    const char **strs = (const char **)R_alloc(nrow+1, sizeof(char *));
+    int64_t strBytes = 0;
+    for (int64_t i=0; i<nrow; i++) {
+      SEXP s = STRING_ELT(thisCol, i);
+      if (s==NA_STRING) { lens[i]=-1; strs[i]=NULL; continue; }
+      strs[i] = IS_ASCII(s) ? CHAR(s) : translateCharUTF8(s);
+      lens[i] = (int32_t)strlen(strs[i]);
+      strBytes += lens[i];
+    }
+    int64_t nbytes = PAD8(nrow*(int64_t)sizeof(int32_t)) + strBytes;
+    writeAll(fp, blk, sizeof(blk), filename);
+    writeAll(fp, &nbytes, sizeof(nbytes), filename);
+    writeAll(fp, lens, nrow*sizeof(int32_t), filename);
+    writePad(fp, nrow*sizeof(int32_t), filename);
+    // Gather into a buffer rather than one write() per string
+    char *buff = R_alloc(COPY_CHUNK, 1);
+    int64_t used = 0;
+    for (int64_t i=0; i<nrow; i++) {
+      if (lens[i]<=0) continue;
+      if (used+lens[i] > COPY_CHUNK) { writeAll(fp, buff, used, filename); used=0; }
+      if (lens[i] > COPY_CHUNK) { writeAll(fp, strs[i], lens[i], filename); continue; }
+      memcpy(buff+used, strs[i], lens[i]);
+      used += lens[i];
+    }
+    writeAll(fp, buff, used, filename);
+    writePad(fp, nbytes, filename);
+    vmaxset(vmax);
+  }
+  R_ClearExternalPtr(fp);
+  if (CLOSE(INTEGER(fd)[0])) error("%s: '%s'. Failed to close file.", strerror(errno), filename);
+  if (verbose) Rprintf("fsave wrote %d columns and %lld rows in %.3fs\n", ncol, (long long)nrow, wallclock()-tt);
+  UNPROTECT(2);
+  return R_NilValue;
+}
+
+static void unmap(SEXP mapPtr)
+{
+  // The mapping is held by an external pointer so that it's unmapped by its finalizer if R errors part way
+  // through fload (e.g. out of memory in allocVector or mkCharLenCE), as well as here on every path of ours
+  void *mmp = R_ExternalPtrAddr(mapPtr);
+  if (!mmp) return;
+#ifdef WIN32
+  UnmapViewOfFile(mmp);
+#else
+  munmap(mmp, (size_t)REAL(R_ExternalPtrTag(mapPtr))[0]);
+#endif
+  R_ClearExternalPtr(mapPtr);
+}
+
+SEXP fload(SEXP filenameArg, SEXP nThreadArg, SEXP verboseArg)
+{
+  if (!isString(filenameArg) || LENGTH(filenameArg)!=1) error("file must be a single character string");
+  if (!isInteger(nThreadArg) || LENGTH(nThreadArg)!=1 || INTEGER(nThreadArg)[0]<1) error("nThread must be a single positive integer");
+  if (!isLogical(verboseArg) || LENGTH(verboseArg)!=1 || LOGICAL(verboseArg)[0]==NA_LOGICAL) error("verbose must be TRUE or FALSE");
+  Rboolean verbose = LOGICAL(verboseArg)[0];
+  const char *filename = CHAR(STRING_ELT(filenameArg, 0));
+  int nth = MIN(INTEGER(nThreadArg)[0], getDTthreads());
+  double tt = wallclock();
+
+  size_t fileSize;
+  void *mmp;
+  SEXP mapSize = PROTECT(ScalarReal(0));
+  SEXP mapPtr = PROTECT(R_MakeExternalPtr(NULL, mapSize, R_NilValue));  // before the file is opened, so nothing leaks if this fails
+  R_RegisterCFinalizerEx(mapPtr, unmap, TRUE);
+#ifndef WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd==-1) error("File not found: %s", filename);
+  struct stat stat_buf;
+  if (fstat(fd,&stat_buf) == -1) { close(fd); error("Opened file ok but couldn't obtain file size: %s", filename); }
+  fileSize = (size_t)stat_buf.st_size;
+  if (fileSize < 32) { close(fd); error("File is too small to be an fsave snapshot: %s", filename); }
+  mmp = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mmp == MAP_FAILED) error("Opened file ok but couldn't memory map it: %s", filename);
+#else
+  HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (hFile==INVALID_HANDLE_VALUE) error("Unable to open file (error %d): %s", GetLastError(), filename);
+  LARGE_INTEGER liFileSize;
+  if (GetFileSizeEx(hFile,&liFileSize)==0) { CloseHandle(hFile); error("GetFileSizeEx failed on file: %s", filename); }
+  fileSize = (size_t)liFileSize.QuadPart;
+  if (fileSize < 32) { CloseHandle(hFile); error("File is too small to be an fsave snapshot: %s", filename); }
+  HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hMap==NULL) { CloseHandle(hFile); error("CreateFileMapping returned error %d for file %s", GetLastError(), filename); }
+  mmp = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, fileSize);
+  CloseHandle(hMap);
+  CloseHandle(hFile);
+  if (mmp == NULL) error("Opened file ok but couldn't memory map it: %s", filename);
+#endif
+  REAL(mapSize)[0] = (double)fileSize;
+  R_SetExternalPtrAddr(mapPtr, mmp);
+  const char *sof = (const char *)mmp, *eof = sof + fileSize;
+
+  #define STOP(...) do { unmap(mapPtr); error(__VA_ARGS__); } while(0)
+  if (memcmp(sof, SNAP_MAGIC, 8)) STOP("File is not an fsave snapshot (magic number not found): %s", filename);
+  uint32_t version, ncol;
+  int64_t nrow, metaBytes;
+  memcpy(&version, sof+8, 4);
+  memcpy(&ncol, sof+12, 4);
+  memcpy(&nrow, sof+16, 8);
+  memcpy(&metaBytes, sof+24, 8);
+  if (version != SNAP_VERSION) {
+    if (version == 0x01000000) STOP("File was written on a machine with different endianness: %s", filename);
+    STOP("File is snapshot version %u but this version of data.table reads version %d: %s", version, SNAP_VERSION, filename);
+  }
+  if (nrow<0 || nrow>INT_MAX) STOP("nrow %lld in file header is out of range: %s", (long long)nrow, filename);
+  if (metaBytes<0 || metaBytes > eof-sof-32) STOP("File is truncated or corrupt (meta section): %s", filename);
+
+  // First pass validates block boundaries so no allocations happen before we know the file is sound
+  const char *ch = sof + 32 + PAD8(metaBytes);
+  const char **blocks = (const char **)R_alloc(ncol+1, sizeof(char *));
+  for (int j=0; j<ncol; j++) {
+    if (eof-ch < 16) STOP("File is truncated or corrupt (header of column %d): %s", j+1, filename);
+    int32_t blk[2]; int64_t nbytes;
+    memcpy(blk, ch, 8);
+    memcpy(&nbytes, ch+8, 8);
+    if (blk[1] != 0) STOP("Column %d uses codec %d which this version of data.table does not support: %s", j+1, blk[1], filename);
+    if (blk[0]!=STRSXP && !typeBytes(blk[0])) STOP("Column %d has unsupported type %d: %s", j+1, blk[0], filename);
+    int64_t expect = blk[0]==STRSXP ? PAD8(nrow*(int64_t)sizeof(int32_t)) : nrow*typeBytes(blk[0]);
+    if (blk[0]==STRSXP ? nbytes<expect : nbytes!=expect) STOP("Column %d is %lld bytes but %lld were expected: %s", j+1, (long long)nbytes, (long long)expect, filename);
+    if (nbytes > eof-ch-16) STOP("File is truncated or corrupt (column %d): %s", j+1, filename);
+    if (blk[0]==STRSXP) {
+      // the string lengths must add up within the block, so copying the strings below can't fail on a corrupt file
+      const int32_t *lens = (const int32_t *)(ch+16);
+      int64_t strBytes = nbytes - expect;
+      for (int64_t i=0; i<nrow; i++) {
+        if (lens[i]==-1) continue;
+        if (lens[i]<0 || lens[i]>strBytes) STOP("File is corrupt (string %lld of column %d): %s", (long long)i+1, j+1, filename);
+        strBytes -= lens[i];
+      }
+    }
+    blocks[j] = ch;
+    ch += 16 + PAD8(nbytes);
+  }
+  if (verbose) Rprintf("Mapped %.3fGB file; %u columns and %lld rows. Validated in %.3fs\n", (double)fileSize/(1024*1024*1024), ncol, (long long)nrow, wallclock()-tt);
+
+  SEXP ans = PROTECT(allocVector(VECSXP, ncol));
+  SEXP meta = PROTECT(allocVector(RAWSXP, metaBytes));
+  memcpy(RAW(meta), sof+32, metaBytes);
+  for (int j=0; j<ncol; j++) {
+    int32_t type;
+    memcpy(&type, blocks[j], 4);
+    SET_VECTOR_ELT(ans, j, allocVector(type, nrow));
+  }
+
+  // Numeric columns: one flat list of fixed-size copy tasks across all columns so threads balance
+  // whether the table is wide or long. The R vectors must own their memory so this is a copy, but a
+  // parallel one straight out of the page cache.
+  char **dst = (char **)R_alloc(ncol+1, sizeof(char *));
+  int64_t *taskEnd = (int64_t *)R_alloc(ncol+1, sizeof(int64_t));  // cumulative task count to end of column j
+  int64_t ntask = 0;
+  for (int j=0; j<ncol; j++) {
+    SEXP thisCol = VECTOR_ELT(ans, j);
+    dst[j] = TYPEOF(thisCol)==STRSXP ? NULL : (char *)DATAPTR(thisCol);
+    if (dst[j]) ntask += (nrow*typeBytes(TYPEOF(thisCol)) + COPY_CHUNK-1) / COPY_CHUNK;
+    taskEnd[j] = ntask;
+  }
+  #pragma omp parallel num_threads(nth)
+  {
+    int j=0;  // each thread's tasks are increasing so it only ever walks j forwards
+    #pragma omp for schedule(dynamic)
+    for (int64_t t=0; t<ntask; t++) {
+      while (t >= taskEnd[j]) j++;
+      int64_t from = (t - (j ? taskEnd[j-1] : 0)) * COPY_CHUNK;
+      int64_t nbytes;
+      memcpy(&nbytes, blocks[j]+8, 8);
+      memcpy(dst[j]+from, blocks[j]+16+from, MIN(COPY_CHUNK, nbytes-from));
+    }
+  }
+  if (verbose) Rprintf("Copied numeric columns using %d threads in %.3fs\n", nth, wallclock()-tt);
+
+  // Character columns: mkChar uses R's global CHARSXP cache so is single-threaded
+  for (int j=0; j<ncol; j++) {
+    SEXP thisCol = VECTOR_ELT(ans, j);
+    if (TYPEOF(thisCol)!=STRSXP) continue;
+    const int32_t *lens = (const int32_t *)(blocks[j]+16);
+    int64_t nbytes;
+    memcpy(&nbytes, blocks[j]+8, 8);
+    const char *str = blocks[j]+16+PAD8(nrow*(int64_t)sizeof(int32_t));
+    for (int64_t i=0; i<nrow; i++) {
+      if (lens[i]==-1) { SET_STRING_ELT(thisCol, i, NA_STRING); continue; }
+      SET_STRING_ELT(thisCol, i, mkCharLenCE(str, lens[i], CE_UTF8));
+      str += lens[i];
+    }
+  }
+  #undef STOP
+  unmap(mapPtr);
+  if (verbose) Rprintf("fload finished in %.3fs\n", wallclock()-tt);
+  SEXP res = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(res, 0, ans);
+  SET_VECTOR_ELT(res, 1, meta);
+  UNPROTECT(5);
+  return res;
+}
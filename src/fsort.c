@@ -2,10 +2,87 @@
 
 #define INSERT_THRESH 200  // TODO: expose via api and test
 
-static void dinsert(double *x, int n) {   // TODO: if and when twiddled, double => ull
+// fsort sorts the values of x (not an ordering). Every supported type is twiddled on the fly to an unsigned 64 bit key whose
+// unsigned order is the requested order (ascending or decreasing), the keys are radix sorted in parallel, and finally untwiddled
+// back to the type of x in a parallel sweep. NAs (and NaN for double) are never given a key; they are counted and placed as one
+// block first or last, or dropped. Types:
+//   double     IEEE bits with the sign bit flipped for positives and all bits flipped for negatives, so -0.0 sorts just before 0.0
+//   integer64  the int64 with its sign bit flipped
+//   integer    the int with its sign bit flipped (logical too)
+//   character  the rank of the string amongst the sorted unique strings (stored in TRUELENGTH as forder does)
+enum {T_DOUBLE, T_INT64, T_INT, T_STRING};
+
+typedef struct {
+  int type;
+  const void *x;         // DATAPTR(x)
+  Rboolean decreasing;
+  unsigned long long nu; // T_STRING only: number of unique non-NA strings
+  SEXP *ustr;            // T_STRING only: the nu unique strings in ascending order
+} fsortSpec;
+
+static inline Rboolean getkey(const fsortSpec *s, R_xlen_t i, unsigned long long *k)
+// twiddle the i-th item to its key; FALSE for NA
+{
+  unsigned long long b;
+  switch(s->type) {
+  case T_DOUBLE: {
+    double d = ((const double *)s->x)[i];
+    if (ISNAN(d)) return FALSE;
+    memcpy(&b, &d, 8);
+    b = (b & 0x8000000000000000ULL) ? ~b : b ^ 0x8000000000000000ULL;
+    *k = s->decreasing ? ~b : b;
+    } return TRUE;
+  case T_INT64:
+    memcpy(&b, (const double *)s->x + i, 8);
+    if (b == 0x8000000000000000ULL) return FALSE;  // NA_integer64 is INT64_MIN
+    b ^= 0x8000000000000000ULL;
+    *k = s->decreasing ? ~b : b;
+    return TRUE;
+  case T_INT: {
+    int v = ((const int *)s->x)[i];
+    if (v == NA_INTEGER) return FALSE;
+    b = (unsigned int)v ^ 0x80000000U;
+    *k = s->decreasing ? 0xFFFFFFFFULL - b : b;
+    } return TRUE;
+  default: {
+    SEXP c = ((const SEXP *)s->x)[i];
+    if (c == NA_STRING) return FALSE;
+    b = -TRUELENGTH(c)-1;
+    *k = s->decreasing ? s->nu-1-b : b;
+    } return TRUE;
+  }
+}
+
+static inline void putval(const fsortSpec *s, void *out, R_xlen_t j, unsigned long long k)
+// untwiddle key k to out[j]; out may be where k was read from (8 byte types)
+{
+  switch(s->type) {
+  case T_DOUBLE:
+    if (s->decreasing) k = ~k;
+    k = (k & 0x8000000000000000ULL) ? k ^ 0x8000000000000000ULL : ~k;
+    memcpy((double *)out + j, &k, 8);
+    break;
+  case T_INT64:
+    if (s->decreasing) k = ~k;
+    k ^= 0x8000000000000000ULL;
+    memcpy((double *)out + j, &k, 8);
+    break;
+  case T_INT:
+    if (s->decreasing) k = 0xFFFFFFFFULL - k;
+    ((int *)out)[j] = (int)((unsigned int)k ^ 0x80000000U);
+    break;
+  default:
+    if (s->decreasing) k = s->nu-1-k;
+    ((SEXP *)out)[j] = s->ustr[k];
+    // Direct write of the CHARSXP pointer rather than SET_STRING_ELT in this parallel region, as in reorder.c. Each of these
+    // strings is already held by x so there is no age or reference count to bump, and ans is new or x itself.
+  }
+}
+
+static void ullinsert(unsigned long long *x, int n) {
   if (n<2) return;
   for (int i=1; i<n; i++) {
-    double xtmp = x[i];
+    unsigned long long xtmp = x[i];
     int j = i-1;
     if (xtmp<x[j]) {
       x[j+1] = x[j];
@@ -16,34 +93,29 @@ static void dinsert(double *x, int n) {   // TODO: if and when twiddled, double
   }
 }
 
-static union {
-  double d;
-  unsigned long long ull;
-} u;
-static unsigned long long minULL;
-
 static void dradix_r(  // single-threaded recursive worker
-  double *in,          // n doubles to be sorted
-  double *working,     // working memory to put the sorted items before copying over *in; must not overlap *in
+  unsigned long long *in,      // n keys to be sorted
+  unsigned long long *working, // working memory to put the sorted items before copying over *in; must not overlap *in
   R_xlen_t n,          // number of items to sort.  *in and *working must be at least n long
-  int fromBit,         // After twiddle to ordered ull, the bits [fromBit,toBit] are used to count  
+  int fromBit,         // The bits [fromBit,toBit] of key-minULL are used to count
   int toBit,           //   fromBit<toBit; bit 0 is the least significant; fromBit is right shift amount too
-  R_xlen_t *counts     // already zero'd counts vector, 2^(toBit-fromBit+1) long. A stack of these is reused.
+  R_xlen_t *counts,    // already zero'd counts vector, 2^(toBit-fromBit+1) long. A stack of these is reused.
+  unsigned long long minULL  // the smallest key overall
 ) {
   unsigned long long width = 1ULL<<(toBit-fromBit+1);
   unsigned long long mask = width-1;
-  
-  const double *tmp=in;
+
+  const unsigned long long *tmp=in;
   for (R_xlen_t i=0; i<n; i++) {
-    counts[(*(unsigned long long *)tmp - minULL) >> fromBit & mask]++;
+    counts[(*tmp - minULL) >> fromBit & mask]++;
     tmp++;
   }
-  int last = (*(unsigned long long *)--tmp - minULL) >> fromBit & mask;
+  int last = (*--tmp - minULL) >> fromBit & mask;
   if (counts[last] == n) {
     // Single value for these bits here. All counted in one bucket which must be the bucket for the last item.
-    counts[last] = 0;  // clear ready for reuse. All other counts must be zero already so save time by not setting to 0. 
-    if (fromBit > 0)   // move on to next bits (if any remain) to resolve 
-      dradix_r(in, working, n, fromBit<8 ? 0 : fromBit-8, toBit-8, counts+256);
+    counts[last] = 0;  // clear ready for reuse. All other counts must be zero already so save time by not setting to 0.
+    if (fromBit > 0)   // move on to next bits (if any remain) to resolve
+      dradix_r(in, working, n, fromBit<8 ? 0 : fromBit-8, toBit-8, counts+256, minULL);
     return;
   }
 
@@ -55,16 +127,16 @@ static void dradix_r(  // single-threaded recursive worker
       cumSum += tmp;
     }
   } // leaves cumSum==n && 0<i && i<=width
-  
+
   tmp=in;
   for (R_xlen_t i=0; i<n; i++) {  // go forwards not backwards to give cpu pipeline better chance
-    int thisx = (*(unsigned long long *)tmp - minULL) >> fromBit & mask;
+    int thisx = (*tmp - minULL) >> fromBit & mask;
     working[ counts[thisx]++ ] = *tmp;
     tmp++;
   }
-  
-  memcpy(in, working, n*sizeof(double));
-  
+
+  memcpy(in, working, n*sizeof(unsigned long long));
+
   if (fromBit==0) {
     // nothing left to do other than reset the counts to 0, ready for next recursion
     // the final bucket must contain n and it might be close to the start. After that must be all 0 so no need to reset.
@@ -74,16 +146,16 @@ static void dradix_r(  // single-threaded recursive worker
     for (int i=0; counts[i]<n; i++) counts[i]=0;
     return;
   }
-  
+
   cumSum=0;
   for (int i=0; cumSum<n; i++) {   // again, cumSum<n better than i<width as it can return early
     if (counts[i] == 0) continue;
     R_xlen_t thisN = counts[i] - cumSum;  // undo cummulate; i.e. diff
     if (thisN <= INSERT_THRESH) {
-      dinsert(in+cumSum, thisN);  // for thisN==1 this'll return instantly. Probably better than several branches here.
+      ullinsert(in+cumSum, thisN);  // for thisN==1 this'll return instantly. Probably better than several branches here.
     } else {
-      dradix_r(in+cumSum, working, thisN, fromBit<=8 ? 0 : fromBit-8, toBit-8, counts+256);
-    }  
+      dradix_r(in+cumSum, working, thisN, fromBit<=8 ? 0 : fromBit-8, toBit-8, counts+256, minULL);
+    }
     cumSum = counts[i];
     counts[i] = 0; // reset to 0 to save wasteful memset afterwards
   }
@@ -98,95 +170,191 @@ int qsort_cmp(const void *a, const void *b) {
   R_xlen_t y = qsort_data[*(int *)b];
   // return x-y;  would like this, but this is long and the cast to int return may not preserve sign
   // We have long vectors in mind (1e10(74GB), 1e11(740GB)) where extreme skew may feasibly mean the largest count
-  // is greater than 2^32. The first split is (currently) 16 bits so should be very rare but to be safe keep 64bit counts.    
+  // is greater than 2^32. The first split is (currently) 16 bits so should be very rare but to be safe keep 64bit counts.
   return (x<y)-(x>y);   // largest first in a safe branchless way casting long to int
 }
 
-SEXP fsort(SEXP x, SEXP verboseArg) {
+static int ustr_cmp(const void *a, const void *b) {
+  return StrCmp(*(SEXP *)a, *(SEXP *)b);
+}
+
+static void ustr_end(SEXP *ustr, R_xlen_t nu) {
+  // restore truelengths of the unique strings: 0 (R's default) then any of R's own usage that savetl saved
+  for (R_xlen_t i=0; i<nu; i++) SET_TRUELENGTH(ustr[i], 0);
+  free(ustr);
+  savetl_end();
+}
+
+SEXP fsort(SEXP x, SEXP decreasingArg, SEXP naArg, SEXP inplaceArg, SEXP verboseArg) {
   double t[10];
   t[0] = wallclock();
   if (!isLogical(verboseArg) || LENGTH(verboseArg)!=1 || LOGICAL(verboseArg)[0]==NA_LOGICAL)
     error("verbose must be TRUE or FALSE");
   Rboolean verbose = LOGICAL(verboseArg)[0];
-  if (!isNumeric(x)) error("x must be a vector of type 'double' currently");
-  // TODO: not only detect if already sorted, but if it is, just return x to save the duplicate
-  
-  SEXP ansVec = PROTECT(allocVector(REALSXP, xlength(x)));
-  double *ans = REAL(ansVec);
-  // allocate early in case fails if not enough RAM
-  // TODO: document this is much cheaper than a copy followed by in-place.
-  
+  if (!isLogical(decreasingArg) || LENGTH(decreasingArg)!=1 || LOGICAL(decreasingArg)[0]==NA_LOGICAL)
+    error("decreasing must be TRUE or FALSE");
+  if (!isLogical(inplaceArg) || LENGTH(inplaceArg)!=1 || LOGICAL(inplaceArg)[0]==NA_LOGICAL)
+    error("inplace must be TRUE or FALSE");
+  Rboolean inplace = LOGICAL(inplaceArg)[0];
+  if (!isLogical(naArg) || LENGTH(naArg)!=1) error("na.last must be TRUE, FALSE or NA");
+  int nalast = (LOGICAL(naArg)[0] == NA_LOGICAL) ? 0 : (LOGICAL(naArg)[0] == TRUE) ? 1 : -1; // 1=TRUE, -1=FALSE, 0=NA
+  if (inplace && nalast==0) error("na.last=NA removes NAs so can't be done in place");
+
+  fsortSpec s;
+  switch(TYPEOF(x)) {
+  case REALSXP : s.type = INHERITS(x, char_integer64) ? T_INT64 : T_DOUBLE; break;
+  case INTSXP : case LGLSXP : s.type = T_INT; break;
+  case STRSXP : s.type = T_STRING; break;
+  default :
+    error("x must be a vector of type double, integer, logical or character; not '%s'", type2char(TYPEOF(x)));
+  }
+  s.decreasing = LOGICAL(decreasingArg)[0];
+  s.nu = 0;
+  s.ustr = NULL;
+  const R_xlen_t n = xlength(x);
+  if (n==0) return(x);
+  s.x = DATAPTR(x);
+
+  if (s.type == T_STRING) {
+    // find the unique strings and their ranks, as forder's csort_pre but with one sequential pass and qsort of the uniques
+    savetl_init();
+    R_xlen_t ualloc = 0;
+    const SEXP *xd = (const SEXP *)s.x;
+    for (R_xlen_t i=0; i<n; i++) {
+      SEXP c = xd[i];
+      if (c==NA_STRING || TRUELENGTH(c)<0) continue;
+      if (TRUELENGTH(c)>0) { savetl(c); SET_TRUELENGTH(c,0); }
+      if (s.nu == ualloc) {
+        ualloc = ualloc==0 ? 10000 : ualloc*2;
+        if (ualloc > n) ualloc = n;
+        SEXP *tt = realloc(s.ustr, ualloc*sizeof(SEXP));
+        if (tt==NULL) { ustr_end(s.ustr, s.nu); error("Failed to realloc ustr. Requested %lld * %d bytes", (long long)ualloc, sizeof(SEXP)); }
+        s.ustr = tt;
+      }
+      SET_TRUELENGTH(c, -1);
+      s.ustr[s.nu++] = c;
+    }
+    qsort(s.ustr, s.nu, sizeof(SEXP), ustr_cmp);
+    for (R_xlen_t i=0; i<s.nu; i++) SET_TRUELENGTH(s.ustr[i], -i-1);
+  }
+
   int nth = getDTthreads();
   int nBatch=nth*2;  // at least nth; more to reduce last-man-home; but not too large to keep counts small in cache
   if (verbose) Rprintf("nth=%d, nBatch=%d\n",nth,nBatch);
-  
-  R_xlen_t batchSize = (xlength(x)-1)/nBatch + 1;
+
+  R_xlen_t batchSize = (n-1)/nBatch + 1;
   if (batchSize < 1024) batchSize = 1024; // simple attempt to work reasonably for short vector. 1024*8 = 2 4kb pages
-  nBatch = (xlength(x)-1)/batchSize + 1;
-  R_xlen_t lastBatchSize = xlength(x) - (nBatch-1)*batchSize;
-  // could be that lastBatchSize == batchSize when i) xlength(x) is multiple of nBatch
-  // and ii) for small vectors with just one batch 
-  
+  nBatch = (n-1)/batchSize + 1;
+  R_xlen_t lastBatchSize = n - (nBatch-1)*batchSize;
+  // could be that lastBatchSize == batchSize when i) n is multiple of nBatch
+  // and ii) for small vectors with just one batch
+
   t[1] = wallclock();
-  double mins[nBatch], maxs[nBatch];
+  // One parallel sweep finds the range of the keys, counts the NAs, and detects whether x is already sorted (including
+  // where its NAs are) in which case x is returned as is, saving the allocation and the sort.
+  unsigned long long mins[nBatch], maxs[nBatch], firsts[nBatch], lasts[nBatch];
+  R_xlen_t nas[nBatch];
+  Rboolean anys[nBatch], sorteds[nBatch], naAfterKey[nBatch], keyAfterNA[nBatch];
   #pragma omp parallel for schedule(dynamic) num_threads(nth)
   for (int batch=0; batch<nBatch; batch++) {
-    R_xlen_t thisLen = (batch==nBatch-1) ? lastBatchSize : batchSize;
-    double *d = &REAL(x)[batchSize * batch];
-    double myMin=*d, myMax=*d;
-    d++;
-    for (R_xlen_t j=1; j<thisLen; j++) {
-      // TODO: test for sortedness here as well.
-      if (*d<myMin) myMin=*d;
-      else if (*d>myMax) myMax=*d;
-      d++;
+    R_xlen_t from = batchSize * batch, to = from + ((batch==nBatch-1) ? lastBatchSize : batchSize);
+    unsigned long long myMin=ULLONG_MAX, myMax=0, myFirst=0, myLast=0, k;
+    R_xlen_t myNA=0;
+    Rboolean any=FALSE, sorted=TRUE, nak=FALSE, kna=FALSE;
+    for (R_xlen_t j=from; j<to; j++) {
+      if (!getkey(&s, j, &k)) { myNA++; nak |= any; continue; }
+      kna |= myNA>0;
+      if (!any) { myFirst = k; any = TRUE; }
+      else if (k<myLast) sorted = FALSE;
+      myLast = k;
+      if (k<myMin) myMin=k;
+      if (k>myMax) myMax=k;
     }
-    mins[batch] = myMin;
-    maxs[batch] = myMax;
+    mins[batch] = myMin;  maxs[batch] = myMax;
+    firsts[batch] = myFirst;  lasts[batch] = myLast;
+    nas[batch] = myNA;  anys[batch] = any;  sorteds[batch] = sorted;
+    naAfterKey[batch] = nak;  keyAfterNA[batch] = kna;
   }
   t[2] = wallclock();
-  double min=mins[0], max=maxs[0];
-  for (int i=1; i<nBatch; i++) {
-    // TODO: if boundaries are sorted then we only need sort the unsorted batches known above
-    if (mins[i]<min) min=mins[i];
-    if (maxs[i]>max) max=maxs[i];
+  unsigned long long minULL=ULLONG_MAX, maxULL=0, prev=0;
+  R_xlen_t nna=0;
+  Rboolean sorted=TRUE, seenKey=FALSE;
+  for (int i=0; i<nBatch; i++) {
+    if (anys[i]) {
+      if (!sorteds[i] || (seenKey && firsts[i]<prev)) sorted = FALSE;
+      prev = lasts[i];
+      if (mins[i]<minULL) minULL=mins[i];
+      if (maxs[i]>maxULL) maxULL=maxs[i];
+    }
+    if (nalast==-1 && nas[i] && (seenKey || naAfterKey[i])) sorted = FALSE;   // NA must all be first
+    if (nalast==1 && anys[i] && (nna || keyAfterNA[i])) sorted = FALSE;       // NA must all be last
+    if (nalast==0 && nas[i]) sorted = FALSE;                                  // NA must be removed
+    seenKey |= anys[i];
+    nna += nas[i];
   }
-  if (verbose) Rprintf("Range = [%g,%g]\n", min, max);
-  if (min < 0.0) error("Cannot yet handle negatives.");
-  // TODO: -0ULL should allow negatives
-  //       avoid twiddle function call as expensive in recent tests (0.34 vs 2.7)
-  //       possibly twiddle once to *ans, then untwiddle at the end in a fast parallel sweep
-  u.d = max;
-  unsigned long long maxULL = u.ull;
-  u.d = min;
-  minULL = u.ull;  // set static global for use by dradix_r
-  
-  int maxBit = floor(log(maxULL-minULL) / log(2));  // 0 is the least significant bit
+  if (sorted) {
+    if (s.type == T_STRING) ustr_end(s.ustr, s.nu);
+    if (verbose) Rprintf("x is already sorted (%lld NA); returning it as is\n", (long long)nna);
+    return(x);
+  }
+  const R_xlen_t m = n-nna;         // number of keys to sort
+  const R_xlen_t off = nalast==-1 ? nna : 0;  // where the sorted keys go in the result
+  if (verbose) Rprintf("Key range = [%llu,%llu], %lld NA\n", minULL, maxULL, (long long)nna);
+
+  // The result is allocated early in case it fails if not enough RAM. When sorting double or integer64 into a new vector,
+  // the keys are sorted directly in the result and untwiddled there; otherwise a separate key vector is needed.
+  SEXP ans = x;
+  if (!inplace) {
+    ans = PROTECT(allocVector(TYPEOF(x), nalast==0 ? m : n));
+    copyMostAttrib(x, ans);
+  }
+  void *out = DATAPTR(ans);
+  const Rboolean direct = !inplace && (s.type==T_DOUBLE || s.type==T_INT64);
+  unsigned long long *keys = direct ? (unsigned long long *)out + off : malloc(m*sizeof(unsigned long long));
+  double *naDouble = NULL;  // the NaN payloads (NA and NaN) in the order they appear, for double only
+  if (s.type == T_DOUBLE && nna) naDouble = malloc(nna*sizeof(double));
+  if ((m && keys==NULL) || (nna && s.type==T_DOUBLE && naDouble==NULL)) {
+    if (!direct) free(keys);
+    free(naDouble);
+    if (s.type == T_STRING) ustr_end(s.ustr, s.nu);
+    error("Unable to allocate working memory");
+  }
+  if (naDouble) {
+    const double *xd = (const double *)s.x;
+    for (R_xlen_t i=0, j=0; j<nna; i++) if (ISNAN(xd[i])) naDouble[j++] = xd[i];
+  }
+
+  int maxBit = -1;  // 0 is the least significant bit; -1 when all keys are equal (or there are none)
+  for (unsigned long long r = maxULL-minULL; m && r; r>>=1) maxBit++;
   int MSBNbits = maxBit > 15 ? 16 : maxBit+1;       // how many bits make up the MSB
   int shift = maxBit + 1 - MSBNbits;                // the right shift to leave the MSB bits remaining
   int MSBsize = 1<<MSBNbits;                        // the number of possible MSB values (16 bits => 65,536)
   if (verbose) Rprintf("maxBit=%d; MSBNbits=%d; shift=%d; MSBsize=%d\n", maxBit, MSBNbits, shift, MSBsize);
-  
+
   R_xlen_t *counts = calloc(nBatch*(size_t)MSBsize, sizeof(R_xlen_t));
-  if (counts==NULL) error("Unable to allocate working memory");
+  if (counts==NULL) {
+    if (!direct) free(keys);
+    free(naDouble);
+    if (s.type == T_STRING) ustr_end(s.ustr, s.nu);
+    error("Unable to allocate working memory");
+  }
   // provided MSBsize>=9, each batch is a multiple of at least one 4k page, so no page overlap
-  // TODO: change all calloc, malloc and free to Calloc and Free to be robust to error() and catch ooms. 
-  
+  // TODO: change all calloc, malloc and free to Calloc and Free to be robust to error() and catch ooms.
+
   if (verbose) Rprintf("counts is %dMB (%d pages per nBatch=%d, batchSize=%lld, lastBatchSize=%lld)\n",
                        nBatch*MSBsize*sizeof(R_xlen_t)/(1024*1024), nBatch*MSBsize*sizeof(R_xlen_t)/(4*1024*nBatch),
                        nBatch, batchSize, lastBatchSize);
   t[3] = wallclock();
   #pragma omp parallel for num_threads(nth)
   for (int batch=0; batch<nBatch; batch++) {
-    R_xlen_t thisLen = (batch==nBatch-1) ? lastBatchSize : batchSize;
-    double *tmp = &REAL(x)[batchSize * (size_t)batch];
+    R_xlen_t from = batchSize * batch, to = from + ((batch==nBatch-1) ? lastBatchSize : batchSize);
     R_xlen_t *thisCounts = counts + batch*(size_t)MSBsize;
-    for (R_xlen_t j=0; j<thisLen; j++) {
-      thisCounts[(*(unsigned long long *)tmp - minULL) >> shift]++;
-      tmp++;
+    unsigned long long k;
+    for (R_xlen_t j=from; j<to; j++) {
+      if (getkey(&s, j, &k)) thisCounts[(k - minULL) >> shift]++;
     }
   }
-  
+
   // cumulate columnwise; parallel histogram; small so no need to parallelize
   R_xlen_t rollSum=0;
   for (int msb=0; msb<MSBsize; msb++) {
@@ -198,33 +366,33 @@ SEXP fsort(SEXP x, SEXP verboseArg) {
       j += MSBsize;  // deliberately non-contiguous here
     }
   }  // leaves msb cumSum in the last batch i.e. last row of the matrix
-  
+
   t[4] = wallclock();
   #pragma omp parallel for num_threads(nth)
   for (int batch=0; batch<nBatch; batch++) {
-    R_xlen_t thisLen = (batch==nBatch-1) ? lastBatchSize : batchSize;
-    double *source = &REAL(x)[batchSize * batch];
-    R_xlen_t *thisCounts = counts + batch*MSBsize;
-    for (R_xlen_t j=0; j<thisLen; j++) {
-      ans[ thisCounts[(*(unsigned long long *)source - minULL) >> shift]++ ] = *source;
-      // This assignment to ans is not random access as it may seem, but cache efficient by
+    R_xlen_t from = batchSize * batch, to = from + ((batch==nBatch-1) ? lastBatchSize : batchSize);
+    R_xlen_t *thisCounts = counts + batch*(size_t)MSBsize;
+    unsigned long long k;
+    for (R_xlen_t j=from; j<to; j++) {
+      if (getkey(&s, j, &k)) keys[ thisCounts[(k - minULL) >> shift]++ ] = k;
+      // This assignment to keys is not random access as it may seem, but cache efficient by
       // design since target pages are written to contiguously. MSBsize * 4k < cache.
       // TODO: therefore 16 bit MSB seems too big for this step. Time this step and reduce 16 a lot.
       //       20MB cache / nth / 4k => MSBsize=160
-      source++;
     }
   }
   // Done with batches now. Will not use batch dimension again.
   t[5] = wallclock();
-  
-  if (shift > 0) { // otherwise, no more bits left to resolve ties and we're done  
+  t[6] = t[5];
+
+  if (shift > 0) { // otherwise, no more bits left to resolve ties and we're done
     int toBit = shift-1;
     int fromBit = toBit>7 ? toBit-7 : 0;
 
     // sort bins by size, largest first to minimise last-man-home
     R_xlen_t *msbCounts = counts + (nBatch-1)*(size_t)MSBsize;
     // msbCounts currently contains the ending position of each MSB (the starting location of the next) even across empty
-    if (msbCounts[MSBsize-1] != xlength(x)) error("Internal error: counts[nBatch-1][MSBsize-1] != length(x)");
+    if (msbCounts[MSBsize-1] != m) error("Internal error: counts[nBatch-1][MSBsize-1] != length(x)-NAs");
     R_xlen_t *msbFrom = malloc(MSBsize*sizeof(R_xlen_t));
     int *order = malloc(MSBsize*sizeof(int));
     R_xlen_t cumSum = 0;
@@ -238,37 +406,37 @@ SEXP fsort(SEXP x, SEXP verboseArg) {
     qsort(order, MSBsize, sizeof(int), qsort_cmp);  // find order of the sizes, largest first
     // Would have liked to define qsort_cmp() inside this function right here, but not sure that's fully portable.
     // TODO: time this qsort but likely insignificant.
-    
+
     if (verbose) {
-      Rprintf("Top 5 MSB counts: "); for(int i=0; i<5; i++) Rprintf("%lld ", msbCounts[order[i]]); Rprintf("\n");
+      Rprintf("Top 5 MSB counts: "); for(int i=0; i<5 && i<MSBsize; i++) Rprintf("%lld ", msbCounts[order[i]]); Rprintf("\n");
       Rprintf("Reduced MSBsize from %d to ", MSBsize);
     }
     while (MSBsize>0 && msbCounts[order[MSBsize-1]] < 2) MSBsize--;
     if (verbose) {
       Rprintf("%d by excluding 0 and 1 counts\n", MSBsize);
     }
-    
+
     t[6] = wallclock();
     #pragma omp parallel num_threads(getDTthreads())
     {
       R_xlen_t *counts = calloc((toBit/8 + 1)*256, sizeof(R_xlen_t));
       // each thread has its own (small) stack of counts
       // don't use VLAs here: perhaps too big for stack yes but more that VLAs apparently fail with schedule(dynamic)
-      
-      double *working=NULL;
+
+      unsigned long long *working=NULL;
       // the working memory (for the largest groups) is allocated the first time the thread is assigned to
       // an iteration.
-     
-      #pragma omp for schedule(dynamic,1)    
+
+      #pragma omp for schedule(dynamic,1)
       // All we assume here is that a thread can never be assigned to an earlier iteration; i.e. threads 0:(nth-1)
       // get iterations 0:(nth-1) possibly out of order, then first-come-first-served in order after that.
       // If a thread deals with an msb lower than the first one it dealt with, then its *working will be too small.
       for (int msb=0; msb<MSBsize; msb++) {
-      
+
         R_xlen_t from= msbFrom[order[msb]];
         R_xlen_t thisN = msbCounts[order[msb]];
-        
-        if (working==NULL) working = malloc(thisN * sizeof(double)); // TODO: check succeeded otherwise exit gracefully 
+
+        if (working==NULL) working = malloc(thisN * sizeof(unsigned long long)); // TODO: check succeeded otherwise exit gracefully
         // Depends on msbCounts being sorted largest first before this parallel loop
         // Could be significant RAM saving if the largest msb is
         // a lot larger than the 2nd largest msb, especially as nth grows to perhaps 128 on X1.
@@ -282,9 +450,9 @@ SEXP fsort(SEXP x, SEXP verboseArg) {
         //       before free. Just need to add the check and exit thread safely somehow.
 
         if (thisN <= INSERT_THRESH) {
-          dinsert(ans+from, thisN);
+          ullinsert(keys+from, thisN);
         } else {
-          dradix_r(ans+from, working, thisN, fromBit, toBit, counts);
+          dradix_r(keys+from, working, thisN, fromBit, toBit, counts, minULL);
         }
       }
       free(counts);
@@ -295,18 +463,36 @@ SEXP fsort(SEXP x, SEXP verboseArg) {
   }
   t[7] = wallclock();
   free(counts);
-  
+
+  // untwiddle the sorted keys into place then add the NA block first or last
+  #pragma omp parallel for num_threads(nth)
+  for (R_xlen_t i=0; i<m; i++) putval(&s, out, off+i, keys[i]);
+  if (nalast != 0) {
+    R_xlen_t from = nalast==-1 ? 0 : m;
+    switch(s.type) {
+    case T_DOUBLE : memcpy((double *)out + from, naDouble, nna*sizeof(double)); break;
+    case T_INT64 : {
+      unsigned long long na64 = 0x8000000000000000ULL;
+      for (R_xlen_t i=0; i<nna; i++) memcpy((double *)out + from + i, &na64, 8);
+      } break;
+    case T_INT : for (R_xlen_t i=0; i<nna; i++) ((int *)out)[from+i] = NA_INTEGER; break;
+    default : for (R_xlen_t i=0; i<nna; i++) ((SEXP *)out)[from+i] = NA_STRING;
+    }
+  }
+  if (!direct) free(keys);
+  free(naDouble);
+  if (s.type == T_STRING) ustr_end(s.ustr, s.nu);
+  t[8] = wallclock();
+
   // TODO: parallel sweep to check sorted using <= on original input. Feasible that twiddling messed up.
   //       After a few years of heavy use remove this check for speed, and move into unit tests.
   //       It's a perfectly contiguous and cache efficient parallel scan so should be relatively negligible.
-  
-  double tot = t[7]-t[0];
-  if (verbose) for (int i=1; i<=7; i++) {
+
+  double tot = t[8]-t[0];
+  if (verbose) for (int i=1; i<=8; i++) {
     Rprintf("%d: %.3f (%4.1f%%)\n", i, t[i]-t[i-1], 100.*(t[i]-t[i-1])/tot);
   }
-  
-  UNPROTECT(1);
-  return(ansVec);
-}
-
 
+  UNPROTECT(!inplace);
+  return(ans);
+}
@@ -1,20 +1,77 @@
 #include "data.table.h"
 //#include <time.h>
 
-static int *grp = NULL;      // the group of each x item, like a factor
+static int *grp = NULL;      // the group of each x item, like a factor; NULL when isruns
 static int ngrp = 0;         // number of groups
 static int *grpsize = NULL;  // size of each group, used by gmean (and gmedian) not gsum
 static int grpn = 0;         // length of underlying x == length(grp)
-static int *irows;           // GForce support for subsets in 'i' (TODO: joins in 'i')
+static int *irows;           // GForce support for subsets in 'i', and for joins in 'i' by=.EACHI (the matched rows, group by group)
 static int irowslen = -1;    // -1 is for irows = NULL
+static int gnth = 1;         // threads the g* functions share their work between; 1 when there are too few rows to bother
 
 // for gmedian
 static int maxgrpn = 0;
 static int *oo = NULL;
 static int *ff = NULL;
 static int isunsorted = 0;
-static union {double d;
-              long long ll;} u;
+static int isruns = 0;       // the groups are runs of positions one after another (o is empty): no grp[] is needed
+
+// Fewer rows than this aren't worth waking threads for
+#define N_PARALLEL 100000
+// With fewer groups than this, the g* functions whose results for parts of a group combine exactly (integer sums and counts,
+// min and max) give each thread a range of rows with its own accumulators for every group. Otherwise, and always for sums
+// and products of doubles whose rounding depends on the order, threads take batches of whole groups.
+#define GFEW 4096
+// the number of groups a thread takes at a time; small enough to balance groups of very different sizes
+#define GBATCH MAX(1, ngrp/(gnth*64))
+// the first position in grp[] of thread th's range of rows
+#define THFROM(th) ((int)((int64_t)grpn*(th)/gnth))
+// Each run of positions [i, e) of one group g in thread th's range of rows, so the g* functions that give threads ranges of
+// rows reduce a run at a time in a tight loop rather than looking up the group of each row
+#define GRUNS(th, g, i, e) \
+    for (int i = THFROM(th), e = i, g = grun(i, THFROM(th+1), &e); i < THFROM(th+1); i = e, g = grun(i, THFROM(th+1), &e))
+
+static SEXP gfusej(SEXP jsub, SEXP env);
+
+// The row of x (0-based) of the j-th item of group g. o is a stable order so a group's items come in the order a pass down
+// x meets them, and a loop over them accumulates in exactly the order the serial scatter through grp[] did.
+static inline int growx(int g, int j) {
+    int k = ff[g]-1+j;
+    if (isunsorted) k = oo[k]-1;
+    return irowslen == -1 ? k : irows[k]-1;
+}
+
+// The group of position i and the end e (at most end) of its run from i. When the groups are runs in order that is the end of
+// the group, found by binary search of ff, with no grp[] at all; else as far as grp[] has the same group.
+static inline int grun(const int i, const int end, int *e) {
+    if (i >= end) { *e = end; return 0; }
+    if (isruns) {
+        int lo = 0, hi = ngrp-1;  // the last group starting at or before i: the one i is in, past any empty ones
+        while (lo < hi) {
+            const int mid = lo + (hi-lo+1)/2;
+            if (ff[mid]-1 <= i) lo = mid; else hi = mid-1;
+        }
+        *e = MIN(end, ff[lo]-1+grpsize[lo]);
+        return lo;
+    }
+    const int g = grp[i];
+    int k = i+1;
+    while (k < end && grp[k] == g) k++;
+    *e = k;
+    return g;
+}
+
+// The position in the result of a window function (gcumsum etc, one value per row of x or of irows) of that item
+static inline int gpos(int g, int j) {
+    const int k = ff[g]-1+j;
+    return isunsorted ? oo[k]-1 : k;
+}
+
+// Threads for a g* function that gathers each group's values into a buffer of maxgrpn, one per thread: no more buffers
+// in all than the column has rows.
+static int gbufnth() {
+    return MAX(1, MIN(MIN(gnth, ngrp), maxgrpn ? grpn/maxgrpn : 1));
+}
 
 // from R's src/cov.c (for variance / sd)
 #ifdef HAVE_LONG_DOUBLE
@@ -26,6 +83,8 @@ static union {double d;
 SEXP gforce(SEXP env, SEXP jsub, SEXP o, SEXP f, SEXP l, SEXP irowsArg) {
     int i, j, g, *this;
     // clock_t start = clock();
+    // Reset first: the resets after eval() below are skipped when an R error (in these checks or in jsub) longjmps out
+    isunsorted = 0; irowslen = -1; isruns = 0; gnth = 1;
     if (TYPEOF(env) != ENVSXP) error("env is not an environment");
     // The type of jsub is pretty flexbile in R, so leave checking to eval() below.
     if (!isInteger(o)) error("o is not an integer vector");
@@ -34,35 +93,42 @@ SEXP gforce(SEXP env, SEXP jsub, SEXP o, SEXP f, SEXP l, SEXP irowsArg) {
     if (!isInteger(irowsArg) && !isNull(irowsArg)) error("irowsArg is not an integer vector");
     ngrp = LENGTH(l);
     if (LENGTH(f) != ngrp) error("length(f)=%d != length(l)=%d", LENGTH(f), ngrp);
-    grpn=0;
+    grpn=0; maxgrpn=0;
     grpsize = INTEGER(l);
-    for (i=0; i<ngrp; i++) grpn+=grpsize[i];
+    for (i=0; i<ngrp; i++) {
+        grpn+=grpsize[i];
+        if (grpsize[i]>maxgrpn) maxgrpn = grpsize[i];  // as forder's attribute "maxgrpn", which o doesn't have when empty
+    }
     if (LENGTH(o) && LENGTH(o)!=grpn) error("o has length %d but sum(l)=%d", LENGTH(o), grpn);
     
-    grp = (int *)R_alloc(grpn, sizeof(int));
-    // global grp because the g* functions (inside jsub) share this common memory
-    
+    // When the groups are already runs one after another, by= of a keyed or sorted table and joins by=.EACHI, each g*
+    // function reduces the runs directly and grp isn't needed
+    isruns = !LENGTH(o) && (ngrp == 0 || INTEGER(f)[0] == 1);
+    for (g=1; g<ngrp && isruns; g++) isruns = INTEGER(f)[g] == INTEGER(f)[g-1] + grpsize[g-1];
+    grp = NULL;
     if (LENGTH(o)) {
+        grp = (int *)R_alloc(grpn, sizeof(int));
+        // global grp because the g* functions (inside jsub) share this common memory
         isunsorted = 1; // for gmedian
         for (g=0; g<ngrp; g++) {
             this = INTEGER(o) + INTEGER(f)[g]-1;
             for (j=0; j<grpsize[g]; j++)  grp[ this[j]-1 ] = g;
         }
-    } else {
+    } else if (!isruns) {
+        grp = (int *)R_alloc(grpn, sizeof(int));
         for (g=0; g<ngrp; g++) {
             this = grp + INTEGER(f)[g]-1;
             for (j=0; j<grpsize[g]; j++)  this[j] = g;
         }
     }
-    // for gmedian
-    // initialise maxgrpn
-    maxgrpn = INTEGER(getAttrib(o, install("maxgrpn")))[0];
     oo = INTEGER(o);
     ff = INTEGER(f);
 
     irows = INTEGER(irowsArg);
-    if (!isNull(irowsArg)) irowslen = length(irowsArg);
+    irowslen = isNull(irowsArg) ? -1 : length(irowsArg);
+    gnth = grpn < N_PARALLEL ? 1 : getDTthreads();
     
+    jsub = PROTECT(gfusej(jsub, env));  // aggregates of the same column in one pass
     SEXP ans = PROTECT( eval(jsub, env) );
     // if this eval() fails with R error, R will release grp for us. Which is why we use R_alloc above.
     if (isVectorAtomic(ans)) {
@@ -71,40 +137,144 @@ SEXP gforce(SEXP env, SEXP jsub, SEXP o, SEXP f, SEXP l, SEXP irowsArg) {
       SET_VECTOR_ELT(ans, 0, tt);
       UNPROTECT(1);
     }
-    ngrp = 0; maxgrpn = 0; irowslen = -1; isunsorted = 0;
+    ngrp = 0; maxgrpn = 0; irowslen = -1; isunsorted = 0; isruns = 0; gnth = 1;
 
     // Rprintf("gforce took %8.3f\n", 1.0*(clock()-start)/CLOCKS_PER_SEC);
-    UNPROTECT(1);
+    UNPROTECT(2);
     return(ans);
 }
 
-// long double usage here results in test 648 being failed when running with valgrind
-// http://valgrind.org/docs/manual/manual-core.html#manual-core.limits
-SEXP gsum(SEXP x, SEXP narm)
+// The mean of k integers summing to t as base's mean of an integer: the exact sum divided in long double, which a sum beyond
+// 2^53 rounded to double first wouldn't be. NA when one of the group's n isn't counted and !narm; NaN when there are none.
+static inline double gimean(const int64_t t, const int k, const int n, const Rboolean narm)
 {
-    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
-    if (!isVectorAtomic(x)) error("GForce sum can only be applied to columns, not .SD or similar. To sum all items in a list such as .SD, either add the prefix base::sum(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,sum),by=,.SDcols=]'");
-    if (inherits(x, "factor")) error("sum is not meaningful for factors.");
-    int i, ix, thisgrp;
-    int n = (irowslen == -1) ? length(x) : irowslen;
-    //clock_t start = clock();
-    SEXP ans;
-    if (grpn != n) error("grpn [%d] != length(x) [%d] in gsum", grpn, n);
-    long double *s = calloc(ngrp, sizeof(long double));
-    if (!s) error("Unable to allocate %d * %d bytes for gsum", ngrp, sizeof(long double));
-    switch(TYPEOF(x)) {
-    case LGLSXP: case INTSXP:
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if(INTEGER(x)[ix] == NA_INTEGER) { 
-                if (!LOGICAL(narm)[0]) s[thisgrp] = NA_REAL;  // Let NA_REAL propogate from here. R_NaReal is IEEE.
-                continue;
+    return (!narm && k<n) ? NA_REAL : (k ? (double)((long double)t/k) : R_NaN);
+}
+
+// Sum the integers of each group into s[g], or NA_REAL when it has an NA and !narm, and count its non-NA into c[g] when c
+// isn't NULL; or, when mean, the group's mean into s[g] (gimean). The sums are exact in int64_t (at most 2^31 items of at
+// most 2^31) so it doesn't matter how the rows are split between threads.
+static void gisum(const int *xd, const Rboolean narm, double *s, int *c, const Rboolean mean)
+{
+    if (ngrp < GFEW) {
+        int64_t *ts = (int64_t *)R_alloc((size_t)gnth*ngrp, sizeof(int64_t));
+        int *tc = (int *)R_alloc((size_t)gnth*ngrp, sizeof(int));
+        #pragma omp parallel for num_threads(gnth)
+        for (int th=0; th<gnth; th++) {
+            int64_t *mys = ts + (size_t)th*ngrp;
+            int *myc = tc + (size_t)th*ngrp;
+            for (int g=0; g<ngrp; g++) { mys[g] = 0; myc[g] = 0; }
+            GRUNS(th, g, i, e) {
+                int64_t t = 0;
+                int k = 0;
+                for (int r=i; r<e; r++) {
+                    const int v = xd[irowslen == -1 ? r : irows[r]-1];
+                    if (v == NA_INTEGER) continue;
+                    t += v;
+                    k++;
+                }
+                mys[g] += t;
+                myc[g] += k;
             }
-            s[thisgrp] += INTEGER(x)[ix];  // no under/overflow here, s is long double (like base)
         }
+        for (int g=0; g<ngrp; g++) {
+            int64_t t = 0;
+            int k = 0;
+            for (int th=0; th<gnth; th++) { t += ts[(size_t)th*ngrp+g]; k += tc[(size_t)th*ngrp+g]; }
+            s[g] = mean ? gimean(t, k, grpsize[g], narm) : (!narm && k<grpsize[g]) ? NA_REAL : (double)t;  // Let NA_REAL propogate from here. R_NaReal is IEEE.
+            if (c) c[g] = k;
+        }
+    } else {
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            int64_t t = 0;
+            int k = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int v = xd[growx(g, j)];
+                if (v == NA_INTEGER) continue;
+                t += v;
+                k++;
+            }
+            s[g] = mean ? gimean(t, k, grpsize[g], narm) : (!narm && k<grpsize[g]) ? NA_REAL : (double)t;
+            if (c) c[g] = k;
+        }
+    }
+}
+
+// The sum of group g's doubles, compensated (dsum_t in data.table.h) so it needs no long double, with NA and NaN skipped
+// when narm, and the count of its values that aren't NA or NaN into *k when k isn't NULL. The lane of each value is its
+// position in the group, so the result doesn't depend on the threads, or on whether the group's rows are contiguous in x:
+// when they are, as for by= of a keyed or sorted table, they're summed a block at a time in a loop that vectorizes.
+// A sum that's NaN is NA when the group has an NA (and !narm), else NaN: which of the two a sum of both would otherwise give
+// depends on the order the compiler puts the operands of each addition in.
+static double gdsum(const double *xd, const int g, const Rboolean narm, int *k)
+{
+    dsum_t t;
+    dsuminit(&t);
+    const int n = grpsize[g];
+    int nna = 0;
+    if (!isunsorted && irowslen == -1) {
+        const double *x = xd + ff[g]-1;
+        dsumblock(&t, 0, x, n, narm);
+        if (k) for (int j=0; j<n; j++) nna += ISNAN(x[j]);
+    } else {
+        // gathered DSUMLANES at a time so each lane's running sum stays in a register
+        int j = 0;
+        for (; j+DSUMLANES<=n; j+=DSUMLANES) {
+            double v[DSUMLANES];
+            for (int l=0; l<DSUMLANES; l++) {
+                v[l] = xd[growx(g, j+l)];
+                nna += ISNAN(v[l]);
+                if (narm && ISNAN(v[l])) v[l] = 0.0;  // which leaves the lane as it is, as skipping it would
+            }
+            for (int l=0; l<DSUMLANES; l++) dsumadd(&t, l, v[l]);
+        }
+        for (; j<n; j++) {
+            const double v = xd[growx(g, j)];
+            nna += ISNAN(v);
+            dsumadd(&t, j%DSUMLANES, narm && ISNAN(v) ? 0.0 : v);
+        }
+    }
+    if (k) *k = n - nna;
+    const double ans = dsumget(&t);
+    if (!ISNAN(ans)) return ans;
+    if (!narm) for (int j=0; j<n; j++) if (ISNA(xd[growx(g, j)])) return NA_REAL;
+    return R_NaN;
+}
+
+// Long double products to double as base does: beyond the range of a double is Inf
+static void gtodbl(double *ad, const long double *s)
+{
+    for (int i=0; i<ngrp; i++) {
+        if (s[i] > DBL_MAX) ad[i] = R_PosInf;
+        else if (s[i] < -DBL_MAX) ad[i] = R_NegInf;
+        else ad[i] = (double)s[i];
+    }
+}
+
+// The result of gmean or gmedian of an IDate, ans, is an IDate as mean.IDate's is: integer, the mean truncated as by as.IDate
+static SEXP gidateans(SEXP ans)
+{
+    SEXP r = PROTECT(allocVector(INTSXP, ngrp));
+    for (int i=0; i<ngrp; i++) INTEGER(r)[i] = ISNAN(REAL(ans)[i]) ? NA_INTEGER : (int)REAL(ans)[i];
+    copyMostAttrib(ans, r);
+    UNPROTECT(1);
+    return(r);
+}
+
+// The results of gsum, gmean and gprod from each group's sum (and count of the non-NA for gmean na.rm=TRUE, else c is NULL)
+// or product; likewise gmin and gmax from ans filled with each group's min or max. These are shared with gfuse, which fills
+// them for several functions of a column in one pass. Each leaves its result PROTECTed; gminans and gmaxans, for numeric
+// columns, take the place of ans on the stack and leave copying x's attributes to the caller.
+static SEXP gsumans(SEXP x, const double *s)
+{
+    SEXP ans;
+    if (TYPEOF(x) == REALSXP) {
+        ans = PROTECT(allocVector(REALSXP, ngrp));
+        memcpy(REAL(ans), s, ngrp*sizeof(double));
+    } else {
         ans = PROTECT(allocVector(INTSXP, ngrp));
-        for (i=0; i<ngrp; i++) {
+        for (int i=0; i<ngrp; i++) {
             if (s[i] > INT_MAX || s[i] < INT_MIN) {
                 warning("Group %d summed to more than type 'integer' can hold so the result has been coerced to 'numeric' automatically, for convenience.", i+1);
                 UNPROTECT(1);
@@ -117,27 +287,180 @@ SEXP gsum(SEXP x, SEXP narm)
                 INTEGER(ans)[i] = (int)s[i]; 
             }
         }
-        break;
-    case REALSXP:
-        ans = PROTECT(allocVector(REALSXP, ngrp));
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if(ISNAN(REAL(x)[ix]) && LOGICAL(narm)[0]) continue;  // else let NA_REAL propogate from here
-            s[thisgrp] += REAL(x)[ix];  // done in long double, like base
+    }
+    copyMostAttrib(x, ans);
+    return(ans);
+}
+
+static SEXP gmeanans(SEXP x, const double *s, const int *c)
+{
+    SEXP ans;
+    if (!c) {
+        ans = gsumans(x, s);
+        if (TYPEOF(ans) != REALSXP) {
+            UNPROTECT(1);
+            ans = PROTECT(coerceVector(ans, REALSXP));
         }
-        for (i=0; i<ngrp; i++) {
-            if (s[i] > DBL_MAX) REAL(ans)[i] = R_PosInf;
-            else if (s[i] < -DBL_MAX) REAL(ans)[i] = R_NegInf;
-            else REAL(ans)[i] = (double)s[i];
+        for (int i=0; i<ngrp; i++) REAL(ans)[i] /= grpsize[i];  // let NA propogate
+        return(ans);
+    }
+    ans = PROTECT(allocVector(REALSXP, ngrp));
+    for (int i=0; i<ngrp; i++) {
+        if (c[i]==0) { REAL(ans)[i] = R_NaN; continue; }  // NaN to follow base::mean
+        REAL(ans)[i] = s[i] / c[i];
+    }
+    copyMostAttrib(x, ans);
+    return(ans);
+}
+
+static SEXP gimeanans(SEXP x, const double *m)
+{
+    // gmean of integers, whose means (gimean) are done already
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    memcpy(REAL(ans), m, ngrp*sizeof(double));
+    copyMostAttrib(x, ans);
+    if (INHERITS(x, char_IDate)) { SEXP r = gidateans(ans); UNPROTECT(1); ans = PROTECT(r); }
+    return(ans);
+}
+
+static SEXP gprodans(SEXP x, const long double *s)
+{
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    gtodbl(REAL(ans), s);
+    copyMostAttrib(x, ans);
+    return(ans);
+}
+
+// The steps of gmin and gmax: fold the value v of a row into its group's running min or max a (u is whether the group has a
+// max yet), with the rules for NA, NaN (#1461) and ties that the serial loops have always had
+#define IMIN(a, v)       if ((v) < (a)) (a) = (v)  // NA_INTEGER==INT_MIN checked in init.c
+#define IMINRM(a, v)     if ((v) != NA_INTEGER && ((a) == NA_INTEGER || (v) < (a))) (a) = (v)
+#define DMIN(a, v)       if (ISNAN(v) || (v) < (a)) (a) = (v)  // the last NaN wins, and of equal values (0 and -0) the first
+#define DMINRM(a, v)     if (!ISNAN(v) && (ISNAN(a) || (v) < (a))) (a) = (v)
+#define IMAX(a, u, v)    if ((v) != NA_INTEGER && (a) != NA_INTEGER) { if (!(u) || (a) < (v)) { (a) = (v); (u) = 1; } } else (a) = NA_INTEGER
+#define IMAXRM(a, u, v)  if ((v) != NA_INTEGER) { if (!(u) || (a) < (v)) { (a) = (v); (u) = 1; } } else if (!(u)) (a) = NA_INTEGER
+#define DMAX(a, u, v)    if (!ISNA(v) && !ISNA(a)) { if (!(u) || (a) < (v) || (ISNAN(v) && !ISNAN(a))) { (a) = (v); (u) = 1; } } else (a) = NA_REAL
+#define DMAXRM(a, u, v)  if (!ISNAN(v)) { if (!(u) || (a) < (v)) { (a) = (v); (u) = 1; } } else if (!(u)) (a) = R_NegInf
+// and of integer64, whose NA is the smallest long long as NA_INTEGER is the smallest int, so IMIN does for its min
+#define LMINRM(a, v)     if ((v) != NA_INT64_LL && ((a) == NA_INT64_LL || (v) < (a))) (a) = (v)
+#define LMAX(a, u, v)    if ((v) != NA_INT64_LL && (a) != NA_INT64_LL) { if (!(u) || (a) < (v)) { (a) = (v); (u) = 1; } } else (a) = NA_INT64_LL
+#define LMAXRM(a, u, v)  if ((v) != NA_INT64_LL) { if (!(u) || (a) < (v)) { (a) = (v); (u) = 1; } } else if (!(u)) (a) = NA_INT64_LL
+
+static SEXP gminans(SEXP ans, const Rboolean narm)
+{
+    if (!narm) return(ans);
+    if (TYPEOF(ans) == INTSXP) {
+        for (int i=0; i<ngrp; i++) {
+            if (INTEGER(ans)[i] == NA_INTEGER) {
+                warning("No non-missing values found in at least one group. Coercing to numeric type and returning 'Inf' for such groups to be consistent with base");
+                UNPROTECT(1);
+                ans = PROTECT(coerceVector(ans, REALSXP));
+                for (i=0; i<ngrp; i++) {
+                    if (ISNA(REAL(ans)[i])) REAL(ans)[i] = R_PosInf;
+                }
+                break;
+            }
         }
+    } else {
+        for (int i=0; i<ngrp; i++) {
+            if (ISNAN(REAL(ans)[i])) {
+                warning("No non-missing values found in at least one group. Returning 'Inf' for such groups to be consistent with base");
+                for (; i<ngrp; i++) if (ISNAN(REAL(ans)[i])) REAL(ans)[i] = R_PosInf;
+                break;
+            }
+        }
+    }
+    return(ans);
+}
+
+static SEXP gmaxans(SEXP ans, const char *update, const Rboolean narm)
+{
+    if (!narm) return(ans);
+    if (TYPEOF(ans) == INTSXP) {
+        for (int i=0; i<ngrp; i++) {
+            if (update[i] != 1)  {// equivalent of INTEGER(ans)[thisgrp] == NA_INTEGER
+                warning("No non-missing values found in at least one group. Coercing to numeric type and returning 'Inf' for such groups to be consistent with base");
+                UNPROTECT(1);
+                ans = PROTECT(coerceVector(ans, REALSXP));
+                for (i=0; i<ngrp; i++) {
+                    if (update[i] != 1) REAL(ans)[i] = -R_PosInf;
+                }
+                break;
+            }
+        }
+    } else {
+        for (int i=0; i<ngrp; i++) if (!update[i]) REAL(ans)[i] = -R_PosInf;  // a group of only NaN gives no thread a value to fold
+        // Just warn if all NA groups have occurred at least once
+        for (int i=0; i<ngrp; i++) {
+            if (update[i] != 1)  { // equivalent of REAL(ans)[thisgrp] == -R_PosInf
+                warning("No non-missing values found in at least one group. Returning '-Inf' for such groups to be consistent with base");
+                break;
+            }
+        }
+    }
+    return(ans);
+}
+
+// integer64: the sum of each group exact in int64_t as bit64's sum. NA, with a warning, for a group whose running sum overflows.
+static SEXP gsum64(SEXP x, const Rboolean narm)
+{
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    const long long *xd = (const long long *)REAL(x);
+    long long *ad = (long long *)REAL(ans);
+    int over = 0;
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH) reduction(+:over)
+    for (int g=0; g<ngrp; g++) {
+        long long t = 0;
+        for (int j=0; j<grpsize[g]; j++) {
+            const long long v = xd[growx(g, j)];
+            if (v == NA_INT64_LL) {
+                if (narm) continue;
+                t = NA_INT64_LL;
+                break;
+            }
+            if (v > 0 ? t > LLONG_MAX - v : t < -LLONG_MAX - v) {  // the valid range is +-LLONG_MAX, LLONG_MIN is NA
+                t = NA_INT64_LL;
+                over++;
+                break;
+            }
+            t += v;
+        }
+        ad[g] = t;
+    }
+    if (over) warning("NAs produced by integer64 overflow in %d group(s)", over);
+    copyMostAttrib(x, ans);
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gsum(SEXP x, SEXP narm)
+{
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    if (!isVectorAtomic(x)) error("GForce sum can only be applied to columns, not .SD or similar. To sum all items in a list such as .SD, either add the prefix base::sum(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,sum),by=,.SDcols=]'");
+    if (inherits(x, "factor")) error("sum is not meaningful for factors.");
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    //clock_t start = clock();
+    SEXP ans;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in gsum", grpn, n);
+    const Rboolean rm = LOGICAL(narm)[0];
+    if (INHERITS(x, char_integer64)) return(gsum64(x, rm));
+    double *s = calloc(ngrp, sizeof(double));
+    if (!s) error("Unable to allocate %d * %d bytes for gsum", ngrp, sizeof(double));
+    switch(TYPEOF(x)) {
+    case LGLSXP: case INTSXP:
+        gisum(INTEGER(x), rm, s, NULL, FALSE);  // no under/overflow here, the sums are exact (like base)
         break;
+    case REALSXP: {
+        const double *xd = REAL(x);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) s[g] = gdsum(xd, g, rm, NULL);  // else let NA_REAL propogate
+    } break;
     default:
         free(s);
         error("Type '%s' not supported by GForce sum (gsum). Either add the prefix base::sum(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
+    ans = gsumans(x, s);
     free(s);
-    copyMostAttrib(x, ans);
     UNPROTECT(1);
     // Rprintf("this gsum took %8.3f\n", 1.0*(clock()-start)/CLOCKS_PER_SEC);
     return(ans);
@@ -146,124 +469,137 @@ SEXP gsum(SEXP x, SEXP narm)
 SEXP gmean(SEXP x, SEXP narm)
 {
     SEXP ans;
-    int i, ix, protecti=0, thisgrp, n;
+    int n;
     //clock_t start = clock();
     if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
     if (!isVectorAtomic(x)) error("GForce mean can only be applied to columns, not .SD or similar. Likely you're looking for 'DT[,lapply(.SD,mean),by=,.SDcols=]'. See ?data.table.");
     if (inherits(x, "factor")) error("mean is not meaningful for factors.");
+    if (TYPEOF(x) == LGLSXP || TYPEOF(x) == INTSXP) {
+        n = (irowslen == -1) ? length(x) : irowslen;
+        if (grpn != n) error("grpn [%d] != length(x) [%d] in gmean", grpn, n);
+        double *m = (double *)R_alloc(ngrp, sizeof(double));
+        gisum(INTEGER(x), LOGICAL(narm)[0], m, NULL, TRUE);
+        ans = gimeanans(x, m);
+        UNPROTECT(1);
+        return(ans);
+    }
     if (!LOGICAL(narm)[0]) {
-        ans = PROTECT(gsum(x,narm)); protecti++;
-        switch(TYPEOF(ans)) {
-        case LGLSXP: case INTSXP:
-            ans = PROTECT(coerceVector(ans, REALSXP)); protecti++;
-        case REALSXP:
-            for (i=0; i<ngrp; i++) REAL(ans)[i] /= grpsize[i];  // let NA propogate
-            break;
-        default :
-            error("Internal error: gsum returned type '%s'. typeof(x) is '%s'", type2char(TYPEOF(ans)), type2char(TYPEOF(x)));
+        ans = PROTECT(gsum(x,narm));
+        if (TYPEOF(ans) != REALSXP) {
+            UNPROTECT(1);
+            ans = PROTECT(coerceVector(ans, REALSXP));
         }
-        UNPROTECT(protecti);
+        for (int i=0; i<ngrp; i++) REAL(ans)[i] /= grpsize[i];  // let NA propogate
+        if (INHERITS(x, char_IDate)) ans = gidateans(ans);
+        UNPROTECT(1);
         return(ans);
     }
     // na.rm=TRUE.  Similar to gsum, but we need to count the non-NA as well for the divisor
     n = (irowslen == -1) ? length(x) : irowslen;
     if (grpn != n) error("grpn [%d] != length(x) [%d] in gsum", grpn, n);
 
-    long double *s = calloc(ngrp, sizeof(long double));
-    if (!s) error("Unable to allocate %d * %d bytes for sum in gmean na.rm=TRUE", ngrp, sizeof(long double));
+    double *s = calloc(ngrp, sizeof(double));
+    if (!s) error("Unable to allocate %d * %d bytes for sum in gmean na.rm=TRUE", ngrp, sizeof(double));
 
     int *c = calloc(ngrp, sizeof(int));
     if (!c) error("Unable to allocate %d * %d bytes for counts in gmean na.rm=TRUE", ngrp, sizeof(int));
 
     switch(TYPEOF(x)) {
-    case LGLSXP: case INTSXP:
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if(INTEGER(x)[ix] == NA_INTEGER) continue;
-            s[thisgrp] += INTEGER(x)[ix];  // no under/overflow here, s is long double
-            c[thisgrp]++;
-        }
-        break;
-    case REALSXP:
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if (ISNAN(REAL(x)[ix])) continue;
-            s[thisgrp] += REAL(x)[ix];
-            c[thisgrp]++;
-        }
-        break;
+    case REALSXP: {
+        const double *xd = REAL(x);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) s[g] = gdsum(xd, g, TRUE, c+g);
+    } break;
     default:
         free(s); free(c);
         error("Type '%s' not supported by GForce mean (gmean) na.rm=TRUE. Either add the prefix base::mean(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
-    ans = PROTECT(allocVector(REALSXP, ngrp));
-    for (i=0; i<ngrp; i++) {
-        if (c[i]==0) { REAL(ans)[i] = R_NaN; continue; }  // NaN to follow base::mean
-        s[i] /= c[i]; 
-        if (s[i] > DBL_MAX) REAL(ans)[i] = R_PosInf;
-        else if (s[i] < -DBL_MAX) REAL(ans)[i] = R_NegInf;
-        else REAL(ans)[i] = (double)s[i];
-    }
+    ans = gmeanans(x, s, c);
     free(s); free(c);
-    copyMostAttrib(x, ans);
+    if (INHERITS(x, char_IDate)) ans = gidateans(ans);
     UNPROTECT(1);
     // Rprintf("this gmean na.rm=TRUE took %8.3f\n", 1.0*(clock()-start)/CLOCKS_PER_SEC);
     return(ans);
 }
 
+// Fold the rows of each group into a[g] by STEP, which updates the group's running value a (and u, gmax's flag for whether it
+// has one yet) with the row's value v, in the order a pass down x meets them. With few groups each thread folds a range of
+// rows into values of its own, which are then folded by STEP in thread order where MERGEIF says that thread's range holds the
+// group. This gives what one pass gives for folds like min and max whose result doesn't depend on where the rows are split.
+#define GFOLD(CTYPE, XD, A, U, INIT, STEP, MERGEIF) \
+    if (ngrp < GFEW) { \
+        CTYPE *ta = (CTYPE *)R_alloc((size_t)gnth*ngrp, sizeof(CTYPE)); \
+        char *tu = R_alloc((size_t)gnth*ngrp, sizeof(char)); \
+        _Pragma("omp parallel for num_threads(gnth)") \
+        for (int th=0; th<gnth; th++) { \
+            CTYPE *mya = ta + (size_t)th*ngrp; \
+            char *myu = tu + (size_t)th*ngrp; \
+            for (int g=0; g<ngrp; g++) { mya[g] = INIT; myu[g] = 0; } \
+            GRUNS(th, g, i, e) { \
+                CTYPE a = mya[g]; \
+                char u = myu[g]; \
+                for (int r=i; r<e; r++) { \
+                    const CTYPE v = XD[irowslen == -1 ? r : irows[r]-1]; \
+                    STEP; \
+                } \
+                mya[g] = a; myu[g] = u; \
+            } \
+        } \
+        for (int g=0; g<ngrp; g++) { \
+            CTYPE a = INIT; \
+            char u = 0; \
+            for (int th=0; th<gnth; th++) { \
+                const CTYPE v = ta[(size_t)th*ngrp+g]; \
+                const char vu = tu[(size_t)th*ngrp+g]; \
+                (void)vu; \
+                if (MERGEIF) { STEP; } \
+            } \
+            A[g] = a; \
+            if (U) (U)[g] = u; \
+        } \
+    } else { \
+        _Pragma("omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)") \
+        for (int g=0; g<ngrp; g++) { \
+            CTYPE a = INIT; \
+            char u = 0; \
+            for (int j=0; j<grpsize[g]; j++) { \
+                const CTYPE v = XD[growx(g, j)]; \
+                STEP; \
+            } \
+            A[g] = a; \
+            if (U) (U)[g] = u; \
+        } \
+    }
+
 // gmin
 SEXP gmin(SEXP x, SEXP narm)
 {
     if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
     if (!isVectorAtomic(x)) error("GForce min can only be applied to columns, not .SD or similar. To find min of all items in a list such as .SD, either add the prefix base::min(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,min),by=,.SDcols=]'");
     if (inherits(x, "factor")) error("min is not meaningful for factors.");
-    R_len_t i, ix, thisgrp=0;
+    R_len_t i, j, ix, thisgrp=0;
     int n = (irowslen == -1) ? length(x) : irowslen;
     //clock_t start = clock();
     SEXP ans;
     if (grpn != n) error("grpn [%d] != length(x) [%d] in gmin", grpn, n);
     switch(TYPEOF(x)) {
-    case LGLSXP: case INTSXP:
+    case LGLSXP: case INTSXP: {
         ans = PROTECT(allocVector(INTSXP, ngrp));
+        const int *xd = INTEGER(x);
+        int *ad = INTEGER(ans);
         if (!LOGICAL(narm)[0]) {
-            for (i=0; i<ngrp; i++) INTEGER(ans)[i] = INT_MAX;
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (INTEGER(x)[ix] < INTEGER(ans)[thisgrp])   // NA_INTEGER==INT_MIN checked in init.c
-                    INTEGER(ans)[thisgrp] = INTEGER(x)[ix];
-            }
+            GFOLD(int, xd, ad, (char *)NULL, INT_MAX, IMIN(a, v), TRUE)
         } else {
-            for (i=0; i<ngrp; i++) INTEGER(ans)[i] = NA_INTEGER;
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (INTEGER(x)[ix] == NA_INTEGER) continue;
-                if (INTEGER(ans)[thisgrp] == NA_INTEGER || INTEGER(x)[ix] < INTEGER(ans)[thisgrp])
-                    INTEGER(ans)[thisgrp] = INTEGER(x)[ix];
-            }
-            for (i=0; i<ngrp; i++) {
-                if (INTEGER(ans)[i] == NA_INTEGER) {
-                    warning("No non-missing values found in at least one group. Coercing to numeric type and returning 'Inf' for such groups to be consistent with base");
-                    UNPROTECT(1);
-                    ans = PROTECT(coerceVector(ans, REALSXP));
-                    for (i=0; i<ngrp; i++) {
-                        if (ISNA(REAL(ans)[i])) REAL(ans)[i] = R_PosInf;
-                    }
-                    break;
-                }
-            }
+            GFOLD(int, xd, ad, (char *)NULL, NA_INTEGER, IMINRM(a, v), TRUE)
         }
-        break;
+        ans = gminans(ans, LOGICAL(narm)[0]);
+    } break;
     case STRSXP:
         ans = PROTECT(allocVector(STRSXP, ngrp));
         if (!LOGICAL(narm)[0]) {
             for (i=0; i<ngrp; i++) SET_STRING_ELT(ans, i, R_BlankString);
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
+            for (thisgrp=0; thisgrp<ngrp; thisgrp++) for (j=0; j<grpsize[thisgrp]; j++) {
+                ix = growx(thisgrp, j);
                 if (STRING_ELT(x, ix) == NA_STRING) {
                     SET_STRING_ELT(ans, thisgrp, NA_STRING);
                 } else {
@@ -275,9 +611,8 @@ SEXP gmin(SEXP x, SEXP narm)
             }
         } else {
             for (i=0; i<ngrp; i++) SET_STRING_ELT(ans, i, NA_STRING);
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
+            for (thisgrp=0; thisgrp<ngrp; thisgrp++) for (j=0; j<grpsize[thisgrp]; j++) {
+                ix = growx(thisgrp, j);
                 if (STRING_ELT(x, ix) == NA_STRING) continue;
                 if (STRING_ELT(ans, thisgrp) == NA_STRING || 
                     strcmp(CHAR(STRING_ELT(x, ix)), CHAR(STRING_ELT(ans, thisgrp))) < 0) {
@@ -292,34 +627,33 @@ SEXP gmin(SEXP x, SEXP narm)
             }
         }
         break;
-    case REALSXP:
+    case REALSXP: {
         ans = PROTECT(allocVector(REALSXP, ngrp));
-        if (!LOGICAL(narm)[0]) {    
-            for (i=0; i<ngrp; i++) REAL(ans)[i] = R_PosInf;
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (ISNAN(REAL(x)[ix]) || REAL(x)[ix] < REAL(ans)[thisgrp])
-                    REAL(ans)[thisgrp] = REAL(x)[ix];
-            }
-        } else {
-            for (i=0; i<ngrp; i++) REAL(ans)[i] = NA_REAL;
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (ISNAN(REAL(x)[ix])) continue;
-                if (ISNAN(REAL(ans)[thisgrp]) || REAL(x)[ix] < REAL(ans)[thisgrp])
-                    REAL(ans)[thisgrp] = REAL(x)[ix];
-            }
-            for (i=0; i<ngrp; i++) {
-                if (ISNAN(REAL(ans)[i])) {
-                    warning("No non-missing values found in at least one group. Returning 'Inf' for such groups to be consistent with base");
-                    for (; i<ngrp; i++) if (ISNAN(REAL(ans)[i])) REAL(ans)[i] = R_PosInf;
+        if (INHERITS(x, char_integer64)) {
+            // as bit64's min: NA wins unless na.rm; with na.rm a group with no value gets the largest integer64, with a warning
+            const long long *xd = (const long long *)REAL(x);
+            long long *ad = (long long *)REAL(ans);
+            if (!LOGICAL(narm)[0]) {
+                GFOLD(long long, xd, ad, (char *)NULL, LLONG_MAX, IMIN(a, v), TRUE)
+            } else {
+                GFOLD(long long, xd, ad, (char *)NULL, NA_INT64_LL, LMINRM(a, v), TRUE)
+                for (i=0; i<ngrp; i++) if (ad[i] == NA_INT64_LL) {
+                    warning("No non-missing values found in at least one group. Returning the largest integer64 for such groups to be consistent with bit64");
+                    for (; i<ngrp; i++) if (ad[i] == NA_INT64_LL) ad[i] = LLONG_MAX;
                     break;
                 }
             }
+            break;
         }
-        break;
+        const double *xd = REAL(x);
+        double *ad = REAL(ans);
+        if (!LOGICAL(narm)[0]) {
+            GFOLD(double, xd, ad, (char *)NULL, R_PosInf, DMIN(a, v), TRUE)
+        } else {
+            GFOLD(double, xd, ad, (char *)NULL, NA_REAL, DMINRM(a, v), TRUE)
+        }
+        ans = gminans(ans, LOGICAL(narm)[0]);
+    } break;
     default:
         error("Type '%s' not supported by GForce min (gmin). Either add the prefix base::min(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
@@ -335,7 +669,7 @@ SEXP gmax(SEXP x, SEXP narm)
     if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
     if (!isVectorAtomic(x)) error("GForce max can only be applied to columns, not .SD or similar. To find max of all items in a list such as .SD, either add the prefix base::max(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,max),by=,.SDcols=]'");
     if (inherits(x, "factor")) error("max is not meaningful for factors.");
-    R_len_t i, ix, thisgrp=0;
+    R_len_t i, j, ix, thisgrp=0;
     int n = (irowslen == -1) ? length(x) : irowslen;
     //clock_t start = clock();
     SEXP ans;
@@ -346,55 +680,23 @@ SEXP gmax(SEXP x, SEXP narm)
     for (int i=0; i<ngrp; i++) update[i] = 0;
     
     switch(TYPEOF(x)) {
-    case LGLSXP: case INTSXP:
+    case LGLSXP: case INTSXP: {
         ans = PROTECT(allocVector(INTSXP, ngrp));
-        for (i=0; i<ngrp; i++) INTEGER(ans)[i] = 0;
+        const int *xd = INTEGER(x);
+        int *ad = INTEGER(ans);
         if (!LOGICAL(narm)[0]) { // simple case - deal in a straightforward manner first
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (INTEGER(x)[ix] != NA_INTEGER && INTEGER(ans)[thisgrp] != NA_INTEGER) {
-                    if ( update[thisgrp] != 1 || INTEGER(ans)[thisgrp] < INTEGER(x)[ix] ) {
-                        INTEGER(ans)[thisgrp] = INTEGER(x)[ix];
-                        if (update[thisgrp] != 1) update[thisgrp] = 1;
-                    }
-                } else  INTEGER(ans)[thisgrp] = NA_INTEGER;
-            }
+            GFOLD(int, xd, ad, update, 0, IMAX(a, u, v), vu || v == NA_INTEGER)
         } else {
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if (INTEGER(x)[ix] != NA_INTEGER) {
-                    if ( update[thisgrp] != 1 || INTEGER(ans)[thisgrp] < INTEGER(x)[ix] ) {
-                        INTEGER(ans)[thisgrp] = INTEGER(x)[ix];
-                        if (update[thisgrp] != 1) update[thisgrp] = 1;
-                    }
-                } else {
-                    if (update[thisgrp] != 1) {
-                        INTEGER(ans)[thisgrp] = NA_INTEGER;
-                    }
-                }
-            }
-            for (i=0; i<ngrp; i++) {
-                if (update[i] != 1)  {// equivalent of INTEGER(ans)[thisgrp] == NA_INTEGER
-                    warning("No non-missing values found in at least one group. Coercing to numeric type and returning 'Inf' for such groups to be consistent with base");
-                    UNPROTECT(1);
-                    ans = PROTECT(coerceVector(ans, REALSXP));
-                    for (i=0; i<ngrp; i++) {
-                        if (update[i] != 1) REAL(ans)[i] = -R_PosInf;
-                    }
-                    break;
-                }
-            }
+            GFOLD(int, xd, ad, update, 0, IMAXRM(a, u, v), vu)
         }
-        break;
+        ans = gmaxans(ans, update, LOGICAL(narm)[0]);
+    } break;
     case STRSXP:
         ans = PROTECT(allocVector(STRSXP, ngrp));
         for (i=0; i<ngrp; i++) SET_STRING_ELT(ans, i, mkChar(""));
         if (!LOGICAL(narm)[0]) { // simple case - deal in a straightforward manner first
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
+            for (thisgrp=0; thisgrp<ngrp; thisgrp++) for (j=0; j<grpsize[thisgrp]; j++) {
+                ix = growx(thisgrp, j);
                 if (STRING_ELT(x,ix) != NA_STRING && STRING_ELT(ans, thisgrp) != NA_STRING) {
                     if ( update[thisgrp] != 1 || strcmp(CHAR(STRING_ELT(ans, thisgrp)), CHAR(STRING_ELT(x,ix))) < 0 ) {
                         SET_STRING_ELT(ans, thisgrp, STRING_ELT(x, ix));
@@ -403,9 +705,8 @@ SEXP gmax(SEXP x, SEXP narm)
                 } else  SET_STRING_ELT(ans, thisgrp, NA_STRING);
             }
         } else {
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
+            for (thisgrp=0; thisgrp<ngrp; thisgrp++) for (j=0; j<grpsize[thisgrp]; j++) {
+                ix = growx(thisgrp, j);
                 if (STRING_ELT(x, ix) != NA_STRING) {
                     if ( update[thisgrp] != 1 || strcmp(CHAR(STRING_ELT(ans, thisgrp)), CHAR(STRING_ELT(x, ix))) < 0 ) {
                         SET_STRING_ELT(ans, thisgrp, STRING_ELT(x, ix));
@@ -425,45 +726,34 @@ SEXP gmax(SEXP x, SEXP narm)
             }
         }    
         break;
-    case REALSXP:
+    case REALSXP: {
         ans = PROTECT(allocVector(REALSXP, ngrp));
-        for (i=0; i<ngrp; i++) REAL(ans)[i] = 0;
-        if (!LOGICAL(narm)[0]) {
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if ( !ISNA(REAL(x)[ix]) && !ISNA(REAL(ans)[thisgrp]) ) {
-                    if ( update[thisgrp] != 1 || REAL(ans)[thisgrp] < REAL(x)[ix] || 
-                         (ISNAN(REAL(x)[ix]) && !ISNAN(REAL(ans)[thisgrp])) ) { // #1461
-                        REAL(ans)[thisgrp] = REAL(x)[ix];
-                        if (update[thisgrp] != 1) update[thisgrp] = 1;
-                    }
-                } else REAL(ans)[thisgrp] = NA_REAL;
-            }
-        } else {
-            for (i=0; i<n; i++) {
-                thisgrp = grp[i];
-                ix = (irowslen == -1) ? i : irows[i]-1;
-                if ( !ISNAN(REAL(x)[ix]) ) { // #1461
-                    if ( update[thisgrp] != 1 || REAL(ans)[thisgrp] < REAL(x)[ix] ) {
-                        REAL(ans)[thisgrp] = REAL(x)[ix];
-                        if (update[thisgrp] != 1) update[thisgrp] = 1;
-                    }
-                } else {
-                    if (update[thisgrp] != 1) {
-                        REAL(ans)[thisgrp] = -R_PosInf;
-                    }
-                }
-            }
-            // everything taken care of already. Just warn if all NA groups have occurred at least once
-            for (i=0; i<ngrp; i++) {
-                if (update[i] != 1)  { // equivalent of REAL(ans)[thisgrp] == -R_PosInf
-                    warning("No non-missing values found in at least one group. Returning '-Inf' for such groups to be consistent with base");
+        if (INHERITS(x, char_integer64)) {
+            // as gmin of integer64: with na.rm a group with no value gets the smallest integer64 (not NA), with a warning
+            const long long *xd = (const long long *)REAL(x);
+            long long *ad = (long long *)REAL(ans);
+            if (!LOGICAL(narm)[0]) {
+                GFOLD(long long, xd, ad, update, 0, LMAX(a, u, v), vu || v == NA_INT64_LL)
+            } else {
+                GFOLD(long long, xd, ad, update, 0, LMAXRM(a, u, v), vu)
+                for (i=0; i<ngrp; i++) if (!update[i]) {
+                    warning("No non-missing values found in at least one group. Returning the smallest integer64 for such groups to be consistent with bit64");
+                    for (; i<ngrp; i++) if (!update[i]) ad[i] = -LLONG_MAX;
                     break;
                 }
             }
+            break;
         }
-        break;
+        const double *xd = REAL(x);
+        double *ad = REAL(ans);
+        if (!LOGICAL(narm)[0]) {
+            // NA wins, then the first NaN a group has, and of equal values (0 and -0) the first
+            GFOLD(double, xd, ad, update, 0, DMAX(a, u, v), vu || ISNA(v))
+        } else {
+            GFOLD(double, xd, ad, update, 0, DMAXRM(a, u, v), vu)
+        }
+        ans = gmaxans(ans, update, LOGICAL(narm)[0]);
+    } break;
     default:
         error("Type '%s' not supported by GForce max (gmax). Either add the prefix base::max(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
@@ -479,171 +769,99 @@ SEXP gmedian(SEXP x, SEXP narm) {
     if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
     if (!isVectorAtomic(x)) error("GForce median can only be applied to columns, not .SD or similar. To find median of all items in a list such as .SD, either add the prefix stats::median(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,median),by=,.SDcols=]'");
     if (inherits(x, "factor")) error("median is not meaningful for factors.");
-    R_len_t i=0, j=0, k=0, imed=0, thisgrpsize=0, medianindex=0, nacount=0;
-    double val = 0.0;
-    Rboolean isna = FALSE, isint64 = FALSE;
-    SEXP ans, sub, class;
-    void *ptr;
+    Rboolean isint64 = FALSE;
+    SEXP ans, class;
     int n = (irowslen == -1) ? length(x) : irowslen;
     if (grpn != n) error("grpn [%d] != length(x) [%d] in gmedian", grpn, n);
+    const Rboolean rm = LOGICAL(narm)[0];
+    const int nth = gbufnth();
     switch(TYPEOF(x)) {
-    case REALSXP:
+    case REALSXP: {
         class = getAttrib(x, R_ClassSymbol);
         isint64 = (isString(class) && STRING_ELT(class, 0) == char_integer64);
         ans = PROTECT(allocVector(REALSXP, ngrp));
-        sub = PROTECT(allocVector(REALSXP, maxgrpn)); // allocate once upfront
-        ptr = DATAPTR(sub);
-        if (!LOGICAL(narm)[0]) {
-            for (i=0; i<ngrp; i++) {
-                isna = FALSE;
-                thisgrpsize = grpsize[i];
-                SETLENGTH(sub, thisgrpsize);
-                for (j=0; j<thisgrpsize; j++) {
-                    k = ff[i]+j-1;
-                    if (isunsorted) k = oo[k]-1;
-                    k = (irowslen == -1) ? k : irows[k]-1;
-                    // TODO: raise this if-statement?
-                    if (!isint64) {
-                        if (!ISNAN(REAL(x)[k])) {
-                            REAL(sub)[j] = REAL(x)[k];
-                        } else {
-                            REAL(ans)[i] = NA_REAL;
-                            isna = TRUE; break;
-                        }
-                    } else {
-                        u.d = REAL(x)[k];
-                        if (u.ll != NA_INT64_LL) {
-                            REAL(sub)[j] = (double)u.ll;
-                        } else {
-                            REAL(ans)[i] = NA_REAL;
-                            isna = TRUE; break;
-                        }
-                    } 
+        const double *xd = REAL(x);
+        double *ad = REAL(ans);
+        double *buf = (double *)R_alloc((size_t)nth*maxgrpn, sizeof(double)); // allocate once upfront, one per thread
+        #pragma omp parallel num_threads(nth)
+        {
+            double *sub = buf + (size_t)omp_get_thread_num()*maxgrpn;
+            #pragma omp for schedule(dynamic, GBATCH)
+            for (int i=0; i<ngrp; i++) {
+                int thisgrpsize = 0;
+                Rboolean isna = FALSE;
+                for (int j=0; j<grpsize[i]; j++) {
+                    double v = xd[growx(i, j)];
+                    if (isint64) {
+                        union {double d; long long ll;} u64;
+                        u64.d = v;
+                        if (u64.ll == NA_INT64_LL) v = NA_REAL; else v = (double)u64.ll;
+                    }
+                    if (ISNAN(v)) {
+                        if (rm) continue;
+                        isna = TRUE; break;
+                    }
+                    sub[thisgrpsize++] = v;
                 }
-                if (isna) continue;
-                medianindex = (R_len_t)(ceil((double)(thisgrpsize)/2));
-                REAL(ans)[i] = dquickselect(ptr, thisgrpsize, medianindex-1); // 0-indexed
+                if (isna || thisgrpsize == 0) { ad[i] = NA_REAL; continue; }  // all NAs when na.rm=TRUE
+                const int medianindex = (int)(ceil((double)(thisgrpsize)/2));
+                ad[i] = dquickselect(sub, thisgrpsize, medianindex-1); // 0-indexed
                 // all elements to the left of thisgrpsize/2 is < the value at that index
                 // we just need to get min of last half
                 if (thisgrpsize % 2 == 0) {
-                    val = REAL(sub)[medianindex]; // 0-indexed
-                    for (imed=medianindex+1; imed<thisgrpsize; imed++) {
-                        val = REAL(sub)[imed] > val ? val : REAL(sub)[imed];
+                    double val = sub[medianindex]; // 0-indexed
+                    for (int imed=medianindex+1; imed<thisgrpsize; imed++) {
+                        val = sub[imed] > val ? val : sub[imed];
                     }
-                    REAL(ans)[i] = (REAL(ans)[i] + val)/2.0;
+                    ad[i] = (ad[i] + val)/2.0;
                 }
             }
-        } else {
-            for (i=0; i<ngrp; i++) {
-                nacount = 0;
-                thisgrpsize = grpsize[i];
-                for (j=0; j<thisgrpsize; j++) {
-                    k = ff[i]+j-1;
-                    if (isunsorted) k = oo[k]-1;
-                    k = (irowslen == -1) ? k : irows[k]-1;
-                    // TODO: raise this if-statement?
-                    if (!isint64) {
-                        if (!ISNAN(REAL(x)[k])) {
-                            REAL(sub)[j-nacount] = REAL(x)[k];
-                        } else { nacount++; continue; }
-                    } else {
-                        u.d = REAL(x)[k];
-                        if (u.ll != NA_INT64_LL) {
-                            REAL(sub)[j-nacount] = (double)u.ll;
-                        } else { nacount++; continue; }
-                    }
-                }
-                if (nacount == thisgrpsize) {
-                    REAL(ans)[i] = NA_REAL; // all NAs
-                    continue;
-                }
-                thisgrpsize -= nacount;
-                SETLENGTH(sub, thisgrpsize);
-                medianindex = (R_len_t)(ceil((double)(thisgrpsize)/2));
-                REAL(ans)[i] = dquickselect(ptr, thisgrpsize, medianindex-1);
-                if (thisgrpsize % 2 == 0) {
-                    // all elements to the left of thisgrpsize/2 is < the value at that index
-                    // we just need to get min of last half
-                    val = REAL(sub)[medianindex]; // 0-indexed
-                    for (imed=medianindex+1; imed<thisgrpsize; imed++) {
-                        val = REAL(sub)[imed] > val ? val : REAL(sub)[imed];
-                    }
-                    REAL(ans)[i] = (REAL(ans)[i] + val)/2.0;
-                }
-            }            
         }
-        SETLENGTH(sub, maxgrpn);
-        break;
-    case LGLSXP: case INTSXP: 
+    } break;
+    case LGLSXP: case INTSXP: {
         ans = PROTECT(allocVector(REALSXP, ngrp));
-        sub = PROTECT(allocVector(INTSXP, maxgrpn)); // allocate once upfront
-        ptr = DATAPTR(sub);
-        if (!LOGICAL(narm)[0]) {
-            for (i=0; i<ngrp; i++) {
-                isna = FALSE;
-                thisgrpsize = grpsize[i];
-                SETLENGTH(sub, thisgrpsize);
-                for (j=0; j<thisgrpsize; j++) {
-                    k = ff[i]+j-1;
-                    if (isunsorted) k = oo[k]-1;
-                    k = (irowslen == -1) ? k : irows[k]-1;
-                    if (INTEGER(x)[k] != NA_INTEGER) {
-                        INTEGER(sub)[j] = INTEGER(x)[k];
-                    } else {
-                        REAL(ans)[i] = NA_REAL;
+        const int *xd = INTEGER(x);
+        double *ad = REAL(ans);
+        int *buf = (int *)R_alloc((size_t)nth*maxgrpn, sizeof(int)); // allocate once upfront, one per thread
+        #pragma omp parallel num_threads(nth)
+        {
+            int *sub = buf + (size_t)omp_get_thread_num()*maxgrpn;
+            #pragma omp for schedule(dynamic, GBATCH)
+            for (int i=0; i<ngrp; i++) {
+                int thisgrpsize = 0;
+                Rboolean isna = FALSE;
+                for (int j=0; j<grpsize[i]; j++) {
+                    const int v = xd[growx(i, j)];
+                    if (v == NA_INTEGER) {
+                        if (rm) continue;
                         isna = TRUE; break;
                     }
+                    sub[thisgrpsize++] = v;
                 }
-                if (isna) continue;
-                medianindex = (R_len_t)(ceil((double)(thisgrpsize)/2));
-                REAL(ans)[i] = iquickselect(ptr, thisgrpsize, medianindex-1); // 0-indexed
+                if (isna || thisgrpsize == 0) { ad[i] = NA_REAL; continue; }  // all NAs when na.rm=TRUE
+                const int medianindex = (int)(ceil((double)(thisgrpsize)/2));
+                ad[i] = iquickselect(sub, thisgrpsize, medianindex-1); // 0-indexed
                 // all elements to the left of thisgrpsize/2 is < the value at that index
                 // we just need to get min of last half
                 if (thisgrpsize % 2 == 0) {
-                    val = INTEGER(sub)[medianindex]; // 0-indexed
-                    for (imed=medianindex+1; imed<thisgrpsize; imed++) {
-                        val = INTEGER(sub)[imed] > val ? val : INTEGER(sub)[imed];
+                    double val = sub[medianindex]; // 0-indexed
+                    for (int imed=medianindex+1; imed<thisgrpsize; imed++) {
+                        val = sub[imed] > val ? val : sub[imed];
                     }
-                    REAL(ans)[i] = (REAL(ans)[i] + val)/2.0;
+                    ad[i] = (ad[i] + val)/2.0;
                 }
             }
-        } else {
-            for (i=0; i<ngrp; i++) {
-                nacount = 0;
-                thisgrpsize = grpsize[i];
-                for (j=0; j<thisgrpsize; j++) {
-                    k = ff[i]+j-1;
-                    if (isunsorted) k = oo[k]-1;
-                    k = (irowslen == -1) ? k : irows[k]-1;
-                    if (INTEGER(x)[k] != NA_INTEGER) {
-                        INTEGER(sub)[j-nacount] = INTEGER(x)[k];
-                    } else { nacount++; continue; }
-                }
-                if (nacount == thisgrpsize) {
-                    REAL(ans)[i] = NA_REAL; // all NAs
-                    continue;
-                }
-                thisgrpsize -= nacount;
-                SETLENGTH(sub, thisgrpsize);
-                medianindex = (R_len_t)(ceil((double)(thisgrpsize)/2));
-                REAL(ans)[i] = iquickselect(ptr, thisgrpsize, medianindex-1);
-                if (thisgrpsize % 2 == 0) {
-                    // all elements to the left of thisgrpsize/2 is < the value at that index
-                    // we just need to get min of last half
-                    val = INTEGER(sub)[medianindex]; // 0-indexed
-                    for (imed=medianindex+1; imed<thisgrpsize; imed++) {
-                        val = INTEGER(sub)[imed] > val ? val : INTEGER(sub)[imed];
-                    }
-                    REAL(ans)[i] = (REAL(ans)[i] + val)/2.0;
-                }
-            }            
         }
-        SETLENGTH(sub, maxgrpn);
-        break;
+    } break;
     default:
         error("Type '%s' not supported by GForce median (gmedian). Either add the prefix stats::median(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
-    UNPROTECT(2);
+    // as median.default, which keeps the class of a Date, POSIXct or difftime (mean of the middle two by mean.Date etc.)
+    if (INHERITS(x, char_Date) || INHERITS(x, char_POSIXct) || inherits(x, "difftime")) {
+        copyMostAttrib(x, ans);
+        if (INHERITS(x, char_IDate)) ans = gidateans(ans);
+    }
+    UNPROTECT(1);
     return(ans);
 }
 
@@ -848,128 +1066,80 @@ SEXP gnthvalue(SEXP x, SEXP valArg) {
 }
 
 // TODO: gwhich.min, gwhich.max
-// implemented this similar to gmedian to balance well between speed and memory usage. There's one extra allocation on maximum groups and that's it.. and that helps speed things up extremely since we don't have to collect x's values for each group for each step (mean, residuals, mean again and then variance).
-SEXP gvarsd1(SEXP x, SEXP narm, Rboolean isSD)
+// The variance of the n values gathered in sub, whose sum is m: the mean in two passes, then the sum of squares
+static inline double gvari(const int *sub, const int n, long double m)
 {
-    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
-    if (!isVectorAtomic(x)) error("GForce var/sd can only be applied to columns, not .SD or similar. To find var/sd of all items in a list such as .SD, either add the prefix stats::var(.SD) (or stats::sd(.SD)) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,var),by=,.SDcols=]'");
-    if (inherits(x, "factor")) error("var/sd is not meaningful for factors.");
-    long double m, s, v;
-    R_len_t i, j, ix, thisgrpsize = 0, n = (irowslen == -1) ? length(x) : irowslen;
-    if (grpn != n) error("grpn [%d] != length(x) [%d] in gvar", grpn, n);
-    SEXP sub, ans = PROTECT(allocVector(REALSXP, ngrp));
-    Rboolean ans_na;
-    switch(TYPEOF(x)) {
-        case LGLSXP: case INTSXP:
-        sub = PROTECT(allocVector(INTSXP, maxgrpn)); // allocate once upfront
-        if (!LOGICAL(narm)[0]) {
-            for (i=0; i<ngrp; i++) {
-                m=0.; s=0.; v=0.; ans_na = FALSE;
-                if (grpsize[i] != 1) {
-                    thisgrpsize = grpsize[i];
-                    SETLENGTH(sub, thisgrpsize); // to gather this group's data
-                    for (j=0; j<thisgrpsize; j++) {
-                        ix = ff[i]+j-1;
-                        if (isunsorted) ix = oo[ix]-1;
-                        ix = (irowslen == -1) ? ix : irows[ix]-1;
-                        if (INTEGER(x)[ix] == NA_INTEGER) { ans_na = TRUE; break; }
-                        INTEGER(sub)[j] = INTEGER(x)[ix];
-                        m += INTEGER(sub)[j]; // sum
-                    }
-                    if (ans_na) { REAL(ans)[i] = NA_REAL; continue; }
-                    m = m/thisgrpsize; // mean, first pass
-                    for (j=0; j<thisgrpsize; j++) s += (INTEGER(sub)[j]-m); // residuals
-                    m += (s/thisgrpsize); // mean, second pass
-                    for (j=0; j<thisgrpsize; j++) { // variance
-                        v += (INTEGER(sub)[j]-(double)m) * (INTEGER(sub)[j]-(double)m);
-                    }
-                    REAL(ans)[i] = (double)v/(thisgrpsize-1);
-                    if (isSD) REAL(ans)[i] = SQRTL(REAL(ans)[i]);
-                } else REAL(ans)[i] = NA_REAL;
-            }
-        } else {
-            for (i=0; i<ngrp; i++) {
-                m=0.; s=0.; v=0.; thisgrpsize = 0;
-                if (grpsize[i] != 1) {
-                    SETLENGTH(sub, grpsize[i]); // to gather this group's data
-                    for (j=0; j<grpsize[i]; j++) {
-                        ix = ff[i]+j-1;
-                        if (isunsorted) ix = oo[ix]-1;
-                        ix = (irowslen == -1) ? ix : irows[ix]-1;
-                        if (INTEGER(x)[ix] == NA_INTEGER) continue;
-                        INTEGER(sub)[thisgrpsize] = INTEGER(x)[ix];
-                        m += INTEGER(sub)[thisgrpsize]; // sum
-                        thisgrpsize++;
-                    }
-                    if (thisgrpsize <= 1) { REAL(ans)[i] = NA_REAL; continue; }
-                    m = m/thisgrpsize; // mean, first pass
-                    for (j=0; j<thisgrpsize; j++) s += (INTEGER(sub)[j]-m); // residuals
-                    m += (s/thisgrpsize); // mean, second pass
-                    for (j=0; j<thisgrpsize; j++) { // variance
-                        v += (INTEGER(sub)[j]-(double)m) * (INTEGER(sub)[j]-(double)m);
-                    }
-                    REAL(ans)[i] = (double)v/(thisgrpsize-1);
-                    if (isSD) REAL(ans)[i] = SQRTL(REAL(ans)[i]);
-                } else REAL(ans)[i] = NA_REAL;
-            }
-        }
-        SETLENGTH(sub, maxgrpn);
-        break;
-        case REALSXP:
-        sub = PROTECT(allocVector(REALSXP, maxgrpn)); // allocate once upfront
-        if (!LOGICAL(narm)[0]) {
-            for (i=0; i<ngrp; i++) {
-                m=0.; s=0.; v=0.; ans_na = FALSE;
-                if (grpsize[i] != 1) {
-                    thisgrpsize = grpsize[i];
-                    SETLENGTH(sub, thisgrpsize); // to gather this group's data
-                    for (j=0; j<thisgrpsize; j++) {
-                        ix = ff[i]+j-1;
-                        if (isunsorted) ix = oo[ix]-1;
-                        ix = (irowslen == -1) ? ix : irows[ix]-1;
-                        if (ISNAN(REAL(x)[ix])) { ans_na = TRUE; break; }
-                        REAL(sub)[j] = REAL(x)[ix];
-                        m += REAL(sub)[j]; // sum
-                    }
-                    if (ans_na) { REAL(ans)[i] = NA_REAL; continue; }
-                    m = m/thisgrpsize; // mean, first pass
-                    for (j=0; j<thisgrpsize; j++) s += (REAL(sub)[j]-m); // residuals
-                    m += (s/thisgrpsize); // mean, second pass
-                    for (j=0; j<thisgrpsize; j++) { // variance
-                        v += (REAL(sub)[j]-(double)m) * (REAL(sub)[j]-(double)m);
-                    }
-                    REAL(ans)[i] = (double)v/(thisgrpsize-1);
-                    if (isSD) REAL(ans)[i] = SQRTL(REAL(ans)[i]);
-                } else REAL(ans)[i] = NA_REAL;
-            }
-        } else {
-            for (i=0; i<ngrp; i++) {
-                m=0.; s=0.; v=0.; thisgrpsize = 0;
-                if (grpsize[i] != 1) {
-                    SETLENGTH(sub, grpsize[i]); // to gather this group's data
-                    for (j=0; j<grpsize[i]; j++) {
-                        ix = ff[i]+j-1;
-                        if (isunsorted) ix = oo[ix]-1;
-                        ix = (irowslen == -1) ? ix : irows[ix]-1;
-                        if (ISNAN(REAL(x)[ix])) continue;
-                        REAL(sub)[thisgrpsize] = REAL(x)[ix];
-                        m += REAL(sub)[thisgrpsize]; // sum
-                        thisgrpsize++;
-                    }
-                    if (thisgrpsize <= 1) { REAL(ans)[i] = NA_REAL; continue; }
-                    m = m/thisgrpsize; // mean, first pass
-                    for (j=0; j<thisgrpsize; j++) s += (REAL(sub)[j]-m); // residuals
-                    m += (s/thisgrpsize); // mean, second pass
-                    for (j=0; j<thisgrpsize; j++) { // variance
-                        v += (REAL(sub)[j]-(double)m) * (REAL(sub)[j]-(double)m);
-                    }
-                    REAL(ans)[i] = (double)v/(thisgrpsize-1);
-                    if (isSD) REAL(ans)[i] = SQRTL(REAL(ans)[i]);
-                } else REAL(ans)[i] = NA_REAL;
-            }
-        }
-        SETLENGTH(sub, maxgrpn);
-        break;
+    long double s=0., v=0.;
+    m = m/n; // mean, first pass
+    for (int j=0; j<n; j++) s += (sub[j]-m); // residuals
+    m += (s/n); // mean, second pass
+    for (int j=0; j<n; j++) { // variance
+        v += (sub[j]-(double)m) * (sub[j]-(double)m);
+    }
+    return (double)v/(n-1);
+}
+
+static inline double gvard(const double *sub, const int n, long double m)
+{
+    long double s=0., v=0.;
+    m = m/n; // mean, first pass
+    for (int j=0; j<n; j++) s += (sub[j]-m); // residuals
+    m += (s/n); // mean, second pass
+    for (int j=0; j<n; j++) { // variance
+        v += (sub[j]-(double)m) * (sub[j]-(double)m);
+    }
+    return (double)v/(n-1);
+}
+
+// implemented this similar to gmedian to balance well between speed and memory usage. There's one extra allocation on maximum groups and that's it.. and that helps speed things up extremely since we don't have to collect x's values for each group for each step (mean, residuals, mean again and then variance).
+SEXP gvarsd1(SEXP x, SEXP narm, Rboolean isSD)
+{
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    if (!isVectorAtomic(x)) error("GForce var/sd can only be applied to columns, not .SD or similar. To find var/sd of all items in a list such as .SD, either add the prefix stats::var(.SD) (or stats::sd(.SD)) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,var),by=,.SDcols=]'");
+    if (inherits(x, "factor")) error("var/sd is not meaningful for factors.");
+    R_len_t n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in gvar", grpn, n);
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    double *ad = REAL(ans);
+    const Rboolean rm = LOGICAL(narm)[0];
+    const int nth = gbufnth();
+    // gather each group's values into this thread's sub, then the mean in two passes and the variance
+    #define GVARSD(CTYPE, XD, ISNAV, VAROF) { \
+        CTYPE *buf = (CTYPE *)R_alloc((size_t)nth*maxgrpn, sizeof(CTYPE)); /* allocate once upfront, one per thread */ \
+        _Pragma("omp parallel num_threads(nth)") \
+        { \
+            CTYPE *sub = buf + (size_t)omp_get_thread_num()*maxgrpn; /* to gather this group's data */ \
+            _Pragma("omp for schedule(dynamic, GBATCH)") \
+            for (int i=0; i<ngrp; i++) { \
+                if (grpsize[i] == 1) { ad[i] = NA_REAL; continue; } \
+                long double m=0.; \
+                int thisgrpsize = 0; \
+                Rboolean ans_na = FALSE; \
+                for (int j=0; j<grpsize[i]; j++) { \
+                    const CTYPE xv = XD[growx(i, j)]; \
+                    if (ISNAV(xv)) { \
+                        if (rm) continue; \
+                        ans_na = TRUE; break; \
+                    } \
+                    sub[thisgrpsize++] = xv; \
+                    m += xv; /* sum */ \
+                } \
+                if (ans_na || (rm && thisgrpsize <= 1)) { ad[i] = NA_REAL; continue; } \
+                ad[i] = VAROF(sub, thisgrpsize, m); \
+                if (isSD) ad[i] = SQRTL(ad[i]); \
+            } \
+        } \
+    }
+    #define INTISNA(xv) ((xv) == NA_INTEGER)
+    switch(TYPEOF(x)) {
+        case LGLSXP: case INTSXP: {
+            const int *xd = INTEGER(x);
+            GVARSD(int, xd, INTISNA, gvari)
+        } break;
+        case REALSXP: {
+            const double *xd = REAL(x);
+            GVARSD(double, xd, ISNAN, gvard)
+        } break;
         default: 
             if (isSD) {
                 error("Type '%s' not supported by GForce var (gvar). Either add the prefix stats::var(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
@@ -977,7 +1147,9 @@ SEXP gvarsd1(SEXP x, SEXP narm, Rboolean isSD)
                 error("Type '%s' not supported by GForce sd (gsd). Either add the prefix stats::sd(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));                
             }
     }
-    UNPROTECT(2);
+    #undef INTISNA
+    #undef GVARSD
+    UNPROTECT(1);
     return (ans);
 }
 
@@ -994,52 +1166,923 @@ SEXP gprod(SEXP x, SEXP narm)
     if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
     if (!isVectorAtomic(x)) error("GForce prod can only be applied to columns, not .SD or similar. To multiply all items in a list such as .SD, either add the prefix base::prod(.SD) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,prod),by=,.SDcols=]'");
     if (inherits(x, "factor")) error("prod is not meaningful for factors.");
-    int i, ix, thisgrp;
     int n = (irowslen == -1) ? length(x) : irowslen;
     //clock_t start = clock();
     SEXP ans;
     if (grpn != n) error("grpn [%d] != length(x) [%d] in gprod", grpn, n);
+    const Rboolean rm = LOGICAL(narm)[0];
     long double *s = malloc(ngrp * sizeof(long double));
     if (!s) error("Unable to allocate %d * %d bytes for gprod", ngrp, sizeof(long double));
-    for (i=0; i<ngrp; i++) s[i] = 1.0;
-    ans = PROTECT(allocVector(REALSXP, ngrp));
     switch(TYPEOF(x)) {
-    case LGLSXP: case INTSXP:
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if(INTEGER(x)[ix] == NA_INTEGER) { 
-                if (!LOGICAL(narm)[0]) s[thisgrp] = NA_REAL;  // Let NA_REAL propogate from here. R_NaReal is IEEE.
-                continue;
+    case LGLSXP: case INTSXP: {
+        const int *xd = INTEGER(x);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            long double t = 1.0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int v = xd[growx(g, j)];
+                if (v == NA_INTEGER) {
+                    if (!rm) t = NA_REAL;  // Let NA_REAL propogate from here. R_NaReal is IEEE.
+                    continue;
+                }
+                t *= v;  // no under/overflow here, s is long double (like base)
             }
-            s[thisgrp] *= INTEGER(x)[ix];  // no under/overflow here, s is long double (like base)
-        }
-        for (i=0; i<ngrp; i++) {
-            if (s[i] > DBL_MAX) REAL(ans)[i] = R_PosInf;
-            else if (s[i] < -DBL_MAX) REAL(ans)[i] = R_NegInf;
-            else REAL(ans)[i] = (double)s[i];
+            s[g] = t;
         }
-        break;
-    case REALSXP:
-        for (i=0; i<n; i++) {
-            thisgrp = grp[i];
-            ix = (irowslen == -1) ? i : irows[i]-1;
-            if(ISNAN(REAL(x)[ix]) && LOGICAL(narm)[0]) continue;  // else let NA_REAL propogate from here
-            s[thisgrp] *= REAL(x)[ix];  // done in long double, like base
-        }
-        for (i=0; i<ngrp; i++) {
-            if (s[i] > DBL_MAX) REAL(ans)[i] = R_PosInf;
-            else if (s[i] < -DBL_MAX) REAL(ans)[i] = R_NegInf;
-            else REAL(ans)[i] = (double)s[i];
+    } break;
+    case REALSXP: {
+        const double *xd = REAL(x);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            long double t = 1.0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const double v = xd[growx(g, j)];
+                if (ISNAN(v) && rm) continue;  // else let NA_REAL propogate from here
+                t *= v;  // done in long double, like base
+            }
+            s[g] = t;
         }
-        break;
+    } break;
     default:
         free(s);
         error("Type '%s' not supported by GForce prod (gprod). Either add the prefix base::prod(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
     }
+    ans = gprodans(x, s);
     free(s);
-    copyMostAttrib(x, ans);
     UNPROTECT(1);
     // Rprintf("this gprod took %8.3f\n", 1.0*(clock()-start)/CLOCKS_PER_SEC);
     return(ans);
 }
+
+// The number of distinct values in each group, as uniqueN: NA and NaN are distinct values unless na.rm, 0 and -0 are not.
+// Each group's values are gathered into this thread's buffer as 64-bit keys, equal exactly when the values are, and sorted.
+static int gkeycmp(const void *a, const void *b) {
+    const unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+SEXP guniqueN(SEXP x, SEXP narm)
+{
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    if (!isVectorAtomic(x)) error("GForce uniqueN can only be applied to columns, not .SD or similar. To count the unique rows of .SD, either add the prefix data.table::uniqueN(.SD) or turn off GForce optimization using options(datatable.optimize=1)");
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in guniqueN", grpn, n);
+    const Rboolean rm = LOGICAL(narm)[0];
+    const int type = TYPEOF(x);
+    if (type != LGLSXP && type != INTSXP && type != REALSXP && type != STRSXP)
+        error("Type '%s' not supported by GForce uniqueN (guniqueN). Either add the prefix data.table::uniqueN(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(type));
+    SEXP ans = PROTECT(allocVector(INTSXP, ngrp));
+    int *ad = INTEGER(ans);
+    const int *xi = type == REALSXP || type == STRSXP ? NULL : INTEGER(x);
+    const double *xd = type == REALSXP ? REAL(x) : NULL;
+    const SEXP *xs = type == STRSXP ? (const SEXP *)DATAPTR(x) : NULL;
+    const Rboolean is64 = INHERITS(x, char_integer64);  // by its bits: as doubles some are NaN and its NA is -0
+    const int nth = gbufnth();
+    unsigned long long *buf = (unsigned long long *)R_alloc((size_t)nth*maxgrpn, sizeof(unsigned long long));
+    #pragma omp parallel num_threads(nth)
+    {
+        unsigned long long *sub = buf + (size_t)omp_get_thread_num()*maxgrpn;
+        #pragma omp for schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            int k = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int ix = growx(g, j);
+                if (xi) {
+                    if (rm && xi[ix] == NA_INTEGER) continue;
+                    sub[k++] = (unsigned)xi[ix];
+                } else if (xd) {
+                    union { double d; unsigned long long u; } v;
+                    v.d = xd[ix];
+                    if (is64) {
+                        if (rm && (long long)v.u == NA_INT64_LL) continue;
+                    } else if (ISNAN(v.d)) {
+                        if (rm) continue;
+                        v.d = ISNA(v.d) ? NA_REAL : R_NaN;  // one key for all the NaN payloads
+                    } else if (v.d == 0) v.d = 0.0;  // -0 to 0
+                    sub[k++] = v.u;
+                } else {
+                    if (rm && xs[ix] == NA_STRING) continue;
+                    sub[k++] = (uintptr_t)xs[ix];  // strings are cached, so equal strings are the same CHARSXP
+                }
+            }
+            qsort(sub, k, sizeof(unsigned long long), gkeycmp);
+            int u = k > 0;
+            for (int j=1; j<k; j++) u += sub[j] != sub[j-1];
+            ad[g] = u;
+        }
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// Quantile probs of type 1-9 as stats::quantile of one group's n values in x, which it reorders. As there, each type picks
+// the lo-th and hi-th smallest values (clamped to 1..n) and the weight h of the hi-th; type 7 is computed its own way
+// without fuzz, as there too.
+static double gquantile1(double *x, const int n, const double p, const int type)
+{
+    if (n == 0) return(NA_REAL);
+    double h, j;
+    if (type == 7) {
+        const double index = 1 + (n-1)*p;
+        j = floor(index);
+        h = index - j;
+    } else {
+        const double fuzz = 4*DBL_EPSILON;
+        if (type <= 3) {
+            const double nppm = type == 3 ? n*p - .5 : n*p;
+            j = floor(nppm + fuzz);
+            switch(type) {
+            case 1:  h = nppm > j; break;
+            case 2:  h = ((nppm > j) + 1)/2.0; break;
+            default: h = nppm != j || j - 2*floor(j/2) == 1;  // R's (j %% 2L) == 1L, also for j=-1
+            }
+        } else {
+            static const double ab[6][2] = {{0, 1}, {.5, .5}, {0, 0}, {1, 1}, {1/3.0, 1/3.0}, {3/8.0, 3/8.0}};  // types 4-9
+            const double a = ab[type-4][0], b = ab[type-4][1];
+            const double nppm = a + p*(n+1-a-b);
+            j = floor(nppm + fuzz);
+            h = nppm - j;
+            if (fabs(h) < fuzz) h = 0;
+        }
+    }
+    const int lo = j < 1 ? 1 : (j > n ? n : (int)j);
+    const int hi = j+1 > n ? n : (j+1 < 1 ? 1 : (int)j+1);
+    const double qlo = dquickselect(x, n, lo-1);
+    if (h <= 0) return(qlo);
+    double qhi = qlo;
+    if (hi > lo) {  // the smallest of those after the lo-th
+        qhi = x[lo];
+        for (int k=lo+1; k<n; k++) if (x[k] < qhi) qhi = x[k];
+    }
+    if (h >= 1) return(qhi);
+    return(qlo == qhi ? qlo : (1-h)*qlo + h*qhi);
+}
+
+SEXP gquantile(SEXP x, SEXP probsArg, SEXP narm, SEXP typeArg)
+{
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    if (!isReal(probsArg) || LENGTH(probsArg)!=1 || !R_FINITE(REAL(probsArg)[0]) || REAL(probsArg)[0]<0 || REAL(probsArg)[0]>1) error("probs must be a single number in [0,1]");
+    if (!isInteger(typeArg) || LENGTH(typeArg)!=1 || INTEGER(typeArg)[0]<1 || INTEGER(typeArg)[0]>9) error("type must be an integer from 1 to 9");
+    if (!isVectorAtomic(x)) error("GForce quantile can only be applied to columns, not .SD or similar. Either add the prefix stats::quantile(.) or turn off GForce optimization using options(datatable.optimize=1). More likely, you may be looking for 'DT[,lapply(.SD,quantile,probs),by=,.SDcols=]'");
+    if (inherits(x, "factor") || inherits(x, "integer64"))
+        error("Class '%s' not supported by GForce quantile (gquantile). Either add the prefix stats::quantile(.) or turn off GForce optimization using options(datatable.optimize=1)", CHAR(STRING_ELT(getAttrib(x, R_ClassSymbol), 0)));
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in gquantile", grpn, n);
+    if (TYPEOF(x) != INTSXP && TYPEOF(x) != REALSXP)
+        error("Type '%s' not supported by GForce quantile (gquantile). Either add the prefix stats::quantile(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
+    const Rboolean rm = LOGICAL(narm)[0];
+    const double p = REAL(probsArg)[0];
+    const int type = INTEGER(typeArg)[0];
+    // types 1 and 3 pick one of the values, so stay integer like stats::quantile
+    const Rboolean isint = TYPEOF(x) == INTSXP, intans = isint && (type == 1 || type == 3);
+    SEXP ans = PROTECT(allocVector(intans ? INTSXP : REALSXP, ngrp));
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    const int nth = gbufnth();
+    double *buf = (double *)R_alloc((size_t)nth*maxgrpn, sizeof(double));  // one per thread
+    int anyna = 0;
+    #pragma omp parallel num_threads(nth)
+    {
+        double *sub = buf + (size_t)omp_get_thread_num()*maxgrpn;
+        #pragma omp for schedule(dynamic, GBATCH) reduction(|:anyna)
+        for (int g=0; g<ngrp; g++) {
+            int k = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int ix = growx(g, j);
+                const double v = isint ? (xi[ix] == NA_INTEGER ? NA_REAL : xi[ix]) : xd[ix];
+                if (ISNAN(v)) {
+                    if (!rm) anyna = 1;
+                    continue;
+                }
+                sub[k++] = v;
+            }
+            const double q = gquantile1(sub, k, p, type);
+            if (intans) INTEGER(ans)[g] = k ? (int)q : NA_INTEGER; else REAL(ans)[g] = q;
+        }
+    }
+    if (anyna) error("missing values and NaN's not allowed if 'na.rm' is FALSE");
+    UNPROTECT(1);
+    return(ans);
+}
+
+// any and all of a logical column, with base's NA rules: a TRUE (FALSE for all) decides, else an NA gives NA unless na.rm
+static SEXP ganyall(SEXP x, SEXP narm, const Rboolean isall)
+{
+    const char *fun = isall ? "all" : "any";
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    if (!isVectorAtomic(x)) error("GForce %s can only be applied to columns, not .SD or similar. Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", fun, fun);
+    if (!isLogical(x)) error("Type '%s' not supported by GForce %s (g%s). Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)), fun, fun, fun);
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in g%s", grpn, n, fun);
+    const Rboolean rm = LOGICAL(narm)[0];
+    SEXP ans = PROTECT(allocVector(LGLSXP, ngrp));
+    const int *xd = LOGICAL(x);
+    int *ad = LOGICAL(ans);
+    const int decides = !isall;
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        int r = isall;
+        for (int j=0; j<grpsize[g]; j++) {
+            const int v = xd[growx(g, j)];
+            if (v == NA_LOGICAL) {
+                if (!rm) r = NA_LOGICAL;
+            } else if (v == decides) {
+                r = decides;
+                break;
+            }
+        }
+        ad[g] = r;
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gany(SEXP x, SEXP narm) {
+    return(ganyall(x, narm, FALSE));
+}
+
+SEXP gall(SEXP x, SEXP narm) {
+    return(ganyall(x, narm, TRUE));
+}
+
+// The position in its group of each group's first min or max, ignoring NA and NaN as base's which.min and which.max do.
+// A group with none gives NA, where which.min gives integer(0).
+static SEXP gwhich(SEXP x, const Rboolean ismax)
+{
+    const char *fun = ismax ? "which.max" : "which.min";
+    if (!isVectorAtomic(x)) error("GForce %s can only be applied to columns, not .SD or similar. Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", fun, fun);
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in g%s", grpn, n, fun);
+    if (TYPEOF(x) != LGLSXP && TYPEOF(x) != INTSXP && TYPEOF(x) != REALSXP)
+        error("Type '%s' not supported by GForce %s (g%s). Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)), fun, fun, fun);
+    SEXP ans = PROTECT(allocVector(INTSXP, ngrp));
+    int *ad = INTEGER(ans);
+    const Rboolean isint = TYPEOF(x) != REALSXP;
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        int w = NA_INTEGER;
+        if (isint) {
+            int best = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int v = xi[growx(g, j)];
+                if (v == NA_INTEGER) continue;
+                if (w == NA_INTEGER || (ismax ? v > best : v < best)) { best = v; w = j+1; }
+            }
+        } else {
+            double best = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const double v = xd[growx(g, j)];
+                if (ISNAN(v)) continue;
+                if (w == NA_INTEGER || (ismax ? v > best : v < best)) { best = v; w = j+1; }
+            }
+        }
+        ad[g] = w;
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gwhichmin(SEXP x) {
+    return(gwhich(x, FALSE));
+}
+
+SEXP gwhichmax(SEXP x) {
+    return(gwhich(x, TRUE));
+}
+
+// Aggregates of two columns of each group, read together in one pass: weighted.mean(x, w), sum(x*w), cov(x, y) and cor(x, y).
+// Either column may be logical, integer or double and is read as double, as base R coerces them.
+#define GPAIRVAL(I, D, r) ((D) ? (D)[r] : ((I)[r]==NA_INTEGER ? NA_REAL : (double)(I)[r]))
+
+static void gpaircheck(SEXP x, SEXP y, const char *fun)
+{
+    if (!isVectorAtomic(x) || !isVectorAtomic(y)) error("GForce %s can only be applied to columns, not .SD or similar. Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", fun, fun);
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n || length(x) != length(y)) error("grpn [%d] != length(x) [%d] or length(y) [%d] in g%s", grpn, n, length(y), fun);
+    for (int k=0; k<2; k++) {
+        SEXP v = k ? y : x;
+        if (TYPEOF(v) != LGLSXP && TYPEOF(v) != INTSXP && TYPEOF(v) != REALSXP)
+            error("Type '%s' not supported by GForce %s (g%s). Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(v)), fun, fun, fun);
+    }
+}
+
+static Rboolean gnarm(SEXP narm)
+{
+    if (!isLogical(narm) || LENGTH(narm)!=1 || LOGICAL(narm)[0]==NA_LOGICAL) error("na.rm must be TRUE or FALSE");
+    return LOGICAL(narm)[0];
+}
+
+// As weighted.mean.default: sum((x*w)[w!=0])/sum(w) over the rows whose x isn't NA when na.rm, each sum in long double
+SEXP gweightedmean(SEXP x, SEXP w, SEXP narmArg)
+{
+    gpaircheck(x, w, "weighted.mean");
+    const Rboolean narm = gnarm(narmArg);
+    const int *xi = isReal(x) ? NULL : INTEGER(x), *wi = isReal(w) ? NULL : INTEGER(w);
+    const double *xd = isReal(x) ? REAL(x) : NULL, *wd = isReal(w) ? REAL(w) : NULL;
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    double *ad = REAL(ans);
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        long double sxw = 0, sw = 0;
+        for (int j=0; j<grpsize[g]; j++) {
+            const int r = growx(g, j);
+            const double v = GPAIRVAL(xi, xd, r), u = GPAIRVAL(wi, wd, r);
+            if (narm && ISNAN(v)) continue;
+            sw += u;
+            if (u != 0) sxw += v*u;  // true for an NA weight too, whose NA term base keeps
+        }
+        ad[g] = (double)sxw / (double)sw;
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// sum(x*w): the products in double, as x*w would be, summed in long double without allocating x*w
+SEXP gsumprod(SEXP x, SEXP w, SEXP narmArg)
+{
+    gpaircheck(x, w, "sum");
+    const Rboolean narm = gnarm(narmArg);
+    const int *xi = isReal(x) ? NULL : INTEGER(x), *wi = isReal(w) ? NULL : INTEGER(w);
+    const double *xd = isReal(x) ? REAL(x) : NULL, *wd = isReal(w) ? REAL(w) : NULL;
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    double *ad = REAL(ans);
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        long double s = 0;
+        for (int j=0; j<grpsize[g]; j++) {
+            const int r = growx(g, j);
+            const double p = GPAIRVAL(xi, xd, r) * GPAIRVAL(wi, wd, r);
+            if (narm && ISNAN(p)) continue;
+            s += p;
+        }
+        ad[g] = (double)s;
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// As R's cov.c with use="everything": NA when a value is missing or there are fewer than 2; else the means (refined by the
+// mean of the residuals) and then the sums of the products of the residuals, in long double
+static SEXP gcovcor(SEXP x, SEXP y, const Rboolean iscor)
+{
+    gpaircheck(x, y, iscor ? "cor" : "cov");
+    const int *xi = isReal(x) ? NULL : INTEGER(x), *yi = isReal(y) ? NULL : INTEGER(y);
+    const double *xd = isReal(x) ? REAL(x) : NULL, *yd = isReal(y) ? REAL(y) : NULL;
+    SEXP ans = PROTECT(allocVector(REALSXP, ngrp));
+    double *ad = REAL(ans);
+    int sd0 = 0;
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH) reduction(|:sd0)
+    for (int g=0; g<ngrp; g++) {
+        const int n = grpsize[g];
+        ad[g] = NA_REAL;
+        if (n < 2) continue;
+        long double sx = 0, sy = 0;
+        Rboolean isna = FALSE;
+        for (int j=0; j<n && !isna; j++) {
+            const int r = growx(g, j);
+            const double v = GPAIRVAL(xi, xd, r), u = GPAIRVAL(yi, yd, r);
+            if (ISNAN(v) || ISNAN(u)) isna = TRUE;
+            sx += v; sy += u;
+        }
+        if (isna) continue;
+        long double tx = sx/n, ty = sy/n;
+        if (R_FINITE((double)tx)) { sx = 0; for (int j=0; j<n; j++) sx += GPAIRVAL(xi, xd, growx(g, j)) - tx; tx += sx/n; }
+        if (R_FINITE((double)ty)) { sy = 0; for (int j=0; j<n; j++) sy += GPAIRVAL(yi, yd, growx(g, j)) - ty; ty += sy/n; }
+        // as cov.c: the means rounded to double (its xm and ym), then the centred values and their products in long double
+        const long double xm = (double)tx, ym = (double)ty;
+        long double sxy = 0, sxx = 0, syy = 0;
+        for (int j=0; j<n; j++) {
+            const int r = growx(g, j);
+            const long double dx = GPAIRVAL(xi, xd, r) - xm, dy = GPAIRVAL(yi, yd, r) - ym;
+            sxy += dx*dy;
+            if (iscor) { sxx += dx*dx; syy += dy*dy; }
+        }
+        double a = (double)(sxy/(n-1));
+        if (iscor) {
+            const double xsd = (double)SQRTL(sxx/(n-1)), ysd = (double)SQRTL(syy/(n-1));
+            if (xsd == 0 || ysd == 0) { sd0 = 1; continue; }
+            a /= xsd*ysd;
+            if (a > 1) a = 1; else if (a < -1) a = -1;
+        }
+        ad[g] = a;
+    }
+    if (sd0) warning("the standard deviation is zero");
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gcov(SEXP x, SEXP y) {
+    return(gcovcor(x, y, FALSE));
+}
+
+SEXP gcor(SEXP x, SEXP y) {
+    return(gcovcor(x, y, TRUE));
+}
+
+// The window functions for := by group: cumsum, cumprod, cummin, cummax, shift, frank and seq_len(.N) of each group, for all
+// the groups in one pass over them in parallel. Each returns a vector with a value for every row of x (of irows when i is a
+// subset), in row order, which [.data.table assigns at once. Each group is as base R or data.table gives for its rows alone.
+static SEXP gwincheck(SEXP x, const char *fun)
+{
+    if (!isVectorAtomic(x)) error("GForce %s can only be applied to columns, not .SD or similar. Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", fun, fun);
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in g%s", grpn, n, fun);
+    if (TYPEOF(x) != LGLSXP && TYPEOF(x) != INTSXP && TYPEOF(x) != REALSXP)
+        error("Type '%s' not supported by GForce %s (g%s). Either add the prefix base::%s(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)), fun, fun, fun);
+    return(x);
+}
+
+// As base's cumsum and cumprod: in long double; an integer cumsum is NA from an NA on, and from an overflow on with a warning
+static SEXP gcum(SEXP x, const Rboolean isprod)
+{
+    gwincheck(x, isprod ? "cumprod" : "cumsum");
+    const Rboolean isint = TYPEOF(x) != REALSXP;
+    SEXP ans = PROTECT(allocVector(isint && !isprod ? INTSXP : REALSXP, grpn));
+    int *ai = isint && !isprod ? INTEGER(ans) : NULL;
+    double *ad = ai ? NULL : REAL(ans);
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    int overflow = 0;
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH) reduction(|:overflow)
+    for (int g=0; g<ngrp; g++) {
+        long double t = isprod ? 1.0 : 0.0;
+        if (ai) {
+            int j = 0;
+            for (; j<grpsize[g]; j++) {
+                const int v = xi[growx(g, j)];
+                if (v == NA_INTEGER) break;
+                t += v;
+                if (t > INT_MAX || t < 1 + INT_MIN) { overflow = 1; break; }
+                ai[gpos(g, j)] = (int)t;
+            }
+            for (; j<grpsize[g]; j++) ai[gpos(g, j)] = NA_INTEGER;
+        } else {
+            for (int j=0; j<grpsize[g]; j++) {
+                const double v = isint ? (xi[growx(g, j)] == NA_INTEGER ? NA_REAL : xi[growx(g, j)]) : xd[growx(g, j)];
+                if (isprod) t *= v; else t += v;
+                ad[gpos(g, j)] = (double)t;
+            }
+        }
+    }
+    if (overflow) warning("integer overflow in 'cumsum'; use 'cumsum(as.numeric(.))'");
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gcumsum(SEXP x) {
+    return(gcum(x, FALSE));
+}
+
+SEXP gcumprod(SEXP x) {
+    return(gcum(x, TRUE));
+}
+
+// As base's cummin and cummax: an integer one is NA from an NA on; a double one carries NA or NaN on by adding them in
+static SEXP gcumext(SEXP x, const Rboolean ismax)
+{
+    gwincheck(x, ismax ? "cummax" : "cummin");
+    const Rboolean isint = TYPEOF(x) != REALSXP;
+    SEXP ans = PROTECT(allocVector(isint ? INTSXP : REALSXP, grpn));
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    int *ai = isint ? INTEGER(ans) : NULL;
+    double *ad = isint ? NULL : REAL(ans);
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        if (isint) {
+            int j = 0, m = 0;
+            for (; j<grpsize[g]; j++) {
+                const int v = xi[growx(g, j)];
+                if (v == NA_INTEGER) break;
+                if (j == 0 || (ismax ? v > m : v < m)) m = v;
+                ai[gpos(g, j)] = m;
+            }
+            for (; j<grpsize[g]; j++) ai[gpos(g, j)] = NA_INTEGER;
+        } else {
+            double m = ismax ? R_NegInf : R_PosInf;
+            for (int j=0; j<grpsize[g]; j++) {
+                const double v = xd[growx(g, j)];
+                if (ISNAN(v) || ISNAN(m)) m = m + v;  // propagate NA and NaN
+                else m = (ismax ? m > v : m < v) ? m : v;  // of equal values (0 and -0) the later, as base
+                ad[gpos(g, j)] = m;
+            }
+        }
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+SEXP gcummin(SEXP x) {
+    return(gcumext(x, FALSE));
+}
+
+SEXP gcummax(SEXP x) {
+    return(gcumext(x, TRUE));
+}
+
+// shift(x, n, fill, type) within each group, as shift.c: fill coerced to x's type and x's attributes (a factor's levels) kept
+SEXP gshift(SEXP x, SEXP nArg, SEXP fill, SEXP type)
+{
+    if (!isVectorAtomic(x)) error("GForce shift can only be applied to columns, not .SD or similar. Either add the prefix data.table::shift(.) or turn off GForce optimization using options(datatable.optimize=1)");
+    if (!isInteger(nArg) || LENGTH(nArg)!=1 || INTEGER(nArg)[0]<0) error("n must be a single non-negative integer");
+    if (length(fill) != 1) error("fill must be a vector of length 1");
+    if (!isString(type) || LENGTH(type)!=1) error("type must be a character vector of length 1");
+    int n = (irowslen == -1) ? length(x) : irowslen;
+    if (grpn != n) error("grpn [%d] != length(x) [%d] in gshift", grpn, n);
+    const int k = INTEGER(nArg)[0];
+    // the item of its group a row takes: j-k for lag, j+k for lead
+    const int by = strcmp(CHAR(STRING_ELT(type, 0)), "lead") ? -k : k;
+    SEXP thisfill = PROTECT(coerceVector(fill, TYPEOF(x)));
+    SEXP ans = PROTECT(allocVector(TYPEOF(x), grpn));
+    switch(TYPEOF(x)) {
+    case LGLSXP: case INTSXP: {
+        const int *xd = INTEGER(x), f = INTEGER(thisfill)[0];
+        int *ad = INTEGER(ans);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            for (int j=0; j<grpsize[g]; j++) ad[gpos(g, j)] = (j+by >= 0 && j+by < grpsize[g]) ? xd[growx(g, j+by)] : f;
+        }
+    } break;
+    case REALSXP: {
+        const double *xd = REAL(x), f = REAL(thisfill)[0];
+        double *ad = REAL(ans);
+        #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            for (int j=0; j<grpsize[g]; j++) ad[gpos(g, j)] = (j+by >= 0 && j+by < grpsize[g]) ? xd[growx(g, j+by)] : f;
+        }
+    } break;
+    case STRSXP:  // SET_STRING_ELT isn't thread safe
+        for (int g=0; g<ngrp; g++) {
+            for (int j=0; j<grpsize[g]; j++) SET_STRING_ELT(ans, gpos(g, j), (j+by >= 0 && j+by < grpsize[g]) ? STRING_ELT(x, growx(g, j+by)) : STRING_ELT(thisfill, 0));
+        }
+        break;
+    default:
+        error("Type '%s' not supported by GForce shift (gshift). Either add the prefix data.table::shift(.) or turn off GForce optimization using options(datatable.optimize=1)", type2char(TYPEOF(x)));
+    }
+    copyMostAttrib(x, ans);
+    UNPROTECT(2);
+    return(ans);
+}
+
+// frank(x, na.last, ties.method) within each group, as frank.c ranks forderv's order: ties are equal values (0 and -0
+// too); with na.last=TRUE NaN rank after the numbers and NA after NaN, with "keep" both are NA
+typedef struct { double v; int c, j; } grankitem;  // value, class (0 number, 1 NaN, 2 NA) and item of the group
+
+static int grankcmp(const void *a, const void *b) {
+    const grankitem *x = (const grankitem *)a, *y = (const grankitem *)b;
+    if (x->c != y->c) return(x->c - y->c);
+    if (x->c == 0 && x->v != y->v) return(x->v < y->v ? -1 : 1);
+    return(x->j - y->j);  // stable, for "first"
+}
+
+SEXP gfrank(SEXP x, SEXP naLastArg, SEXP tiesArg)
+{
+    gwincheck(x, "frank");
+    if (!isString(tiesArg) || LENGTH(tiesArg)!=1) error("ties.method must be a character vector of length 1");
+    enum {MEAN, FIRST, MAX, MIN, DENSE} ties;
+    const char *tm = CHAR(STRING_ELT(tiesArg, 0));
+    if (!strcmp(tm, "average")) ties = MEAN;
+    else if (!strcmp(tm, "first")) ties = FIRST;
+    else if (!strcmp(tm, "max")) ties = MAX;
+    else if (!strcmp(tm, "min")) ties = MIN;
+    else if (!strcmp(tm, "dense")) ties = DENSE;
+    else error("Internal error: invalid ties.method for gfrank, should have been caught before. Please report to datatable-help");
+    const Rboolean keep = isString(naLastArg);  // "keep", else TRUE
+    const Rboolean isint = TYPEOF(x) != REALSXP;
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    SEXP ans = PROTECT(allocVector(ties == MEAN ? REALSXP : INTSXP, grpn));
+    double *ad = ties == MEAN ? REAL(ans) : NULL;
+    int *ai = ties == MEAN ? NULL : INTEGER(ans);
+    const int nth = gbufnth();
+    grankitem *buf = (grankitem *)R_alloc((size_t)nth*maxgrpn, sizeof(grankitem));  // one per thread
+    #pragma omp parallel num_threads(nth)
+    {
+        grankitem *sub = buf + (size_t)omp_get_thread_num()*maxgrpn;
+        #pragma omp for schedule(dynamic, GBATCH)
+        for (int g=0; g<ngrp; g++) {
+            int m = 0;
+            for (int j=0; j<grpsize[g]; j++) {
+                const int ix = growx(g, j);
+                grankitem it = { 0.0, 0, j };
+                if (isint) {
+                    if (xi[ix] == NA_INTEGER) it.c = 2; else it.v = xi[ix];
+                } else {
+                    if (ISNAN(xd[ix])) it.c = ISNA(xd[ix]) ? 2 : 1; else it.v = xd[ix];
+                }
+                if (keep && it.c) {
+                    if (ad) ad[gpos(g, j)] = NA_REAL; else ai[gpos(g, j)] = NA_INTEGER;
+                    continue;
+                }
+                sub[m++] = it;
+            }
+            qsort(sub, m, sizeof(grankitem), grankcmp);
+            for (int a=0, b, dense=1; a<m; a=b, dense++) {
+                // sub[a..b) are a run of ties, ranked a+1..b
+                for (b=a+1; b<m && sub[b].c == sub[a].c && (sub[a].c || sub[b].v == sub[a].v); b++);
+                for (int r=a; r<b; r++) {
+                    const int pos = gpos(g, sub[r].j);
+                    switch(ties) {
+                    case MEAN:  ad[pos] = (a+1+b)/2.0; break;  // (2*xstart+xlen-1)/2 as frank.c with xstart=a+1, xlen=b-a
+                    case FIRST: ai[pos] = r+1; break;
+                    case MAX:   ai[pos] = b; break;
+                    case MIN:   ai[pos] = a+1; break;
+                    case DENSE: ai[pos] = dense; break;
+                    }
+                }
+            }
+        }
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// seq_len(.N): each row's place in its group
+SEXP gseqlen()
+{
+    SEXP ans = PROTECT(allocVector(INTSXP, grpn));
+    int *ad = INTEGER(ans);
+    #pragma omp parallel for num_threads(gnth) schedule(dynamic, GBATCH)
+    for (int g=0; g<ngrp; g++) {
+        for (int j=0; j<grpsize[g]; j++) ad[gpos(g, j)] = j+1;
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// Fusing the g* functions of one column. gforce() finds in j the calls of sum, mean, min, max, var, sd and prod that take the
+// same column and gfuse() computes all of them in one pass over it instead of one pass each. Per group it keeps every
+// accumulator any of them needs, filled in the order a pass down x meets the rows, so each result is identical to what the
+// function gives alone; the results are finished by the same gsumans, gminans etc.
+enum { GSUM, GMEAN, GMIN, GMAX, GVAR, GSD, GPROD };
+#define GNEED(op, narm) (1u << (2*(op) + (narm)))
+#define GNEEDANY(op) (GNEED(op, 0) | GNEED(op, 1))
+
+typedef struct {
+    dsum_t sum[2];                    // [na.rm]; without na.rm the NA and NaN go in as they come, as in gsum and gprod
+    long double prod[2];
+    char hasna;                       // whether there's an NA, for a sum that's NaN as gdsum
+    int64_t isum;                     // the sum of the non-NA integers, exact
+    int k;                            // the count of the non-NA
+    char u[2];                        // gmax's flags: whether the group has a max yet
+    union { int i; double d; } min[2], max[2];
+} gacc;
+
+static inline void gaccinit(gacc *a, const Rboolean isint)
+{
+    dsuminit(a->sum); dsuminit(a->sum+1);
+    a->hasna = 0;
+    a->prod[0] = a->prod[1] = 1.0;
+    a->isum = 0;
+    a->k = 0;
+    a->u[0] = a->u[1] = 0;
+    if (isint) { a->min[0].i = INT_MAX; a->min[1].i = NA_INTEGER; a->max[0].i = a->max[1].i = 0; }
+    else { a->min[0].d = R_PosInf; a->min[1].d = NA_REAL; a->max[0].d = a->max[1].d = 0.0; }
+}
+
+static inline void gaccint(gacc *a, const int v, const unsigned need)
+{
+    if (v != NA_INTEGER) { a->isum += v; a->k++; }
+    if (need & GNEED(GMIN, 0)) { IMIN(a->min[0].i, v); }
+    if (need & GNEED(GMIN, 1)) { IMINRM(a->min[1].i, v); }
+    if (need & GNEED(GMAX, 0)) { IMAX(a->max[0].i, a->u[0], v); }
+    if (need & GNEED(GMAX, 1)) { IMAXRM(a->max[1].i, a->u[1], v); }
+    if (need & GNEEDANY(GPROD)) {
+        if (v == NA_INTEGER) a->prod[0] = NA_REAL;
+        else { a->prod[0] *= v; a->prod[1] *= v; }
+    }
+}
+
+// v is the j-th value of the group; its lane in the sums is gdsum's
+static inline void gaccdbl(gacc *a, const double v, const int j, const unsigned need)
+{
+    if (need & (GNEED(GSUM, 0) | GNEED(GMEAN, 0))) { dsumadd(a->sum, j%DSUMLANES, v); a->hasna |= ISNA(v); }
+    if (!ISNAN(v)) {
+        if (need & (GNEED(GSUM, 1) | GNEED(GMEAN, 1))) dsumadd(a->sum+1, j%DSUMLANES, v);
+        a->k++;
+    }
+    if (need & GNEED(GMIN, 0)) { DMIN(a->min[0].d, v); }
+    if (need & GNEED(GMIN, 1)) { DMINRM(a->min[1].d, v); }
+    if (need & GNEED(GMAX, 0)) { DMAX(a->max[0].d, a->u[0], v); }
+    if (need & GNEED(GMAX, 1)) { DMAXRM(a->max[1].d, a->u[1], v); }
+    if (need & GNEEDANY(GPROD)) {
+        a->prod[0] *= v;
+        if (!ISNAN(v)) a->prod[1] *= v;
+    }
+}
+
+// Fold b, a later thread's accumulators for the same group, into a. Only for what combines exactly: integer sums and counts,
+// min and max; the conditions for max are GFOLD's in gmax.
+static inline void gaccmerge(gacc *a, const gacc *b, const Rboolean isint, const unsigned need)
+{
+    a->isum += b->isum;
+    a->k += b->k;
+    if (isint) {
+        if (need & GNEED(GMIN, 0)) { IMIN(a->min[0].i, b->min[0].i); }
+        if (need & GNEED(GMIN, 1)) { IMINRM(a->min[1].i, b->min[1].i); }
+        if ((need & GNEED(GMAX, 0)) && (b->u[0] || b->max[0].i == NA_INTEGER)) { IMAX(a->max[0].i, a->u[0], b->max[0].i); }
+        if ((need & GNEED(GMAX, 1)) && b->u[1]) { IMAXRM(a->max[1].i, a->u[1], b->max[1].i); }
+    } else {
+        if (need & GNEED(GMIN, 0)) { DMIN(a->min[0].d, b->min[0].d); }
+        if (need & GNEED(GMIN, 1)) { DMINRM(a->min[1].d, b->min[1].d); }
+        if ((need & GNEED(GMAX, 0)) && (b->u[0] || ISNA(b->max[0].d))) { DMAX(a->max[0].d, a->u[0], b->max[0].d); }
+        if ((need & GNEED(GMAX, 1)) && b->u[1]) { DMAXRM(a->max[1].d, a->u[1], b->max[1].d); }
+    }
+}
+
+// Compute the nf functions fop[] (with na.rm fnarm[]) of column x and return the list of their results
+static SEXP gfuse(SEXP x, const int nf, const int *fop, const int *fnarm)
+{
+    const Rboolean isint = TYPEOF(x) != REALSXP;
+    unsigned need = 0;
+    for (int f=0; f<nf; f++) need |= GNEED(fop[f]==GSD ? GVAR : fop[f], fnarm[f]);
+    // each function's output: sums for gsumans/gmeanans, products for gprodans, ans for gminans/gmaxans, or the var/sd
+    double **fs = (double **)R_alloc(nf, sizeof(double *));
+    long double **fp = (long double **)R_alloc(nf, sizeof(long double *));
+    int **fc = (int **)R_alloc(nf, sizeof(int *));
+    char **fu = (char **)R_alloc(nf, sizeof(char *));
+    SEXP ans = PROTECT(allocVector(VECSXP, nf));
+    for (int f=0; f<nf; f++) {
+        fs[f] = NULL; fp[f] = NULL; fc[f] = NULL; fu[f] = NULL;
+        switch(fop[f]) {
+        case GSUM:
+            fs[f] = (double *)R_alloc(ngrp, sizeof(double));
+            break;
+        case GPROD:
+            fp[f] = (long double *)R_alloc(ngrp, sizeof(long double));
+            break;
+        case GMEAN:
+            fs[f] = (double *)R_alloc(ngrp, sizeof(double));
+            if (fnarm[f]) fc[f] = (int *)R_alloc(ngrp, sizeof(int));
+            break;
+        case GMAX:
+            fu[f] = R_alloc(ngrp, sizeof(char));
+        case GMIN:
+            SET_VECTOR_ELT(ans, f, allocVector(isint ? INTSXP : REALSXP, ngrp));
+            break;
+        default:  // GVAR, GSD
+            SET_VECTOR_ELT(ans, f, allocVector(REALSXP, ngrp));
+        }
+    }
+    // write out group g's results from its accumulators a (and, for var and sd, var[na.rm])
+    #define GPUT(g, a, var) \
+    for (int f=0; f<nf; f++) { \
+        const int rm = fnarm[f]; \
+        switch(fop[f]) { \
+        case GSUM: case GMEAN: \
+            if (isint) fs[f][g] = fop[f]==GMEAN ? gimean((a).isum, (a).k, grpsize[g], rm) : (!rm && (a).k<grpsize[g]) ? NA_REAL : (double)(a).isum; \
+            else { fs[f][g] = dsumget((a).sum+rm); if (ISNAN(fs[f][g])) fs[f][g] = !rm && (a).hasna ? NA_REAL : R_NaN; } \
+            if (fc[f]) fc[f][g] = (a).k; \
+            break; \
+        case GPROD: fp[f][g] = (a).prod[rm]; break; \
+        case GMIN: \
+            if (isint) INTEGER(VECTOR_ELT(ans, f))[g] = (a).min[rm].i; else REAL(VECTOR_ELT(ans, f))[g] = (a).min[rm].d; \
+            break; \
+        case GMAX: \
+            if (isint) INTEGER(VECTOR_ELT(ans, f))[g] = (a).max[rm].i; else REAL(VECTOR_ELT(ans, f))[g] = (a).max[rm].d; \
+            fu[f][g] = (a).u[rm]; \
+            break; \
+        case GVAR: REAL(VECTOR_ELT(ans, f))[g] = (var)[rm]; break; \
+        default: REAL(VECTOR_ELT(ans, f))[g] = ISNA((var)[rm]) ? NA_REAL : SQRTL((var)[rm]); \
+        } \
+    }
+    const int *xi = isint ? INTEGER(x) : NULL;
+    const double *xd = isint ? NULL : REAL(x);
+    const unsigned exact = isint ? (GNEEDANY(GSUM) | GNEEDANY(GMEAN) | GNEEDANY(GMIN) | GNEEDANY(GMAX)) : (GNEEDANY(GMIN) | GNEEDANY(GMAX));
+    if (ngrp < GFEW && !(need & ~exact)) {
+        // as gisum and GFOLD: each thread a range of rows, then the threads' accumulators folded in order
+        gacc *ta = (gacc *)R_alloc((size_t)gnth*ngrp, sizeof(gacc));
+        #pragma omp parallel for num_threads(gnth)
+        for (int th=0; th<gnth; th++) {
+            gacc *mya = ta + (size_t)th*ngrp;
+            for (int g=0; g<ngrp; g++) gaccinit(mya+g, isint);
+            GRUNS(th, g, i, e) {
+                for (int r=i; r<e; r++) {
+                    const int ix = irowslen == -1 ? r : irows[r]-1;
+                    if (isint) gaccint(mya+g, xi[ix], need); else gaccdbl(mya+g, xd[ix], 0, need);  // no sums here
+                }
+            }
+        }
+        for (int g=0; g<ngrp; g++) {
+            gacc a = ta[g];
+            for (int th=1; th<gnth; th++) gaccmerge(&a, ta+(size_t)th*ngrp+g, isint, need);
+            GPUT(g, a, (double *)NULL)
+        }
+    } else {
+        const Rboolean isvar = (need & GNEEDANY(GVAR)) != 0;
+        const int nth = isvar ? gbufnth() : gnth;
+        void *buf = isvar ? R_alloc((size_t)nth*maxgrpn, isint ? sizeof(int) : sizeof(double)) : NULL;
+        #pragma omp parallel num_threads(nth)
+        {
+            int *isub = isvar && isint ? (int *)buf + (size_t)omp_get_thread_num()*maxgrpn : NULL;
+            double *dsub = isvar && !isint ? (double *)buf + (size_t)omp_get_thread_num()*maxgrpn : NULL;
+            #pragma omp for schedule(dynamic, GBATCH)
+            for (int g=0; g<ngrp; g++) {
+                gacc a;
+                gaccinit(&a, isint);
+                long double m = 0.;  // the sum of the values gathered for var and sd
+                int nsub = 0;
+                for (int j=0; j<grpsize[g]; j++) {
+                    const int ix = growx(g, j);
+                    if (isint) {
+                        gaccint(&a, xi[ix], need);
+                        if (isub && xi[ix] != NA_INTEGER) { isub[nsub++] = xi[ix]; m += xi[ix]; }
+                    } else {
+                        gaccdbl(&a, xd[ix], j, need);
+                        if (dsub && !ISNAN(xd[ix])) { dsub[nsub++] = xd[ix]; m += xd[ix]; }
+                    }
+                }
+                double var[2] = {NA_REAL, NA_REAL};  // as gvarsd1: NA for a group of 1, with an NA unless na.rm, or with 1 or no value
+                if (isvar && grpsize[g] != 1) {
+                    const Rboolean nona = nsub == grpsize[g];
+                    if (nona || nsub > 1) {
+                        const double v = isint ? gvari(isub, nsub, m) : gvard(dsub, nsub, m);
+                        if (nona) var[0] = v;
+                        if (nsub > 1) var[1] = v;
+                    }
+                }
+                GPUT(g, a, var)
+            }
+        }
+    }
+    #undef GPUT
+    for (int f=0; f<nf; f++) {
+        SEXP this;
+        switch(fop[f]) {
+        case GSUM:  this = gsumans(x, fs[f]); break;
+        case GMEAN:
+            if (isint) { this = gimeanans(x, fs[f]); break; }
+            this = gmeanans(x, fs[f], fc[f]);
+            if (INHERITS(x, char_IDate)) this = gidateans(this);
+            break;
+        case GPROD: this = gprodans(x, fp[f]); break;
+        case GMIN:
+            this = PROTECT(VECTOR_ELT(ans, f));
+            this = gminans(this, fnarm[f]);
+            copyMostAttrib(x, this);
+            break;
+        case GMAX:
+            this = PROTECT(VECTOR_ELT(ans, f));
+            this = gmaxans(this, fu[f], fnarm[f]);
+            copyMostAttrib(x, this);
+            break;
+        default:
+            continue;  // var and sd are done, and like gvarsd1 don't take x's attributes
+        }
+        SET_VECTOR_ELT(ans, f, this);
+        UNPROTECT(1);
+    }
+    UNPROTECT(1);
+    return(ans);
+}
+
+// When j is list(...) and at least two of its items are the g* functions gfuse() knows of the same column, compute them with
+// gfuse() and return a copy of j with their results in place of the calls; otherwise return j as is. Anything unusual (the
+// column isn't a plain integer, logical or double vector of the groups' length, na.rm isn't TRUE or FALSE) is left to the
+// g* functions themselves, and to their errors.
+static SEXP gfusej(SEXP jsub, SEXP env)
+{
+    static const char *gfuns[] = {"gsum", "gmean", "gmin", "gmax", "gvar", "gsd", "gprod"};
+    if (TYPEOF(jsub) != LANGSXP || CAR(jsub) != install("list")) return(jsub);
+    const int n = length(jsub)-1;
+    if (n < 2) return(jsub);
+    int *op = (int *)R_alloc(n, sizeof(int)), *rm = (int *)R_alloc(n, sizeof(int));
+    SEXP *sym = (SEXP *)R_alloc(n, sizeof(SEXP));
+    SEXP cell = CDR(jsub);
+    for (int i=0; i<n; i++, cell=CDR(cell)) {
+        SEXP call = CAR(cell);
+        op[i] = -1;
+        if (TYPEOF(call) != LANGSXP || !isSymbol(CAR(call)) || !isSymbol(CADR(call))) continue;
+        int k = 0;
+        while (k<7 && CAR(call) != install(gfuns[k])) k++;
+        if (k == 7) continue;
+        SEXP rest = CDDR(call);
+        if (rest == R_NilValue) rm[i] = FALSE;
+        else if (CDR(rest) == R_NilValue && isLogical(CAR(rest)) && LENGTH(CAR(rest)) == 1 && LOGICAL(CAR(rest))[0] != NA_LOGICAL) rm[i] = LOGICAL(CAR(rest))[0];
+        else continue;
+        op[i] = k;
+        sym[i] = CADR(call);
+    }
+    int *fop = (int *)R_alloc(n, sizeof(int)), *fnarm = (int *)R_alloc(n, sizeof(int)), *fat = (int *)R_alloc(n, sizeof(int));
+    SEXP ans = jsub;
+    for (int i=0; i<n; i++) {
+        if (op[i] == -1) continue;
+        int nf = 0;
+        for (int j=i; j<n; j++) if (op[j] != -1 && sym[j] == sym[i]) {
+            fop[nf] = op[j]; fnarm[nf] = rm[j]; fat[nf++] = j;
+            if (j > i) op[j] = -1;  // done with this column
+        }
+        if (nf < 2) continue;
+        if (ans == jsub) ans = PROTECT(duplicate(jsub));
+        SEXP x = PROTECT(eval(sym[i], env));
+        if ((TYPEOF(x) != LGLSXP && TYPEOF(x) != INTSXP && TYPEOF(x) != REALSXP) || (OBJECT(x) && (inherits(x, "factor") || inherits(x, "integer64")))
+            || (irowslen == -1 ? length(x) : irowslen) != grpn) { UNPROTECT(1); continue; }
+        SEXP res = PROTECT(gfuse(x, nf, fop, fnarm));
+        for (int f=0; f<nf; f++) SETCAR(nthcdr(ans, fat[f]+1), VECTOR_ELT(res, f));
+        UNPROTECT(2);
+    }
+    if (ans != jsub) UNPROTECT(1);
+    return(ans);
+}
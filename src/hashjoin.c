@@ -0,0 +1,535 @@
+#include "data.table.h"
+
+/*
+  Hash join for an equi join of i to x when x has neither a key nor an index on the join columns; i.e. the 'on=' join that
+  would otherwise first compute an ad hoc forderv(x) just so that bmerge can binary search it. The distinct join values of
+  the smaller of i and x are put in a hash table (built in parallel, one open addressing table per hash partition) and each
+  row of the larger side is looked up in parallel. Every row of i and x so gets a group id of its join value, and a counting
+  sort of x by group id gives xo: x's rows grouped by join value, each group in x's row order, exactly as the stable
+  forderv(x) would have grouped them. The result is bmerge's (starts, lens, indices, allLen1, allGrp1) with starts
+  referring to xo, plus xo itself, so [.data.table consumes it just as it consumes bmerge's result with an ad hoc index.
+
+  Equality is bmerge's: integer, logical and factor (i already recoded to x's levels by bmerge.R) by value including NA,
+  double after dtwiddle (so numeric rounding applies and -0==0, NA!=NaN), integer64 by bits and character by CHARSXP
+  pointer. Pointer equality is only string equality when the strings are ASCII or marked UTF-8, so R_NilValue is returned
+  when any other encoding is present (or a column type isn't supported) and the caller falls back to bmerge.
+*/
+
+enum {HJ_INT, HJ_DOUBLE, HJ_BITS, HJ_STRING};
+
+typedef struct {
+  int ncol;
+  const int *kind;
+  const void **a;    // data pointers of the join columns of the probe side
+  const void **b;    // and of the build side
+} hjCols;
+
+static inline unsigned long long hjval(int kind, const void *p, int r)
+{
+  switch(kind) {
+  case HJ_INT : return (unsigned int)((const int *)p)[r];
+  case HJ_DOUBLE : return dtwiddle((void *)p, r, 1, -1);
+  case HJ_BITS : return ((const unsigned long long *)p)[r];
+  default : return (unsigned long long)(uintptr_t)((const SEXP *)p)[r];
+  }
+}
+
+static inline unsigned long long hjmix(unsigned long long h)
+// murmur3's 64 bit finalizer so that the top bits (the partition) and the bottom bits (the slot) are both well spread
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline unsigned long long hjhash(const hjCols *c, const void **cols, int r)
+{
+  unsigned long long h = 0x9e3779b97f4a7c15ULL;
+  for (int j=0; j<c->ncol; j++) h = hjmix(h ^ hjval(c->kind[j], cols[j], r));
+  return h;
+}
+
+static inline Rboolean hjeq(const hjCols *c, const void **acols, int ra, const void **bcols, int rb)
+{
+  for (int j=0; j<c->ncol; j++) {
+    if (hjval(c->kind[j], acols[j], ra) != hjval(c->kind[j], bcols[j], rb)) return FALSE;
+  }
+  return TRUE;
+}
+
+static Rboolean hjhashall(const hjCols *c, const void **cols, int n, unsigned long long *h, int nth)
+// hash every row; FALSE if a string isn't ASCII or UTF-8 (pointer equality then wouldn't be string equality)
+{
+  Rboolean ok = TRUE;
+  for (int j=0; j<c->ncol; j++) {
+    if (c->kind[j] != HJ_STRING) continue;
+    const SEXP *s = (const SEXP *)cols[j];
+    #pragma omp parallel for num_threads(nth) reduction(&&:ok)
+    for (int r=0; r<n; r++) ok = ok && (s[r]==NA_STRING || IS_ASCII(s[r]) || IS_UTF8(s[r]));
+  }
+  if (!ok) return FALSE;
+  #pragma omp parallel for num_threads(nth)
+  for (int r=0; r<n; r++) h[r] = hjhash(c, cols, r);
+  return TRUE;
+}
+
+SEXP hashjoin(SEXP i, SEXP x, SEXP icolsArg, SEXP xcolsArg, SEXP nomatchArg, SEXP multArg)
+{
+  if (!isInteger(icolsArg) || !isInteger(xcolsArg) || LENGTH(icolsArg)!=LENGTH(xcolsArg))
+    error("Internal error: icols and xcols must be integer vectors of equal length");
+  if ((!isInteger(nomatchArg) && !isLogical(nomatchArg)) || LENGTH(nomatchArg)!=1) error("Internal error: nomatch must be 0 or NA");
+  int nomatch = INTEGER(nomatchArg)[0];
+  enum {ALL, FIRST, LAST} mult;
+  if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "all")) mult = ALL;
+  else if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "first")) mult = FIRST;
+  else if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "last")) mult = LAST;
+  else error("Internal error: invalid value for 'mult'. Please report to datatable-help");
+
+  const int ncol = LENGTH(icolsArg), *icols = INTEGER(icolsArg), *xcols = INTEGER(xcolsArg);
+  if (ncol==0 || !length(i) || !length(x)) return(R_NilValue);
+  const int iN = length(VECTOR_ELT(i,0)), xN = length(VECTOR_ELT(x,0));
+  if (iN==0 || xN==0) return(R_NilValue);  // nothing to gain
+  int kind[ncol];
+  const void *icp[ncol], *xcp[ncol];
+  for (int j=0; j<ncol; j++) {
+    if (icols[j]<1 || icols[j]>LENGTH(i) || xcols[j]<1 || xcols[j]>LENGTH(x)) error("Internal error: join column out of range");
+    SEXP ic = VECTOR_ELT(i, icols[j]-1), xc = VECTOR_ELT(x, xcols[j]-1);
+    if (TYPEOF(ic) != TYPEOF(xc)) return(R_NilValue);  // bmerge gives the error
+    switch(TYPEOF(xc)) {
+    case INTSXP : case LGLSXP : kind[j] = HJ_INT; break;
+    case REALSXP :
+      if (INHERITS(xc, char_integer64) != INHERITS(ic, char_integer64)) return(R_NilValue);
+      kind[j] = INHERITS(xc, char_integer64) ? HJ_BITS : HJ_DOUBLE;
+      break;
+    case STRSXP : kind[j] = HJ_STRING; break;
+    default : return(R_NilValue);
+    }
+    icp[j] = DATAPTR(ic);
+    xcp[j] = DATAPTR(xc);
+  }
+  // build on the smaller side, probe with the larger
+  const Rboolean buildx = xN <= iN;
+  const int nA = buildx ? iN : xN, nB = buildx ? xN : iN;
+  hjCols c = {.ncol=ncol, .kind=kind, .a = buildx ? icp : xcp, .b = buildx ? xcp : icp};
+
+  const int nth = getDTthreads();
+  unsigned long long *hA = malloc((size_t)nA * sizeof(unsigned long long));
+  unsigned long long *hB = malloc((size_t)nB * sizeof(unsigned long long));
+  int *gA = malloc((size_t)nA * sizeof(int)), *gB = malloc((size_t)nB * sizeof(int));
+  int *prow = malloc((size_t)nB * sizeof(int));   // build rows grouped by partition
+  int *rep = malloc((size_t)nB * sizeof(int));    // the first build row of each group, per partition
+  if (!hA || !hB || !gA || !gB || !prow || !rep) {
+    free(hA); free(hB); free(gA); free(gB); free(prow); free(rep);
+    error("Unable to allocate working memory for hash join of %d and %d rows", nA, nB);
+  }
+  if (!hjhashall(&c, c.b, nB, hB, nth) || !hjhashall(&c, c.a, nA, hA, nth)) {
+    free(hA); free(hB); free(gA); free(gB); free(prow); free(rep);
+    return(R_NilValue);
+  }
+
+  // partition the build rows on the top bits of their hash so that each partition's table is built by one thread
+  int pbits = 1;
+  while (pbits<10 && (1<<pbits) < 4*nth && (1<<pbits) < nB/1024) pbits++;
+  const int nPart = 1<<pbits, pshift = 64-pbits;
+  const int nBatch = nth;
+  const int batchSize = (nB-1)/nBatch + 1;
+  int *counts = calloc((size_t)nBatch*nPart, sizeof(int));
+  int *pfrom = malloc((nPart+1)*sizeof(int)), *ngrp = malloc(nPart*sizeof(int)), *goff = malloc(nPart*sizeof(int));
+  size_t *soff = malloc((nPart+1)*sizeof(size_t));
+  if (!counts || !pfrom || !ngrp || !goff || !soff) {
+    free(hA); free(hB); free(gA); free(gB); free(prow); free(rep); free(counts); free(pfrom); free(ngrp); free(goff); free(soff);
+    error("Unable to allocate working memory for hash join");
+  }
+  #pragma omp parallel for num_threads(nth)
+  for (int b=0; b<nBatch; b++) {
+    int *bc = counts + (size_t)b*nPart;
+    for (int r=b*batchSize, to=((b+1)*batchSize<nB ? (b+1)*batchSize : nB); r<to; r++) bc[hB[r]>>pshift]++;
+  }
+  int cum=0;
+  for (int p=0; p<nPart; p++) {
+    pfrom[p] = cum;
+    for (int b=0; b<nBatch; b++) { int tt=counts[(size_t)b*nPart+p]; counts[(size_t)b*nPart+p]=cum; cum+=tt; }
+  }
+  pfrom[nPart] = nB;
+  #pragma omp parallel for num_threads(nth)
+  for (int b=0; b<nBatch; b++) {
+    int *bc = counts + (size_t)b*nPart;
+    for (int r=b*batchSize, to=((b+1)*batchSize<nB ? (b+1)*batchSize : nB); r<to; r++) prow[bc[hB[r]>>pshift]++] = r;
+  }
+  // table of each partition is a power of 2 at least twice its rows; slots hold local group id + 1, 0 for empty
+  soff[0] = 0;
+  for (int p=0; p<nPart; p++) {
+    size_t size = 2;
+    while (size < 2*(size_t)(pfrom[p+1]-pfrom[p])) size<<=1;
+    soff[p+1] = soff[p] + size;
+  }
+  int *slot = calloc(soff[nPart], sizeof(int));
+  if (!slot) {
+    free(hA); free(hB); free(gA); free(gB); free(prow); free(rep); free(counts); free(pfrom); free(ngrp); free(goff); free(soff);
+    error("Unable to allocate working memory for hash join");
+  }
+  #pragma omp parallel for schedule(dynamic) num_threads(nth)
+  for (int p=0; p<nPart; p++) {
+    int *tab = slot + soff[p], *prep = rep + pfrom[p], ng = 0;
+    const size_t mask = soff[p+1]-soff[p]-1;
+    for (int k=pfrom[p]; k<pfrom[p+1]; k++) {
+      const int r = prow[k];
+      const unsigned long long h = hB[r];
+      size_t s = h & mask;
+      while (TRUE) {
+        const int g = tab[s];
+        if (g==0) { tab[s] = ++ng; prep[ng-1] = r; gB[r] = ng-1; break; }
+        const int rr = prep[g-1];
+        if (hB[rr]==h && hjeq(&c, c.b, r, c.b, rr)) { gB[r] = g-1; break; }
+        s = (s+1) & mask;
+      }
+    }
+    ngrp[p] = ng;
+  }
+  int G = 0;
+  for (int p=0; p<nPart; p++) { goff[p] = G; G += ngrp[p]; }
+  #pragma omp parallel for num_threads(nth)
+  for (int r=0; r<nB; r++) gB[r] += goff[hB[r]>>pshift];
+
+  // probe
+  #pragma omp parallel for num_threads(nth)
+  for (int r=0; r<nA; r++) {
+    const unsigned long long h = hA[r];
+    const int p = h>>pshift;
+    const int *tab = slot + soff[p], *prep = rep + pfrom[p];
+    const size_t mask = soff[p+1]-soff[p]-1;
+    size_t s = h & mask;
+    int ans = -1, g;
+    while ((g=tab[s])) {
+      const int rr = prep[g-1];
+      if (hB[rr]==h && hjeq(&c, c.a, r, c.b, rr)) { ans = goff[p]+g-1; break; }
+      s = (s+1) & mask;
+    }
+    gA[r] = ans;
+  }
+  free(hA); free(hB); free(prow); free(rep); free(counts); free(pfrom); free(ngrp); free(goff); free(soff); free(slot);
+  const int *gI = buildx ? gA : gB, *gX = buildx ? gB : gA;
+
+  // xo: counting sort of x by group id, unmatched x rows (group -1 when i is the build side) last
+  int protecti=0;
+  SEXP xoArg = PROTECT(allocVector(INTSXP, xN)); protecti++;
+  int *xo = INTEGER(xoArg);
+  int *gstart = calloc((size_t)G+1, sizeof(int)), *glen = calloc((size_t)G+1, sizeof(int));
+  if (!gstart || !glen) {
+    free(gA); free(gB); free(gstart); free(glen);
+    error("Unable to allocate working memory for hash join");
+  }
+  for (int r=0; r<xN; r++) glen[gX[r]<0 ? G : gX[r]]++;
+  cum = 0;
+  for (int g=0; g<=G; g++) { gstart[g] = cum; cum += glen[g]; }
+  for (int r=0; r<xN; r++) xo[gstart[gX[r]<0 ? G : gX[r]]++] = r+1;   // sequential as x rows must stay in order within group
+  for (int g=0; g<=G; g++) gstart[g] -= glen[g];
+
+  SEXP retFirstArg = PROTECT(allocVector(INTSXP, iN)); protecti++;
+  SEXP retLengthArg = PROTECT(allocVector(INTSXP, iN)); protecti++;
+  int *retFirst = INTEGER(retFirstArg), *retLength = INTEGER(retLengthArg);
+  Rboolean anyLen2 = FALSE;
+  #pragma omp parallel for num_threads(nth) reduction(||:anyLen2)
+  for (int r=0; r<iN; r++) {
+    const int g = gI[r], len = g<0 ? 0 : glen[g];
+    if (len==0) {
+      retFirst[r] = nomatch;
+      retLength[r] = nomatch==0 ? 0 : 1;
+    } else {
+      retFirst[r] = (mult != LAST) ? gstart[g]+1 : gstart[g]+len;   // +1 for 1-based indexing at R level, as bmerge
+      retLength[r] = (mult == ALL) ? len : 1;
+      anyLen2 = anyLen2 || (mult==ALL && len>1);
+    }
+  }
+  free(gA); free(gB); free(gstart); free(glen);
+
+  SEXP ans = PROTECT(allocVector(VECSXP, 6)); protecti++;
+  SEXP ansnames = PROTECT(allocVector(STRSXP, 6)); protecti++;
+  SET_VECTOR_ELT(ans, 0, retFirstArg);
+  SET_VECTOR_ELT(ans, 1, retLengthArg);
+  SET_VECTOR_ELT(ans, 2, allocVector(INTSXP, 0));
+  SET_VECTOR_ELT(ans, 3, ScalarLogical(!anyLen2));
+  SET_VECTOR_ELT(ans, 4, ScalarLogical(TRUE));
+  SET_VECTOR_ELT(ans, 5, xoArg);
+  SET_STRING_ELT(ansnames, 0, char_starts);
+  SET_STRING_ELT(ansnames, 1, mkChar("lens"));
+  SET_STRING_ELT(ansnames, 2, mkChar("indices"));
+  SET_STRING_ELT(ansnames, 3, mkChar("allLen1"));
+  SET_STRING_ELT(ansnames, 4, mkChar("allGrp1"));
+  SET_STRING_ELT(ansnames, 5, mkChar("xo"));
+  setAttrib(ans, R_NamesSymbol, ansnames);
+  UNPROTECT(protecti);
+  return(ans);
+}
+
+/*
+  Hash grouping for by= (not keyby=): the groups of the rows of the by columns in order of first appearance, found in one
+  parallel pass with no sort. Each thread takes a contiguous range of rows and counts the distinct values in it, in order
+  of their first appearance there: directly by value into an array when there is one integer, logical or factor column of
+  range at most HG_MAXDIRECT, otherwise in an open addressing hash table of its own. Since each thread's range of rows
+  follows the previous thread's, merging the threads' values in thread order numbers the groups by first appearance in x.
+  A stable counting sort by group number then gives o, as forderv(retGrp=TRUE) followed by putting its groups back in order
+  of first appearance would, with attributes "starts" and "maxgrpn". o is integer() when each group's rows are already
+  contiguous, as forderv returns for sorted input. Equality is hashjoin's; so numeric rounding applies to doubles and -0==0,
+  NA!=NaN, just as for forderv.
+
+  R_NilValue is returned, and by= falls back to forderv, when hashing finds more than maxgrp distinct values: with many
+  groups the hash tables outgrow the cache and a radix sort is as fast. Also for unsupported column types and for strings
+  in encodings other than ASCII or UTF-8.
+*/
+
+#define HG_MAXDIRECT 65536
+
+typedef struct {
+  int ng;                   // the groups of the thread's rows so far, in order of first appearance
+  int cap;                  // room in rep, cnt and h
+  int *rep, *cnt;           // the first row and number of rows of each
+  unsigned long long *h;    // and its hash, to rehash when the table grows
+  size_t mask;              // slots-1; the slots are a power of 2 at least twice ng
+  int *slot;                // local group + 1, 0 for empty
+  Rboolean fail;
+} hgLocal;
+
+static Rboolean hggrow(hgLocal *t)
+{
+  const int cap = t->cap ? 2*t->cap : 256;
+  int *rep = realloc(t->rep, cap*sizeof(int)), *cnt = rep ? realloc(t->cnt, cap*sizeof(int)) : NULL;
+  if (rep) t->rep = rep;
+  if (cnt) t->cnt = cnt;
+  unsigned long long *h = cnt ? realloc(t->h, cap*sizeof(unsigned long long)) : NULL;
+  if (!h) return FALSE;
+  t->h = h;
+  t->cap = cap;
+  const size_t size = 2*(size_t)cap;
+  int *slot = calloc(size, sizeof(int));
+  if (!slot) return FALSE;
+  for (int g=0; g<t->ng; g++) {
+    size_t s = t->h[g] & (size-1);
+    while (slot[s]) s = (s+1) & (size-1);
+    slot[s] = g+1;
+  }
+  free(t->slot);
+  t->slot = slot;
+  t->mask = size-1;
+  return TRUE;
+}
+
+SEXP hashgroup(SEXP l, SEXP maxgrpArg)
+{
+  if (!isNewList(l) || !LENGTH(l)) error("Internal error: l must be a non-empty list");
+  if (!isInteger(maxgrpArg) || LENGTH(maxgrpArg)!=1) error("Internal error: maxgrp must be a single integer");
+  const int ncol = LENGTH(l), n = length(VECTOR_ELT(l, 0)), maxgrp = INTEGER(maxgrpArg)[0];
+  if (n==0 || maxgrp<1) return(R_NilValue);
+  int kind[ncol];
+  const void *cp[ncol];
+  for (int j=0; j<ncol; j++) {
+    SEXP v = VECTOR_ELT(l, j);
+    if (length(v) != n) error("Internal error: the columns of l must be the same length");
+    switch(TYPEOF(v)) {
+    case INTSXP : case LGLSXP : kind[j] = HJ_INT; break;
+    case REALSXP : kind[j] = INHERITS(v, char_integer64) ? HJ_BITS : HJ_DOUBLE; break;
+    case STRSXP : kind[j] = HJ_STRING; break;
+    default : return(R_NilValue);
+    }
+    cp[j] = DATAPTR(v);
+  }
+  hjCols c = {.ncol=ncol, .kind=kind, .a=cp, .b=cp};
+  const int nth = MAX(1, MIN(getDTthreads(), n/65536));
+  #define HGFROM(t) ((int)((int64_t)n*(t)/nth))
+
+  // an integer column of small range: its values are the keys, no hashing
+  Rboolean direct = FALSE;
+  int xmin = 0, range = 0;
+  const int *xi = (ncol==1 && kind[0]==HJ_INT) ? (const int *)cp[0] : NULL;
+  if (xi) {
+    int mn = INT_MAX, mx = INT_MIN;
+    #pragma omp parallel for num_threads(nth) reduction(min:mn) reduction(max:mx)
+    for (int r=0; r<n; r++) {
+      const int v = xi[r];
+      if (v == NA_INTEGER) continue;
+      if (v < mn) mn = v;
+      if (v > mx) mx = v;
+    }
+    if (mn > mx) mn = mx = 0;                            // all NA
+    if ((int64_t)mx - mn + 2 <= HG_MAXDIRECT) {          // +1 for the NA key, range-1
+      direct = TRUE;
+      xmin = mn;
+      range = mx - mn + 2;
+    }
+  } else {
+    for (int j=0; j<ncol; j++) {
+      if (kind[j] != HJ_STRING) continue;
+      const SEXP *s = (const SEXP *)cp[j];
+      Rboolean ok = TRUE;
+      #pragma omp parallel for num_threads(nth) reduction(&&:ok)
+      for (int r=0; r<n; r++) ok = ok && (s[r]==NA_STRING || IS_ASCII(s[r]) || IS_UTF8(s[r]));
+      if (!ok) return(R_NilValue);
+    }
+  }
+  #define HGKEY(r) (xi[r]==NA_INTEGER ? range-1 : xi[r]-xmin)
+
+  // each thread: the distinct values of its rows, in order of first appearance; lid the local group of each row
+  hgLocal *loc = calloc(nth, sizeof(hgLocal));
+  int *dcnt = direct ? calloc((size_t)nth*range, sizeof(int)) : NULL;  // direct: count of each key by thread
+  int *lid = direct ? NULL : malloc((size_t)n*sizeof(int));
+  if (!loc || (direct ? !dcnt : !lid)) {
+    free(loc); free(dcnt); free(lid);
+    error("Unable to allocate working memory for hash grouping of %d rows", n);
+  }
+  #pragma omp parallel for num_threads(nth)
+  for (int t=0; t<nth; t++) {
+    hgLocal *my = loc+t;
+    if (direct) {
+      int *mycnt = dcnt + (size_t)t*range;
+      for (int r=HGFROM(t); r<HGFROM(t+1) && !my->fail; r++) {
+        const int k = HGKEY(r);
+        if (mycnt[k]++) continue;
+        if (my->ng == my->cap && !hggrow(my)) { my->fail = TRUE; break; }
+        my->rep[my->ng++] = r;
+      }
+      continue;
+    }
+    for (int r=HGFROM(t); r<HGFROM(t+1); r++) {
+      if (2*(size_t)my->ng >= my->mask && !hggrow(my)) { my->fail = TRUE; break; }  // also allocates on the first row
+      const unsigned long long h = hjhash(&c, cp, r);
+      size_t s = h & my->mask;
+      int g;
+      while ((g = my->slot[s])) {
+        if (my->h[g-1]==h && hjeq(&c, cp, r, cp, my->rep[g-1])) break;
+        s = (s+1) & my->mask;
+      }
+      if (!g) {
+        if (my->ng >= maxgrp) { my->fail = TRUE; break; }
+        if (my->ng == my->cap && !hggrow(my)) { my->fail = TRUE; break; }
+        g = ++my->ng;
+        my->slot[s] = g;
+        my->rep[g-1] = r;
+        my->cnt[g-1] = 0;
+        my->h[g-1] = h;
+      }
+      my->cnt[g-1]++;
+      lid[r] = g-1;
+    }
+  }
+  Rboolean fail = FALSE;
+  for (int t=0; t<nth; t++) fail = fail || loc[t].fail;
+
+  // the groups of the threads in thread order: gid of each local group (direct: of each key), numbered by first appearance
+  int G = 0, *gmap = NULL, *glen = NULL, *gstart = NULL, *grep = NULL;
+  int **lmap = fail ? NULL : calloc(nth, sizeof(int *));
+  int L = 0;
+  for (int t=0; t<nth; t++) L += loc[t].ng;
+  if (!fail && lmap) {
+    grep = malloc((size_t)L*sizeof(int));
+    glen = calloc((size_t)L, sizeof(int));
+    if (direct) {
+      gmap = malloc((size_t)range*sizeof(int));
+      if (gmap) for (int k=0; k<range; k++) gmap[k] = -1;
+    } else {
+      for (int t=0; t<nth && !fail; t++) fail = !(lmap[t] = malloc(MAX(1, loc[t].ng)*sizeof(int)));
+    }
+    fail = fail || !grep || !glen || (direct && !gmap);
+  } else fail = TRUE;
+  if (!fail) {
+    if (direct) {
+      for (int t=0; t<nth; t++) for (int q=0; q<loc[t].ng; q++) {
+        const int k = HGKEY(loc[t].rep[q]);
+        if (gmap[k] == -1) { gmap[k] = G; grep[G++] = loc[t].rep[q]; }
+      }
+      for (int t=0; t<nth; t++) for (int k=0; k<range; k++) if (dcnt[(size_t)t*range+k]) glen[gmap[k]] += dcnt[(size_t)t*range+k];
+    } else {
+      size_t size = 2;
+      while (size < 2*(size_t)L) size <<= 1;
+      int *slot = calloc(size, sizeof(int));
+      unsigned long long *gh = malloc((size_t)L*sizeof(unsigned long long));
+      fail = !slot || !gh;
+      for (int t=0; t<nth && !fail; t++) for (int q=0; q<loc[t].ng; q++) {
+        const unsigned long long h = loc[t].h[q];
+        const int r = loc[t].rep[q];
+        size_t s = h & (size-1);
+        int g;
+        while ((g = slot[s])) {
+          if (gh[g-1]==h && hjeq(&c, cp, r, cp, grep[g-1])) break;
+          s = (s+1) & (size-1);
+        }
+        if (!g) { g = ++G; slot[s] = g; grep[g-1] = r; gh[g-1] = h; }
+        lmap[t][q] = g-1;
+        glen[g-1] += loc[t].cnt[q];
+      }
+      free(slot); free(gh);
+    }
+    fail = fail || (!direct && G > maxgrp);   // the direct array is small however many of its keys occur
+  }
+  if (fail) {
+    for (int t=0; t<nth; t++) { free(loc[t].rep); free(loc[t].cnt); free(loc[t].h); free(loc[t].slot); if (lmap) free(lmap[t]); }
+    free(loc); free(dcnt); free(lid); free(lmap); free(gmap); free(grep); free(glen);
+    return(R_NilValue);
+  }
+  #define HGGID(t, r) (direct ? gmap[HGKEY(r)] : lmap[t][lid[r]])
+
+  // o is integer() when the groups are already runs one after another: the group changes only G-1 times down the rows
+  int64_t nchange = 0;
+  #pragma omp parallel for num_threads(nth) reduction(+:nchange)
+  for (int t=0; t<nth; t++) {
+    if (HGFROM(t) == HGFROM(t+1)) continue;
+    int prev = t ? HGGID(t-1, HGFROM(t)-1) : HGGID(0, 0);
+    for (int r=HGFROM(t); r<HGFROM(t+1); r++) {
+      const int g = HGGID(t, r);
+      nchange += g != prev;
+      prev = g;
+    }
+  }
+  const Rboolean isruns = nchange == G-1;
+  int maxgrpn = 0;
+  gstart = malloc((size_t)G*sizeof(int));
+  if (gstart) for (int g=0, cum=0; g<G; g++) { gstart[g] = cum; cum += glen[g]; if (glen[g] > maxgrpn) maxgrpn = glen[g]; }
+  SEXP ans = PROTECT(allocVector(INTSXP, isruns ? 0 : n));
+  SEXP starts = PROTECT(allocVector(INTSXP, G));
+  if (gstart) for (int g=0; g<G; g++) INTEGER(starts)[g] = gstart[g]+1;
+  if (gstart && !isruns) {
+    // stable counting sort: each thread's rows of a group go after those of the previous threads
+    int *off = direct ? dcnt : NULL;   // direct: reused as the next position of each key by thread
+    if (direct) {
+      for (int k=0; k<range; k++) if (gmap[k] != -1) {
+        int pos = gstart[gmap[k]];
+        for (int t=0; t<nth; t++) { const int cnt = dcnt[(size_t)t*range+k]; dcnt[(size_t)t*range+k] = pos; pos += cnt; }
+      }
+    } else {
+      int *pos = malloc((size_t)G*sizeof(int));
+      if (pos) {
+        memcpy(pos, gstart, (size_t)G*sizeof(int));
+        for (int t=0; t<nth; t++) for (int q=0; q<loc[t].ng; q++) {
+          const int g = lmap[t][q], cnt = loc[t].cnt[q];
+          loc[t].cnt[q] = pos[g];   // the next position of the local group's rows
+          pos[g] += cnt;
+        }
+        free(pos);
+      } else { free(gstart); gstart = NULL; }
+    }
+    if (gstart) {
+      int *o = INTEGER(ans);
+      #pragma omp parallel for num_threads(nth)
+      for (int t=0; t<nth; t++) {
+        if (direct) {
+          int *myoff = off + (size_t)t*range;
+          for (int r=HGFROM(t); r<HGFROM(t+1); r++) o[myoff[HGKEY(r)]++] = r+1;
+        } else {
+          int *myoff = loc[t].cnt;
+          for (int r=HGFROM(t); r<HGFROM(t+1); r++) o[myoff[lid[r]]++] = r+1;
+        }
+      }
+    }
+  }
+  for (int t=0; t<nth; t++) { free(loc[t].rep); free(loc[t].cnt); free(loc[t].h); free(loc[t].slot); free(lmap[t]); }
+  free(loc); free(dcnt); free(lid); free(lmap); free(gmap); free(grep); free(glen);
+  if (!gstart) {
+    UNPROTECT(2);
+    error("Unable to allocate working memory for hash grouping of %d rows", n);
+  }
+  free(gstart);
+  setAttrib(ans, install("starts"), starts);
+  setAttrib(ans, install("maxgrpn"), ScalarInteger(maxgrpn));
+  UNPROTECT(2);
+  return(ans);
+}
@@ -77,6 +77,33 @@ SEXP fsort();
 SEXP inrange();
 SEXP between();
 SEXP hasOpenMP();
+SEXP fsave();
+SEXP fload();
+SEXP topk();
+SEXP keymerge();
+SEXP hashjoin();
+SEXP nqjoin();
+SEXP subsetRuns();
+SEXP vecseqlen();
+SEXP notRuns();
+SEXP guniqueN();
+SEXP gquantile();
+SEXP gany();
+SEXP gall();
+SEXP gwhichmin();
+SEXP gwhichmax();
+SEXP gcumsum();
+SEXP gcumprod();
+SEXP gcummin();
+SEXP gcummax();
+SEXP gshift();
+SEXP gfrank();
+SEXP gseqlen();
+SEXP gweightedmean();
+SEXP gsumprod();
+SEXP gcov();
+SEXP gcor();
+SEXP hashgroup();
 
 // .Externals
 SEXP fastmean();
@@ -156,6 +183,33 @@ R_CallMethodDef callMethods[] = {
 {"Cinrange", (DL_FUNC) &inrange, -1},
 {"Cbetween", (DL_FUNC) &between, -1},
 {"ChasOpenMP", (DL_FUNC) &hasOpenMP, -1},
+{"Cfsave", (DL_FUNC) &fsave, -1},
+{"Cfload", (DL_FUNC) &fload, -1},
+{"Ctopk", (DL_FUNC) &topk, -1},
+{"Ckeymerge", (DL_FUNC) &keymerge, -1},
+{"Chashjoin", (DL_FUNC) &hashjoin, -1},
+{"Cnqjoin", (DL_FUNC) &nqjoin, -1},
+{"CsubsetRuns", (DL_FUNC) &subsetRuns, -1},
+{"Cvecseqlen", (DL_FUNC) &vecseqlen, -1},
+{"CnotRuns", (DL_FUNC) &notRuns, -1},
+{"CguniqueN", (DL_FUNC) &guniqueN, -1},
+{"Cgquantile", (DL_FUNC) &gquantile, -1},
+{"Cgany", (DL_FUNC) &gany, -1},
+{"Cgall", (DL_FUNC) &gall, -1},
+{"Cgwhichmin", (DL_FUNC) &gwhichmin, -1},
+{"Cgwhichmax", (DL_FUNC) &gwhichmax, -1},
+{"Cgcumsum", (DL_FUNC) &gcumsum, -1},
+{"Cgcumprod", (DL_FUNC) &gcumprod, -1},
+{"Cgcummin", (DL_FUNC) &gcummin, -1},
+{"Cgcummax", (DL_FUNC) &gcummax, -1},
+{"Cgshift", (DL_FUNC) &gshift, -1},
+{"Cgfrank", (DL_FUNC) &gfrank, -1},
+{"Cgseqlen", (DL_FUNC) &gseqlen, -1},
+{"Cgweightedmean", (DL_FUNC) &gweightedmean, -1},
+{"Cgsumprod", (DL_FUNC) &gsumprod, -1},
+{"Cgcov", (DL_FUNC) &gcov, -1},
+{"Cgcor", (DL_FUNC) &gcor, -1},
+{"Chashgroup", (DL_FUNC) &hashgroup, -1},
 {NULL, NULL, 0}
 };
 
@@ -231,6 +285,7 @@ void attribute_visible R_init_datatable(DllInfo *info)
     char_integer64 = PRINTNAME(install("integer64"));
     char_ITime =     PRINTNAME(install("ITime"));
     char_Date =      PRINTNAME(install("Date"));   // used for IDate too since IDate inherits from Date
+    char_IDate =     PRINTNAME(install("IDate"));  // where an IDate must stay integer, as mean.IDate
     char_POSIXct =   PRINTNAME(install("POSIXct"));
     char_nanotime =  PRINTNAME(install("nanotime"));
     char_starts =    PRINTNAME(sym_starts = install("starts"));
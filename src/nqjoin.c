@@ -0,0 +1,295 @@
+#include "data.table.h"
+
+/*
+  Non-equi join with two inequalities on two different columns of x, e.g. the points of i within x's intervals,
+  x[i, on=.(start<=pos, end>=pos)]. Without this the rows of x would be split into nested groups (nestedid) so that each
+  group is sorted on both columns, and bmerge would run once per group; with overlapping intervals there are about as many
+  groups as rows.
+
+  Instead bmerge.R runs bmerge just once on the equality columns and the first inequality (A), with x ordered by those
+  columns (xo). For each row of i that gives one contiguous range of xo, [starts, starts+lens), in which A holds. nqjoin
+  then picks the rows of that range in which the second inequality (B) holds as well, using an index on x's B in xo order:
+  a segment tree over blocks of NQBLK rows. Each node of the tree holds the min and max of B below it (not counting NA),
+  its number of NA and the positions of its first and last rows of x. A node inside the range is reported as a whole
+  when all of its B satisfy the bound, and skipped when none can. So the cost of each row of i is the log of the range
+  plus the number of runs of matching rows reported, and the index is only about 40 bytes per block. The rows of i are
+  joined in parallel.
+
+  B is compared as bmerge compares it: doubles after dtwiddle, and NA (or NaN) in i matches only NA (resp. NaN) in x
+  for <= and >=, and nothing for < and >. The result keeps bmerge's contract for non-equi joins: starts/lens into xo with
+  the further runs of each row of i appended with their indices. allGrp1 is FALSE for mult="all", so [.data.table returns
+  the rows of x matching each row of i in row order. mult="first"/"last" give the first/last of those rows.
+*/
+
+#define NQBLK 32
+
+#define LE 2     // op codes as in bmerge.c
+#define LT 3
+#define GE 4
+#define GT 5
+
+enum {ALL, FIRST, LAST};
+
+typedef struct {
+  const unsigned long long *key;   // B of x in xo order, twiddled so that unsigned comparison is B's order
+  const char *na;                  // is B of x NA, in xo order
+  const int *xo;
+  int xN, size;                    // size = number of leaf nodes (a power of 2 >= number of blocks)
+  unsigned long long *lo, *hi;     // min and max key of the non-NA below each node (lo>hi when there are none)
+  int *nna, *first, *last;         // number of NA below each node, and the positions of its first and last rows of x
+} nqIndex;
+
+typedef struct {
+  int mult;
+  int nrun, runalloc;              // runs [rs[k], re[k]) of matching positions of the current row of i
+  int *rs, *re;
+  int best;                        // mult="first"/"last": position of the first/last matching row of x so far, or -1
+  int *extFirst, *extLength, *extIndex;
+  int ctr, extalloc;
+  Rboolean fail;
+} nqOut;
+
+#define NQROW(xo, p) ((xo) ? (xo)[(p)] : (p)+1)   // row of x at position p of xo
+
+static inline unsigned long long nqkey(SEXP col, Rboolean isInt64, int r, Rboolean *isna)
+{
+  switch(TYPEOF(col)) {
+  case REALSXP :
+    if (isInt64) {
+      *isna = ((const long long *)REAL(col))[r] == NA_INT64_LL;
+      return i64twiddle(DATAPTR(col), r, 1, -1);
+    }
+    *isna = ISNAN(REAL(col)[r]);
+    return dtwiddle(DATAPTR(col), r, 1, -1);
+  default : // INTSXP, LGLSXP
+    *isna = INTEGER(col)[r] == NA_INTEGER;
+    return (unsigned int)INTEGER(col)[r] ^ 0x80000000U;
+  }
+}
+
+static void nqemit(const nqIndex *t, nqOut *out, int from, int to, int first, int last)
+// positions [from,to) of xo match; first and last are those whose row of x is first and last
+{
+  if (out->mult != ALL) {
+    int p = out->mult==FIRST ? first : last;
+    if (out->best==-1 || (out->mult==FIRST ? NQROW(t->xo,p)<NQROW(t->xo,out->best) : NQROW(t->xo,p)>NQROW(t->xo,out->best))) out->best = p;
+    return;
+  }
+  if (out->nrun && out->re[out->nrun-1]==from) { out->re[out->nrun-1] = to; return; }
+  if (out->nrun == out->runalloc) {
+    int newalloc = out->runalloc ? 2*out->runalloc : 64;
+    int *s = realloc(out->rs, newalloc*sizeof(int)); if (s) out->rs = s;
+    int *e = realloc(out->re, newalloc*sizeof(int)); if (e) out->re = e;
+    if (!s || !e) { out->fail = TRUE; return; }
+    out->runalloc = newalloc;
+  }
+  out->rs[out->nrun] = from;
+  out->re[out->nrun] = to;
+  out->nrun++;
+}
+
+static void nqquery(const nqIndex *t, int node, int blo, int bw, int s, int e, unsigned long long klo, unsigned long long khi, nqOut *out)
+// node covers blocks [blo, blo+bw); report its positions in [s,e) whose key is in [klo,khi] and is not NA
+{
+  const int nlo = blo*NQBLK, nhi = (blo+bw)*NQBLK < t->xN ? (blo+bw)*NQBLK : t->xN;
+  if (nhi<=s || nlo>=e || t->lo[node]>khi || t->hi[node]<klo || out->fail) return;
+  if (s<=nlo && nhi<=e && !t->nna[node] && klo<=t->lo[node] && t->hi[node]<=khi) {
+    nqemit(t, out, nlo, nhi, t->first[node], t->last[node]);
+    return;
+  }
+  if (bw==1) {
+    for (int p=(nlo>s ? nlo : s), to=(nhi<e ? nhi : e); p<to; p++) {
+      if (!t->na[p] && t->key[p]>=klo && t->key[p]<=khi) nqemit(t, out, p, p+1, p, p);
+    }
+    return;
+  }
+  nqquery(t, 2*node, blo, bw/2, s, e, klo, khi, out);
+  nqquery(t, 2*node+1, blo+bw/2, bw/2, s, e, klo, khi, out);
+}
+
+static Rboolean nqgrow(nqOut *out)
+{
+  int newalloc = out->extalloc ? 1.1*out->extalloc+1 : 1000;
+  int *f = realloc(out->extFirst, newalloc*sizeof(int));  if (f) out->extFirst = f;
+  int *l = realloc(out->extLength, newalloc*sizeof(int)); if (l) out->extLength = l;
+  int *x = realloc(out->extIndex, newalloc*sizeof(int));  if (x) out->extIndex = x;
+  if (!f || !l || !x) { out->fail = TRUE; return FALSE; }
+  out->extalloc = newalloc;
+  return TRUE;
+}
+
+SEXP nqjoin(SEXP xcol, SEXP xoArg, SEXP icol, SEXP startsArg, SEXP lensArg, SEXP opArg, SEXP nomatchArg, SEXP multArg)
+{
+  const int xN = LENGTH(xcol), iN = LENGTH(icol);
+  if (TYPEOF(xcol) != TYPEOF(icol) || (TYPEOF(xcol)!=INTSXP && TYPEOF(xcol)!=LGLSXP && TYPEOF(xcol)!=REALSXP))
+    error("Internal error: nqjoin supports integer, logical and double columns of the same type in i and x");
+  const Rboolean isInt64 = INHERITS(xcol, char_integer64);
+  if (INHERITS(icol, char_integer64) != isInt64) error("Internal error: nqjoin i and x columns must both be integer64 or not");
+  if (!isInteger(startsArg) || !isInteger(lensArg) || LENGTH(startsArg)!=iN || LENGTH(lensArg)!=iN)
+    error("Internal error: nqjoin starts and lens must be integer vectors of length nrow(i)");
+  if (!isInteger(xoArg) || (LENGTH(xoArg) && LENGTH(xoArg)!=xN)) error("Internal error: nqjoin xo must be integer(0) or of length nrow(x)");
+  if (!isInteger(opArg) || LENGTH(opArg)!=1 || INTEGER(opArg)[0]<LE || INTEGER(opArg)[0]>GT) error("Internal error: nqjoin op must be one of <=, <, >=, >");
+  const int op = INTEGER(opArg)[0], nomatch = INTEGER(nomatchArg)[0];
+  int mult;
+  if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "all")) mult = ALL;
+  else if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "first")) mult = FIRST;
+  else if (!strcmp(CHAR(STRING_ELT(multArg, 0)), "last")) mult = LAST;
+  else error("Internal error: invalid value for 'mult'. Please report to datatable-help");
+  const int *starts = INTEGER(startsArg), *lens = INTEGER(lensArg), *xo = LENGTH(xoArg) ? INTEGER(xoArg) : NULL;
+  const int nth = getDTthreads();
+
+  // the index
+  nqIndex t = {.xo=xo, .xN=xN, .size=1};
+  const int nb = (xN + NQBLK-1)/NQBLK;
+  while (t.size < nb) t.size *= 2;
+  unsigned long long *key = malloc((size_t)xN * sizeof(unsigned long long));
+  char *na = malloc(xN);
+  t.lo = malloc(2*(size_t)t.size * sizeof(unsigned long long));
+  t.hi = malloc(2*(size_t)t.size * sizeof(unsigned long long));
+  t.nna = malloc(2*(size_t)t.size * sizeof(int));
+  t.first = malloc(2*(size_t)t.size * sizeof(int));
+  t.last = malloc(2*(size_t)t.size * sizeof(int));
+  if (!key || !na || !t.lo || !t.hi || !t.nna || !t.first || !t.last) {
+    free(key); free(na); free(t.lo); free(t.hi); free(t.nna); free(t.first); free(t.last);
+    error("Unable to allocate working memory for non-equi join index of %d rows", xN);
+  }
+  t.key = key; t.na = na;
+  #pragma omp parallel for num_threads(nth)
+  for (int b=0; b<t.size; b++) {
+    const int node = t.size+b;
+    unsigned long long lo = ULLONG_MAX, hi = 0;
+    int nna = 0, first = -1, last = -1;
+    for (int p=b*NQBLK, to=((b+1)*NQBLK<xN ? (b+1)*NQBLK : xN); p<to; p++) {
+      Rboolean isna;
+      const int r = xo ? xo[p]-1 : p;
+      key[p] = nqkey(xcol, isInt64, r, &isna);
+      na[p] = isna;
+      if (isna) nna++;
+      else { if (key[p]<lo) lo = key[p]; if (key[p]>hi) hi = key[p]; }
+      if (first==-1 || r+1 < NQROW(xo,first)) first = p;
+      if (last==-1 || r+1 > NQROW(xo,last)) last = p;
+    }
+    t.lo[node] = lo; t.hi[node] = hi; t.nna[node] = nna; t.first[node] = first; t.last[node] = last;
+  }
+  for (int node=t.size-1; node>0; node--) {
+    const int a = 2*node, b = 2*node+1;
+    t.lo[node] = t.lo[a]<t.lo[b] ? t.lo[a] : t.lo[b];
+    t.hi[node] = t.hi[a]>t.hi[b] ? t.hi[a] : t.hi[b];
+    t.nna[node] = t.nna[a] + t.nna[b];
+    t.first[node] = t.first[b]==-1 || (t.first[a]!=-1 && NQROW(xo,t.first[a])<NQROW(xo,t.first[b])) ? t.first[a] : t.first[b];
+    t.last[node] = t.last[b]==-1 || (t.last[a]!=-1 && NQROW(xo,t.last[a])>NQROW(xo,t.last[b])) ? t.last[a] : t.last[b];
+  }
+  // positions of NA in B, for the rows of i whose B is NA
+  const int nNA = t.nna[1];
+  int *naPos = malloc(((size_t)nNA+1) * sizeof(int));
+  if (!naPos) {
+    free(key); free(na); free(t.lo); free(t.hi); free(t.nna); free(t.first); free(t.last);
+    error("Unable to allocate working memory for non-equi join index of %d rows", xN);
+  }
+  for (int p=0, k=0; p<xN; p++) if (na[p]) naPos[k++] = p;
+
+  // the rows of i, in contiguous blocks on different threads; each block has its own runs and ext buffers
+  int protecti = 0;
+  SEXP retFirstArg = PROTECT(allocVector(INTSXP, iN));
+  SEXP retLengthArg = PROTECT(allocVector(INTSXP, iN));
+  SEXP retIndexArg = PROTECT(allocVector(INTSXP, mult==ALL ? iN : 0));
+  protecti += 3;
+  int *retFirst = INTEGER(retFirstArg), *retLength = INTEGER(retLengthArg), *retIndex = INTEGER(retIndexArg);
+  int nBlock = (nth>1 && iN>=1024) ? 4*nth : 1;
+  if (nBlock > iN/256) nBlock = iN/256;
+  if (nBlock < 1) nBlock = 1;
+  nqOut *out = (nqOut *)R_alloc(nBlock, sizeof(nqOut));
+  int *blen1 = (int *)R_alloc(nBlock, sizeof(int));
+  for (int b=0; b<nBlock; b++) {
+    out[b] = (nqOut){.mult=mult, .nrun=0, .runalloc=0, .rs=NULL, .re=NULL, .best=-1,
+                     .extFirst=NULL, .extLength=NULL, .extIndex=NULL, .ctr=0, .extalloc=0, .fail=FALSE};
+    blen1[b] = TRUE;
+  }
+  #pragma omp parallel for schedule(dynamic) num_threads(nth)
+  for (int b=0; b<nBlock; b++) {
+    nqOut *o = out+b;
+    for (int j=(int)((long long)iN*b/nBlock), to=(int)((long long)iN*(b+1)/nBlock); j<to && !o->fail; j++) {
+      o->nrun = 0;
+      o->best = -1;
+      if (starts[j]>0 && lens[j]>0) {
+        const int s = starts[j]-1, e = s+lens[j];
+        Rboolean isna;
+        const unsigned long long k = nqkey(icol, isInt64, j, &isna);
+        if (isna) {
+          if (op==LE || op==GE) {    // NA (NaN) in i matches just NA (NaN) in x, as in bmerge
+            int lo = 0, hi = nNA;    // first NA position >= s
+            while (lo<hi) { int mid = lo+(hi-lo)/2; if (naPos[mid]<s) lo = mid+1; else hi = mid; }
+            for (; lo<nNA && naPos[lo]<e; lo++) if (key[naPos[lo]]==k) nqemit(&t, o, naPos[lo], naPos[lo]+1, naPos[lo], naPos[lo]);
+          }
+        } else if (!(op==LT && k==0) && !(op==GT && k==ULLONG_MAX)) {
+          const unsigned long long klo = op==GE ? k : op==GT ? k+1 : 0;
+          const unsigned long long khi = op==LE ? k : op==LT ? k-1 : ULLONG_MAX;
+          nqquery(&t, 1, 0, t.size, s, e, klo, khi, o);
+        }
+      }
+      if (mult != ALL) {
+        retFirst[j] = o->best==-1 ? nomatch : o->best+1;
+        retLength[j] = o->best==-1 ? (nomatch==0 ? 0 : 1) : 1;
+        continue;
+      }
+      retIndex[j] = j+1;
+      if (!o->nrun) {
+        retFirst[j] = nomatch;
+        retLength[j] = nomatch==0 ? 0 : 1;
+        continue;
+      }
+      retFirst[j] = o->rs[0]+1;
+      retLength[j] = o->re[0]-o->rs[0];
+      if (retLength[j]>1) blen1[b] = FALSE;
+      for (int r=1; r<o->nrun; r++) {
+        if (o->ctr == o->extalloc && !nqgrow(o)) break;
+        o->extFirst[o->ctr] = o->rs[r]+1;
+        o->extLength[o->ctr] = o->re[r]-o->rs[r];
+        o->extIndex[o->ctr] = j+1;
+        if (o->extLength[o->ctr]>1) blen1[b] = FALSE;
+        o->ctr++;
+      }
+    }
+  }
+  free(key); free(na); free(t.lo); free(t.hi); free(t.nna); free(t.first); free(t.last); free(naPos);
+  int ctr = iN, allLen1 = TRUE;
+  Rboolean fail = FALSE;
+  for (int b=0; b<nBlock; b++) {
+    ctr += out[b].ctr;
+    fail |= out[b].fail;
+    if (!blen1[b]) allLen1 = FALSE;
+  }
+  if (!fail && ctr > iN) {
+    SEXP f = PROTECT(allocVector(INTSXP, ctr)), l = PROTECT(allocVector(INTSXP, ctr)), x = PROTECT(allocVector(INTSXP, ctr));
+    protecti += 3;
+    memcpy(INTEGER(f), retFirst, sizeof(int)*iN);
+    memcpy(INTEGER(l), retLength, sizeof(int)*iN);
+    memcpy(INTEGER(x), retIndex, sizeof(int)*iN);
+    for (int b=0, k=iN; b<nBlock; k+=out[b].ctr, b++) {
+      memcpy(INTEGER(f)+k, out[b].extFirst, sizeof(int)*out[b].ctr);
+      memcpy(INTEGER(l)+k, out[b].extLength, sizeof(int)*out[b].ctr);
+      memcpy(INTEGER(x)+k, out[b].extIndex, sizeof(int)*out[b].ctr);
+    }
+    retFirstArg = f; retLengthArg = l; retIndexArg = x;
+  }
+  for (int b=0; b<nBlock; b++) {
+    free(out[b].rs); free(out[b].re); free(out[b].extFirst); free(out[b].extLength); free(out[b].extIndex);
+  }
+  if (fail) error("Error in reallocating memory in non-equi joins.\n");
+  SEXP ans = PROTECT(allocVector(VECSXP, 5));
+  SEXP ansnames = PROTECT(allocVector(STRSXP, 5));
+  protecti += 2;
+  SET_VECTOR_ELT(ans, 0, retFirstArg);
+  SET_VECTOR_ELT(ans, 1, retLengthArg);
+  SET_VECTOR_ELT(ans, 2, retIndexArg);
+  SET_VECTOR_ELT(ans, 3, ScalarLogical(allLen1));
+  SET_VECTOR_ELT(ans, 4, ScalarLogical(mult != ALL));
+  SET_STRING_ELT(ansnames, 0, char_starts);
+  SET_STRING_ELT(ansnames, 1, mkChar("lens"));
+  SET_STRING_ELT(ansnames, 2, mkChar("indices"));
+  SET_STRING_ELT(ansnames, 3, mkChar("allLen1"));
+  SET_STRING_ELT(ansnames, 4, mkChar("allGrp1"));
+  setAttrib(ans, R_NamesSymbol, ansnames);
+  UNPROTECT(protecti);
+  return(ans);
+}
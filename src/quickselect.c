@@ -90,6 +90,48 @@ double iquickselect(int *x, int n, int k) {
     }
 }
 
+unsigned long long ullquickselect(unsigned long long *x, int n, int k) {
+    // for twiddled keys; e.g. forder's topk
+    unsigned long i,ir,j,l,mid;
+    unsigned long long a,temp;
+
+    l=0;
+    ir=n-1;
+    for(;;) {
+        if (ir <= l+1) { 
+            if (ir == l+1 && x[ir] < x[l]) {
+                SWAP(x[l],x[ir]);
+            }
+        return x[k];
+        } else {
+            mid=(l+ir) >> 1; 
+            SWAP(x[mid],x[l+1]);
+            if (x[l] > x[ir]) {
+                SWAP(x[l],x[ir]);
+            }
+            if (x[l+1] > x[ir]) {
+                SWAP(x[l+1],x[ir]);
+            }
+            if (x[l] > x[l+1]) {
+                SWAP(x[l],x[l+1]);
+            }
+            i=l+1; 
+            j=ir;
+            a=x[l+1]; 
+            for (;;) { 
+                do i++; while (x[i] < a); 
+                do j--; while (x[j] > a); 
+                if (j < i) break; 
+                    SWAP(x[i],x[j]);
+            } 
+            x[l+1]=x[j]; 
+            x[j]=a;
+            if (j >= k) ir=j-1; 
+            if (j <= k) l=i;
+        }
+    }
+}
+
 
 // SEXP quickselect(SEXP xArg, SEXP n, SEXP k) {
 
@@ -138,3 +138,82 @@ SEXP setrev(SEXP x) {
 }
 
 
+
+typedef struct {
+    int type;
+    void *d;
+    unsigned long long (*twiddle)(void *, int, int, int);
+} keycol;
+
+static int keycmp(const keycol *k, int ncol, int a, int b)
+// compares rows a and b as a key is sorted: ascending with NA first
+{
+    for (int j=0; j<ncol; j++) {
+        switch(k[j].type) {
+        case INTSXP : case LGLSXP : {
+            int u = ((int *)k[j].d)[a], v = ((int *)k[j].d)[b];     // NA_INTEGER==INT_MIN sorts first, checked in init.c
+            if (u!=v) return u<v ? -1 : 1;
+        } break;
+        case REALSXP : {
+            unsigned long long u = k[j].twiddle(k[j].d, a, 1, -1), v = k[j].twiddle(k[j].d, b, 1, -1);
+            if (u!=v) return u<v ? -1 : 1;
+        } break;
+        default : {
+            int c = StrCmp(((SEXP *)k[j].d)[a], ((SEXP *)k[j].d)[b]);
+            if (c) return c;
+        }
+        }
+    }
+    return 0;
+}
+
+SEXP keymerge(SEXP x, SEXP nxArg, SEXP ox, SEXP oy, SEXP cols)
+{
+    // For internal use only by rbindkeyed().
+    // x is rbind(x, y); its first nx rows are in order ox by 'cols' and the remaining rows are in order oy (empty ox or oy means
+    // already in order). Returns the order of all rows of x by 'cols', the same as a stable forder would, in O(n) rather than
+    // O(n log n): each row of y is placed after the rows of x it ties with by binary search, and the runs of x between them are
+    // filled in parallel.
+    if (!isNewList(x) || !length(x)) error("x must be a non-empty list");
+    if (!isInteger(nxArg) || LENGTH(nxArg)!=1) error("nx must be a single integer");
+    if (!isInteger(ox) || !isInteger(oy) || !isInteger(cols) || !LENGTH(cols)) error("ox, oy and cols must be integer vectors");
+    const int n = length(VECTOR_ELT(x,0)), nx = INTEGER(nxArg)[0], ny = n-nx, ncol = LENGTH(cols);
+    if (nx<0 || nx>n) error("nx [%d] is outside [0,nrow(x)=%d]", nx, n);
+    if ((LENGTH(ox) && LENGTH(ox)!=nx) || (LENGTH(oy) && LENGTH(oy)!=ny)) error("ox must be length 0 or nx and oy length 0 or nrow(x)-nx");
+    keycol k[ncol];
+    int nth = getDTthreads();
+    for (int j=0; j<ncol; j++) {
+        if (INTEGER(cols)[j]<1 || INTEGER(cols)[j]>length(x)) error("cols[%d]=%d out of range [1,ncol(x)=%d]", j+1, INTEGER(cols)[j], length(x));
+        SEXP v = VECTOR_ELT(x, INTEGER(cols)[j]-1);
+        switch(TYPEOF(v)) {
+        case INTSXP : case LGLSXP : case REALSXP : break;
+        case STRSXP : nth = 1; break;   // StrCmp's ENC2UTF8 may allocate
+        default : error("Column %d is type '%s' which is not supported as a key column type", INTEGER(cols)[j], type2char(TYPEOF(v)));
+        }
+        k[j].type = TYPEOF(v);
+        k[j].d = DATAPTR(v);
+        k[j].twiddle = INHERITS(v, char_integer64) ? &i64twiddle : &dtwiddle;
+    }
+    const int *pox = LENGTH(ox) ? INTEGER(ox) : NULL, *poy = LENGTH(oy) ? INTEGER(oy) : NULL;
+    SEXP ans = PROTECT(allocVector(INTSXP, n));
+    int *o = INTEGER(ans);
+    int *ub = (int *)R_alloc(ny+1, sizeof(int));   // ub[j] = the number of rows of x before row j of y (in order)
+    #pragma omp parallel for num_threads(ny<1000 ? 1 : nth)
+    for (int j=0; j<ny; j++) {
+        int yrow = nx + (poy ? poy[j]-1 : j), lo = 0, hi = nx;
+        while (lo<hi) {
+            int mid = lo + (hi-lo)/2;
+            if (keycmp(k, ncol, pox ? pox[mid]-1 : mid, yrow) <= 0) lo = mid+1; else hi = mid;
+        }
+        ub[j] = lo;
+        o[lo+j] = yrow+1;
+    }
+    ub[ny] = nx;
+    #pragma omp parallel for schedule(dynamic) num_threads(nth)
+    for (int j=0; j<=ny; j++) {
+        // the rows of x between rows j-1 and j of y
+        for (int p=(j ? ub[j-1] : 0); p<ub[j]; p++) o[p+j] = pox ? pox[p] : p+1;
+    }
+    UNPROTECT(1);
+    return ans;
+}
@@ -314,3 +314,133 @@ SEXP subsetVector(SEXP x, SEXP idx) { // idx is 1-based passed from R level
 }
 
 
+
+/*
+* subsetRuns - x[vecseq(starts, lens)] (through xo when xo is non-empty), or when each=TRUE x[rep.int(seq_along(lens), lens)],
+* without allocating those row numbers. For [.data.table to gather the columns of a many-to-many join straight from bmerge's
+* starts and lens, so that peak memory is about the size of the result. The size is known up front from lens (their cumsum
+* gives where each run goes), and the result is then filled in parallel over batches of it, other than STRSXP and VECSXP
+* which are filled by this thread due to the write barrier (as in subsetDT).
+* starts of NA (nomatch=NA, lens 1) give NA; starts of 0 (nomatch=0) have lens 0 and give nothing.
+*/
+#define RUNBATCH 8192
+
+SEXP subsetRuns(SEXP x, SEXP starts, SEXP lens, SEXP xo, SEXP eachArg)
+{
+    if (!isInteger(starts) || !isInteger(lens) || LENGTH(starts)!=LENGTH(lens)) error("Internal error: starts and lens must be integer vectors of the same length");
+    if (!isInteger(xo)) error("Internal error: xo is type '%s' not 'integer'", type2char(TYPEOF(xo)));
+    if (!isLogical(eachArg) || LENGTH(eachArg)!=1 || LOGICAL(eachArg)[0]==NA_LOGICAL) error("Internal error: each must be TRUE or FALSE");
+    const Rboolean each = LOGICAL(eachArg)[0];
+    const int n = LENGTH(lens), *ps = INTEGER(starts), *pl = INTEGER(lens), *pxo = LENGTH(xo) ? INTEGER(xo) : NULL;
+    if (each && n!=length(x)) error("Internal error: each=TRUE but length(lens) [%d] != length(x) [%d]", n, length(x));
+    int *off = (int *)R_alloc(n+1, sizeof(int));
+    off[0] = 0;
+    for (int r=0; r<n; r++) {
+        if (INT_MAX-off[r] < pl[r]) error("Join results in more than 2^31 rows (internal subsetRuns reached physical limit).");
+        off[r+1] = off[r] + pl[r];
+    }
+    const int ansn = off[n], nBatch = (ansn-1)/RUNBATCH + 1;
+    SEXP ans = PROTECT(allocVector(TYPEOF(x), ansn));
+    copyMostAttrib(x, ans);
+    if (!ansn) { UNPROTECT(1); return ans; }
+
+    // the 0-based row of x at position p of the result, which is in run r; -1 for NA
+    #define RUNROW(r, p) (each ? (r) : ps[r]==NA_INTEGER ? -1 : (pxo ? pxo[ps[r]-1+(p)-off[r]] : ps[r]+(p)-off[r]) - 1)
+    // the run of the first position of batch b: the last run starting at or before it (runs of lens 0 are skipped by RUNS)
+    #define RUNS(body) \
+    for (int b=0; b<nBatch; b++) { \
+        const int from = b*RUNBATCH, to = MIN(from+RUNBATCH, ansn); \
+        int lo = 0, hi = n; \
+        while (hi-lo > 1) { int mid = lo + (hi-lo)/2; if (off[mid] <= from) lo = mid; else hi = mid; } \
+        for (int p=from, r=lo; p<to; p++) { \
+            while (off[r+1] <= p) r++; \
+            const int w = RUNROW(r, p); \
+            body; \
+        } \
+    }
+
+    const int nth = nBatch > 1 ? getDTthreads() : 1;
+    switch(TYPEOF(x)) {
+    case INTSXP : case LGLSXP : {
+        const int *xd = INTEGER(x);
+        int *ad = INTEGER(ans);
+        #pragma omp parallel for num_threads(nth)
+        RUNS(ad[p] = w<0 ? NA_INTEGER : xd[w])
+    } break;
+    case REALSXP : {
+        union { double d; long long ll; } naval;
+        if (INHERITS(x, char_integer64)) naval.ll = NA_INT64_LL;
+        else naval.d = NA_REAL;
+        const double *xd = REAL(x);
+        double *ad = REAL(ans);
+        #pragma omp parallel for num_threads(nth)
+        RUNS(ad[p] = w<0 ? naval.d : xd[w])
+    } break;
+    case CPLXSXP : {
+        Rcomplex naval;
+        naval.r = naval.i = NA_REAL;
+        const Rcomplex *xd = COMPLEX(x);
+        Rcomplex *ad = COMPLEX(ans);
+        #pragma omp parallel for num_threads(nth)
+        RUNS(ad[p] = w<0 ? naval : xd[w])
+    } break;
+    case RAWSXP : {
+        const Rbyte *xd = RAW(x);
+        Rbyte *ad = RAW(ans);
+        #pragma omp parallel for num_threads(nth)
+        RUNS(ad[p] = w<0 ? (Rbyte) 0 : xd[w])
+    } break;
+    case STRSXP :
+        RUNS(SET_STRING_ELT(ans, p, w<0 ? NA_STRING : STRING_ELT(x, w)))
+        break;
+    case VECSXP :
+        RUNS(SET_VECTOR_ELT(ans, p, w<0 ? R_NilValue : VECTOR_ELT(x, w)))
+        break;
+    default :
+        error("Unsupported column type '%s'", type2char(TYPEOF(x)));
+    }
+    #undef RUNS
+    #undef RUNROW
+    UNPROTECT(1);
+    return ans;
+}
+
+/*
+* notRuns - the rows of x, in order, that are in none of the runs starts/lens (through xo when xo is non-empty), i.e. the result
+* of a not-join DT[!i]. The runs are marked with +1/-1 at their ends and a single sweep of the running sum then finds the rows
+* no run covers, so duplicate and overlapping runs cost nothing extra; the matches are never expanded into row numbers.
+* starts of 0 (no match) and NA are ignored.
+*/
+SEXP notRuns(SEXP starts, SEXP lens, SEXP xo, SEXP nrowArg)
+{
+    if (!isInteger(starts) || !isInteger(lens) || LENGTH(starts)!=LENGTH(lens)) error("Internal error: starts and lens must be integer vectors of the same length");
+    if (!isInteger(xo)) error("Internal error: xo is type '%s' not 'integer'", type2char(TYPEOF(xo)));
+    if (!isInteger(nrowArg) || LENGTH(nrowArg)!=1 || INTEGER(nrowArg)[0]<0) error("Internal error: nrow must be integer vector length 1 and >=0");
+    const int nrow = INTEGER(nrowArg)[0], n = LENGTH(lens), *ps = INTEGER(starts), *pl = INTEGER(lens), *pxo = LENGTH(xo) ? INTEGER(xo) : NULL;
+    if (pxo && LENGTH(xo)!=nrow) error("Internal error: length(xo) [%d] != nrow [%d]", LENGTH(xo), nrow);
+    int *d = (int *)R_alloc(nrow+1, sizeof(int));
+    memset(d, 0, (nrow+1)*sizeof(int));
+    for (int r=0; r<n; r++) {
+        if (ps[r]==NA_INTEGER || ps[r]<1 || pl[r]<1) continue;
+        if (ps[r]-1 > nrow-pl[r]) error("Internal error: run %d [%d,%d) is beyond nrow [%d]", r+1, ps[r], ps[r]+pl[r], nrow);
+        d[ps[r]-1]++;
+        d[ps[r]-1+pl[r]]--;
+    }
+    // d[p] becomes whether position p is in no run, then for xo whether row p is the row of no such position
+    int ansn = 0;
+    for (int p=0, cover=0; p<nrow; p++) {
+        cover += d[p];
+        d[p] = (cover==0);
+        ansn += d[p];
+    }
+    if (pxo) {
+        char *keep = (char *)R_alloc(nrow, sizeof(char));
+        for (int p=0; p<nrow; p++) keep[pxo[p]-1] = (char)d[p];
+        for (int p=0; p<nrow; p++) d[p] = keep[p];
+    }
+    SEXP ans = PROTECT(allocVector(INTSXP, ansn));
+    int *pa = INTEGER(ans);
+    for (int p=0, k=0; p<nrow; p++) if (d[p]) pa[k++] = p+1;
+    UNPROTECT(1);
+    return ans;
+}
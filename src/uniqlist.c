@@ -12,6 +12,7 @@ SEXP uniqlist(SEXP l, SEXP order)
     // DONE: ans is now grown
     Rboolean b, byorder;
     unsigned long long *ulv; // for numeric check speed-up
+    unsigned long long (*twiddle)(void *, int, int, int);
     SEXP v, ans, class;
     R_len_t i, j, nrow, ncol, len, thisi, previ, isize=1000;
 
@@ -46,7 +47,7 @@ SEXP uniqlist(SEXP l, SEXP order)
                 if (!b) {
                     class = getAttrib(v, R_ClassSymbol);
                     twiddle = (isString(class) && STRING_ELT(class, 0)==char_integer64) ? &i64twiddle : &dtwiddle;
-                    b = twiddle(ulv, thisi, 1) == twiddle(ulv, previ, 1);
+                    b = twiddle(ulv, thisi, 1, -1) == twiddle(ulv, previ, 1, -1);
                 }
                 break;
                 // TO DO: store previ twiddle call, but it'll need to be vector since this is in a loop through columns. Hopefully the first == will short circuit most often
@@ -135,6 +136,7 @@ SEXP rleid(SEXP l, SEXP cols)
 
 SEXP nestedid(SEXP l, SEXP cols, SEXP order, SEXP grps, SEXP resetvals, SEXP multArg) {
     Rboolean b, byorder = length(order);
+    unsigned long long (*twiddle)(void *, int, int, int);
     SEXP v, ans, class;
     R_len_t nrows = length(VECTOR_ELT(l,0)), ncols = length(cols);
     R_len_t i, j, k, thisi, previ, ansgrpsize=1000, nansgrp=0;
@@ -191,7 +193,7 @@ SEXP nestedid(SEXP l, SEXP cols, SEXP order, SEXP grps, SEXP resetvals, SEXP mul
                     break;
                     case REALSXP:
                     twiddle = i64[j] ? &i64twiddle : &dtwiddle;
-                    b = twiddle(DATAPTR(v), thisi, 1) >= twiddle(DATAPTR(v), previ, 1);
+                    b = twiddle(DATAPTR(v), thisi, 1, -1) >= twiddle(DATAPTR(v), previ, 1, -1);  // -1: NA first, as in the key
                     break;
                     default:
                     error("Type '%s' not supported", type2char(TYPEOF(v)));
@@ -1,5 +1,31 @@
 #include "data.table.h"
 
+static R_len_t vecseqlen_(SEXP len, SEXP clamp)
+{
+    R_len_t reslen = 0;
+    double limit;
+    for (R_len_t i=0; i<LENGTH(len); i++) {
+        if (INT_MAX-reslen < INTEGER(len)[i])
+            error("Join results in more than 2^31 rows (internal vecseq reached physical limit). Very likely misspecified join. Check for duplicate key values in i each of which join to the same group in x over and over again. If that's ok, try by=.EACHI to run j for each group to avoid the large allocation. Otherwise, please search for this error message in the FAQ, Wiki, Stack Overflow and datatable-help for advice.");
+        reslen += INTEGER(len)[i];
+    }
+    if (!isNull(clamp)) {
+        if (!isNumeric(clamp) || LENGTH(clamp)!=1) error("clamp must be a double vector length 1");
+        limit = REAL(clamp)[0];
+        if (limit<0) error("clamp must be positive");
+        if (reslen>limit) error("Join results in %d rows; more than %d = nrow(x)+nrow(i). Check for duplicate key values in i each of which join to the same group in x over and over again. If that's ok, try by=.EACHI to run j for each group to avoid the large allocation. If you are sure you wish to proceed, rerun with allow.cartesian=TRUE. Otherwise, please search for this error message in the FAQ, Wiki, Stack Overflow and datatable-help for advice.", reslen, (int)limit);
+    }
+    return reslen;
+}
+
+SEXP vecseqlen(SEXP len, SEXP clamp)
+{
+    // The number of rows vecseq(x, len, clamp) would return, with the same checks, without allocating them. For
+    // [.data.table to size a join up front when it gathers the columns straight from the runs (see subsetRuns).
+    if (!isInteger(len)) error("len must be an integer vector");
+    return ScalarInteger(vecseqlen_(len, clamp));
+}
+
 SEXP vecseq(SEXP x, SEXP len, SEXP clamp)
 {
     // Name taken from bit::vecseq, but,
@@ -10,24 +36,12 @@ SEXP vecseq(SEXP x, SEXP len, SEXP clamp)
     // Specially for use by [.data.table after binary search. Now so specialized that for general use
     // bit::vecseq is recommended (Jens has coded it in C now).
     R_len_t reslen,i,j,k, thisx;
-    double limit;
     SEXP ans;
     
     if (!isInteger(x)) error("x must be an integer vector");
     if (!isInteger(len)) error("len must be an integer vector");
     if (LENGTH(x) != LENGTH(len)) error("x and len must be the same length");
-    reslen = 0;
-    for (i=0; i<LENGTH(len); i++) {
-        if (INT_MAX-reslen < INTEGER(len)[i])
-            error("Join results in more than 2^31 rows (internal vecseq reached physical limit). Very likely misspecified join. Check for duplicate key values in i each of which join to the same group in x over and over again. If that's ok, try by=.EACHI to run j for each group to avoid the large allocation. Otherwise, please search for this error message in the FAQ, Wiki, Stack Overflow and datatable-help for advice.");
-        reslen += INTEGER(len)[i];
-    }
-    if (!isNull(clamp)) {
-        if (!isNumeric(clamp) || LENGTH(clamp)!=1) error("clamp must be a double vector length 1");
-        limit = REAL(clamp)[0];
-        if (limit<0) error("clamp must be positive");
-        if (reslen>limit) error("Join results in %d rows; more than %d = nrow(x)+nrow(i). Check for duplicate key values in i each of which join to the same group in x over and over again. If that's ok, try by=.EACHI to run j for each group to avoid the large allocation. If you are sure you wish to proceed, rerun with allow.cartesian=TRUE. Otherwise, please search for this error message in the FAQ, Wiki, Stack Overflow and datatable-help for advice.", reslen, (int)limit);
-    }
+    reslen = vecseqlen_(len, clamp);
     ans = PROTECT(allocVector(INTSXP, reslen));
     k = 0;
     for (i=0; i<LENGTH(len); i++) {